@@ -31,6 +31,7 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <fstream>
+#include <set>
 #include <dirent.h> //for getMyExec
 #include "procs.h"
 
@@ -348,6 +349,50 @@ int Util::Config::forkServer(Socket::Server & server_socket, int (*callback)(Soc
   return 0;
 }
 
+/// Starts the given amount of worker processes, that all accept connections from the same server socket.
+/// Each worker calls the callback once with the server socket, and is expected to serve many connections from it.
+/// Workers that exit are restarted, for as long as this process is active.
+/// When this process is no longer active, all workers are asked to stop.
+int Util::Config::workerServer(Socket::Server & server_socket, unsigned int workers, int (*callback)(Socket::Server &)) {
+  Util::Procs::socketList.insert(server_socket.getSocket());
+  std::set<pid_t> children;
+  while (is_active && server_socket.connected()) {
+    //(re)start workers until we have enough
+    while (children.size() < workers) {
+      pid_t myid = fork();
+      if (myid == 0) {
+        //the server socket is shared with the other workers: a signal should not shut it down for them
+        serv_sock_pointer = 0;
+        return callback(server_socket);
+      }
+      if (myid < 0) {
+        FAIL_MSG("Could not start worker process: %s", strerror(errno));
+        break;
+      }
+      DEBUG_MSG(DLVL_HIGH, "Forked new worker process %i for socket %i", (int)myid, server_socket.getSocket());
+      children.insert(myid);
+    }
+    Util::sleep(1000);
+    if (!is_active) {break;}
+    std::set<pid_t> gone;
+    for (std::set<pid_t>::iterator it = children.begin(); it != children.end(); ++it) {
+      if (!Util::Procs::childRunning(*it)) {
+        WARN_MSG("Worker process %i ended; restarting it", (int)*it);
+        gone.insert(*it);
+      }
+    }
+    for (std::set<pid_t>::iterator it = gone.begin(); it != gone.end(); ++it) {
+      children.erase(*it);
+    }
+  }
+  for (std::set<pid_t>::iterator it = children.begin(); it != children.end(); ++it) {
+    kill(*it, SIGTERM);
+  }
+  Util::Procs::socketList.erase(server_socket.getSocket());
+  server_socket.close();
+  return 0;
+}
+
 int Util::Config::serveThreadedSocket(int (*callback)(Socket::Connection &)) {
   Socket::Server server_socket;
   if (vals.isMember("socket")) {
@@ -388,6 +433,26 @@ int Util::Config::serveForkedSocket(int (*callback)(Socket::Connection & S)) {
   return r;
 }
 
+int Util::Config::serveWorkerSocket(unsigned int workers, int (*callback)(Socket::Server & S)) {
+  Socket::Server server_socket;
+  if (vals.isMember("socket")) {
+    server_socket = Socket::Server(Util::getTmpFolder() + getString("socket"));
+  }
+  if (vals.isMember("port") && vals.isMember("interface")) {
+    server_socket = Socket::Server(getInteger("port"), getString("interface"), false);
+  }
+  if (!server_socket.connected()) {
+    DEBUG_MSG(DLVL_DEVEL, "Failure to open socket");
+    return 1;
+  }
+  serv_sock_pointer = &server_socket;
+  DEBUG_MSG(DLVL_DEVEL, "Activating worker server with %u workers: %s", workers, getString("cmd").c_str());
+  activate();
+  int r = workerServer(server_socket, workers, callback);
+  serv_sock_pointer = 0;
+  return r;
+}
+
 /// Activated the stored config. This will:
 /// - Drop permissions to the stored "username", if any.
 /// - Set is_active to true.
@@ -531,6 +596,13 @@ void Util::Config::addConnectorOptions(int port, JSON::Value & capabilities) {
   capabilities["optional"]["interface"]["short"] = "i";
   capabilities["optional"]["interface"]["type"] = "str";
 
+  capabilities["optional"]["workers"]["name"] = "Worker processes";
+  capabilities["optional"]["workers"]["help"] = "Amount of processes that each serve many connections. Zero (the default) means one process per connection. Ignored by protocols that need a process per connection.";
+  capabilities["optional"]["workers"]["default"] = 0ll;
+  capabilities["optional"]["workers"]["option"] = "--workers";
+  capabilities["optional"]["workers"]["short"] = "W";
+  capabilities["optional"]["workers"]["type"] = "uint";
+
   addBasicConnectorOptions(capabilities);
 } //addConnectorOptions
 
@@ -40,6 +40,8 @@ namespace Util {
       int forkServer(Socket::Server & server_socket, int (*callback)(Socket::Connection & S));
       int serveThreadedSocket(int (*callback)(Socket::Connection & S));
       int serveForkedSocket(int (*callback)(Socket::Connection & S));
+      int workerServer(Socket::Server & server_socket, unsigned int workers, int (*callback)(Socket::Server & S));
+      int serveWorkerSocket(unsigned int workers, int (*callback)(Socket::Server & S));
       int servePlainSocket(int (*callback)(Socket::Connection & S));
       void addOptionsFromCapabilities(const JSON::Value & capabilities);
       void addBasicConnectorOptions(JSON::Value & capabilities);
@@ -115,6 +115,7 @@ static inline void show_stackframe(){}
 #define FLIP_MIN_DURATION 20000
 
 #define SHM_STREAM_INDEX "MstSTRM%s" //%s stream name
+#define SHM_STREAM_GENERATION (DEFAULT_STRM_PAGE_SIZE - 8) //offset of the IPC::generation at the end of live stream index pages
 #define SHM_STREAM_STATE "MstSTATE%s" //%s stream name
 #define STRMSTAT_OFF 0
 #define STRMSTAT_INIT 1
@@ -125,9 +126,19 @@ static inline void show_stackframe(){}
 #define STRMSTAT_INVALID 255
 #define SHM_TRACK_META "MstTRAK%s@%lu" //%s stream name, %lu track ID
 #define SHM_TRACK_INDEX "MstTRID%s@%lu" //%s stream name, %lu track ID
-#define SHM_TRACK_INDEX_SIZE 8192
+#define SHM_TRACK_INDEX_ENTRIES 1024 //amount of 8-byte page entries on a track index page
+#define SHM_TRACK_INDEX_NOTIFY (SHM_TRACK_INDEX_ENTRIES * 8) //offset of the IPC::notifier following the page entries
+#define SHM_TRACK_INDEX_GENERATION (SHM_TRACK_INDEX_NOTIFY + 8) //offset of the IPC::generation bumped on every change to the page entries
+#define SHM_TRACK_INDEX_SIZE (SHM_TRACK_INDEX_GENERATION + 8)
 #define SHM_TRACK_DATA "MstDATA%s@%lu_%lu" //%s stream name, %lu track ID, %lu page #
 #define SHM_STATISTICS "MstSTAT"
+#define SHM_CACHE_INDEX "MstCACH%s" //%s cache name
+#define SHM_CACHE_DATA "MstCDAT%s@%lu" //%s cache name, %lu entry ID
+#define SHM_CACHE_ENTRIES 128 //amount of entries on a cache index page
+#define SHM_CACHE_ENTRY_SIZE 128 //size of a single entry on a cache index page
+#define SHM_CACHE_SIZE (64 + SHM_CACHE_ENTRIES * SHM_CACHE_ENTRY_SIZE)
+#define SEM_CACHE "/MstCach%s" //%s cache name
+#define CACHE_MP4_INDEX "mp4i" //kind of the cache holding progressive MP4 interleave indexes
 #define SHM_USERS "MstUSER%s" //%s stream name
 #define SHM_TRIGGER "MstTRIG%s" //%s trigger name
 #define SEM_LIVE "/MstLIVE%s" //%s stream name
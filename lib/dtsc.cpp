@@ -3,6 +3,7 @@
 
 #include "dtsc.h"
 #include "defines.h"
+#include "util.h"
 #include <stdlib.h>
 #include <string.h> //for memcmp
 #include <arpa/inet.h> //for htonl/ntohl
@@ -10,6 +11,7 @@ char DTSC::Magic_Header[] = "DTSC";
 char DTSC::Magic_Packet[] = "DTPD";
 char DTSC::Magic_Packet2[] = "DTP2";
 char DTSC::Magic_Command[] = "DTCM";
+char DTSC::Magic_Index[] = "DTSH";
 
 DTSC::File::File() {
   F = 0;
@@ -111,10 +113,7 @@ DTSC::File::File(std::string filename, bool create) {
     }
   } else {
     fseek(F, 0, SEEK_SET);
-    File Fhead(filename + ".dtsh");
-    if (Fhead) {
-      metadata = Fhead.metadata;
-    }
+    metadata.fromFile(filename + ".dtsh");
   }
   currframe = 0;
 }
@@ -534,6 +533,14 @@ void DTSC::File::selectTracks(std::set<unsigned long> & tracks) {
   seek_time(0);
 }
 
+/// Hints the kernel to start reading the given byte range of the file in the background.
+/// A toPos of zero means until the end of the file.
+void DTSC::File::prefetch(uint64_t fromPos, uint64_t toPos) {
+  if (F) {
+    Util::prefetch(F, fromPos, toPos > fromPos ? toPos - fromPos : 0);
+  }
+}
+
 /// Close the file if open
 DTSC::File::~File() {
   if (F) {
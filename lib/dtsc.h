@@ -24,7 +24,8 @@
 //  Version 0-2: Undocumented changes
 //  Version 3: switched to bigMeta-style by default, Parts layout switched from 3/2/4 to 3/3/3 bytes
 //  Version 4: renamed bps to maxbps (peak bit rate) and added new value bps (average bit rate)
-#define DTSH_VERSION 4
+//  Version 5: binary layout; DTSC-packed fields followed by raw key, key size, part and fragment tables per track
+#define DTSH_VERSION 5
 
 namespace DTSC {
 
@@ -42,6 +43,7 @@ namespace DTSC {
   extern char Magic_Packet[]; ///< The magic bytes for a DTSC packet
   extern char Magic_Packet2[]; ///< The magic bytes for a DTSC packet version 2
   extern char Magic_Command[]; ///< The magic bytes for a DTCM packet
+  extern char Magic_Index[]; ///< The magic bytes for a DTSH header file
 
   ///\brief A simple structure used for ordering byte seek positions.
   struct seekPos {
@@ -118,7 +120,7 @@ namespace DTSC {
       packType getVersion() const;
       void reInit(Socket::Connection & src);
       void reInit(const char * data_, unsigned int len, bool noCopy = false);
-      void genericFill(long long packTime, long long packOffset, long long packTrack, const char * packData, long long packDataSize, uint64_t packBytePos, bool isKeyframe);
+      void genericFill(long long packTime, long long packOffset, long long packTrack, const char * packData, long long packDataSize, uint64_t packBytePos, bool isKeyframe, bool isDisposable = false);
       void getString(const char * identifier, char *& result, unsigned int & len) const;
       void getString(const char * identifier, std::string & result) const;
       void getInt(const char * identifier, uint64_t & result) const;
@@ -143,9 +145,15 @@ namespace DTSC {
       bool master;
       packType version;
       void resize(unsigned int size);
+      Scan getField(const char * identifier) const;
+      void buildIndex() const;
       char * data;
       unsigned int bufferLen;
       unsigned int dataLen;
+      ///\brief The commonly requested members, which are located in a single pass over the packet on first access
+      enum fieldName {FIELD_DATA, FIELD_OFFSET, FIELD_KEYFRAME, FIELD_BPOS, FIELD_TIME, FIELD_TRACKID, FIELD_COUNT};
+      mutable bool indexed;///< Whether fieldOffset holds the offsets for the current data
+      mutable uint32_t fieldOffset[FIELD_COUNT];///< Offset of the value of each common member, 0 if not present
 
       uint64_t prevNalSize;
   };
@@ -265,6 +273,7 @@ namespace DTSC {
       Track();      
       Track(JSON::Value & trackRef);
       Track(Scan & trackRef);
+      void refresh(Scan & trackRef);
             
       inline operator bool() const {
         return (parts.size() && keySizes.size() && (keySizes.size() == keys.size()));
@@ -272,6 +281,7 @@ namespace DTSC {
       void update(long long packTime, long long packOffset, long long packDataSize, uint64_t packBytePos, bool isKeyframe, long long packSendSize, unsigned long segment_size = 5000);
       int getSendLen(bool skipDynamic = false);
       void send(Socket::Connection & conn, bool skipDynamic = false);
+      void send(JSON::Writer & w, bool skipDynamic = false);
       void writeTo(char *& p);
       JSON::Value toJSON(bool skipDynamic = false);
       std::deque<Fragment> fragments;
@@ -311,10 +321,48 @@ namespace DTSC {
       void removeFirstKey();
       uint32_t secsSinceFirstFragmentInsert();
     private:
+      void readFields(Scan & trackRef);
       std::string cachedIdent;
       std::deque<uint32_t> fragInsertTime;
   };
 
+  ///\brief Native-endian, column-wise copy of the key and part tables of a Track.
+  ///
+  /// The packed deques in Track remain the authoritative storage and the wire format; this index mirrors them
+  /// in contiguous columns with running part and byte totals per key, so that lookups need no decoding or linear walks.
+  /// It is kept up to date incrementally by update(), which only handles keys and parts added or removed since the last call.
+  class TrackIndex{
+    public:
+      TrackIndex();
+      void update(Track & trk);
+      void clear();
+      size_t keyCount() const{return keyTimes.size() - keyStart;}
+      uint64_t keyTime(size_t keyIdx) const{return keyTimes[keyStart + keyIdx];}
+      uint64_t partsBefore(size_t keyIdx) const;
+      uint64_t bytesBefore(size_t keyIdx) const;
+      size_t keyForTime(uint64_t timestamp) const;
+      size_t partCount() const{return partDurs.size() - partStart;}
+      uint32_t partDuration(size_t partIdx) const{return partDurs[partStart + partIdx];}
+      uint32_t partOffset(size_t partIdx) const{return partOffs[partStart + partIdx];}
+      uint32_t partSize(size_t partIdx) const{return partSizes[partStart + partIdx];}
+      const uint32_t * durations() const{return partCount() ? &partDurs[partStart] : 0;}
+      const uint32_t * offsets() const{return partCount() ? &partOffs[partStart] : 0;}
+      const uint32_t * sizes() const{return partCount() ? &partSizes[partStart] : 0;}
+    private:
+      void compact();
+      unsigned long firstKey;///< Number of the key at keyStart.
+      size_t keyStart;///< Index of the first key still in the track, entries before it are removed lazily.
+      size_t partStart;///< Index of the first part still in the track, entries before it are removed lazily.
+      uint64_t partBase;///< Total amount of parts of keys that were removed from the front.
+      uint64_t byteBase;///< Total size of keys that were removed from the front.
+      std::vector<uint64_t> keyTimes;///< Start time per key.
+      std::vector<uint64_t> partSums;///< For each key, the total amount of parts up to and including that key.
+      std::vector<uint64_t> byteSums;///< For each key, the total size of all keys up to and including that key.
+      std::vector<uint32_t> partDurs;///< Duration per part.
+      std::vector<uint32_t> partOffs;///< Presentation time offset per part.
+      std::vector<uint32_t> partSizes;///< Payload size per part.
+  };
+
   ///\brief Class for storage of meta data
   class Meta{
       /// \todo Make toJSON().toNetpacked() shorter
@@ -327,6 +375,7 @@ namespace DTSC {
         return vod || live;
       }
       void reinit(const DTSC::Packet & source);
+      void refresh(const DTSC::Packet & source);
       void update(const DTSC::Packet & pack, unsigned long segment_size = 5000);
       void updatePosOverride(DTSC::Packet & pack, uint64_t bpos);
       void update(JSON::Value & pack, unsigned long segment_size = 5000);
@@ -334,9 +383,10 @@ namespace DTSC {
       unsigned int getSendLen(bool skipDynamic = false, std::set<unsigned long> selectedTracks = std::set<unsigned long>());
       void send(Socket::Connection & conn, bool skipDynamic = false, std::set<unsigned long> selectedTracks = std::set<unsigned long>());
       void writeTo(char * p);
-      JSON::Value toJSON();
+      JSON::Value toJSON(bool skipDynamic = false);
       void reset();
       bool toFile(const std::string & fileName);
+      bool fromFile(const std::string & fileName);
       void toPrettyString(std::ostream & str, int indent = 0, int verbosity = 0);
       //members:
       std::map<unsigned int, Track> tracks;
@@ -348,6 +398,7 @@ namespace DTSC {
       uint16_t version;
       long long int moreheader;
       long long int bufferWindow;
+      long long int sourceSize;///< Amount of bytes of the source file described by this header, if known
       std::string sourceURI;
   };
 
@@ -394,6 +445,7 @@ namespace DTSC {
       void writePacket(JSON::Value & newPacket);
       bool atKeyframe();
       void selectTracks(std::set<unsigned long> & tracks);
+      void prefetch(uint64_t fromPos, uint64_t toPos);
     private:
       long int endPos;
       void readHeader(int pos);
@@ -1,10 +1,15 @@
 #include "dtsc.h"
 #include "defines.h"
 #include "bitfields.h"
+#include "util.h"
 #include <cstdlib>
 #include <cstring>
 #include <iomanip>
 #include <fstream>
+#include <algorithm>
+#include <sstream>
+#include <cstdio>
+#include <unistd.h>
 
 #define AUDIO_KEY_INTERVAL 5000 ///< This define controls the keyframe interval for non-video tracks, such as audio and metadata tracks.
 
@@ -16,6 +21,7 @@ namespace DTSC {
     dataLen = 0;
     master = false;
     version = DTSC_INVALID;
+    indexed = false;
   }
 
   /// Copy constructor for packets, copies an existing packet with same noCopy flag as original.
@@ -23,6 +29,7 @@ namespace DTSC {
     master = false;
     bufferLen = 0;
     data = NULL;
+    indexed = false;
     if (rhs.data && rhs.dataLen){
       reInit(rhs.data, rhs.dataLen, !rhs.master);
     }else{
@@ -35,6 +42,7 @@ namespace DTSC {
     master = false;
     bufferLen = 0;
     data = NULL;
+    indexed = false;
     reInit(data_, len, noCopy);
   }
 
@@ -97,6 +105,7 @@ namespace DTSC {
     bufferLen = 0;
     dataLen = 0;
     version = DTSC_INVALID;
+    indexed = false;
   }
 
   /// Internally used resize function for when operating in copy mode and the internal buffer is too small.
@@ -120,15 +129,16 @@ namespace DTSC {
     int toReceive = 0;
     while (src.connected()){
       if (!toReceive && src.Received().available(8)){
-        if (src.Received().copy(2) != "DT"){
+        const char * header = src.Received().peek(8);
+        if (header[0] != 'D' || header[1] != 'T'){
           WARN_MSG("Invalid DTSC Packet header encountered (%s)", src.Received().copy(4).c_str());
           break;
         }
-        toReceive = Bit::btohl(src.Received().copy(8).data() + 4);
+        toReceive = Bit::btohl(header + 4);
       }
       if (toReceive && src.Received().available(toReceive + 8)){
-        std::string dataBuf = src.Received().remove(toReceive + 8);
-        reInit(dataBuf.data(), dataBuf.size());
+        reInit(src.Received().peek(toReceive + 8), toReceive + 8);
+        src.Received().consume(toReceive + 8);
         return;
       }
       if(!src.spool()){
@@ -181,6 +191,7 @@ namespace DTSC {
     //check header type and store packet length
     dataLen = len;
     version = DTSC_INVALID;
+    indexed = false;
     if (len > 3) {
       if (!memcmp(data, Magic_Packet2, 4)) {
         version = DTSC_V2;
@@ -209,20 +220,27 @@ namespace DTSC {
   /// Re-initializes this Packet to contain a generic DTSC packet with the given data fields.
   /// When given a NULL pointer, the data is reserved and memset to 0
   /// If given a NULL pointer and a zero size, an empty packet is created.
-  void Packet::genericFill(long long packTime, long long packOffset, long long packTrack, const char * packData, long long packDataSize, uint64_t packBytePos, bool isKeyframe){
-    null();
-    master = true;
+  /// A buffer this packet already owns is reused, so refilling the same packet does not allocate once it is large enough.
+  /// Frames that no other frame depends on can be marked with isDisposable, which sets the disposableframe member.
+  void Packet::genericFill(long long packTime, long long packOffset, long long packTrack, const char * packData, long long packDataSize, uint64_t packBytePos, bool isKeyframe, bool isDisposable){
+    if (!master){
+      null();
+      master = true;
+    }
+    indexed = false;
     //time and trackID are part of the 20-byte header.
     //the container object adds 4 bytes (plus 2+namelen for each content, see below)
     //offset, if non-zero, adds 9 bytes (integer type) and 8 bytes (2+namelen)
     //bpos, if >= 0, adds 9 bytes (integer type) and 6 bytes (2+namelen)
     //keyframe, if true, adds 9 bytes (integer type) and 10 bytes (2+namelen)
+    //disposableframe, if true, adds 9 bytes (integer type) and 17 bytes (2+namelen)
     //data adds packDataSize+5 bytes (string type) and 6 bytes (2+namelen)
     if (packData && packDataSize < 1){
       FAIL_MSG("Attempted to fill a packet with %lli bytes!", packDataSize);
+      null();
       return;
     }
-    unsigned int sendLen = 24 + (packOffset?17:0) + (packBytePos?15:0) + (isKeyframe?19:0) + packDataSize+11;
+    unsigned int sendLen = 24 + (packOffset?17:0) + (packBytePos?15:0) + (isKeyframe?19:0) + (isDisposable?26:0) + packDataSize+11;
     resize(sendLen);
     //set internal variables
     version = DTSC_V2;
@@ -259,6 +277,10 @@ namespace DTSC {
       memcpy(data+offset, "\000\010keyframe\001\000\000\000\000\000\000\000\001", 19);
       offset += 19;
     }
+    if (isDisposable){
+      memcpy(data+offset, "\000\017disposableframe\001\000\000\000\000\000\000\000\001", 26);
+      offset += 26;
+    }
     memcpy(data+offset, "\000\004data\002", 7);
     tmpLong = htonl(packDataSize);
     memcpy(data+offset+7, (char *)&tmpLong, 4);
@@ -274,16 +296,19 @@ namespace DTSC {
   ///sets the keyframe byte.
   void Packet::setKeyFrame(bool kf){
     uint32_t offset = 23;
-    while (data[offset] != 'd' && data[offset] != 'k' && data[offset] != 'K'){
+    while ((data[offset] != 'd' || data[offset-1] != 4) && data[offset] != 'k' && data[offset] != 'K'){
       switch (data[offset]){
         case 'o': offset += 17; break;
         case 'b': offset += 15; break;
+        case 'd': offset += 26; break;//disposableframe
         default:
           FAIL_MSG("Unknown field: %c", data[offset]);
       }
     }
 
     if(data[offset] == 'k' || data[offset] == 'K'){
+      //renaming the member changes whether it is found as "keyframe"
+      indexed = false;
       data[offset] = (kf?'k':'K');
       data[offset+16] = (kf?1:0);
     }else{
@@ -336,12 +361,13 @@ namespace DTSC {
   ///Method can only be used when using internal functions to build the data.
   uint32_t Packet::getDataStringLenOffset(){
     uint32_t offset = 23;
-    while (data[offset] != 'd'){
+    while (data[offset] != 'd' || data[offset-1] != 4){
       switch (data[offset]){
         case 'o': offset += 17; break;
         case 'b': offset += 15; break;
         case 'k': offset += 19; break;
         case 'K': offset += 19; break;
+        case 'd': offset += 26; break;//disposableframe
         default:
           FAIL_MSG("Unknown field: %c", data[offset]);
           return -1;
@@ -397,26 +423,100 @@ namespace DTSC {
     return 0;//out of packet! 1 == error
   }
 
+  /// Locates the values of all common members in a single pass over the packet.
+  /// Only the first occurrence of each member is used, matching Scan::getMember.
+  void Packet::buildIndex() const {
+    indexed = true;
+    memset(fieldOffset, 0, sizeof(fieldOffset));
+    if (!*this || getDataLen() <= getPayloadLen()){
+      return;
+    }
+    char * p = data + (getDataLen() - getPayloadLen());
+    char * max = data + dataLen;
+    if ((unsigned char)p[0] != DTSC_OBJ && (unsigned char)p[0] != DTSC_CON){
+      return;
+    }
+    ++p;
+    while (p + 2 < max && p[0] + p[1] != 0){
+      unsigned int nameLen = Bit::btohs(p);
+      char * name = p + 2;
+      p = name + nameLen;
+      if (p >= max){
+        return;
+      }
+      int field = -1;
+      switch (nameLen){
+        case 4:
+          if (!memcmp(name, "data", 4)){field = FIELD_DATA;}
+          if (!memcmp(name, "bpos", 4)){field = FIELD_BPOS;}
+          if (!memcmp(name, "time", 4)){field = FIELD_TIME;}
+          break;
+        case 6:
+          if (!memcmp(name, "offset", 6)){field = FIELD_OFFSET;}
+          break;
+        case 7:
+          if (!memcmp(name, "trackid", 7)){field = FIELD_TRACKID;}
+          break;
+        case 8:
+          if (!memcmp(name, "keyframe", 8)){field = FIELD_KEYFRAME;}
+          break;
+      }
+      if (field >= 0 && !fieldOffset[field]){
+        fieldOffset[field] = p - data;
+      }
+      p = skipDTSC(p, max);
+      if (!p){
+        return;
+      }
+    }
+  }
+
+  /// Returns a DTSC::Scan instance to the named member of this packet.
+  /// Common members are looked up through the index built by buildIndex, others are searched for.
+  Scan Packet::getField(const char * identifier) const {
+    int field = -1;
+    switch (identifier[0]){
+      case 'd': if (!strcmp(identifier, "data")){field = FIELD_DATA;} break;
+      case 'o': if (!strcmp(identifier, "offset")){field = FIELD_OFFSET;} break;
+      case 'k': if (!strcmp(identifier, "keyframe")){field = FIELD_KEYFRAME;} break;
+      case 'b': if (!strcmp(identifier, "bpos")){field = FIELD_BPOS;} break;
+      case 't':
+        if (!strcmp(identifier, "time")){field = FIELD_TIME;}
+        if (!strcmp(identifier, "trackid")){field = FIELD_TRACKID;}
+        break;
+    }
+    if (field < 0){
+      return getScan().getMember(identifier);
+    }
+    if (!indexed){
+      buildIndex();
+    }
+    if (!fieldOffset[field]){
+      return Scan();
+    }
+    return Scan(data + fieldOffset[field], dataLen - fieldOffset[field]);
+  }
+
   ///\brief Retrieves a single parameter as a string
   ///\param identifier The name of the parameter
   ///\param result A location on which the string will be returned
   ///\param len An integer in which the length of the string will be returned
   void Packet::getString(const char * identifier, char *& result, unsigned int & len) const {
-    getScan().getMember(identifier).getString(result, len);
+    getField(identifier).getString(result, len);
   }
 
   ///\brief Retrieves a single parameter as a string
   ///\param identifier The name of the parameter
   ///\param result The string in which to store the result
   void Packet::getString(const char * identifier, std::string & result) const {
-    result = getScan().getMember(identifier).asString();
+    result = getField(identifier).asString();
   }
 
   ///\brief Retrieves a single parameter as an integer
   ///\param identifier The name of the parameter
   ///\param result The result is stored in this integer
   void Packet::getInt(const char * identifier, uint64_t & result) const {
-    result = getScan().getMember(identifier).asInt();
+    result = getField(identifier).asInt();
   }
 
   ///\brief Retrieves a single parameter as an integer
@@ -450,7 +550,7 @@ namespace DTSC {
   ///\param identifier The name of the parameter
   ///\result Whether the parameter exists or not
   bool Packet::hasMember(const char * identifier) const {
-    return getScan().getMember(identifier).getType() > 0;
+    return getField(identifier).getType() > 0;
   }
 
   ///\brief Returns the timestamp of the packet.
@@ -1178,6 +1278,19 @@ namespace DTSC {
       trackRef.getMember("parts").getString(tmp, tmplen);
       parts = std::deque<Part>((Part *)tmp, ((Part *)tmp) + (tmplen / 9));
     }
+    if (trackRef.getMember("keysizes").getType() == DTSC_STR) {
+      char * tmp = 0;
+      unsigned int tmplen = 0;
+      trackRef.getMember("keysizes").getString(tmp, tmplen);
+      for (unsigned int i = 0; i + 4 <= tmplen; i += 4){
+        keySizes.push_back(Bit::btohl(tmp + i));
+      }
+    }
+    readFields(trackRef);
+  }
+
+  ///\brief Reads all the non-list members of a track
+  void Track::readFields(Scan & trackRef) {
     trackID = trackRef.getMember("trackid").asInt();
     firstms = trackRef.getMember("firstms").asInt();
     lastms = trackRef.getMember("lastms").asInt();
@@ -1187,6 +1300,7 @@ namespace DTSC {
     codec = trackRef.getMember("codec").asString();
     type = trackRef.getMember("type").asString();
     init = trackRef.getMember("init").asString();
+    lang.clear();
     if (trackRef.getMember("lang")){
       lang = trackRef.getMember("lang").asString();
     }
@@ -1200,14 +1314,6 @@ namespace DTSC {
       height = trackRef.getMember("height").asInt();
       fpks = trackRef.getMember("fpks").asInt();
     }
-    if (trackRef.getMember("keysizes").getType() == DTSC_STR) {
-      char * tmp = 0;
-      unsigned int tmplen = 0;
-      trackRef.getMember("keysizes").getString(tmp, tmplen);
-      for (unsigned int i = 0; i < tmplen; i += 4){
-        keySizes.push_back((((long unsigned)tmp[i]) << 24) | (((long unsigned)tmp[i+1]) << 16) | (((long unsigned int)tmp[i+2]) << 8) | tmp[i+3]);
-      }
-    }
     if (trackRef.getMember("keepaway").getType() == DTSC_INT){
       minKeepAway = trackRef.getMember("keepaway").asInt();
     }else{
@@ -1215,6 +1321,67 @@ namespace DTSC {
     }
   }
 
+  ///\brief Brings a track up to date with a newer version of the same track.
+  ///
+  ///Only the keys and parts removed from the front or added to the back are processed,
+  ///plus the last previously known entry, as that one may still have grown since.
+  ///The fragment list is short and always copied in full.
+  ///Falls back to a full rebuild when the two versions do not line up.
+  void Track::refresh(Scan & trackRef) {
+    char * tmp = 0;
+    unsigned int tmplen = 0;
+    if (trackRef.getMember("keys").getType() != DTSC_STR || trackRef.getMember("parts").getType() != DTSC_STR || trackRef.getMember("fragments").getType() != DTSC_STR || trackRef.getMember("keysizes").getType() != DTSC_STR) {
+      *this = Track(trackRef);
+      return;
+    }
+    trackRef.getMember("keys").getString(tmp, tmplen);
+    Key * newKeys = (Key *)tmp;
+    unsigned int keyCount = tmplen / PACKED_KEY_SIZE;
+    trackRef.getMember("parts").getString(tmp, tmplen);
+    Part * newParts = (Part *)tmp;
+    unsigned int partCount = tmplen / PACKED_PART_SIZE;
+    trackRef.getMember("fragments").getString(tmp, tmplen);
+    Fragment * newFrags = (Fragment *)tmp;
+    unsigned int fragCount = tmplen / PACKED_FRAGMENT_SIZE;
+    char * newSizes = 0;
+    trackRef.getMember("keysizes").getString(newSizes, tmplen);
+    if (!keys.size() || !keyCount || keySizes.size() != keys.size() || tmplen / 4 != keyCount) {
+      *this = Track(trackRef);
+      return;
+    }
+    //The first new key must still be known to us, and line up with the key we know by that number
+    unsigned long dropKeys = newKeys[0].getNumber() - keys[0].getNumber();
+    if (newKeys[0].getNumber() < keys[0].getNumber() || dropKeys >= keys.size() || keys[dropKeys].getTime() != newKeys[0].getTime()) {
+      *this = Track(trackRef);
+      return;
+    }
+    unsigned long dropParts = 0;
+    for (unsigned long i = 0; i < dropKeys; ++i) {
+      dropParts += keys[i].getParts();
+    }
+    if (dropParts >= parts.size() || keyCount < keys.size() - dropKeys || partCount < parts.size() - dropParts) {
+      *this = Track(trackRef);
+      return;
+    }
+    keys.erase(keys.begin(), keys.begin() + dropKeys);
+    keySizes.erase(keySizes.begin(), keySizes.begin() + dropKeys);
+    parts.erase(parts.begin(), parts.begin() + dropParts);
+    //Replace the last known entry of each list, and append anything after it
+    unsigned long known = keys.size() - 1;
+    keys.erase(keys.begin() + known, keys.end());
+    keys.insert(keys.end(), newKeys + known, newKeys + keyCount);
+    keySizes.erase(keySizes.begin() + known, keySizes.end());
+    for (unsigned long i = known; i < keyCount; ++i) {
+      keySizes.push_back(Bit::btohl(newSizes + i * 4));
+    }
+    known = parts.size() - 1;
+    parts.erase(parts.begin() + known, parts.end());
+    parts.insert(parts.end(), newParts + known, newParts + partCount);
+    fragments.assign(newFrags, newFrags + fragCount);
+    cachedIdent.clear();
+    readFields(trackRef);
+  }
+
   ///\brief Updates a track and its metadata given new packet properties.
   ///Will also insert keyframes on non-video tracks, and creates fragments
   void Track::update(long long packTime, long long packOffset, long long packDataSize, uint64_t packBytePos, bool isKeyframe, long long packSendSize, unsigned long segment_size) {
@@ -1354,28 +1521,145 @@ namespace DTSC {
 
   /// Returns the number of the key containing timestamp, or last key if nowhere.
   unsigned int Track::timeToKeynum(unsigned int timestamp){
-    unsigned int result = 0;
-    for (std::deque<Key>::iterator it = keys.begin(); it != keys.end(); it++){
-      if (it->getTime() > timestamp){
-        break;
+    //binary search for the first key starting after timestamp
+    size_t lo = 0, hi = keys.size();
+    while (lo < hi){
+      size_t mid = lo + (hi - lo) / 2;
+      if (keys[mid].getTime() > timestamp){
+        hi = mid;
+      }else{
+        lo = mid + 1;
       }
-      result = it->getNumber();
     }
-    return result;
+    return lo ? keys[lo - 1].getNumber() : 0;
   }
 
   /// Gets indice of the fragment containing timestamp, or last fragment if nowhere.
   uint32_t Track::timeToFragnum(uint64_t timestamp){
-    uint32_t i = 0;
-    for (std::deque<Fragment>::iterator it = fragments.begin(); it != fragments.end(); ++it){
-      if (timestamp < getKey(it->getNumber()).getTime() + it->getDuration()){
-        return i;
+    //binary search for the first fragment ending after timestamp
+    size_t lo = 0, hi = fragments.size();
+    while (lo < hi){
+      size_t mid = lo + (hi - lo) / 2;
+      if (timestamp < getKey(fragments[mid].getNumber()).getTime() + fragments[mid].getDuration()){
+        hi = mid;
+      }else{
+        lo = mid + 1;
       }
-      ++i;
+    }
+    if (lo < fragments.size()){
+      return lo;
     }
     return fragments.size()-1;
   }
 
+  TrackIndex::TrackIndex(){
+    clear();
+  }
+
+  /// Empties the index. The next update() will rebuild it from scratch.
+  void TrackIndex::clear(){
+    firstKey = 0;
+    keyStart = 0;
+    partStart = 0;
+    partBase = 0;
+    byteBase = 0;
+    keyTimes.clear();
+    partSums.clear();
+    byteSums.clear();
+    partDurs.clear();
+    partOffs.clear();
+    partSizes.clear();
+  }
+
+  /// Drops the entries for removed keys and parts from the front of the columns.
+  void TrackIndex::compact(){
+    keyTimes.erase(keyTimes.begin(), keyTimes.begin() + keyStart);
+    partSums.erase(partSums.begin(), partSums.begin() + keyStart);
+    byteSums.erase(byteSums.begin(), byteSums.begin() + keyStart);
+    keyStart = 0;
+    partDurs.erase(partDurs.begin(), partDurs.begin() + partStart);
+    partOffs.erase(partOffs.begin(), partOffs.begin() + partStart);
+    partSizes.erase(partSizes.begin(), partSizes.begin() + partStart);
+    partStart = 0;
+  }
+
+  /// Brings the index up to date with the given track.
+  /// Keys and parts removed from the front since the last call are dropped, new ones are appended.
+  /// The last key and part are always recalculated, since live streams may still be adding to them.
+  void TrackIndex::update(Track & trk){
+    if (!trk.keys.size()){
+      clear();
+      return;
+    }
+    unsigned long first = trk.keys.begin()->getNumber();
+    //restart from scratch if the keys don't overlap with what we know
+    if (keyCount() && (first < firstKey || first >= firstKey + keyCount())){
+      clear();
+    }
+    if (!keyCount()){
+      clear();
+      firstKey = first;
+    }
+    while (firstKey < first){
+      uint64_t removedParts = partSums[keyStart] - partBase;
+      partBase = partSums[keyStart];
+      byteBase = byteSums[keyStart];
+      ++keyStart;
+      ++firstKey;
+      partStart += std::min(removedParts, (uint64_t)partCount());
+    }
+    if (keyStart > keyTimes.size() / 2 || partStart > partDurs.size() / 2){
+      compact();
+    }
+    //keys
+    size_t known = keyCount();
+    if (known){--known;}
+    if (known > trk.keys.size()){known = trk.keys.size();}
+    keyTimes.resize(keyStart + known);
+    partSums.resize(keyStart + known);
+    byteSums.resize(keyStart + known);
+    for (size_t i = known; i < trk.keys.size(); ++i){
+      uint64_t prevParts = keyTimes.size() > keyStart ? partSums.back() : partBase;
+      uint64_t prevBytes = keyTimes.size() > keyStart ? byteSums.back() : byteBase;
+      keyTimes.push_back(trk.keys[i].getTime());
+      partSums.push_back(prevParts + trk.keys[i].getParts());
+      byteSums.push_back(prevBytes + (i < trk.keySizes.size() ? trk.keySizes[i] : 0));
+    }
+    //parts
+    known = partCount();
+    if (known){--known;}
+    if (known > trk.parts.size()){known = trk.parts.size();}
+    partDurs.resize(partStart + known);
+    partOffs.resize(partStart + known);
+    partSizes.resize(partStart + known);
+    for (size_t i = known; i < trk.parts.size(); ++i){
+      partDurs.push_back(trk.parts[i].getDuration());
+      partOffs.push_back(trk.parts[i].getOffset());
+      partSizes.push_back(trk.parts[i].getSize());
+    }
+  }
+
+  /// Returns the amount of parts belonging to the keys before keyIdx, which is the index of the first part of that key.
+  uint64_t TrackIndex::partsBefore(size_t keyIdx) const{
+    if (!keyIdx || !keyCount()){return 0;}
+    if (keyIdx > keyCount()){keyIdx = keyCount();}
+    return partSums[keyStart + keyIdx - 1] - partBase;
+  }
+
+  /// Returns the total size of the keys before keyIdx, which is the byte position of that key within the track.
+  uint64_t TrackIndex::bytesBefore(size_t keyIdx) const{
+    if (!keyIdx || !keyCount()){return 0;}
+    if (keyIdx > keyCount()){keyIdx = keyCount();}
+    return byteSums[keyStart + keyIdx - 1] - byteBase;
+  }
+
+  /// Returns the index of the last key starting at or before timestamp, or 0 if there is none.
+  size_t TrackIndex::keyForTime(uint64_t timestamp) const{
+    std::vector<uint64_t>::const_iterator it = std::upper_bound(keyTimes.begin() + keyStart, keyTimes.end(), timestamp);
+    if (it == keyTimes.begin() + keyStart){return 0;}
+    return (it - (keyTimes.begin() + keyStart)) - 1;
+  }
+
   ///\brief Resets a track, clears all meta values
   void Track::reset() {
     fragments.clear();
@@ -1397,6 +1681,7 @@ namespace DTSC {
     moreheader = 0;
     merged = false;
     bufferWindow = 0;
+    sourceSize = 0;
   }
 
   Meta::Meta(const DTSC::Packet & source) {
@@ -1411,6 +1696,7 @@ namespace DTSC {
     merged = source.getFlag("merged");
     bufferWindow = source.getInt("buffer_window");
     moreheader = source.getInt("moreheader");
+    sourceSize = source.getInt("source_size");
     source.getString("source", sourceURI);
     Scan tmpTracks = source.getScan().getMember("tracks");
     unsigned int num = 0;
@@ -1427,6 +1713,47 @@ namespace DTSC {
     } while (tmpTrack.asBool());
   }
 
+  ///\brief Brings a meta object up to date with a newer version of the same metadata.
+  ///
+  ///Unlike reinit, tracks that are already known are updated in place through Track::refresh.
+  void Meta::refresh(const DTSC::Packet & source) {
+    vod = source.getFlag("vod");
+    live = source.getFlag("live");
+    version = source.getInt("version");
+    merged = source.getFlag("merged");
+    bufferWindow = source.getInt("buffer_window");
+    moreheader = source.getInt("moreheader");
+    sourceSize = source.getInt("source_size");
+    source.getString("source", sourceURI);
+    Scan tmpTracks = source.getScan().getMember("tracks");
+    std::set<unsigned int> seenTracks;
+    unsigned int num = 0;
+    Scan tmpTrack;
+    do {
+      tmpTrack = tmpTracks.getIndice(num);
+      if (tmpTrack.asBool()) {
+        unsigned int trackId = tmpTrack.getMember("trackid").asInt();
+        if (trackId) {
+          if (tracks.count(trackId)) {
+            tracks[trackId].refresh(tmpTrack);
+          } else {
+            tracks[trackId] = Track(tmpTrack);
+          }
+          seenTracks.insert(trackId);
+        }
+        num++;
+      }
+    } while (tmpTrack.asBool());
+    std::map<unsigned int, Track>::iterator it = tracks.begin();
+    while (it != tracks.end()) {
+      if (!seenTracks.count(it->first)) {
+        tracks.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+  }
+
   ///\brief Creates a meta object from a JSON::Value
   Meta::Meta(JSON::Value & meta) {
     vod = meta.isMember("vod") && meta["vod"];
@@ -1438,6 +1765,7 @@ namespace DTSC {
     if (meta.isMember("buffer_window")) {
       bufferWindow = meta["buffer_window"].asInt();
     }
+    sourceSize = meta.isMember("source_size") ? meta["source_size"].asInt() : 0;
     //for (JSON::ObjIter it = meta["tracks"].ObjBegin(); it != meta["tracks"].ObjEnd(); it++) {
     jsonForEach(meta["tracks"], it) {
       if ((*it)["trackid"].asInt()) {
@@ -1770,22 +2098,28 @@ namespace DTSC {
 
   ///\brief Writes a track to a socket
   void Track::send(Socket::Connection & conn, bool skipDynamic) {
-    conn.SendNow(convertShort(getWritableIdentifier().size()), 2);
-    conn.SendNow(getWritableIdentifier());
-    conn.SendNow("\340", 1);//Begin track object
+    JSON::SocketWriter w(conn);
+    send(w, skipDynamic);
+  }
+
+  ///\brief Writes a track to a JSON::Writer, in the same packed form as Track::writeTo
+  void Track::send(JSON::Writer & w, bool skipDynamic) {
+    w.append(convertShort(getWritableIdentifier().size()), 2);
+    w.append(getWritableIdentifier());
+    w.append("\340", 1);//Begin track object
     if (!skipDynamic){
-    conn.SendNow("\000\011fragments\002", 12);
-      conn.SendNow(convertInt(fragments.size() * PACKED_FRAGMENT_SIZE), 4);
+    w.append("\000\011fragments\002", 12);
+      w.append(convertInt(fragments.size() * PACKED_FRAGMENT_SIZE), 4);
     for (std::deque<Fragment>::iterator it = fragments.begin(); it != fragments.end(); it++) {
-        conn.SendNow(it->getData(), PACKED_FRAGMENT_SIZE);
+        w.append(it->getData(), PACKED_FRAGMENT_SIZE);
     }
-    conn.SendNow("\000\004keys\002", 7);
-      conn.SendNow(convertInt(keys.size() * PACKED_KEY_SIZE), 4);
+    w.append("\000\004keys\002", 7);
+      w.append(convertInt(keys.size() * PACKED_KEY_SIZE), 4);
     for (std::deque<Key>::iterator it = keys.begin(); it != keys.end(); it++) {
-        conn.SendNow(it->getData(), PACKED_KEY_SIZE);
+        w.append(it->getData(), PACKED_KEY_SIZE);
     }
-    conn.SendNow("\000\010keysizes\002,", 11);
-    conn.SendNow(convertInt(keySizes.size() * 4), 4);
+    w.append("\000\010keysizes\002,", 11);
+    w.append(convertInt(keySizes.size() * 4), 4);
     std::string tmp;
     tmp.reserve(keySizes.size() * 4);
     for (unsigned int i = 0; i < keySizes.size(); i++){
@@ -1794,61 +2128,61 @@ namespace DTSC {
       tmp += (char)(keySizes[i] >> 8);
       tmp += (char)(keySizes[i]);
     }
-    conn.SendNow(tmp.data(), tmp.size());
-    conn.SendNow("\000\005parts\002", 8);
-    conn.SendNow(convertInt(parts.size() * 9), 4);
+    w.append(tmp.data(), tmp.size());
+    w.append("\000\005parts\002", 8);
+    w.append(convertInt(parts.size() * 9), 4);
     for (std::deque<Part>::iterator it = parts.begin(); it != parts.end(); it++) {
-      conn.SendNow(it->getData(), 9);
+      w.append(it->getData(), 9);
     }
     }
-    conn.SendNow("\000\007trackid\001", 10);
-    conn.SendNow(convertLongLong(trackID), 8);
+    w.append("\000\007trackid\001", 10);
+    w.append(convertLongLong(trackID), 8);
     if (!skipDynamic && missedFrags) {
-      conn.SendNow("\000\014missed_frags\001", 15);
-      conn.SendNow(convertLongLong(missedFrags), 8);
-    }
-    conn.SendNow("\000\007firstms\001", 10);
-    conn.SendNow(convertLongLong(firstms), 8);
-    conn.SendNow("\000\006lastms\001", 9);
-    conn.SendNow(convertLongLong(lastms), 8);
-    conn.SendNow("\000\003bps\001", 6);
-    conn.SendNow(convertLongLong(bps), 8);
-    conn.SendNow("\000\006maxbps\001", 9);
-    conn.SendNow(convertLongLong(max_bps), 8);
-    conn.SendNow("\000\004init\002", 7);
-    conn.SendNow(convertInt(init.size()), 4);
-    conn.SendNow(init);
-    conn.SendNow("\000\005codec\002", 8);
-    conn.SendNow(convertInt(codec.size()), 4);
-    conn.SendNow(codec);
-    conn.SendNow("\000\004type\002", 7);
-    conn.SendNow(convertInt(type.size()), 4);
-    conn.SendNow(type);
+      w.append("\000\014missed_frags\001", 15);
+      w.append(convertLongLong(missedFrags), 8);
+    }
+    w.append("\000\007firstms\001", 10);
+    w.append(convertLongLong(firstms), 8);
+    w.append("\000\006lastms\001", 9);
+    w.append(convertLongLong(lastms), 8);
+    w.append("\000\003bps\001", 6);
+    w.append(convertLongLong(bps), 8);
+    w.append("\000\006maxbps\001", 9);
+    w.append(convertLongLong(max_bps), 8);
+    w.append("\000\004init\002", 7);
+    w.append(convertInt(init.size()), 4);
+    w.append(init);
+    w.append("\000\005codec\002", 8);
+    w.append(convertInt(codec.size()), 4);
+    w.append(codec);
+    w.append("\000\004type\002", 7);
+    w.append(convertInt(type.size()), 4);
+    w.append(type);
     if (lang.size() && lang != "und"){
-    conn.SendNow("\000\004lang\002", 7);
-    conn.SendNow(convertInt(lang.size()), 4);
-    conn.SendNow(lang);
+    w.append("\000\004lang\002", 7);
+    w.append(convertInt(lang.size()), 4);
+    w.append(lang);
     }
     if (type == "audio") {
-      conn.SendNow("\000\004rate\001", 7);
-      conn.SendNow(convertLongLong(rate), 8);
-      conn.SendNow("\000\004size\001", 7);
-      conn.SendNow(convertLongLong(size), 8);
-      conn.SendNow("\000\010channels\001", 11);
-      conn.SendNow(convertLongLong(channels), 8);
+      w.append("\000\004rate\001", 7);
+      w.append(convertLongLong(rate), 8);
+      w.append("\000\004size\001", 7);
+      w.append(convertLongLong(size), 8);
+      w.append("\000\010channels\001", 11);
+      w.append(convertLongLong(channels), 8);
     } else if (type == "video") {
-      conn.SendNow("\000\005width\001", 8);
-      conn.SendNow(convertLongLong(width), 8);
-      conn.SendNow("\000\006height\001", 9);
-      conn.SendNow(convertLongLong(height), 8);
-      conn.SendNow("\000\004fpks\001", 7);
-      conn.SendNow(convertLongLong(fpks), 8);
+      w.append("\000\005width\001", 8);
+      w.append(convertLongLong(width), 8);
+      w.append("\000\006height\001", 9);
+      w.append(convertLongLong(height), 8);
+      w.append("\000\004fpks\001", 7);
+      w.append(convertLongLong(fpks), 8);
     }
     if (minKeepAway){
-      conn.SendNow("\000\010keepaway\001", 11);
-      conn.SendNow(convertLongLong(minKeepAway), 8);
+      w.append("\000\010keepaway\001", 11);
+      w.append(convertLongLong(minKeepAway), 8);
     }
-    conn.SendNow("\000\000\356", 3);//End this track Object
+    w.append("\000\000\356", 3);//End this track Object
   }
 
   ///\brief Determines the "packed" size of a meta object
@@ -1905,45 +2239,47 @@ namespace DTSC {
   }
 
   ///\brief Writes a meta object to a socket
+  /// Data is collected in a bounded buffer, so even huge headers are sent in a handful of writes.
   void Meta::send(Socket::Connection & conn, bool skipDynamic, std::set<unsigned long> selectedTracks) {
+    JSON::SocketWriter w(conn);
     int dataLen = getSendLen(skipDynamic, selectedTracks) - 8; //strip 8 bytes header
-    conn.SendNow(DTSC::Magic_Header, 4);
-    conn.SendNow(convertInt(dataLen), 4);
-    conn.SendNow("\340\000\006tracks\340", 10);
+    w.append(DTSC::Magic_Header, 4);
+    w.append(convertInt(dataLen), 4);
+    w.append("\340\000\006tracks\340", 10);
     for (std::map<unsigned int, Track>::iterator it = tracks.begin(); it != tracks.end(); it++) {
       if (!selectedTracks.size() || selectedTracks.count(it->first)){
-        it->second.send(conn, skipDynamic);
+        it->second.send(w, skipDynamic);
       }
     }
-    conn.SendNow("\000\000\356", 3);//End tracks object
+    w.append("\000\000\356", 3);//End tracks object
     if (vod) {
-      conn.SendNow("\000\003vod\001", 6);
-      conn.SendNow(convertLongLong(1), 8);
+      w.append("\000\003vod\001", 6);
+      w.append(convertLongLong(1), 8);
     }
     if (live) {
-      conn.SendNow("\000\004live\001", 7);
-      conn.SendNow(convertLongLong(1), 8);
+      w.append("\000\004live\001", 7);
+      w.append(convertLongLong(1), 8);
     }
     if (merged) {
-      conn.SendNow("\000\006merged\001", 9);
-      conn.SendNow(convertLongLong(1), 8);
+      w.append("\000\006merged\001", 9);
+      w.append(convertLongLong(1), 8);
     }
     if (version) {
-      conn.SendNow("\000\007version\001", 10);
-      conn.SendNow(convertLongLong(version), 8);
+      w.append("\000\007version\001", 10);
+      w.append(convertLongLong(version), 8);
     }
     if (sourceURI.size()) {
-      conn.SendNow("\000\006source\002", 9);
-      conn.SendNow(convertInt(sourceURI.size()), 4);
-      conn.SendNow(sourceURI);
+      w.append("\000\006source\002", 9);
+      w.append(convertInt(sourceURI.size()), 4);
+      w.append(sourceURI);
     }
     if (bufferWindow) {
-      conn.SendNow("\000\015buffer_window\001", 16);
-      conn.SendNow(convertLongLong(bufferWindow), 8);
+      w.append("\000\015buffer_window\001", 16);
+      w.append(convertLongLong(bufferWindow), 8);
     }
-    conn.SendNow("\000\012moreheader\001", 13);
-    conn.SendNow(convertLongLong(moreheader), 8);
-    conn.SendNow("\000\000\356", 3);//End global object
+    w.append("\000\012moreheader\001", 13);
+    w.append(convertLongLong(moreheader), 8);
+    w.append("\000\000\356", 3);//End global object
   }
 
   ///\brief Converts a track to a JSON::Value
@@ -2010,10 +2346,11 @@ namespace DTSC {
   }
 
   ///\brief Converts a meta object to a JSON::Value
-  JSON::Value Meta::toJSON() {
+  ///\param skipDynamic Leaves out the fragment, key, key size and part lists of all tracks
+  JSON::Value Meta::toJSON(bool skipDynamic) {
     JSON::Value result;
     for (std::map<unsigned int, Track>::iterator it = tracks.begin(); it != tracks.end(); it++) {
-      result["tracks"][it->second.getWritableIdentifier()] = it->second.toJSON();
+      result["tracks"][it->second.getWritableIdentifier()] = it->second.toJSON(skipDynamic);
     }
     if (vod) {
       result["vod"] = 1ll;
@@ -2033,16 +2370,128 @@ namespace DTSC {
     if (sourceURI.size()){
       result["source"] = sourceURI;
     }
+    if (sourceSize){
+      result["source_size"] = sourceSize;
+    }
     result["moreheader"] = moreheader;
     return result;
   }
 
-  ///\brief Writes metadata to a filename. Wipes existing contents, if any.
+  ///\brief Writes metadata to a filename in the DTSH layout. Wipes existing contents, if any.
+  ///
+  /// - 4 bytes: "DTSH"
+  /// - 4 bytes: DTSH_VERSION
+  /// - 4 bytes: length of the DTSC header packet that follows, holding all values except the per-track lists
+  /// - 4 bytes: amount of tracks, followed per track by its track ID and its key, part and fragment counts, 4 bytes each
+  /// - Per track, in the same order: packed keys, 4-byte key sizes, packed parts and packed fragments
+  ///
+  /// The lists are stored exactly as they are kept in memory, so fromFile can copy them over in bulk.
+  /// The file is written next to the target and renamed over it once complete, as other processes may have the old one mapped.
   bool Meta::toFile(const std::string & fileName){
-    std::ofstream oFile(fileName.c_str());
-    oFile << toJSON().toNetPacked();
-    if (!oFile.good()){return false;}
+    std::stringstream tmpName;
+    tmpName << fileName << ".tmp" << getpid();
+    std::ofstream oFile(tmpName.str().c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    std::string fields = toJSON(true).toNetPacked();
+    oFile.write(Magic_Index, 4);
+    oFile.write(convertInt(DTSH_VERSION), 4);
+    oFile.write(convertInt(fields.size()), 4);
+    oFile.write(fields.data(), fields.size());
+    oFile.write(convertInt(tracks.size()), 4);
+    for (std::map<unsigned int, Track>::iterator it = tracks.begin(); it != tracks.end(); it++) {
+      oFile.write(convertInt(it->first), 4);
+      oFile.write(convertInt(it->second.keys.size()), 4);
+      oFile.write(convertInt(it->second.parts.size()), 4);
+      oFile.write(convertInt(it->second.fragments.size()), 4);
+    }
+    char sizeBuf[4];
+    for (std::map<unsigned int, Track>::iterator it = tracks.begin(); it != tracks.end(); it++) {
+      Track & trk = it->second;
+      for (std::deque<Key>::iterator kIt = trk.keys.begin(); kIt != trk.keys.end(); kIt++) {
+        oFile.write(kIt->getData(), PACKED_KEY_SIZE);
+      }
+      for (unsigned int i = 0; i < trk.keys.size(); i++) {
+        Bit::htobl(sizeBuf, i < trk.keySizes.size() ? trk.keySizes[i] : 0);
+        oFile.write(sizeBuf, 4);
+      }
+      for (std::deque<Part>::iterator pIt = trk.parts.begin(); pIt != trk.parts.end(); pIt++) {
+        oFile.write(pIt->getData(), PACKED_PART_SIZE);
+      }
+      for (std::deque<Fragment>::iterator fIt = trk.fragments.begin(); fIt != trk.fragments.end(); fIt++) {
+        oFile.write(fIt->getData(), PACKED_FRAGMENT_SIZE);
+      }
+    }
     oFile.close();
+    if (!oFile.good() || rename(tmpName.str().c_str(), fileName.c_str())){
+      unlink(tmpName.str().c_str());
+      return false;
+    }
+    return true;
+  }
+
+  ///\brief Reads metadata from a file written by toFile, replacing the current contents.
+  ///
+  /// The file is mapped into memory and the track lists are copied straight out of the mapping.
+  /// The version is set to the one stored in the file, so callers can tell outdated files apart.
+  ///\return True if the file was read, false if it does not exist or is not a valid DTSH file.
+  bool Meta::fromFile(const std::string & fileName){
+    Util::MappedFile inFile;
+    if (!inFile.open(fileName)){return false;}
+    inFile.setSequential(true);
+    const char * d = inFile.data();
+    uint64_t dLen = inFile.size();
+    if (dLen >= 8 && memcmp(d, Magic_Header, 4) == 0 && 8 + (uint64_t)Bit::btohl(d + 4) <= dLen){
+      //Files from before version 5 hold a single DTSC header packet
+      Packet oldHeader(d, 8 + Bit::btohl(d + 4), true);
+      if (oldHeader.getVersion() != DTSC_HEAD){return false;}
+      reinit(oldHeader);
+      return true;
+    }
+    if (dLen < 16 || memcmp(d, Magic_Index, 4) != 0){
+      DEBUG_MSG(DLVL_MEDIUM, "%s is not a DTSH file", fileName.c_str());
+      return false;
+    }
+    uint32_t fieldsLen = Bit::btohl(d + 8);
+    if (16 + (uint64_t)fieldsLen > dLen){return false;}
+    Packet fields(d + 12, fieldsLen, true);
+    if (fields.getVersion() != DTSC_HEAD){return false;}
+    reinit(fields);
+    version = Bit::btohl(d + 4);
+    uint64_t pos = 12 + fieldsLen;
+    uint32_t trackCount = Bit::btohl(d + pos);
+    pos += 4;
+    uint64_t tablePos = pos + trackCount * 16ull;
+    for (uint32_t i = 0; i < trackCount; ++i, pos += 16){
+      if (pos + 16 > dLen){
+        FAIL_MSG("Corrupt DTSH file %s: track list is cut short", fileName.c_str());
+        tracks.clear();
+        return false;
+      }
+      unsigned int tid = Bit::btohl(d + pos);
+      uint64_t keyCount = Bit::btohl(d + pos + 4);
+      uint64_t partCount = Bit::btohl(d + pos + 8);
+      uint64_t fragCount = Bit::btohl(d + pos + 12);
+      uint64_t tableLen = keyCount * (PACKED_KEY_SIZE + 4) + partCount * PACKED_PART_SIZE + fragCount * PACKED_FRAGMENT_SIZE;
+      if (!tracks.count(tid) || tablePos + tableLen > dLen){
+        FAIL_MSG("Corrupt DTSH file %s: track %u tables do not fit", fileName.c_str(), tid);
+        tracks.clear();
+        return false;
+      }
+      Track & trk = tracks[tid];
+      const Key * keyData = (const Key *)(d + tablePos);
+      trk.keys.assign(keyData, keyData + keyCount);
+      tablePos += keyCount * PACKED_KEY_SIZE;
+      trk.keySizes.resize(keyCount);
+      for (uint64_t k = 0; k < keyCount; ++k){
+        trk.keySizes[k] = Bit::btohl(d + tablePos + k * 4);
+      }
+      tablePos += keyCount * 4;
+      const Part * partData = (const Part *)(d + tablePos);
+      trk.parts.assign(partData, partData + partCount);
+      tablePos += partCount * PACKED_PART_SIZE;
+      const Fragment * fragData = (const Fragment *)(d + tablePos);
+      trk.fragments.assign(fragData, fragData + fragCount);
+      tablePos += fragCount * PACKED_FRAGMENT_SIZE;
+    }
     return true;
   }
 
@@ -2069,6 +2518,9 @@ namespace DTSC {
     if (sourceURI.size()){
       str << std::string(indent, ' ') << "Source: " << sourceURI << std::endl;
     }
+    if (sourceSize){
+      str << std::string(indent, ' ') << "Source size: " << sourceSize << " bytes" << std::endl;
+    }
     str << std::string(indent, ' ') << "More Header: " << moreheader << std::endl;
   }
 
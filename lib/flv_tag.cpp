@@ -93,6 +93,63 @@ bool FLV::seekToTagType(FILE * f, uint8_t t){
   }
 }
 
+/// Helper function that can quickly skip through a data buffer looking for a particular tag type.
+/// \param D The location of the data buffer.
+/// \param S The size of the data buffer.
+/// \param P The current position in the data buffer. Will be updated to the start of the found tag.
+/// \return True if a tag of the given type was found, false otherwise.
+bool FLV::seekToTagType(const char * D, uint64_t S, uint64_t & P, uint8_t t){
+  while (P + 4 <= S){
+    const unsigned char * tag = (const unsigned char *)D + P;
+    switch (tag[0]){
+      case 0x09:
+      case 0x08:
+      case 0x12:
+        if (t == tag[0]){
+          INSANE_MSG("Found tag of type %u at %llu", t, P);
+          return true;
+        }
+        P += ((tag[1] << 16) | (tag[2] << 8) | tag[3]) + 15;
+        break;
+      default:
+        WARN_MSG("Invalid FLV tag detected! Aborting search.");
+        return false;
+    }
+  }
+  return false;
+}
+
+/// Checks whether a complete audio, video or metadata tag starts at the given position of a data buffer.
+/// Besides the tag type, the stream ID must be zero and the trailing previous tag size must match the tag.
+/// \param D The location of the data buffer.
+/// \param S The size of the data buffer.
+/// \param P The position in the data buffer to check.
+bool FLV::isTagStart(const char * D, uint64_t S, uint64_t P){
+  if (P + 15 > S){return false;}
+  const unsigned char * tag = (const unsigned char *)D + P;
+  if (tag[0] != 0x08 && tag[0] != 0x09 && tag[0] != 0x12){return false;}
+  if (tag[8] || tag[9] || tag[10]){return false;}
+  uint64_t tagLen = ((tag[1] << 16) | (tag[2] << 8) | tag[3]) + 11;
+  if (P + tagLen + 4 > S){return false;}
+  return (uint64_t)((tag[tagLen] << 24) | (tag[tagLen + 1] << 16) | (tag[tagLen + 2] << 8) | tag[tagLen + 3]) == tagLen;
+}
+
+/// Finds the first tag boundary at or after a position in a data buffer, for example to start parsing in the middle of a file.
+/// A position only counts as a boundary if the tag there, and the tag following it if the buffer holds one, pass isTagStart.
+/// \param D The location of the data buffer.
+/// \param S The size of the data buffer.
+/// \param P The position to start searching at. Will be updated to the found boundary.
+/// \return True if a boundary was found, false otherwise.
+bool FLV::findTagStart(const char * D, uint64_t S, uint64_t & P){
+  for (; P + 15 <= S; ++P){
+    if (!isTagStart(D, S, P)){continue;}
+    const unsigned char * tag = (const unsigned char *)D + P;
+    uint64_t next = P + ((tag[1] << 16) | (tag[2] << 8) | tag[3]) + 15;
+    if (next + 15 > S || isTagStart(D, S, next)){return true;}
+  }
+  return false;
+}
+
 /// True if this media type requires init data.
 /// Will always return false if the tag type is not 0x08 or 0x09.
 /// Returns true for H263, AVC (H264), AAC.
@@ -982,6 +1039,17 @@ unsigned int FLV::Tag::getDataLen(){
   return len - 16;
 }
 
+/// Returns true if this is a video tag that may be dropped without affecting any other frame.
+/// That is either a tag with the disposable inter frame type, or H264 data in which no slice is used as reference.
+bool FLV::Tag::isDisposable(){
+  if (data[0] != 0x09 || len < 16){return false;}
+  if ((data[11] & 0xF0) == 0x30){return true;}
+  if ((data[11] & 0x0F) == 7 && data[12] == 1){
+    return h264::isDisposable(getData(), getDataLen());
+  }
+  return false;
+}
+
 void FLV::Tag::toMeta(DTSC::Meta & metadata, AMF::Object & amf_storage, unsigned int reTrack){
   if (!reTrack){
     switch (data[0]){
@@ -26,6 +26,9 @@ namespace FLV {
 
   /// Helper function that can quickly skip through a file looking for a particular tag type
   bool seekToTagType(FILE * f, uint8_t type);
+  bool seekToTagType(const char * D, uint64_t S, uint64_t & P, uint8_t type);
+  bool isTagStart(const char * D, uint64_t S, uint64_t P);
+  bool findTagStart(const char * D, uint64_t S, uint64_t & P);
 
   /// This class is used to hold, work with and get information about a single FLV tag.
   class Tag {
@@ -59,6 +62,7 @@ namespace FLV {
       unsigned int getTrackID();
       char * getData();
       unsigned int getDataLen();
+      bool isDisposable(); ///< True if current tag is a video frame no other frame depends on.
     protected:
       int buf; ///< Maximum length of buffer space.
       bool done; ///< Body reading done?
@@ -39,6 +39,25 @@ namespace h264 {
     return false;
   }
 
+  ///Helper function to determine if a H264 frame can be dropped without affecting any other frame.
+  ///The frame is a series of NAL units that are each preceded by their size in 4 bytes, as stored in DTSC packets.
+  ///This is the case when it holds slices, and none of them have a nonzero nal_ref_idc.
+  bool isDisposable(const char * data, uint32_t len){
+    bool hasSlices = false;
+    uint32_t pos = 0;
+    while (pos + 5 <= len){
+      uint32_t nalLen = Bit::btohl(data + pos);
+      if (nalLen > len - pos - 4){return false;}
+      uint8_t nalType = (data[pos + 4] & 0x1F);
+      if (nalType >= 0x01 && nalType <= 0x05){
+        if (data[pos + 4] & 0x60){return false;}
+        hasSlices = true;
+      }
+      pos += 4 + nalLen;
+    }
+    return hasSlices;
+  }
+
   std::deque<nalu::nalData> analysePackets(const char * data, unsigned long len){
     std::deque<nalu::nalData> res;
 
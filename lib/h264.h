@@ -68,4 +68,5 @@ namespace h264 {
   };
 
   bool isKeyframe(const char * data, uint32_t len);
+  bool isDisposable(const char * data, uint32_t len);
 }
@@ -6,6 +6,8 @@
 #include "defines.h"
 #include "encode.h"
 #include "timing.h"
+#include <algorithm>
+#include <cstring>
 #include <iomanip>
 
 /// Helper function to check if the given c-string is numeric or not
@@ -513,6 +515,19 @@ void HTTP::Parser::StartResponse(HTTP::Parser &request, Socket::Connection &conn
   StartResponse("200", "OK", request, conn, bufferAllChunks);
 }
 
+/// Creates a writer that sends its data as response chunks through H, over conn.
+HTTP::ChunkWriter::ChunkWriter(Parser &H, Socket::Connection &conn, unsigned int bufSize)
+    : JSON::Writer(bufSize), H(H), conn(conn){}
+
+/// Sends any data that is still buffered.
+HTTP::ChunkWriter::~ChunkWriter(){
+  flush();
+}
+
+void HTTP::ChunkWriter::flushData(const char *data, unsigned int len){
+  H.Chunkify(data, len, conn);
+}
+
 /// After receiving a header with this object, and after a call with SendResponse/SendRequest with
 /// this object, this function call will:
 /// - Retrieve all the body from the 'from' Socket::Connection.
@@ -705,26 +720,20 @@ void HTTP::Parser::SetVar(std::string i, std::string v){
 /// If a whole request could be read, it is removed from the front of the socket buffer and true
 /// returned. If not, as much as can be interpreted is removed and false returned. \param conn The
 /// socket to read from. \return True if a whole request or response was read, false otherwise.
+/// The buffered data is parsed in place and only the interpreted part is consumed, without copying it out first.
 bool HTTP::Parser::Read(Socket::Connection &conn){
-  // Make sure the received data ends in a newline (\n).
-  while ((!seenHeaders || (getChunks && !doingChunk)) && conn.Received().get().size() &&
-         *(conn.Received().get().rbegin()) != '\n'){
-    if (conn.Received().size() > 1){
-      // make a copy of the first part
-      std::string tmp = conn.Received().get();
-      // clear the first part, wiping it from the partlist
-      conn.Received().get().clear();
-      conn.Received().size();
-      // take the now first (was second) part, insert the stored part in front of it
-      conn.Received().get().insert(0, tmp);
-    }else{
-      return false;
-    }
+  Socket::Buffer &buf = conn.Received();
+  unsigned int avail = buf.bytes(0xFFFFFFFFu);
+  while (avail){
+    size_t used = 0;
+    bool ret = parse(buf.peek(avail), avail, used);
+    buf.consume(used);
+    // if a parse succeeds, simply return true
+    if (ret){return true;}
+    // otherwise, keep going as long as the parser makes progress, as it stops after every chunk of a chunked body
+    if (!used){return false;}
+    avail = buf.bytes(0xFFFFFFFFu);
   }
-  // if a parse succeeds, simply return true
-  if (parse(conn.Received().get())){return true;}
-  // otherwise, if we have parts left, call ourselves recursively
-  if (conn.Received().size()){return Read(conn);}
   return false;
 }// HTTPReader::Read
 
@@ -742,20 +751,28 @@ bool HTTP::Parser::Read(std::string &strbuf){
 /// \param HTTPbuffer The data buffer to read from.
 /// \return True on success, false otherwise.
 bool HTTP::Parser::parse(std::string &HTTPbuffer){
+  size_t used = 0;
+  bool ret = parse(HTTPbuffer.data(), HTTPbuffer.size(), used);
+  HTTPbuffer.erase(0, used);
+  return ret;
+}// HTTPReader::parse
+
+/// Attempt to read a whole HTTP response or request from len bytes of data.
+/// If succesful, fills its own fields with the proper data.
+/// \param HTTPbuffer The data to read from.
+/// \param len The amount of bytes available in HTTPbuffer.
+/// \param used Set to the amount of bytes interpreted, which the caller should remove from its buffer.
+/// \return True on success, false otherwise.
+bool HTTP::Parser::parse(const char *HTTPbuffer, size_t len, size_t &used){
   size_t f;
   std::string tmpA, tmpB, tmpC;
-  /// \todo Make this not resize HTTPbuffer in parts, but read all at once and then remove the
-  /// entire request, like doxygen claims it does?
-  while (!HTTPbuffer.empty()){
+  used = 0;
+  while (used < len){
     if (!seenHeaders){
-      f = HTTPbuffer.find('\n');
-      if (f == std::string::npos) return false;
-      tmpA = HTTPbuffer.substr(0, f);
-      if (f + 1 == HTTPbuffer.size()){
-        HTTPbuffer.clear();
-      }else{
-        HTTPbuffer.erase(0, f + 1);
-      }
+      const char *lineEnd = (const char *)memchr(HTTPbuffer + used, '\n', len - used);
+      if (!lineEnd) return false;
+      tmpA.assign(HTTPbuffer + used, lineEnd - HTTPbuffer - used);
+      used = lineEnd - HTTPbuffer + 1;
       while (tmpA.find('\r') != std::string::npos){tmpA.erase(tmpA.find('\r'));}
       if (!seenReq){
         seenReq = true;
@@ -821,10 +838,10 @@ bool HTTP::Parser::parse(std::string &HTTPbuffer){
     if (seenHeaders){
       if (length > 0){
         if (headerOnly){return true;}
-        unsigned int toappend = length - body.length();
+        size_t toappend = std::min((size_t)(length - body.length()), len - used);
         if (toappend > 0){
-          body.append(HTTPbuffer, 0, toappend);
-          HTTPbuffer.erase(0, toappend);
+          body.append(HTTPbuffer + used, toappend);
+          used += toappend;
         }
         if (length == body.length()){
           parseVars(body, vars); // parse POST variables
@@ -836,15 +853,14 @@ bool HTTP::Parser::parse(std::string &HTTPbuffer){
         if (getChunks){
           if (headerOnly){return true;}
           if (doingChunk){
-            unsigned int toappend = HTTPbuffer.size();
-            if (toappend > doingChunk){toappend = doingChunk;}
-            body.append(HTTPbuffer, 0, toappend);
-            HTTPbuffer.erase(0, toappend);
+            size_t toappend = std::min((size_t)doingChunk, len - used);
+            body.append(HTTPbuffer + used, toappend);
+            used += toappend;
             doingChunk -= toappend;
           }else{
-            f = HTTPbuffer.find('\n');
-            if (f == std::string::npos) return false;
-            tmpA = HTTPbuffer.substr(0, f);
+            const char *lineEnd = (const char *)memchr(HTTPbuffer + used, '\n', len - used);
+            if (!lineEnd) return false;
+            tmpA.assign(HTTPbuffer + used, lineEnd - HTTPbuffer - used);
             while (tmpA.find('\r') != std::string::npos){tmpA.erase(tmpA.find('\r'));}
             unsigned int chunkLen = 0;
             if (!tmpA.empty()){
@@ -857,11 +873,7 @@ bool HTTP::Parser::parse(std::string &HTTPbuffer){
               }
               doingChunk = chunkLen;
             }
-            if (f + 1 == HTTPbuffer.size()){
-              HTTPbuffer.clear();
-            }else{
-              HTTPbuffer.erase(0, f + 1);
-            }
+            used = lineEnd - HTTPbuffer + 1;
           }
           return false;
         }else{
@@ -930,7 +942,10 @@ void HTTP::Parser::Chunkify(const char *data, unsigned int size, Socket::Connect
   }
   if (sendingChunks){
     // prepend the chunk size and \r\n
-    if (!size){conn.SendNow("0\r\n\r\n", 5);}
+    if (!size){
+      conn.SendNow("0\r\n\r\n", 5);
+      return;
+    }
     size_t offset = 8;
     unsigned int t_size = size;
     char len[] = "\000\000\000\000\000\000\0000\r\n";
@@ -938,11 +953,15 @@ void HTTP::Parser::Chunkify(const char *data, unsigned int size, Socket::Connect
       len[--offset] = hexa[t_size & 0xf];
       t_size >>= 4;
     }
-    conn.SendNow(len + offset, 10 - offset);
-    // send the chunk itself
-    conn.SendNow(data, size);
-    // append \r\n
-    conn.SendNow("\r\n", 2);
+    // send the chunk size, the chunk itself and the trailing \r\n in one go
+    struct iovec iov[3];
+    iov[0].iov_base = len + offset;
+    iov[0].iov_len = 10 - offset;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = size;
+    iov[2].iov_base = (void *)"\r\n";
+    iov[2].iov_len = 2;
+    conn.SendNow(iov, 3);
   }else{
     // just send the chunk itself
     conn.SendNow(data, size);
@@ -2,6 +2,7 @@
 /// Holds all headers for the HTTP namespace.
 
 #pragma once
+#include "json.h"
 #include "socket.h"
 #include <map>
 #include <stdio.h>
@@ -65,6 +66,7 @@ namespace HTTP{
     bool getChunks;
     unsigned int doingChunk;
     bool parse(std::string &HTTPbuffer);
+    bool parse(const char *HTTPbuffer, size_t len, size_t &used);
     std::string builder;
     std::string read_buffer;
     std::map<std::string, std::string> headers;
@@ -72,6 +74,21 @@ namespace HTTP{
     void Trim(std::string &s);
   };
 
+  /// JSON::Writer that sends its data as chunks of a response started with Parser::StartResponse.
+  /// The response itself is not ended; call Chunkify with an empty chunk once the writer is gone.
+  class ChunkWriter : public JSON::Writer{
+  public:
+    ChunkWriter(Parser &H, Socket::Connection &conn, unsigned int bufSize = JSON_WRITE_BUFFER);
+    ~ChunkWriter();
+
+  protected:
+    void flushData(const char *data, unsigned int len);
+
+  private:
+    Parser &H;
+    Socket::Connection &conn;
+  };
+
   /// URL parsing class. Parses full URL into its subcomponents
   class URL{
   public:
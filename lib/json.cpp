@@ -4,11 +4,74 @@
 #include "defines.h"
 #include <sstream>
 #include <fstream>
+#include <algorithm>
 #include <stdlib.h>
 #include <stdint.h> //for uint64_t
 #include <string.h> //for memcpy
 #include <arpa/inet.h> //for htonl
 
+/// Creates a writer that flushes its buffer whenever it would grow past bufSize bytes.
+/// A bufSize of zero never flushes, keeping all written data.
+JSON::Writer::Writer(unsigned int bufSize){
+  this->bufSize = bufSize;
+  if (bufSize){
+    buffer.reserve(bufSize);
+  }
+}
+
+/// Writes data, flushing the buffer first if it would not fit.
+/// Data too big for the buffer is flushed directly without being copied.
+void JSON::Writer::append(const char * data, unsigned int len){
+  if (bufSize && buffer.size() + len > bufSize){
+    flush();
+    if (len >= bufSize){
+      flushData(data, len);
+      return;
+    }
+  }
+  buffer.append(data, len);
+}
+
+/// Writes a string, flushing the buffer first if it would not fit.
+void JSON::Writer::append(const std::string & data){
+  append(data.data(), data.size());
+}
+
+/// Writes a single character, flushing the buffer first if it is full.
+void JSON::Writer::append(char c){
+  if (bufSize && buffer.size() >= bufSize){
+    flush();
+  }
+  buffer.append(1, c);
+}
+
+/// Hands the buffered data to flushData() and empties the buffer.
+/// Does nothing for writers with a bufSize of zero, or when the buffer is empty.
+void JSON::Writer::flush(){
+  if (!bufSize || !buffer.size()){
+    return;
+  }
+  flushData(buffer.data(), buffer.size());
+  buffer.clear();
+}
+
+/// Returns the data that was written and not yet flushed.
+std::string & JSON::Writer::str(){
+  return buffer;
+}
+
+/// Creates a writer that sends its data over the given connection.
+JSON::SocketWriter::SocketWriter(Socket::Connection & conn, unsigned int bufSize) : Writer(bufSize), conn(conn){}
+
+/// Sends any data that is still buffered.
+JSON::SocketWriter::~SocketWriter(){
+  flush();
+}
+
+void JSON::SocketWriter::flushData(const char * data, unsigned int len){
+  conn.SendNow(data, len);
+}
+
 /// Construct from a root Value to iterate over.
 JSON::Iter::Iter(Value & root){
   myType = root.myType;
@@ -18,9 +81,6 @@ JSON::Iter::Iter(Value & root){
   if (myType == JSON::ARRAY){
     aIt = root.arrVal.begin();
   }
-  if (myType == JSON::OBJECT){
-    oIt = root.objVal.begin();
-  }
 }
 
 /// Dereferences into a Value reference.
@@ -29,8 +89,8 @@ JSON::Value & JSON::Iter::operator*() const{
   if (myType == JSON::ARRAY && aIt != r->arrVal.end()){
     return **aIt;
   }
-  if (myType == JSON::OBJECT && oIt != r->objVal.end()){
-    return *(oIt->second);
+  if (myType == JSON::OBJECT && i < r->objVal.size()){
+    return *(r->objVal[i].second);
   }
   static JSON::Value error;
   WARN_MSG("Dereferenced invalid JSON iterator");
@@ -45,7 +105,7 @@ JSON::Value * JSON::Iter::operator->() const{
 
 /// True if not done iterating.
 JSON::Iter::operator bool() const{
-  return ((myType == JSON::ARRAY && aIt != r->arrVal.end()) || (myType == JSON::OBJECT && oIt != r->objVal.end()));
+  return ((myType == JSON::ARRAY && aIt != r->arrVal.end()) || (myType == JSON::OBJECT && i < r->objVal.size()));
 }
 
 /// Go to next iteration.
@@ -55,9 +115,6 @@ JSON::Iter & JSON::Iter::operator++(){
     if (myType == JSON::ARRAY){
       ++aIt;
     }
-    if (myType == JSON::OBJECT){
-      ++oIt;
-    }
   }
   return *this;
 }
@@ -65,7 +122,7 @@ JSON::Iter & JSON::Iter::operator++(){
 /// Return the name of the current indice.
 const std::string & JSON::Iter::key() const{
   if (myType == JSON::OBJECT && *this){
-    return oIt->first;
+    return r->objVal[i].first;
   }
   static const std::string empty;
   WARN_MSG("Got key from invalid JSON iterator");
@@ -85,7 +142,7 @@ void JSON::Iter::remove(){
       return;
     }
     if (myType == JSON::OBJECT){
-      r->removeMember(oIt);
+      r->removeMember(r->objVal.begin() + i);
       return;
     }
   }
@@ -100,9 +157,6 @@ JSON::ConstIter::ConstIter(const Value & root){
   if (myType == JSON::ARRAY){
     aIt = root.arrVal.begin();
   }
-  if (myType == JSON::OBJECT){
-    oIt = root.objVal.begin();
-  }
 }
 
 /// Dereferences into a Value reference.
@@ -111,8 +165,8 @@ const JSON::Value & JSON::ConstIter::operator*() const{
   if (myType == JSON::ARRAY && aIt != r->arrVal.end()){
     return **aIt;
   }
-  if (myType == JSON::OBJECT && oIt != r->objVal.end()){
-    return *(oIt->second);
+  if (myType == JSON::OBJECT && i < r->objVal.size()){
+    return *(r->objVal[i].second);
   }
   static JSON::Value error;
   WARN_MSG("Dereferenced invalid JSON iterator");
@@ -127,7 +181,7 @@ const JSON::Value * JSON::ConstIter::operator->() const{
 
 /// True if not done iterating.
 JSON::ConstIter::operator bool() const{
-  return ((myType == JSON::ARRAY && aIt != r->arrVal.end()) || (myType == JSON::OBJECT && oIt != r->objVal.end()));
+  return ((myType == JSON::ARRAY && aIt != r->arrVal.end()) || (myType == JSON::OBJECT && i < r->objVal.size()));
 }
 
 /// Go to next iteration.
@@ -137,9 +191,6 @@ JSON::ConstIter & JSON::ConstIter::operator++(){
     if (myType == JSON::ARRAY){
       ++aIt;
     }
-    if (myType == JSON::OBJECT){
-      ++oIt;
-    }
   }
   return *this;
 }
@@ -147,7 +198,7 @@ JSON::ConstIter & JSON::ConstIter::operator++(){
 /// Return the name of the current indice.
 const std::string & JSON::ConstIter::key() const{
   if (myType == JSON::OBJECT && *this){
-    return oIt->first;
+    return r->objVal[i].first;
   }
   static const std::string empty;
   WARN_MSG("Got key from invalid JSON iterator");
@@ -418,9 +469,12 @@ JSON::Value::Value(std::istream & fromstream) {
           reading_array = true;
           c = fromstream.get();
           myType = ARRAY;
-          Value tmp = JSON::Value(fromstream);
-          if (tmp.myType != EMPTY) {
-            append(tmp);
+          //parse children straight into place, instead of copying them in
+          Value * tmp = new Value(fromstream);
+          if (tmp->myType != EMPTY) {
+            arrVal.push_back(tmp);
+          }else{
+            delete tmp;
           }
           break;
         }
@@ -433,7 +487,12 @@ JSON::Value::Value(std::istream & fromstream) {
           stop = true;
         } else {
           std::string tmpstr = read_string(c, fromstream);
-          (*this)[tmpstr] = JSON::Value(fromstream);
+          Value * tmp = new Value(fromstream);
+          Value *& slot = memberSlot(tmpstr);
+          if (slot){
+            delete slot;
+          }
+          slot = tmp;
         }
         break;
       case '-':
@@ -462,7 +521,7 @@ JSON::Value::Value(std::istream & fromstream) {
         }
         c = fromstream.get();
         if (reading_array) {
-          append(JSON::Value(fromstream));
+          arrVal.push_back(new Value(fromstream));
         }
         break;
       case '}':
@@ -653,6 +712,9 @@ JSON::Value & JSON::Value::assignFrom(const Value & rhs, const std::set<std::str
 
 /// Sets this JSON::Value to be equal to the given JSON::Value.
 JSON::Value & JSON::Value::operator=(const JSON::Value & rhs) {
+  if (this == &rhs){
+    return *this;
+  }
   null();
   myType = rhs.myType;
   if (myType == STRING){
@@ -662,13 +724,16 @@ JSON::Value & JSON::Value::operator=(const JSON::Value & rhs) {
     intVal = rhs.intVal;
   }
   if (myType == OBJECT){
-    jsonForEachConst(rhs, i){
-      (*this)[i.key()] = *i;
+    //the source is already sorted, so each member can be appended directly
+    objVal.reserve(rhs.objVal.size());
+    for (memberList::const_iterator it = rhs.objVal.begin(); it != rhs.objVal.end(); ++it){
+      objVal.push_back(std::pair<std::string, Value*>(it->first, new Value(*it->second)));
     }
   }
   if (myType == ARRAY){
-    jsonForEachConst(rhs, i){
-      append(*i);
+    arrVal.reserve(rhs.arrVal.size());
+    for (std::vector<Value*>::const_iterator it = rhs.arrVal.begin(); it != rhs.arrVal.end(); ++it){
+      arrVal.push_back(new Value(**it));
     }
   }
   return *this;
@@ -798,6 +863,38 @@ const char * JSON::Value::c_str() const {
   return "";
 }
 
+/// Orders object members by name, for searching the sorted member list.
+static bool memberBefore(const std::pair<std::string, JSON::Value*> & member, const std::string & name){
+  return member.first < name;
+}
+
+/// Returns the first object member whose name is not less than the given name.
+/// Names added in sorted order, as parsers and copies do, are found at the end without searching.
+JSON::memberList::iterator JSON::Value::findMember(const std::string & name){
+  if (objVal.empty() || objVal.back().first < name){
+    return objVal.end();
+  }
+  return std::lower_bound(objVal.begin(), objVal.end(), name, memberBefore);
+}
+
+/// Returns the first object member whose name is not less than the given name.
+JSON::memberList::const_iterator JSON::Value::findMember(const std::string & name) const {
+  if (objVal.empty() || objVal.back().first < name){
+    return objVal.end();
+  }
+  return std::lower_bound(objVal.begin(), objVal.end(), name, memberBefore);
+}
+
+/// Returns the value pointer of the named object member, inserting a null pointer in its sorted place if it is not there yet.
+/// The reference is only valid until the next member is added or removed.
+JSON::Value *& JSON::Value::memberSlot(const std::string & name){
+  memberList::iterator it = findMember(name);
+  if (it == objVal.end() || it->first != name){
+    it = objVal.insert(it, std::pair<std::string, Value*>(name, (Value*)0));
+  }
+  return it->second;
+}
+
 /// Retrieves or sets the JSON::Value at this position in the object.
 /// Converts destructively to object if not already an object.
 JSON::Value & JSON::Value::operator[](const std::string i) {
@@ -805,10 +902,9 @@ JSON::Value & JSON::Value::operator[](const std::string i) {
     null();
     myType = OBJECT;
   }
-  Value * pntr = objVal[i];
+  Value *& pntr = memberSlot(i);
   if (!pntr){
-    objVal[i] = new JSON::Value();
-    pntr = objVal[i];
+    pntr = new JSON::Value();
   }
   return *pntr;
 }
@@ -820,10 +916,9 @@ JSON::Value & JSON::Value::operator[](const char * i) {
     null();
     myType = OBJECT;
   }
-  Value * pntr = objVal[i];
+  Value *& pntr = memberSlot(i);
   if (!pntr){
-    objVal[i] = new JSON::Value();
-    pntr = objVal[i];
+    pntr = new JSON::Value();
   }
   return *pntr;
 }
@@ -831,27 +926,34 @@ JSON::Value & JSON::Value::operator[](const char * i) {
 /// Retrieves or sets the JSON::Value at this position in the array.
 /// Converts destructively to array if not already an array.
 JSON::Value & JSON::Value::operator[](unsigned int i) {
-  static JSON::Value empty;
   if (myType != ARRAY) {
     null();
     myType = ARRAY;
   }
-  while (i >= arrVal.size()) {
-    append(empty);
+  if (i >= arrVal.size()){
+    arrVal.reserve(i + 1);
+    while (i >= arrVal.size()) {
+      arrVal.push_back(new JSON::Value());
+    }
   }
   return *arrVal[i];
 }
 
 /// Retrieves the JSON::Value at this position in the object.
-/// Fails horribly if that values does not exist.
+/// Returns a null value if it does not exist.
 const JSON::Value & JSON::Value::operator[](const std::string i) const {
-  return *objVal.find(i)->second;
+  memberList::const_iterator it = findMember(i);
+  if (it == objVal.end() || it->first != i){
+    static const JSON::Value empty;
+    return empty;
+  }
+  return *it->second;
 }
 
 /// Retrieves the JSON::Value at this position in the object.
-/// Fails horribly if that values does not exist.
+/// Returns a null value if it does not exist.
 const JSON::Value & JSON::Value::operator[](const char * i) const {
-  return *objVal.find(i)->second;
+  return (*this)[std::string(i)];
 }
 
 /// Retrieves the JSON::Value at this position in the array.
@@ -862,80 +964,89 @@ const JSON::Value & JSON::Value::operator[](unsigned int i) const {
 
 /// Packs to a std::string for transfer over the network.
 /// If the object is a container type, this function will call itself recursively and contain all contents.
-/// As a side effect, this function clear the internal buffer of any object-types.
 std::string JSON::Value::toPacked() const {
-  std::string r;
+  Writer w;
+  toPacked(w);
+  return w.str();
+}
+//toPacked
+
+/// Packs into the given JSON::Writer, piece by piece.
+/// If the object is a container type, this function will call itself recursively and contain all contents.
+void JSON::Value::toPacked(Writer & w) const {
   if (isInt() || isNull() || isBool()) {
-    r += 0x01;
-    uint64_t numval = intVal;
-    r += *(((char *) &numval) + 7);
-    r += *(((char *) &numval) + 6);
-    r += *(((char *) &numval) + 5);
-    r += *(((char *) &numval) + 4);
-    r += *(((char *) &numval) + 3);
-    r += *(((char *) &numval) + 2);
-    r += *(((char *) &numval) + 1);
-    r += *(((char *) &numval));
+    char numval[9];
+    numval[0] = 0x01;
+    uint64_t val = intVal;
+    for (unsigned int i = 8; i > 0; --i) {
+      numval[i] = val & 0xFF;
+      val >>= 8;
+    }
+    w.append(numval, 9);
   }
   if (isString()) {
-    r += 0x02;
-    r += strVal.size() / (256 * 256 * 256);
-    r += strVal.size() / (256 * 256);
-    r += strVal.size() / 256;
-    r += strVal.size() % 256;
-    r += strVal;
+    char header[5];
+    header[0] = 0x02;
+    header[1] = strVal.size() / (256 * 256 * 256);
+    header[2] = strVal.size() / (256 * 256);
+    header[3] = strVal.size() / 256;
+    header[4] = strVal.size() % 256;
+    w.append(header, 5);
+    w.append(strVal);
   }
   if (isObject()) {
-    r += 0xE0;
+    w.append((char)0xE0);
     if (objVal.size() > 0) {
       jsonForEachConst(*this, i){
         if (i.key().size() > 0) {
-          r += i.key().size() / 256;
-          r += i.key().size() % 256;
-          r += i.key();
-          r += i->toPacked();
+          w.append((char)(i.key().size() / 256));
+          w.append((char)(i.key().size() % 256));
+          w.append(i.key());
+          i->toPacked(w);
         }
       }
     }
-    r += (char)0x0;
-    r += (char)0x0;
-    r += (char)0xEE;
+    w.append("\000\000\356", 3);
   }
   if (isArray()) {
-    r += 0x0A;
+    w.append((char)0x0A);
     jsonForEachConst(*this, i){
-      r += i->toPacked();
+      i->toPacked(w);
     }
-    r += (char)0x0;
-    r += (char)0x0;
-    r += (char)0xEE;
+    w.append("\000\000\356", 3);
   }
-  return r;
 }
-//toPacked
 
 /// Packs and transfers over the network.
 /// If the object is a container type, this function will call itself recursively for all contents.
+/// The data is collected in a bounded buffer, so only full buffers are sent.
 void JSON::Value::sendTo(Socket::Connection & socket) const {
+  SocketWriter w(socket);
+  sendTo(w);
+}
+
+/// Packs into the given JSON::Writer, including DTSC/DTP2 headers where sendTo(Socket::Connection &) would send them.
+/// If the object is a container type, this function will call itself recursively for all contents.
+void JSON::Value::sendTo(Writer & w) const {
   if (isInt() || isNull() || isBool()) {
-    socket.SendNow("\001", 1);
+    w.append("\001", 1);
     int tmpHalf = htonl((int)(intVal >> 32));
-    socket.SendNow((char *)&tmpHalf, 4);
+    w.append((char *)&tmpHalf, 4);
     tmpHalf = htonl((int)(intVal & 0xFFFFFFFF));
-    socket.SendNow((char *)&tmpHalf, 4);
+    w.append((char *)&tmpHalf, 4);
     return;
   }
   if (isString()) {
-    socket.SendNow("\002", 1);
+    w.append("\002", 1);
     int tmpVal = htonl((int)strVal.size());
-    socket.SendNow((char *)&tmpVal, 4);
-    socket.SendNow(strVal);
+    w.append((char *)&tmpVal, 4);
+    w.append(strVal);
     return;
   }
   if (isObject()) {
     if (isMember("trackid") && isMember("time")) {
-      unsigned int trackid = objVal.find("trackid")->second->asInt();
-      long long time = objVal.find("time")->second->asInt();
+      unsigned int trackid = (*this)["trackid"].asInt();
+      long long time = (*this)["time"].asInt();
       unsigned int size = 16;
       if (objVal.size() > 0) {
         jsonForEachConst(*this, i){
@@ -944,58 +1055,58 @@ void JSON::Value::sendTo(Socket::Connection & socket) const {
           }
         }
       }
-      socket.SendNow("DTP2", 4);
+      w.append("DTP2", 4);
       size = htonl(size);
-      socket.SendNow((char *)&size, 4);
+      w.append((char *)&size, 4);
       trackid = htonl(trackid);
-      socket.SendNow((char *)&trackid, 4);
+      w.append((char *)&trackid, 4);
       int tmpHalf = htonl((int)(time >> 32));
-      socket.SendNow((char *)&tmpHalf, 4);
+      w.append((char *)&tmpHalf, 4);
       tmpHalf = htonl((int)(time & 0xFFFFFFFF));
-      socket.SendNow((char *)&tmpHalf, 4);
-      socket.SendNow("\340", 1);
+      w.append((char *)&tmpHalf, 4);
+      w.append("\340", 1);
       if (objVal.size() > 0) {
         jsonForEachConst(*this, i){
           if (i.key().size() > 0 && i.key() != "trackid" && i.key() != "time" && i.key() != "datatype") {
             char sizebuffer[2] = {0, 0};
             sizebuffer[0] = (i.key().size() >> 8) & 0xFF;
             sizebuffer[1] = i.key().size() & 0xFF;
-            socket.SendNow(sizebuffer, 2);
-            socket.SendNow(i.key());
-            i->sendTo(socket);
+            w.append(sizebuffer, 2);
+            w.append(i.key());
+            i->sendTo(w);
           }
         }
       }
-      socket.SendNow("\000\000\356", 3);
+      w.append("\000\000\356", 3);
       return;
     }
     if (isMember("tracks")) {
-      socket.SendNow("DTSC", 4);
+      w.append("DTSC", 4);
       unsigned int size = htonl(packedSize());
-      socket.SendNow((char *)&size, 4);
+      w.append((char *)&size, 4);
     }
-    socket.SendNow("\340", 1);
+    w.append("\340", 1);
     if (objVal.size() > 0) {
       jsonForEachConst(*this, i){
         if (i.key().size() > 0) {
           char sizebuffer[2] = {0, 0};
           sizebuffer[0] = (i.key().size() >> 8) & 0xFF;
           sizebuffer[1] = i.key().size() & 0xFF;
-          socket.SendNow(sizebuffer, 2);
-          socket.SendNow(i.key());
-          i->sendTo(socket);
+          w.append(sizebuffer, 2);
+          w.append(i.key());
+          i->sendTo(w);
         }
       }
     }
-    socket.SendNow("\000\000\356", 3);
+    w.append("\000\000\356", 3);
     return;
   }
   if (isArray()) {
-    socket.SendNow("\012", 1);
+    w.append("\012", 1);
     jsonForEachConst(*this, i){
-      i->sendTo(socket);
+      i->sendTo(w);
     }
-    socket.SendNow("\000\000\356", 3);
+    w.append("\000\000\356", 3);
     return;
   }
 }//sendTo
@@ -1120,59 +1231,64 @@ std::string & JSON::Value::toNetPacked() {
 /// Converts this JSON::Value to valid JSON notation and returns it.
 /// Makes absolutely no attempts to pretty-print anything. :-)
 std::string JSON::Value::toString() const {
+  Writer w;
+  toString(w);
+  return w.str();
+}
+
+/// Converts this JSON::Value to valid JSON notation, writing it into the given JSON::Writer piece by piece.
+/// Makes absolutely no attempts to pretty-print anything. :-)
+void JSON::Value::toString(Writer & w) const {
   switch (myType) {
     case INTEGER: {
-        std::stringstream st;
-        st << intVal;
-        return st.str();
+        char numBuf[24];
+        w.append(numBuf, snprintf(numBuf, 24, "%lld", intVal));
         break;
       }
     case BOOL: {
         if (intVal != 0){
-          return "true";
+          w.append("true", 4);
         }else{
-          return "false";
+          w.append("false", 5);
         }
         break;
       }
     case STRING: {
-        return JSON::string_escape(strVal);
+        w.append(JSON::string_escape(strVal));
         break;
       }
     case ARRAY: {
-        std::string tmp = "[";
+        w.append('[');
         if (arrVal.size() > 0) {
           jsonForEachConst(*this, i){
-            tmp += i->toString();
+            i->toString(w);
             if (i.num()+1 != arrVal.size()) {
-              tmp += ",";
+              w.append(',');
             }
           }
         }
-        tmp += "]";
-        return tmp;
+        w.append(']');
         break;
       }
     case OBJECT: {
-        std::string tmp2 = "{";
+        w.append('{');
         if (objVal.size() > 0) {
           jsonForEachConst(*this, i){
-            tmp2 += JSON::string_escape(i.key()) + ":";
-            tmp2 += i->toString();
+            w.append(JSON::string_escape(i.key()));
+            w.append(':');
+            i->toString(w);
             if (i.num()+1 != objVal.size()) {
-              tmp2 += ",";
+              w.append(',');
             }
           }
         }
-        tmp2 += "}";
-        return tmp2;
+        w.append('}');
         break;
       }
     case EMPTY:
     default:
-      return "null";
+      w.append("null", 4);
   }
-  return "null"; //should never get here...
 }
 
 /// Converts this JSON::Value to valid JSON notation and returns it.
@@ -1255,7 +1371,7 @@ void JSON::Value::prepend(const JSON::Value & rhs) {
     null();
     myType = ARRAY;
   }
-  arrVal.push_front(new JSON::Value(rhs));
+  arrVal.insert(arrVal.begin(), new JSON::Value(rhs));
 }
 
 /// For array and object JSON::Value objects, reduces them
@@ -1265,31 +1381,38 @@ void JSON::Value::prepend(const JSON::Value & rhs) {
 /// do anything if the size is already lower or equal to the
 /// given size.
 void JSON::Value::shrink(unsigned int size) {
-  while (arrVal.size() > size) {
-    delete arrVal.front();
-    arrVal.pop_front();
+  if (arrVal.size() > size) {
+    unsigned int drop = arrVal.size() - size;
+    for (unsigned int i = 0; i < drop; ++i) {
+      delete arrVal[i];
+    }
+    arrVal.erase(arrVal.begin(), arrVal.begin() + drop);
   }
-  while (objVal.size() > size) {
-    delete objVal.begin()->second;
-    objVal.erase(objVal.begin());
+  if (objVal.size() > size) {
+    unsigned int drop = objVal.size() - size;
+    for (unsigned int i = 0; i < drop; ++i) {
+      delete objVal[i].second;
+    }
+    objVal.erase(objVal.begin(), objVal.begin() + drop);
   }
 }
 
 /// For object JSON::Value objects, removes the member with
 /// the given name, if it exists. Has no effect otherwise.
 void JSON::Value::removeMember(const std::string & name) {
-  if (objVal.count(name)){
-    delete objVal[name];
-    objVal.erase(name);
+  memberList::iterator it = findMember(name);
+  if (it != objVal.end() && it->first == name){
+    delete it->second;
+    objVal.erase(it);
   }
 }
 
-void JSON::Value::removeMember(const std::deque<Value*>::iterator & it){
+void JSON::Value::removeMember(const std::vector<Value*>::iterator & it){
   delete (*it);
   arrVal.erase(it);
 }
 
-void JSON::Value::removeMember(const std::map<std::string, Value*>::iterator & it){
+void JSON::Value::removeMember(const memberList::iterator & it){
   delete it->second;
   objVal.erase(it);
 }
@@ -1311,7 +1434,8 @@ void JSON::Value::removeNullMembers(){
 /// For object JSON::Value objects, returns true if the
 /// given name is a member. Returns false otherwise.
 bool JSON::Value::isMember(const std::string & name) const {
-  return objVal.count(name) > 0;
+  memberList::const_iterator it = findMember(name);
+  return it != objVal.end() && it->first == name;
 }
 
 /// Returns true if this object is an integer.
@@ -1437,8 +1561,9 @@ void JSON::fromDTMI(const unsigned char * data, unsigned int len, unsigned int &
           unsigned int tmpi = data[i] * 256 + data[i + 1]; //set tmpi to the UTF-8 length
           std::string tmpstr = std::string((const char *)data + i + 2, (size_t)tmpi); //set the string data
           i += tmpi + 2; //skip length+size forwards
-          ret[tmpstr].null();
-          fromDTMI(data, len, i, ret[tmpstr]); //add content, recursively parsed, updating i, setting indice to tmpstr
+          JSON::Value & child = ret[tmpstr];
+          child.null();
+          fromDTMI(data, len, i, child); //add content, recursively parsed, updating i, setting indice to tmpstr
         }
         i += 3; //skip 0x0000EE
         return;
@@ -1447,9 +1572,9 @@ void JSON::fromDTMI(const unsigned char * data, unsigned int len, unsigned int &
     case 0x0A: { //array
         ++i;
         while (data[i] + data[i + 1] != 0 && i < len) { //while not encountering 0x0000 (we assume 0x0000EE)
-          JSON::Value tval;
-          fromDTMI(data, len, i, tval); //add content, recursively parsed, updating i
-          ret.append(tval);
+          //parse straight into a new array element, rather than copying a parsed one in
+          ret.append(JSON::Value());
+          fromDTMI(data, len, i, ret[ret.size() - 1]); //add content, recursively parsed, updating i
         }
         i += 3; //skip 0x0000EE
         return;
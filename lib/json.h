@@ -20,6 +20,46 @@ namespace JSON {
   /// JSON-string-escapes a value
   std::string string_escape(const std::string & val);
 
+  /// Default buffer size of writers that flush their data somewhere, such as JSON::SocketWriter.
+  #define JSON_WRITE_BUFFER (64 * 1024)
+
+  /// Output for the streaming serialisers, such as JSON::Value::toString(Writer &).
+  /// Data is collected in a buffer, which is handed to flushData() whenever it would grow past bufSize bytes,
+  /// so memory use stays the same regardless of document size.
+  /// With a bufSize of zero, as in this base class, nothing is flushed and str() returns all written data.
+  class Writer {
+    public:
+      Writer(unsigned int bufSize = 0);
+      virtual ~Writer(){}
+      void append(const char * data, unsigned int len);
+      void append(const std::string & data);
+      void append(char c);
+      void flush();
+      std::string & str();
+    protected:
+      virtual void flushData(const char * data, unsigned int len){}
+    private:
+      std::string buffer;
+      unsigned int bufSize;
+  };
+
+  /// Writer that sends its data over a socket whenever its buffer fills up, and when destroyed.
+  /// Sending blocks until the data is written, which paces serialisation to the speed of the connection.
+  class SocketWriter : public Writer {
+    public:
+      SocketWriter(Socket::Connection & conn, unsigned int bufSize = JSON_WRITE_BUFFER);
+      ~SocketWriter();
+    protected:
+      void flushData(const char * data, unsigned int len);
+    private:
+      Socket::Connection & conn;
+  };
+
+  class Value;
+
+  /// Members of an object: name and value pairs, kept sorted by name.
+  typedef std::vector<std::pair<std::string, Value*> > memberList;
+
   /// A JSON::Value is either a string or an integer, but may also be an object, array or null.
   class Value {
     friend class Iter;
@@ -28,8 +68,11 @@ namespace JSON {
       ValueType myType;
       long long int intVal;
       std::string strVal;
-      std::deque<Value*> arrVal;
-      std::map<std::string, Value*> objVal;
+      std::vector<Value*> arrVal;
+      memberList objVal;
+      memberList::iterator findMember(const std::string & name);
+      memberList::const_iterator findMember(const std::string & name) const;
+      Value *& memberSlot(const std::string & name);
     public:
       //constructors/destructors
       Value();
@@ -72,18 +115,21 @@ namespace JSON {
       const Value & operator[](unsigned int i) const;
       //handy functions and others
       std::string toPacked() const;
+      void toPacked(Writer & w) const;
       void sendTo(Socket::Connection & socket) const;
+      void sendTo(Writer & w) const;
       unsigned int packedSize() const;
       void netPrepare();
       std::string & toNetPacked();
       std::string toString() const;
+      void toString(Writer & w) const;
       std::string toPrettyString(int indentation = 0) const;
       void append(const Value & rhs);
       void prepend(const Value & rhs);
       void shrink(unsigned int size);
       void removeMember(const std::string & name);
-      void removeMember(const std::deque<Value*>::iterator & it);
-      void removeMember(const std::map<std::string, Value*>::iterator & it);
+      void removeMember(const std::vector<Value*>::iterator & it);
+      void removeMember(const memberList::iterator & it);
       void removeNullMembers();
       bool isMember(const std::string & name) const;
       bool isInt() const;
@@ -122,8 +168,7 @@ namespace JSON {
       ValueType myType;
       Value * r;
       unsigned int i;
-      std::deque<Value*>::iterator aIt;
-      std::map<std::string, Value*>::iterator oIt;
+      std::vector<Value*>::iterator aIt;
   };
   class ConstIter {
     public:
@@ -138,8 +183,7 @@ namespace JSON {
       ValueType myType;
       const Value * r;
       unsigned int i;
-      std::deque<Value*>::const_iterator aIt;
-      std::map<std::string, Value*>::const_iterator oIt;
+      std::vector<Value*>::const_iterator aIt;
   };
   #define jsonForEach(val, i) for(JSON::Iter i(val); i; ++i)
   #define jsonForEachConst(val, i) for(JSON::ConstIter i(val); i; ++i)
@@ -7,25 +7,6 @@
 #include "timing.h"
 #include "auth.h"
 
-std::string RTMPStream::handshake_in; ///< Input for the handshake.
-std::string RTMPStream::handshake_out; ///< Output for the handshake.
-
-unsigned int RTMPStream::chunk_rec_max = 128;
-unsigned int RTMPStream::chunk_snd_max = 128;
-unsigned int RTMPStream::rec_window_size = 2500000;
-unsigned int RTMPStream::snd_window_size = 2500000;
-unsigned int RTMPStream::rec_window_at = 0;
-unsigned int RTMPStream::snd_window_at = 0;
-unsigned int RTMPStream::rec_cnt = 0;
-unsigned int RTMPStream::snd_cnt = 0;
-
-timeval RTMPStream::lastrec;
-
-/// Holds the last sent chunk for every msg_id.
-std::map<unsigned int, RTMPStream::Chunk> RTMPStream::lastsend;
-/// Holds the last received chunk for every msg_id.
-std::map<unsigned int, RTMPStream::Chunk> RTMPStream::lastrecv;
-
 #define P1024 \
   "FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74020BBEA63B139B22514A08798E3404DD" \
   "EF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED" \
@@ -65,14 +46,29 @@ bool ValidateClientScheme(uint8_t * pBuffer, uint8_t scheme) {
   return result;
 }
 
+/// Copies all header fields of one chunk into another, leaving the payload of the destination alone.
+static void copyChunkHeader(RTMPStream::Chunk & dest, const RTMPStream::Chunk & src){
+  dest.headertype = src.headertype;
+  dest.cs_id = src.cs_id;
+  dest.timestamp = src.timestamp;
+  dest.ts_delta = src.ts_delta;
+  dest.ts_header = src.ts_header;
+  dest.len = src.len;
+  dest.real_len = src.real_len;
+  dest.len_left = src.len_left;
+  dest.msg_type_id = src.msg_type_id;
+  dest.msg_stream_id = src.msg_stream_id;
+}
+
 /// Packs up the chunk for sending over the network.
 /// \warning Do not call if you are not actually sending the resulting data!
-/// \returns A std::string ready to be sent.
-std::string & RTMPStream::Chunk::Pack() {
-  static std::string output;
+/// \param session The connection this chunk is sent over, which keeps the previous chunk of every chunk stream.
+/// \returns A std::string ready to be sent, valid until the next chunk is packed for the same session.
+std::string & RTMPStream::Chunk::Pack(Session & session) {
+  std::string & output = session.packed;
   output.clear();
-  bool allow_short = lastsend.count(cs_id);
-  RTMPStream::Chunk prev = lastsend[cs_id];
+  bool allow_short = session.hasSent(cs_id);
+  RTMPStream::Chunk & prev = session.lastSent(cs_id);
   unsigned int tmpi;
   unsigned char chtype = 0x00;
   if (allow_short && (prev.cs_id == cs_id)) {
@@ -153,8 +149,8 @@ std::string & RTMPStream::Chunk::Pack() {
   len_left = 0;
   while (len_left < len) {
     tmpi = len - len_left;
-    if (tmpi > RTMPStream::chunk_snd_max) {
-      tmpi = RTMPStream::chunk_snd_max;
+    if (tmpi > session.chunk_snd_max) {
+      tmpi = session.chunk_snd_max;
     }
     output.append(data, len_left, tmpi);
     len_left += tmpi;
@@ -179,8 +175,8 @@ std::string & RTMPStream::Chunk::Pack() {
       }
     }
   }
-  lastsend[cs_id] = *this;
-  RTMPStream::snd_cnt += output.size();
+  copyChunkHeader(prev, *this);
+  session.snd_cnt += output.size();
   return output;
 } //SendChunk
 
@@ -189,6 +185,8 @@ RTMPStream::Chunk::Chunk() {
   headertype = 0;
   cs_id = 0;
   timestamp = 0;
+  ts_delta = 0;
+  ts_header = 0;
   len = 0;
   real_len = 0;
   len_left = 0;
@@ -197,9 +195,58 @@ RTMPStream::Chunk::Chunk() {
   data = "";
 } //constructor
 
+/// Creates the state for a new connection, with the default chunk and window sizes.
+RTMPStream::Session::Session() {
+  chunk_rec_max = 128;
+  chunk_snd_max = 128;
+  rec_window_size = 2500000;
+  snd_window_size = 2500000;
+  rec_window_at = 0;
+  snd_window_at = 0;
+  rec_cnt = 0;
+  snd_cnt = 0;
+  lastrec.tv_sec = 0;
+  lastrec.tv_usec = 0;
+} //constructor
+
+/// Returns true if a chunk was sent on the given chunk stream before.
+bool RTMPStream::Session::hasSent(unsigned int cs_id) const {
+  if (cs_id < RTMP_FLAT_CHUNK_STREAMS) {
+    return lastsend[cs_id].cs_id == cs_id;
+  }
+  std::map<unsigned int, Chunk>::const_iterator it = highsend.find(cs_id);
+  return it != highsend.end() && it->second.cs_id == cs_id;
+}
+
+/// Returns the last chunk sent on the given chunk stream, or an empty chunk if there was none yet.
+RTMPStream::Chunk & RTMPStream::Session::lastSent(unsigned int cs_id) {
+  if (cs_id < RTMP_FLAT_CHUNK_STREAMS) {
+    return lastsend[cs_id];
+  }
+  return highsend[cs_id];
+}
+
+/// Returns true if a chunk was received on the given chunk stream before.
+bool RTMPStream::Session::hasReceived(unsigned int cs_id) const {
+  if (cs_id < RTMP_FLAT_CHUNK_STREAMS) {
+    return lastrecv[cs_id].cs_id == cs_id;
+  }
+  std::map<unsigned int, Chunk>::const_iterator it = highrecv.find(cs_id);
+  return it != highrecv.end() && it->second.cs_id == cs_id;
+}
+
+/// Returns the last chunk received on the given chunk stream, or an empty chunk if there was none yet.
+/// While a message is being received, its payload is assembled in the data member of this chunk.
+RTMPStream::Chunk & RTMPStream::Session::lastReceived(unsigned int cs_id) {
+  if (cs_id < RTMP_FLAT_CHUNK_STREAMS) {
+    return lastrecv[cs_id];
+  }
+  return highrecv[cs_id];
+}
+
 /// Packs up a chunk with the given arguments as properties.
-std::string & RTMPStream::SendChunk(unsigned int cs_id, unsigned char msg_type_id, unsigned int msg_stream_id, std::string data) {
-  static RTMPStream::Chunk ch;
+std::string & RTMPStream::Session::SendChunk(unsigned int cs_id, unsigned char msg_type_id, unsigned int msg_stream_id, const std::string & data) {
+  RTMPStream::Chunk & ch = outgoing;
   ch.cs_id = cs_id;
   ch.timestamp = 0;
   ch.len = data.size();
@@ -208,7 +255,7 @@ std::string & RTMPStream::SendChunk(unsigned int cs_id, unsigned char msg_type_i
   ch.msg_type_id = msg_type_id;
   ch.msg_stream_id = msg_stream_id;
   ch.data = data;
-  return ch.Pack();
+  return ch.Pack(*this);
 } //constructor
 
 /// Packs up a chunk with media contents.
@@ -216,8 +263,8 @@ std::string & RTMPStream::SendChunk(unsigned int cs_id, unsigned char msg_type_i
 /// \param data Contents of the media data.
 /// \param len Length of the media data, in bytes.
 /// \param ts Timestamp of the media data, relative to current system time.
-std::string & RTMPStream::SendMedia(unsigned char msg_type_id, unsigned char * data, int len, unsigned int ts) {
-  static RTMPStream::Chunk ch;
+std::string & RTMPStream::Session::SendMedia(unsigned char msg_type_id, unsigned char * data, int len, unsigned int ts) {
+  RTMPStream::Chunk & ch = outgoing;
   ch.cs_id = msg_type_id + 42;
   ch.timestamp = ts;
   ch.len = len;
@@ -226,13 +273,13 @@ std::string & RTMPStream::SendMedia(unsigned char msg_type_id, unsigned char * d
   ch.msg_type_id = msg_type_id;
   ch.msg_stream_id = 1;
   ch.data = std::string((char *)data, (size_t)len);
-  return ch.Pack();
+  return ch.Pack(*this);
 } //SendMedia
 
 /// Packs up a chunk with media contents.
 /// \param tag FLV::Tag with media to send.
-std::string & RTMPStream::SendMedia(FLV::Tag & tag) {
-  static RTMPStream::Chunk ch;
+std::string & RTMPStream::Session::SendMedia(FLV::Tag & tag) {
+  RTMPStream::Chunk & ch = outgoing;
   //Commented bit is more efficient and correct according to RTMP spec.
   //Simply passing "4" is the only thing that actually plays correctly, though.
   //Adobe, if you're ever reading this... wtf? Seriously.
@@ -244,12 +291,12 @@ std::string & RTMPStream::SendMedia(FLV::Tag & tag) {
   ch.data = std::string(tag.data + 11, (size_t)(tag.len - 15));
   ch.len = ch.data.size();
   ch.real_len = ch.len;
-  return ch.Pack();
+  return ch.Pack(*this);
 } //SendMedia
 
 /// Packs up a chunk for a control message with 1 argument.
-std::string & RTMPStream::SendCTL(unsigned char type, unsigned int data) {
-  static RTMPStream::Chunk ch;
+std::string & RTMPStream::Session::SendCTL(unsigned char type, unsigned int data) {
+  RTMPStream::Chunk & ch = outgoing;
   ch.cs_id = 2;
   ch.timestamp = Util::getMS();
   ch.msg_type_id = type;
@@ -266,12 +313,12 @@ std::string & RTMPStream::SendCTL(unsigned char type, unsigned int data) {
     ch.data.resize(4);
   }
   *(int *)((char *)ch.data.data()) = htonl(data);
-  return ch.Pack();
+  return ch.Pack(*this);
 } //SendCTL
 
 /// Packs up a chunk for a control message with 2 arguments.
-std::string & RTMPStream::SendCTL(unsigned char type, unsigned int data, unsigned char data2) {
-  static RTMPStream::Chunk ch;
+std::string & RTMPStream::Session::SendCTL(unsigned char type, unsigned int data, unsigned char data2) {
+  RTMPStream::Chunk & ch = outgoing;
   ch.cs_id = 2;
   ch.timestamp = Util::getMS();
   ch.len = 5;
@@ -282,12 +329,12 @@ std::string & RTMPStream::SendCTL(unsigned char type, unsigned int data, unsigne
   ch.data.resize(5);
   *(unsigned int *)((char *)ch.data.c_str()) = htonl(data);
   ch.data[4] = data2;
-  return ch.Pack();
+  return ch.Pack(*this);
 } //SendCTL
 
 /// Packs up a chunk for a user control message with 1 argument.
-std::string & RTMPStream::SendUSR(unsigned char type, unsigned int data) {
-  static RTMPStream::Chunk ch;
+std::string & RTMPStream::Session::SendUSR(unsigned char type, unsigned int data) {
+  RTMPStream::Chunk & ch = outgoing;
   ch.cs_id = 2;
   ch.timestamp = Util::getMS();
   ch.len = 6;
@@ -299,12 +346,12 @@ std::string & RTMPStream::SendUSR(unsigned char type, unsigned int data) {
   *(unsigned int *)(((char *)ch.data.c_str()) + 2) = htonl(data);
   ch.data[0] = 0;
   ch.data[1] = type;
-  return ch.Pack();
+  return ch.Pack(*this);
 } //SendUSR
 
 /// Packs up a chunk for a user control message with 2 arguments.
-std::string & RTMPStream::SendUSR(unsigned char type, unsigned int data, unsigned int data2) {
-  static RTMPStream::Chunk ch;
+std::string & RTMPStream::Session::SendUSR(unsigned char type, unsigned int data, unsigned int data2) {
+  RTMPStream::Chunk & ch = outgoing;
   ch.cs_id = 2;
   ch.timestamp = Util::getMS();
   ch.len = 10;
@@ -317,7 +364,7 @@ std::string & RTMPStream::SendUSR(unsigned char type, unsigned int data, unsigne
   *(unsigned int *)(((char *)ch.data.c_str()) + 6) = htonl(data2);
   ch.data[0] = 0;
   ch.data[1] = type;
-  return ch.Pack();
+  return ch.Pack(*this);
 } //SendUSR
 
 /// Parses the argument Socket::Buffer into the current chunk.
@@ -325,16 +372,19 @@ std::string & RTMPStream::SendUSR(unsigned char type, unsigned int data, unsigne
 /// If a single packet contains a partial chunk, it will remove the packet and
 /// call itself again. This has the effect of only causing a "true" reponse in
 /// the case a *whole* chunk is read, not just part of a chunk.
+/// Partial messages are assembled inside the matching lastrecv entry, so every byte is copied only once
+/// no matter how many chunks a message is split into. Completed payloads are swapped out of it.
+/// \param session The connection the input belongs to, which keeps the previous chunk of every chunk stream.
 /// \param buffer The input to parse and update.
 /// \warning This function will destroy the current data in this chunk!
 /// \returns True if a whole chunk could be read, false otherwise.
-bool RTMPStream::Chunk::Parse(Socket::Buffer & buffer) {
-  gettimeofday(&RTMPStream::lastrec, 0);
+bool RTMPStream::Chunk::Parse(Session & session, Socket::Buffer & buffer) {
+  gettimeofday(&session.lastrec, 0);
   unsigned int i = 0;
   if (!buffer.available(3)) {
     return false;
   } //we want at least 3 bytes
-  std::string indata = buffer.copy(3);
+  const char * indata = buffer.peek(3);
 
   unsigned char chunktype = indata[i++ ];
   //read the chunkstream ID properly
@@ -351,20 +401,20 @@ bool RTMPStream::Chunk::Parse(Socket::Buffer & buffer) {
       break;
   }
 
-  bool allow_short = lastrecv.count(cs_id);
-  RTMPStream::Chunk prev = lastrecv[cs_id];
+  bool allow_short = session.hasReceived(cs_id);
+  RTMPStream::Chunk & prev = session.lastReceived(cs_id);
 
   //process the rest of the header, for each chunk type
   headertype = chunktype & 0xC0;
   
-  DEBUG_MSG(DLVL_DONTEVEN, "Parsing RTMP chunk header (%#.2hhX) at offset %#X", chunktype, RTMPStream::rec_cnt);
+  DEBUG_MSG(DLVL_DONTEVEN, "Parsing RTMP chunk header (%#.2hhX) at offset %#X", chunktype, session.rec_cnt);
   
   switch (headertype) {
     case 0x00:
       if (!buffer.available(i + 11)) {
         return false;
       } //can't read whole header
-      indata = buffer.copy(i + 11);
+      indata = buffer.peek(i + 11);
       timestamp = indata[i++ ] * 256 * 256;
       timestamp += indata[i++ ] * 256;
       timestamp += indata[i++ ];
@@ -384,7 +434,7 @@ bool RTMPStream::Chunk::Parse(Socket::Buffer & buffer) {
       if (!buffer.available(i + 7)) {
         return false;
       } //can't read whole header
-      indata = buffer.copy(i + 7);
+      indata = buffer.peek(i + 7);
       if (!allow_short) {
         DEBUG_MSG(DLVL_WARN, "Warning: Header type 0x40 with no valid previous chunk!");
       }
@@ -407,7 +457,7 @@ bool RTMPStream::Chunk::Parse(Socket::Buffer & buffer) {
       if (!buffer.available(i + 3)) {
         return false;
       } //can't read whole header
-      indata = buffer.copy(i + 3);
+      indata = buffer.peek(i + 3);
       if (!allow_short) {
         DEBUG_MSG(DLVL_WARN, "Warning: Header type 0x80 with no valid previous chunk!");
       }
@@ -447,9 +497,9 @@ bool RTMPStream::Chunk::Parse(Socket::Buffer & buffer) {
   } else {
     real_len = len;
   }
-  if (real_len > RTMPStream::chunk_rec_max) {
-    len_left += real_len - RTMPStream::chunk_rec_max;
-    real_len = RTMPStream::chunk_rec_max;
+  if (real_len > session.chunk_rec_max) {
+    len_left += real_len - session.chunk_rec_max;
+    real_len = session.chunk_rec_max;
   }
   
   DEBUG_MSG(DLVL_DONTEVEN, "Parsing RTMP chunk result: len_left=%d, real_len=%d", len_left, real_len);
@@ -459,7 +509,7 @@ bool RTMPStream::Chunk::Parse(Socket::Buffer & buffer) {
     if (!buffer.available(i + 4)) {
       return false;
     } //can't read timestamp
-    indata = buffer.copy(i + 4);
+    indata = buffer.peek(i + 4);
     timestamp = indata[i++ ];
     timestamp += indata[i++ ] * 256;
     timestamp += indata[i++ ] * 256 * 256;
@@ -473,25 +523,31 @@ bool RTMPStream::Chunk::Parse(Socket::Buffer & buffer) {
     if (!buffer.available(i + real_len)) {
       return false;
     } //can't read all data (yet)
-    buffer.remove(i); //remove the header
+    buffer.consume(i); //remove the header
     if (prev.len_left > 0) {
-      data = prev.data + buffer.remove(real_len); //append the data and remove from buffer
+      prev.data.append(buffer.peek(real_len), real_len); //append the data and remove from buffer
     } else {
-      data = buffer.remove(real_len); //append the data and remove from buffer
+      if (len_left > 0) {
+        prev.data.reserve(len);
+      }
+      prev.data.assign(buffer.peek(real_len), real_len); //append the data and remove from buffer
     }
-    lastrecv[cs_id] = *this;
-    RTMPStream::rec_cnt += i + real_len;
+    buffer.consume(real_len);
+    copyChunkHeader(prev, *this);
+    session.rec_cnt += i + real_len;
     if (len_left == 0) {
+      //hand out the whole message; our previous buffer is left behind to be reused for the next one
+      data.swap(prev.data);
       return true;
     } else {
-      return Parse(buffer);
+      return Parse(session, buffer);
     }
   } else {
-    buffer.remove(i); //remove the header
-    data = "";
-    indata = indata.substr(i + real_len);
-    lastrecv[cs_id] = *this;
-    RTMPStream::rec_cnt += i + real_len;
+    buffer.consume(i); //remove the header
+    data.clear();
+    prev.data.clear();
+    copyChunkHeader(prev, *this);
+    session.rec_cnt += i + real_len;
     return true;
   }
 } //Parse
@@ -500,18 +556,18 @@ bool RTMPStream::Chunk::Parse(Socket::Buffer & buffer) {
 /// After calling this function, don't forget to read and ignore 1536 extra bytes,
 /// these are the handshake response and not interesting for us because we don't do client
 /// verification.
-bool RTMPStream::doHandshake() {
+bool RTMPStream::Session::doHandshake() {
   char Version;
   //Read C0
   if (handshake_in.size() < 1537) {
     DEBUG_MSG(DLVL_FAIL, "Handshake wasn't filled properly (%lu/1537) - aborting!", handshake_in.size());
     return false;
   }
-  Version = RTMPStream::handshake_in[0];
-  uint8_t * Client = (uint8_t *)RTMPStream::handshake_in.data() + 1;
-  RTMPStream::handshake_out.resize(3073);
-  uint8_t * Server = (uint8_t *)RTMPStream::handshake_out.data() + 1;
-  RTMPStream::rec_cnt += 1537;
+  Version = handshake_in[0];
+  uint8_t * Client = (uint8_t *)handshake_in.data() + 1;
+  handshake_out.resize(3073);
+  uint8_t * Server = (uint8_t *)handshake_out.data() + 1;
+  rec_cnt += 1537;
 
   //Build S1 Packet
   *((uint32_t *)Server) = 0; //time zero
@@ -547,7 +603,7 @@ bool RTMPStream::doHandshake() {
   }
 
   Server[ -1] = Version;
-  RTMPStream::snd_cnt += 3073;
+  snd_cnt += 3073;
   return true;
 }
 
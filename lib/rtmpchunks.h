@@ -2,6 +2,7 @@
 /// Holds all headers for the RTMPStream namespace.
 
 #pragma once
+#include <vector>
 #include <map>
 #include <string.h>
 #include <stdlib.h>
@@ -14,6 +15,10 @@
 #define FILLER_DATA "Lorem ipsum dolor sit amet, consectetur adipiscing elit. Praesent commodo vulputate urna eu commodo. Cras tempor velit nec nulla placerat volutpat. Proin eleifend blandit quam sit amet suscipit. Pellentesque vitae tristique lorem. Maecenas facilisis consequat neque, vitae iaculis eros vulputate ut. Suspendisse ut arcu non eros vestibulum pulvinar id sed erat. Nam dictum tellus vel tellus rhoncus ut mollis tellus fermentum. Fusce volutpat consectetur ante, in mollis nisi euismod vulputate. Curabitur vitae facilisis ligula. Sed sed gravida dolor. Integer eu eros a dolor lobortis ullamcorper. Mauris interdum elit non neque interdum dictum. Suspendisse imperdiet eros sed sapien cursus pulvinar. Vestibulum ut dolor lectus, id commodo elit. Cras convallis varius leo eu porta. Duis luctus sapien nec dui adipiscing quis interdum nunc congue. Morbi pharetra aliquet mauris vitae tristique. Etiam feugiat sapien quis augue elementum id ultricies magna vulputate. Phasellus luctus, leo id egestas consequat, eros tortor commodo neque, vitae hendrerit nunc sem ut odio."
 #endif
 
+/// Chunk stream ids below this are looked up in a flat table: all ids a one byte chunk basic header can hold.
+/// Higher ids, which only need a longer basic header, are kept in a map.
+#define RTMP_FLAT_CHUNK_STREAMS 64
+
 //forward declaration of FLV::Tag to avoid circular dependencies.
 namespace FLV {
   class Tag;
@@ -22,16 +27,7 @@ namespace FLV {
 /// Contains all functions and classes needed for RTMP connections.
 namespace RTMPStream {
 
-  extern unsigned int chunk_rec_max; ///< Maximum size for a received chunk.
-  extern unsigned int chunk_snd_max; ///< Maximum size for a sent chunk.
-  extern unsigned int rec_window_size; ///< Window size for receiving.
-  extern unsigned int snd_window_size; ///< Window size for sending.
-  extern unsigned int rec_window_at; ///< Current position of the receiving window.
-  extern unsigned int snd_window_at; ///< Current position of the sending window.
-  extern unsigned int rec_cnt; ///< Counter for total data received, in bytes.
-  extern unsigned int snd_cnt; ///< Counter for total data sent, in bytes.
-
-  extern timeval lastrec; ///< Timestamp of last time data was received.
+  class Session;
 
   /// Holds a single RTMP chunk, either send or receive direction.
   class Chunk {
@@ -49,26 +45,53 @@ namespace RTMPStream {
       std::string data; ///< Payload of chunk.
 
       Chunk();
-      bool Parse(Socket::Buffer & data);
-      std::string & Pack();
+      bool Parse(Session & session, Socket::Buffer & data);
+      std::string & Pack(Session & session);
   };
   //RTMPStream::Chunk
 
-  extern std::map<unsigned int, Chunk> lastsend;
-  extern std::map<unsigned int, Chunk> lastrecv;
+  /// Holds the state of a single RTMP connection: negotiated chunk sizes and windows, byte counters,
+  /// the handshake and the last chunk sent and received on every chunk stream.
+  /// Connections do not share any of it, so a single process may serve any number of them.
+  class Session {
+    public:
+      Session();
+      unsigned int chunk_rec_max; ///< Maximum size for a received chunk.
+      unsigned int chunk_snd_max; ///< Maximum size for a sent chunk.
+      unsigned int rec_window_size; ///< Window size for receiving.
+      unsigned int snd_window_size; ///< Window size for sending.
+      unsigned int rec_window_at; ///< Current position of the receiving window.
+      unsigned int snd_window_at; ///< Current position of the sending window.
+      unsigned int rec_cnt; ///< Counter for total data received, in bytes.
+      unsigned int snd_cnt; ///< Counter for total data sent, in bytes.
+      timeval lastrec; ///< Timestamp of last time data was received.
 
-  std::string & SendChunk(unsigned int cs_id, unsigned char msg_type_id, unsigned int msg_stream_id, std::string data);
-  std::string & SendMedia(unsigned char msg_type_id, unsigned char * data, int len, unsigned int ts);
-  std::string & SendMedia(FLV::Tag & tag);
-  std::string & SendCTL(unsigned char type, unsigned int data);
-  std::string & SendCTL(unsigned char type, unsigned int data, unsigned char data2);
-  std::string & SendUSR(unsigned char type, unsigned int data);
-  std::string & SendUSR(unsigned char type, unsigned int data, unsigned int data2);
+      /// This value should be set to the first 1537 bytes received.
+      std::string handshake_in;
+      /// This value is the handshake response that is to be sent out.
+      std::string handshake_out;
+      bool doHandshake();
 
-  /// This value should be set to the first 1537 bytes received.
-  extern std::string handshake_in;
-  /// This value is the handshake response that is to be sent out.
-  extern std::string handshake_out;
-  /// Does the handshake. Expects handshake_in to be filled, and fills handshake_out.
-  bool doHandshake();
+      bool hasSent(unsigned int cs_id) const;
+      Chunk & lastSent(unsigned int cs_id);
+      bool hasReceived(unsigned int cs_id) const;
+      Chunk & lastReceived(unsigned int cs_id);
+
+      std::string & SendChunk(unsigned int cs_id, unsigned char msg_type_id, unsigned int msg_stream_id, const std::string & data);
+      std::string & SendMedia(unsigned char msg_type_id, unsigned char * data, int len, unsigned int ts);
+      std::string & SendMedia(FLV::Tag & tag);
+      std::string & SendCTL(unsigned char type, unsigned int data);
+      std::string & SendCTL(unsigned char type, unsigned int data, unsigned char data2);
+      std::string & SendUSR(unsigned char type, unsigned int data);
+      std::string & SendUSR(unsigned char type, unsigned int data, unsigned int data2);
+    private:
+      friend class Chunk;
+      Chunk lastsend[RTMP_FLAT_CHUNK_STREAMS]; ///< The last sent chunk for every low cs_id, indexed by cs_id.
+      Chunk lastrecv[RTMP_FLAT_CHUNK_STREAMS]; ///< The last received chunk for every low cs_id, indexed by cs_id.
+      std::map<unsigned int, Chunk> highsend; ///< The last sent chunk for every cs_id of RTMP_FLAT_CHUNK_STREAMS and up.
+      std::map<unsigned int, Chunk> highrecv; ///< The last received chunk for every cs_id of RTMP_FLAT_CHUNK_STREAMS and up.
+      Chunk outgoing; ///< Reused by the Send functions to build their message.
+      std::string packed; ///< Holds the result of the last Chunk::Pack call.
+  };
+  //RTMPStream::Session
 } //RTMPStream namespace
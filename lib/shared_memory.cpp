@@ -8,6 +8,8 @@
 #include <cstdio>
 #include <unistd.h>
 #include <iostream>
+#include <map>
+#include <signal.h>
 #include "defines.h"
 #include "shared_memory.h"
 #include "stream.h"
@@ -21,6 +23,12 @@
 #include <accctrl.h>
 #endif
 
+#if defined(__linux__)
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 
 /// Forces a disconnect to all users.
 static void killStatistics(char * data, size_t len, unsigned int id){
@@ -330,6 +338,7 @@ namespace IPC {
     len = 0;
     master = false;
     mapped = 0;
+    isShared = false;
     init(name_, len_, master_, autoBackoff);
   }
 
@@ -340,6 +349,7 @@ namespace IPC {
     len = 0;
     master = false;
     mapped = 0;
+    isShared = false;
     init(rhs.name, rhs.len, rhs.master);
   }
 
@@ -349,9 +359,38 @@ namespace IPC {
   }
 
 #ifdef SHM_ENABLED
+  bool sharedPage::shareMappings = false;
+
+#if !defined(__CYGWIN__) && !defined(_WIN32)
+  ///\brief A mapping of a page that is used by one or more sharedPage objects in this process
+  struct sharedMapping {
+    dev_t dev;///< Device of the page, to detect pages that were recreated under the same name
+    ino_t ino;///< Inode of the page, to detect pages that were recreated under the same name
+    char * mapped;
+    long long int len;
+    unsigned int refs;///< Amount of sharedPage objects using this mapping
+  };
+
+  ///\brief All shared mappings in this process, by page name
+  static std::map<std::string, sharedMapping> sharedMappings;
+#endif
+
   ///\brief Unmaps a shared page if allowed
   void sharedPage::unmap() {
     if (mapped && len) {
+#if !defined(__CYGWIN__) && !defined(_WIN32)
+      if (isShared) {
+        std::map<std::string, sharedMapping>::iterator it = sharedMappings.find(name);
+        if (it != sharedMappings.end() && it->second.mapped == mapped && !--it->second.refs) {
+          munmap(mapped, len);
+          sharedMappings.erase(it);
+        }
+        isShared = false;
+        mapped = 0;
+        len = 0;
+        return;
+      }
+#endif
 #if defined(__CYGWIN__) || defined(_WIN32)
       //under Cygwin, the mapped location is shifted by 4 to contain the page size.
       UnmapViewOfFile(mapped - 4);
@@ -365,6 +404,8 @@ namespace IPC {
 
   ///\brief Closes a shared page if allowed
   void sharedPage::close() {
+    //a page using a shared mapping has no handle of its own, but was opened all the same
+    bool opened = (handle > 0) || isShared;
     unmap();
     if (handle > 0) {
       INSANE_MSG("Closing page %s in %s mode", name.c_str(), master ? "master" : "client");
@@ -372,12 +413,14 @@ namespace IPC {
       CloseHandle(handle);
 #else
       ::close(handle);
-      if (master && name != "") {
-        shm_unlink(name.c_str());
-      }
 #endif
       handle = 0;
     }
+#if !defined(__CYGWIN__) && !defined(_WIN32)
+    if (opened && master && name != "") {
+      shm_unlink(name.c_str());
+    }
+#endif
   }
 
   ///\brief Returns whether the shared page is valid or not
@@ -474,6 +517,37 @@ namespace IPC {
           return;
         }
         len = buffStats.st_size;
+        if (shareMappings) {
+          //Reuse the mapping of the same page if this process already has one, instead of mapping it again
+          std::map<std::string, sharedMapping>::iterator it = sharedMappings.find(name);
+          if (it != sharedMappings.end() && it->second.dev == buffStats.st_dev && it->second.ino == buffStats.st_ino && it->second.len == len) {
+            it->second.refs++;
+            mapped = it->second.mapped;
+            isShared = true;
+            ::close(handle);
+            handle = 0;
+            return;
+          }
+          mapped = (char *)mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, handle, 0);
+          if (mapped == MAP_FAILED) {
+            FAIL_MSG("mmap for page %s failed: %s", name.c_str(), strerror(errno));
+            mapped = 0;
+            return;
+          }
+          //Only take over the shared slot if it is not in use by an older page of the same name
+          if (it == sharedMappings.end()) {
+            sharedMapping & M = sharedMappings[name];
+            M.dev = buffStats.st_dev;
+            M.ino = buffStats.st_ino;
+            M.mapped = mapped;
+            M.len = len;
+            M.refs = 1;
+            isShared = true;
+            ::close(handle);
+            handle = 0;
+          }
+          return;
+        }
       }
       mapped = (char *)mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, handle, 0);
       if (mapped == MAP_FAILED) {
@@ -730,6 +804,119 @@ namespace IPC {
     return *(uint32_t*)(data+173);
   }
 
+  ///\brief Calculates a FNV-1a hash of the fields that identify a session.
+  static uint32_t calcSessionHash(const char * data) {
+    uint32_t hash = 2166136261u;
+    const char * fields[4] = {data + 32, data + 48, data + 148, data + 168};
+    size_t lens[4] = {16, strnlen(data + 48, 100), strnlen(data + 148, 20), 4};
+    for (unsigned int f = 0; f < 4; ++f) {
+      for (size_t i = 0; i < lens[f]; ++i) {
+        hash = (hash ^ (unsigned char)fields[f][i]) * 16777619u;
+      }
+    }
+    return hash ? hash : 1;
+  }
+
+  ///\brief Stores the hash of the current host, streamName, connector and CRC fields.
+  ///Should be called after changing any of those.
+  void statExchange::updateSessionHash() {
+    htobl(data + 177, calcSessionHash(data));
+  }
+
+  ///\brief Gets the hash of the host, streamName, connector and CRC fields.
+  ///Calculates it if the writer did not store one.
+  uint32_t statExchange::sessionHash() {
+    unsigned int result;
+    btohl(data + 177, result);
+    if (!result) {
+      result = calcSessionHash(data);
+    }
+    return result;
+  }
+
+  ///\brief Sets the amount of frames dropped because the peer could not keep up
+  void statExchange::dropped(uint32_t frames) {
+    htobl(data + 181, frames);
+  }
+
+  ///\brief Gets the amount of frames dropped because the peer could not keep up
+  uint32_t statExchange::dropped() {
+    unsigned int result;
+    btohl(data + 181, result);
+    return result;
+  }
+
+  ///\brief Creates a notifier on top of 8 bytes of shared memory.
+  notifier::notifier(char * _data) : data(_data) {}
+
+  ///\brief Returns the current sequence number, to be passed to wait() later on.
+  uint32_t notifier::get() const {
+    return __sync_fetch_and_add((uint32_t *)data, 0);
+  }
+
+  ///\brief Increases the sequence number and wakes up all waiting processes, if any.
+  void notifier::signal() {
+    __sync_fetch_and_add((uint32_t *)data, 1);
+#if defined(__linux__)
+    //Only do the system call if someone may be waiting. Clearing the flag here instead of in wait()
+    //means a waiter that died while waiting costs at most one needless wake-up.
+    if (__sync_lock_test_and_set((uint32_t *)(data + 4), 0)) {
+      syscall(SYS_futex, (uint32_t *)data, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+#endif
+  }
+
+  ///\brief Waits until the sequence number differs from seen, or ms milliseconds have passed.
+  ///\return True if the sequence number changed, false on timeout.
+  bool notifier::wait(uint32_t seen, unsigned int ms) {
+    if (get() != seen) {
+      return true;
+    }
+#if defined(__linux__)
+    struct timespec wt;
+    wt.tv_sec = ms / 1000;
+    wt.tv_nsec = (ms % 1000) * 1000000;
+    //Set the flag before sleeping: either signal() sees it, or it increased the sequence number before we sleep
+    __sync_lock_test_and_set((uint32_t *)(data + 4), 1);
+    __sync_synchronize();
+    //Returns instantly if the sequence number changed in the meantime
+    syscall(SYS_futex, (uint32_t *)data, FUTEX_WAIT, seen, &wt, NULL, 0);
+#else
+    Util::sleep(ms);
+#endif
+    return get() != seen;
+  }
+
+  ///\brief Creates a generation counter on top of 4 bytes of shared memory.
+  generation::generation(char * _data) : data(_data) {}
+
+  ///\brief Returns the current generation. Odd values mean a write is in progress.
+  uint32_t generation::get() const {
+    return __sync_fetch_and_add((uint32_t *)data, 0);
+  }
+
+  ///\brief Marks the start of a write, making the generation odd.
+  void generation::startWrite() {
+    uint32_t gen = get();
+    if (!(gen & 1)) {
+      __sync_fetch_and_add((uint32_t *)data, 1);
+    }
+  }
+
+  ///\brief Marks the end of a write, making the generation even (and never zero) again.
+  void generation::endWrite() {
+    uint32_t gen = get();
+    __sync_fetch_and_add((uint32_t *)data, (gen & 1) ? 1 : 2);
+    if (!get()) {
+      __sync_fetch_and_add((uint32_t *)data, 2);
+    }
+  }
+
+  ///\brief Returns true if a read that started at generation gen is still valid.
+  bool generation::unchanged(uint32_t gen) const {
+    return !(gen & 1) && get() == gen;
+  }
+
   ///\brief Creates a semaphore guard, locks the semaphore on call
   semGuard::semGuard(semaphore * thisSemaphore) : mySemaphore(thisSemaphore) {
     mySemaphore->wait();
@@ -1248,6 +1435,292 @@ namespace IPC {
     return *(myPage.mapped + offsetOnPage);
   }
 
+  ///\brief Removes the data page of a cache entry, if it still exists
+  static void removeCachePage(const std::string & cacheName, unsigned long id) {
+    char pageName[NAME_BUFFER_SIZE];
+    snprintf(pageName, NAME_BUFFER_SIZE, SHM_CACHE_DATA, cacheName.c_str(), id);
+    sharedPage erasePage(pageName, 0, false, false);
+    if (erasePage.mapped) {
+      erasePage.master = true;
+    }
+  }
+
+  sharedCache::sharedCache() {
+    maxBytes = 0;
+  }
+
+  ///\brief Opens the cache of a stream
+  ///\param streamName The stream to open the cache for
+  ///\param maxBytes_ The maximum total size of all entries. Only used when storing entries.
+  ///\param create Whether to create the cache if it does not exist yet
+  ///\param kind Zero for the cache of generated segments, or the name of another kind of cache of the stream.
+  ///Every kind of cache has its own entries and size limit, so filling one never evicts entries of another.
+  ///\return True if the cache is available
+  bool sharedCache::init(const std::string & streamName, uint64_t maxBytes_, bool create, const char * kind) {
+    cacheName = streamName;
+    if (kind) {
+      cacheName += std::string("@") + kind;
+    }
+    maxBytes = maxBytes_;
+    char name[NAME_BUFFER_SIZE];
+    snprintf(name, NAME_BUFFER_SIZE, SEM_CACHE, cacheName.c_str());
+    if (create) {
+      lock.open(name, O_CREAT | O_RDWR, ACCESSPERMS, 1);
+    } else {
+      lock.open(name, O_RDWR, 0, 0, true);
+    }
+    if (!lock) {
+      return false;
+    }
+    snprintf(name, NAME_BUFFER_SIZE, SHM_CACHE_INDEX, cacheName.c_str());
+    index.init(name, SHM_CACHE_SIZE, false, false);
+    if (!index.mapped && create) {
+      semGuard guard(&lock);
+      //check again, someone else may have created it while we were waiting
+      index.init(name, SHM_CACHE_SIZE, false, false);
+      if (!index.mapped) {
+        index.init(name, SHM_CACHE_SIZE, true);
+        if (index.mapped) {
+          memset(index.mapped, 0, SHM_CACHE_SIZE);
+        }
+        //keep the index when this process exits, wipe() removes it
+        index.master = false;
+      }
+    }
+    return index.mapped;
+  }
+
+  ///\brief Returns whether the cache is available
+  sharedCache::operator bool() const {
+    return index.mapped;
+  }
+
+  char * sharedCache::entry(unsigned int num) {
+    return index.mapped + 64 + num * SHM_CACHE_ENTRY_SIZE;
+  }
+
+  ///\brief Finds the entry for the given key. Must be called while holding the lock.
+  ///\return The entry number, or -1 if there is none.
+  int sharedCache::findEntry(const std::string & key) {
+    for (unsigned int i = 0; i < SHM_CACHE_ENTRIES; ++i) {
+      char * e = entry(i);
+      if (e[0] && !strncmp(e + 40, key.c_str(), 88)) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  ///\brief Frees an entry, removing its data if it was stored. Must be called while holding the lock.
+  void sharedCache::evict(unsigned int num) {
+    char * e = entry(num);
+    if (e[0] == 2) {
+      removeCachePage(cacheName, Bit::btohl(e + 32));
+      Bit::htobll(index.mapped + 24, Bit::btohll(index.mapped + 24) - Bit::btohll(e + 16));
+      Bit::htobll(index.mapped + 16, Bit::btohll(index.mapped + 16) + 1);
+    }
+    memset(e, 0, SHM_CACHE_ENTRY_SIZE);
+  }
+
+  ///\brief Looks up an entry, and claims it for generation if it is missing.
+  ///\param key The key of the entry, at most 87 characters
+  ///\param data Set to the data page of the entry on a hit
+  ///\param size Set to the size of the data on a hit
+  ///\return CACHE_HIT if data was mapped, CACHE_MISS if the caller should generate the data and store() it, CACHE_BUSY if another process is generating it.
+  cacheResult sharedCache::claim(const std::string & key, sharedPage & data, uint64_t & size) {
+    if (!index.mapped || key.size() > 87) {
+      return CACHE_MISS;
+    }
+    semGuard guard(&lock);
+    uint64_t now = Util::getMS();
+    int num = findEntry(key);
+    if (num >= 0) {
+      char * e = entry(num);
+      if (e[0] == 2) {
+        char pageName[NAME_BUFFER_SIZE];
+        snprintf(pageName, NAME_BUFFER_SIZE, SHM_CACHE_DATA, cacheName.c_str(), (unsigned long)Bit::btohl(e + 32));
+        data.init(pageName, 0, false, false);
+        if (data.mapped) {
+          size = Bit::btohll(e + 16);
+          Bit::htobll(e + 8, now);
+          Bit::htobll(index.mapped, Bit::btohll(index.mapped) + 1);
+          return CACHE_HIT;
+        }
+        //the data went missing, start over
+        memset(e, 0, SHM_CACHE_ENTRY_SIZE);
+        num = -1;
+      } else {
+        pid_t pid = Bit::btohl(e + 4);
+        if (pid != getpid() && (kill(pid, 0) == 0 || errno == EPERM)) {
+          return CACHE_BUSY;
+        }
+        //the generating process is gone, take over
+        Bit::htobl(e + 4, getpid());
+        Bit::htobll(e + 8, now);
+        Bit::htobll(index.mapped + 8, Bit::btohll(index.mapped + 8) + 1);
+        return CACHE_MISS;
+      }
+    }
+    Bit::htobll(index.mapped + 8, Bit::btohll(index.mapped + 8) + 1);
+    //find a free entry, or else the least recently used stored one
+    int lru = -1;
+    for (unsigned int i = 0; i < SHM_CACHE_ENTRIES; ++i) {
+      char * e = entry(i);
+      if (!e[0]) {
+        num = i;
+        break;
+      }
+      if (e[0] == 2 && (lru == -1 || Bit::btohll(e + 8) < Bit::btohll(entry(lru) + 8))) {
+        lru = i;
+      }
+    }
+    if (num < 0) {
+      if (lru < 0) {
+        //everything is being generated: generate without caching
+        return CACHE_MISS;
+      }
+      evict(lru);
+      num = lru;
+    }
+    char * e = entry(num);
+    uint32_t id = Bit::btohl(index.mapped + 32) + 1;
+    Bit::htobl(index.mapped + 32, id);
+    e[0] = 1;
+    Bit::htobl(e + 4, getpid());
+    Bit::htobll(e + 8, now);
+    Bit::htobll(e + 16, 0);
+    Bit::htobll(e + 24, 0);
+    Bit::htobl(e + 32, id);
+    strncpy(e + 40, key.c_str(), 88);
+    return CACHE_MISS;
+  }
+
+  ///\brief Stores the data for an entry this process claimed, evicting least recently used entries to make room.
+  ///\param key The key of the entry
+  ///\param time The media time of the data, for evictBefore()
+  ///\param data The data to store
+  ///\param size The size of the data
+  void sharedCache::store(const std::string & key, uint64_t time, const char * data, uint64_t size) {
+    if (!index.mapped) {
+      return;
+    }
+    semGuard guard(&lock);
+    int num = findEntry(key);
+    if (num < 0) {
+      return;
+    }
+    char * e = entry(num);
+    if (e[0] != 1 || (pid_t)Bit::btohl(e + 4) != getpid()) {
+      return;
+    }
+    //make room, least recently used first
+    while (size && size <= maxBytes && Bit::btohll(index.mapped + 24) + size > maxBytes) {
+      int lru = -1;
+      for (unsigned int i = 0; i < SHM_CACHE_ENTRIES; ++i) {
+        char * o = entry(i);
+        if (o[0] == 2 && (lru == -1 || Bit::btohll(o + 8) < Bit::btohll(entry(lru) + 8))) {
+          lru = i;
+        }
+      }
+      if (lru < 0) {
+        break;
+      }
+      evict(lru);
+    }
+    if (!size || Bit::btohll(index.mapped + 24) + size > maxBytes) {
+      memset(e, 0, SHM_CACHE_ENTRY_SIZE);
+      return;
+    }
+    char pageName[NAME_BUFFER_SIZE];
+    snprintf(pageName, NAME_BUFFER_SIZE, SHM_CACHE_DATA, cacheName.c_str(), (unsigned long)Bit::btohl(e + 32));
+    sharedPage dataPage(pageName, size, true);
+    if (!dataPage.mapped) {
+      memset(e, 0, SHM_CACHE_ENTRY_SIZE);
+      return;
+    }
+    memcpy(dataPage.mapped, data, size);
+    //keep the data when this process exits, evict() removes it
+    dataPage.master = false;
+    e[0] = 2;
+    Bit::htobll(e + 8, Util::getMS());
+    Bit::htobll(e + 16, size);
+    Bit::htobll(e + 24, time);
+    Bit::htobll(index.mapped + 24, Bit::btohll(index.mapped + 24) + size);
+  }
+
+  ///\brief Gives up on generating an entry this process claimed, so others may claim it.
+  void sharedCache::abandon(const std::string & key) {
+    if (!index.mapped) {
+      return;
+    }
+    semGuard guard(&lock);
+    int num = findEntry(key);
+    if (num >= 0 && entry(num)[0] == 1 && (pid_t)Bit::btohl(entry(num) + 4) == getpid()) {
+      memset(entry(num), 0, SHM_CACHE_ENTRY_SIZE);
+    }
+  }
+
+  ///\brief Evicts all stored entries with a media time before the given time, such as entries that are no longer in the live buffer.
+  void sharedCache::evictBefore(uint64_t time) {
+    if (!index.mapped) {
+      return;
+    }
+    semGuard guard(&lock);
+    for (unsigned int i = 0; i < SHM_CACHE_ENTRIES; ++i) {
+      if (entry(i)[0] == 2 && Bit::btohll(entry(i) + 24) < time) {
+        evict(i);
+      }
+    }
+  }
+
+  ///\brief Removes all entries and the cache itself. Used when the stream shuts down.
+  void sharedCache::wipe() {
+    if (!index.mapped) {
+      return;
+    }
+    lock.wait();
+    for (unsigned int i = 0; i < SHM_CACHE_ENTRIES; ++i) {
+      evict(i);
+    }
+    index.master = true;
+    index.close();
+    lock.post();
+    lock.unlink();
+  }
+
+  ///\brief Returns the amount of claims that found their entry stored
+  uint64_t sharedCache::hits() {
+    return index.mapped ? Bit::btohll(index.mapped) : 0;
+  }
+
+  ///\brief Returns the amount of claims that did not find their entry stored
+  uint64_t sharedCache::misses() {
+    return index.mapped ? Bit::btohll(index.mapped + 8) : 0;
+  }
+
+  ///\brief Returns the amount of stored entries that were evicted
+  uint64_t sharedCache::evictions() {
+    return index.mapped ? Bit::btohll(index.mapped + 16) : 0;
+  }
+
+  ///\brief Returns the total size of all stored entries
+  uint64_t sharedCache::bytes() {
+    return index.mapped ? Bit::btohll(index.mapped + 24) : 0;
+  }
+
+  ///\brief Returns the amount of stored entries
+  unsigned int sharedCache::entries() {
+    unsigned int count = 0;
+    if (index.mapped) {
+      for (unsigned int i = 0; i < SHM_CACHE_ENTRIES; ++i) {
+        if (entry(i)[0] == 2) {
+          ++count;
+        }
+      }
+    }
+    return count;
+  }
+
   userConnection::userConnection(char * _data) {
     data = _data;
     if (!data){
@@ -15,7 +15,7 @@
 #define ACCESSPERMS (S_IRWXU|S_IRWXG|S_IRWXO) 
 #endif
 
-#define STAT_EX_SIZE 177
+#define STAT_EX_SIZE 185
 #define PLAY_EX_SIZE 2+6*SIMUL_TRACKS
 
 namespace IPC {
@@ -45,6 +45,10 @@ namespace IPC {
       void setSync(char s);
       unsigned int crc();
       uint32_t getPID();
+      void updateSessionHash();
+      uint32_t sessionHash();
+      void dropped(uint32_t frames);
+      uint32_t dropped();
   private:
       ///\brief The payload for the stat exchange
       /// - 8 byte - now (timestamp of last statistics)
@@ -58,6 +62,44 @@ namespace IPC {
       /// - 4 byte - CRC32 of user agent (or zero if none)
       /// - 1 byte sync (was seen by controller yes/no)
       /// - (implicit 4 bytes: PID)
+      /// - 4 byte - hash of host, streamName, connector and CRC, so readers can tell if any of them changed (zero if not set)
+      /// - 4 byte - dropped (Number of frames not sent because the peer could not keep up)
+      char * data;
+  };
+
+  ///\brief A sequence counter in shared memory that processes can block on until it changes.
+  ///
+  ///Writers call signal() after making new data available.
+  ///Readers store the value of get(), check for new data, and if there is none call wait() with the stored value.
+  ///On Linux waiting uses a futex, so readers wake up as soon as a writer signals. Elsewhere, wait() simply sleeps.
+  class notifier {
+    public:
+      notifier(char * _data);
+      uint32_t get() const;
+      void signal();
+      bool wait(uint32_t seen, unsigned int ms);
+    private:
+      ///\brief The payload for the notifier, in native byte order
+      /// - 4 byte - sequence (increased by one on every signal)
+      /// - 4 byte - waiting (nonzero if processes may be waiting, cleared by signal)
+      char * data;
+  };
+
+  ///\brief A generation counter in shared memory, protecting data that has a single writer and many readers.
+  ///
+  ///The writer calls startWrite() before and endWrite() after changing the data.
+  ///Readers store get(), copy the data, and only use the copy if unchanged() still returns true for the stored value.
+  ///A generation of zero means the data was never written through this counter.
+  class generation {
+    public:
+      generation(char * _data);
+      uint32_t get() const;
+      void startWrite();
+      void endWrite();
+      bool unchanged(uint32_t gen) const;
+    private:
+      ///\brief The payload for the generation counter, in native byte order
+      /// - 4 byte - generation (odd while a write is in progress)
       char * data;
   };
 
@@ -158,6 +200,11 @@ namespace IPC {
     bool master;
     ///\brief A pointer to the payload of the page
     char * mapped;
+    ///\brief Whether pages opened in client mode share one mapping per process, see init()
+    static bool shareMappings;
+  private:
+    ///\brief Whether mapped is shared with other sharedPage objects in this process
+    bool isShared;
   };
 #else
   ///\brief A class for handling shared memory pages.
@@ -247,6 +294,60 @@ namespace IPC {
       bool hasCounter;
   };
 
+  ///\brief Result of a sharedCache::claim call
+  enum cacheResult {
+    CACHE_HIT,///< The entry is available and was mapped
+    CACHE_MISS,///< The entry is not available; the caller should generate it and store() or abandon() it
+    CACHE_BUSY///< The entry is being generated by another process; try again later
+  };
+
+  ///\brief A cache of generated data (segments, playlists) in shared memory, shared by all processes serving a stream.
+  ///
+  ///Entries are looked up by key. The first process to claim a missing key generates its data and stores it;
+  ///processes claiming the same key in the meantime are told to wait, so every entry is generated only once.
+  ///The total size of all entries is bounded, with least recently used entries evicted first.
+  class sharedCache {
+    public:
+      sharedCache();
+      bool init(const std::string & streamName, uint64_t maxBytes = 0, bool create = true, const char * kind = 0);
+      operator bool() const;
+      cacheResult claim(const std::string & key, sharedPage & data, uint64_t & size);
+      void store(const std::string & key, uint64_t time, const char * data, uint64_t size);
+      void abandon(const std::string & key);
+      void evictBefore(uint64_t time);
+      void wipe();
+      uint64_t hits();
+      uint64_t misses();
+      uint64_t evictions();
+      uint64_t bytes();
+      unsigned int entries();
+    private:
+      ///\brief The index page, laid out as:
+      /// - 8 byte - hits
+      /// - 8 byte - misses
+      /// - 8 byte - evictions
+      /// - 8 byte - total size of all stored entries
+      /// - 4 byte - last used entry ID
+      /// - 28 byte - reserved
+      /// - SHM_CACHE_ENTRIES entries of SHM_CACHE_ENTRY_SIZE bytes:
+      ///   - 1 byte - state (0 = free, 1 = being generated, 2 = stored)
+      ///   - 3 byte - reserved
+      ///   - 4 byte - PID of the generating process
+      ///   - 8 byte - time in ms the entry was last used
+      ///   - 8 byte - size of the data
+      ///   - 8 byte - media time of the data, for evictBefore()
+      ///   - 4 byte - entry ID, used in the name of the data page
+      ///   - 4 byte - reserved
+      ///   - 88 byte - key, zero terminated
+      sharedPage index;
+      semaphore lock;
+      std::string cacheName;///< Stream name, followed by @ and the kind of cache for caches other than segments
+      uint64_t maxBytes;
+      char * entry(unsigned int num);
+      int findEntry(const std::string & key);
+      void evict(unsigned int num);
+  };
+
   class userConnection {
     public:
       userConnection(char * _data);
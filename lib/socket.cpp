@@ -6,10 +6,12 @@
 #include "defines.h"
 #include "timing.h"
 #include <cstdlib>
+#include <cstring>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <sstream>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <ifaddrs.h>
@@ -22,6 +24,10 @@
 #define SOCKETSIZE 51200ul
 #endif
 
+#ifndef MSG_MORE
+#define MSG_MORE 0 // corking is a hint only, ignore it where unsupported
+#endif
+
 /// Local-scope only helper function that prints address families
 static const char* addrFam(int f){
   switch(f){
@@ -168,166 +174,155 @@ std::string uint2string(unsigned int i){
 
 Socket::Buffer::Buffer(){
   splitter = "\n";
+  start = 0;
+}
+
+/// Moves the data up to and including the next splitter (at most BUFFER_BLOCKSIZE bytes) into the current chunk.
+/// Does nothing if there already is a current chunk.
+void Socket::Buffer::cutChunk(){
+  if (chunk.size() || start >= data.size()){return;}
+  unsigned int len = std::min((unsigned int)data.size() - start, (unsigned int)BUFFER_BLOCKSIZE);
+  if (splitter.size()){
+    size_t pos = data.find(splitter, start);
+    if (pos != std::string::npos && pos + splitter.size() - start < len){len = pos + splitter.size() - start;}
+  }
+  chunk.assign(data, start, len);
+  start += len;
+  if (start == data.size()){
+    data.clear();
+    start = 0;
+  }
 }
 
-/// Returns the amount of elements in the internal std::deque of std::string objects.
-/// The back is popped as long as it is empty, first - this way this function is
-/// guaranteed to return 0 if the buffer is empty.
+/// Puts the current chunk back in front of the rest of the data, so everything is contiguous again.
+void Socket::Buffer::unChunk(){
+  if (!chunk.size()){return;}
+  if (start >= chunk.size()){
+    //Usually the chunk was cut from the data right before start, so it fits back in place
+    start -= chunk.size();
+    memcpy((char *)data.data() + start, chunk.data(), chunk.size());
+  }else{
+    data.replace(0, start, chunk);
+    start = 0;
+  }
+  chunk.clear();
+}
+
+/// Returns the amount of chunks in the buffer: zero if it is empty,
+/// one if all data is in the chunk returned by get(), two if there is more data after that chunk.
 unsigned int Socket::Buffer::size(){
-  while (data.size() > 0 && data.back().empty()){data.pop_back();}
-  return data.size();
+  cutChunk();
+  return (chunk.size() ? 1 : 0) + (start < data.size() ? 1 : 0);
 }
 
 /// Returns either the amount of total bytes available in the buffer or max, whichever is smaller.
 unsigned int Socket::Buffer::bytes(unsigned int max){
-  unsigned int i = 0;
-  for (std::deque<std::string>::iterator it = data.begin(); it != data.end(); ++it){
-    i += (*it).size();
-    if (i >= max){return max;}
-  }
-  return i;
+  unsigned int i = chunk.size() + data.size() - start;
+  return std::min(i, max);
 }
 
 /// Returns how many bytes to read until the next splitter, or 0 if none found.
 unsigned int Socket::Buffer::bytesToSplit(){
-  unsigned int i = 0;
-  for (std::deque<std::string>::reverse_iterator it = data.rbegin(); it != data.rend(); ++it){
-    i += (*it).size();
-    if ((*it).size() >= splitter.size() && (*it).substr((*it).size()-splitter.size()) == splitter){
-      return i;
-    }
-  }
-  return 0;
+  if (!splitter.size()){return 0;}
+  unChunk();
+  size_t pos = data.find(splitter, start);
+  if (pos == std::string::npos){return 0;}
+  return pos + splitter.size() - start;
 }
 
-/// Appends this string to the internal std::deque of std::string objects.
-/// It is automatically split every BUFFER_BLOCKSIZE bytes and when the splitter string is encountered.
+/// Appends this string to the end of the buffer.
 void Socket::Buffer::append(const std::string &newdata){
   append(newdata.data(), newdata.size());
 }
 
-///Helper function that does a short-circuiting string compare
-inline bool string_compare(const char *a, const char *b, const size_t len){
-  for (size_t i = 0; i < len; ++i){
-    if (a[i] != b[i]){return false;}
-  }
-  return true;
-}
-
-/// Appends this data block to the internal std::deque of std::string objects.
-/// It is automatically split every BUFFER_BLOCKSIZE bytes and when the splitter string is encountered.
+/// Appends this data block to the end of the buffer.
 void Socket::Buffer::append(const char *newdata, const unsigned int newdatasize){
-  uint32_t i = 0;
-  while (i < newdatasize){
-    uint32_t j = 0;
-    if (!splitter.size()){
-      if (newdatasize - i > BUFFER_BLOCKSIZE){
-        j = BUFFER_BLOCKSIZE;
-      }else{
-        j = newdatasize - i;
-      }
-    }else{
-      while (j+i < newdatasize && j < BUFFER_BLOCKSIZE){
-        j++;
-        if (j >= splitter.size()){
-          if (string_compare(newdata+i+j-splitter.size(), splitter.data(), splitter.size())){break;}
-        }
-      }
-    }
-    if (j){
-      data.push_front("");
-      data.front().assign(newdata + i, (size_t)j);
-      i += j;
-    }else{
-      FAIL_MSG("Appended an empty string to buffer: aborting!");
-      break;
-    }
-  }
-  if (data.size() > 5000){
-    DEBUG_MSG(DLVL_WARN, "Warning: After %d new bytes, buffer has %d parts containing over %u bytes!", newdatasize, (int)data.size(),
-              bytes(9000));
+  data.append(newdata, newdatasize);
+  if (data.size() - start > 5000 * BUFFER_BLOCKSIZE && data.size() - start - newdatasize <= 5000 * BUFFER_BLOCKSIZE){
+    WARN_MSG("Warning: After %u new bytes, buffer contains over %u bytes!", newdatasize, 5000 * BUFFER_BLOCKSIZE);
   }
 }
 
-/// Prepends this data block to the internal std::deque of std::string objects.
-/// It is _not_ automatically split every BUFFER_BLOCKSIZE bytes.
+/// Prepends this data block to the buffer.
+/// It will be returned as a separate chunk by get().
 void Socket::Buffer::prepend(const std::string &newdata){
-  data.push_back(newdata);
+  unChunk();
+  chunk = newdata;
 }
 
-/// Prepends this data block to the internal std::deque of std::string objects.
-/// It is _not_ automatically split every BUFFER_BLOCKSIZE bytes.
+/// Prepends this data block to the buffer.
+/// It will be returned as a separate chunk by get().
 void Socket::Buffer::prepend(const char *newdata, const unsigned int newdatasize){
-  data.push_back(std::string(newdata, (size_t)newdatasize));
+  unChunk();
+  chunk.assign(newdata, (size_t)newdatasize);
 }
 
 /// Returns true if at least count bytes are available in this buffer.
 bool Socket::Buffer::available(unsigned int count){
-  size();
-  unsigned int i = 0;
-  for (std::deque<std::string>::iterator it = data.begin(); it != data.end(); ++it){
-    i += (*it).size();
-    if (i >= count){return true;}
-  }
-  return false;
+  return bytes(count) >= count;
 }
 
 /// Removes count bytes from the buffer, returning them by value.
 /// Returns an empty string if not all count bytes are available.
 std::string Socket::Buffer::remove(unsigned int count){
-  size();
-  if (!available(count)){return "";}
-  unsigned int i = 0;
-  std::string ret;
-  ret.reserve(count);
-  for (std::deque<std::string>::reverse_iterator it = data.rbegin(); it != data.rend(); ++it){
-    if (i + (*it).size() < count){
-      ret.append(*it);
-      i += (*it).size();
-      (*it).clear();
-    }else{
-      ret.append(*it, 0, count - i);
-      (*it).erase(0, count - i);
-      break;
-    }
-  }
+  std::string ret = copy(count);
+  if (ret.size()){consume(count);}
   return ret;
 }
 
 /// Copies count bytes from the buffer, returning them by value.
 /// Returns an empty string if not all count bytes are available.
 std::string Socket::Buffer::copy(unsigned int count){
-  size();
-  if (!available(count)){return "";}
-  unsigned int i = 0;
+  if (!count || !available(count)){return "";}
+  if (count <= chunk.size()){return chunk.substr(0, count);}
   std::string ret;
   ret.reserve(count);
-  for (std::deque<std::string>::reverse_iterator it = data.rbegin(); it != data.rend(); ++it){
-    if (i + (*it).size() < count){
-      ret.append(*it);
-      i += (*it).size();
-    }else{
-      ret.append(*it, 0, count - i);
-      break;
+  ret.append(chunk);
+  ret.append(data, start, count - chunk.size());
+  return ret;
+}
+
+/// Returns a pointer to the first count bytes in the buffer, without copying or removing them.
+/// The pointer stays valid until the buffer is changed. Returns a null pointer if not all count bytes are available.
+const char *Socket::Buffer::peek(unsigned int count){
+  if (!available(count)){return 0;}
+  unChunk();
+  return data.data() + start;
+}
+
+/// Removes count bytes from the front of the buffer, without copying them.
+void Socket::Buffer::consume(unsigned int count){
+  if (chunk.size()){
+    if (count < chunk.size()){
+      chunk.erase(0, count);
+      return;
     }
+    count -= chunk.size();
+    chunk.clear();
+  }
+  start += std::min(count, (unsigned int)data.size() - start);
+  if (start == data.size()){
+    data.clear();
+    start = 0;
+  }else if (start > 16 * BUFFER_BLOCKSIZE && start > data.size() / 2){
+    //release the part that was read, once it is the larger part
+    data.erase(0, start);
+    start = 0;
   }
-  return ret;
 }
 
-/// Gets a reference to the back of the internal std::deque of std::string objects.
+/// Gets a reference to the current chunk: the data up to and including the next splitter, at most BUFFER_BLOCKSIZE bytes.
+/// Changes made to the chunk are changes made to the buffer.
 std::string &Socket::Buffer::get(){
-  size();
-  static std::string empty;
-  if (data.size() > 0){
-    return data.back();
-  }else{
-    return empty;
-  }
+  cutChunk();
+  return chunk;
 }
 
 /// Completely empties the buffer
 void Socket::Buffer::clear(){
   data.clear();
+  start = 0;
+  chunk.clear();
 }
 
 /// Create a new base socket. This is a basic constructor for converting any valid socket to a Socket::Connection.
@@ -341,6 +336,8 @@ Socket::Connection::Connection(int sockNo){
   conntime = Util::epoch();
   Error = false;
   Blocking = false;
+  corked = false;
+  keepSends = false;
 }// Socket::Connection basic constructor
 
 /// Simulate a socket using two file descriptors.
@@ -355,6 +352,8 @@ Socket::Connection::Connection(int write, int read){
   conntime = Util::epoch();
   Error = false;
   Blocking = false;
+  corked = false;
+  keepSends = false;
 }// Socket::Connection basic constructor
 
 /// Create a new disconnected base socket. This is a basic constructor for placeholder purposes.
@@ -368,6 +367,8 @@ Socket::Connection::Connection(){
   conntime = Util::epoch();
   Error = false;
   Blocking = false;
+  corked = false;
+  keepSends = false;
 }// Socket::Connection basic constructor
 
 void Socket::Connection::resetCounter(){
@@ -474,6 +475,8 @@ std::string Socket::Connection::getError(){
 Socket::Connection::Connection(std::string address, bool nonblock){
   pipes[0] = -1;
   pipes[1] = -1;
+  corked = false;
+  keepSends = false;
   sock = socket(PF_UNIX, SOCK_STREAM, 0);
   if (sock < 0){
     remotehost = strerror(errno);
@@ -512,6 +515,8 @@ Socket::Connection::Connection(std::string host, int port, bool nonblock){
   struct addrinfo *result, *rp, hints;
   Error = false;
   Blocking = false;
+  corked = false;
+  keepSends = false;
   up = 0;
   down = 0;
   conntime = Util::epoch();
@@ -588,7 +593,7 @@ std::string Socket::Connection::getStats(std::string C){
 /// Returns true if new data was received, false otherwise.
 bool Socket::Connection::spool(){
   /// \todo Provide better mechanism to prevent overbuffering.
-  if (downbuffer.size() > 10000){
+  if (downbuffer.bytes(10000 * BUFFER_BLOCKSIZE) >= 10000 * BUFFER_BLOCKSIZE){
     return true;
   }else{
     return iread(downbuffer);
@@ -609,11 +614,153 @@ Socket::Buffer &Socket::Connection::Received(){
 /// Will not buffer anything but always send right away. Blocks.
 /// Any data that could not be send will block until it can be send or the connection is severed.
 void Socket::Connection::SendNow(const char *data, size_t len){
-  bool bing = isBlocking();
-  if (!bing){setBlocking(true);}
-  unsigned int i = iwrite(data, std::min((long unsigned int)len, SOCKETSIZE));
-  while (i < len && connected()){i += iwrite(data + i, std::min((long unsigned int)(len - i), SOCKETSIZE));}
-  if (!bing){setBlocking(false);}
+  struct iovec iov;
+  iov.iov_base = (void *)data;
+  iov.iov_len = len;
+  SendNow(&iov, 1);
+}
+
+/// Sends all given buffers, in order, as if they were one contiguous buffer. Blocks.
+/// The buffers are handed to the kernel together, so small headers and trailers do not cost a call each.
+/// Any data that could not be send will block until it can be send or the connection is severed.
+/// Data still kept by Send() is sent first.
+/// If setKeepSends() was turned on, never blocks but leaves whatever cannot be sent right away to Send().
+/// \param iov The buffers to send. Their contents are not changed.
+/// \param cnt The amount of buffers.
+void Socket::Connection::SendNow(const struct iovec *iov, int cnt){
+  if (keepSends){
+    Send(iov, cnt);
+    return;
+  }
+  while (!flush() && connected()){waitWritable();}
+  struct iovec parts[16];
+  while (cnt > 0 && connected()){
+    // skip empty buffers, and copy up to 16 of the remaining ones so we can track partial writes
+    if (!iov->iov_len){
+      ++iov;
+      --cnt;
+      continue;
+    }
+    int num = std::min(cnt, 16);
+    memcpy(parts, iov, num * sizeof(struct iovec));
+    iov += num;
+    cnt -= num;
+    struct iovec *cur = parts;
+    while (num && connected()){
+      unsigned int r = iwritev(cur, num);
+      if (!r){
+        waitWritable();
+        continue;
+      }
+      while (num && r >= cur->iov_len){
+        r -= cur->iov_len;
+        ++cur;
+        --num;
+      }
+      if (num){
+        cur->iov_base = (char *)cur->iov_base + r;
+        cur->iov_len -= r;
+      }
+    }
+  }
+}
+
+/// Sends all given buffers, in order, as if they were one contiguous buffer. Never blocks.
+/// Whatever the socket does not accept right away is copied and kept, to be sent by flush() or any later send call.
+/// Data kept by earlier calls is always sent first.
+/// \param iov The buffers to send. Their contents are not changed.
+/// \param cnt The amount of buffers.
+/// \returns True if everything was sent, false if some data is kept for later.
+bool Socket::Connection::Send(const struct iovec *iov, int cnt){
+  struct iovec parts[16];
+  int i = 0;
+  size_t done = 0; // bytes of iov[i] that were already sent
+  if (flush()){
+    while (i < cnt && connected()){
+      int num = std::min(cnt - i, 16);
+      memcpy(parts, iov + i, num * sizeof(struct iovec));
+      parts[0].iov_base = (char *)parts[0].iov_base + done;
+      parts[0].iov_len -= done;
+      size_t r = iwritev(parts, num);
+      if (!r){break;}
+      r += done;
+      while (i < cnt && r >= iov[i].iov_len){
+        r -= iov[i].iov_len;
+        ++i;
+      }
+      done = r;
+    }
+  }
+  if (i == cnt || !connected()){return i == cnt;}
+  upbuffer.append((const char *)iov[i].iov_base + done, iov[i].iov_len - done);
+  for (++i; i < cnt; ++i){upbuffer.append((const char *)iov[i].iov_base, iov[i].iov_len);}
+  return false;
+}
+
+/// Sends as much of the data kept by Send() as the socket accepts right now. Never blocks.
+/// \returns True if no kept data remains.
+bool Socket::Connection::flush(){
+  unsigned int pending = sendPending();
+  while (pending && connected()){
+    unsigned int r = iwrite(upbuffer.peek(pending), pending);
+    if (!r){return false;}
+    upbuffer.consume(r);
+    pending -= r;
+  }
+  return !pending;
+}
+
+/// Returns the amount of bytes kept by Send() that were not sent yet.
+/// These come on top of what sendQueue() reports as waiting in the kernel.
+unsigned int Socket::Connection::sendPending(){
+  return upbuffer.bytes(0xFFFFFFFF);
+}
+
+/// Sets whether SendNow keeps what the socket does not accept right away, instead of waiting until it does.
+/// Used when one process serves many connections, where waiting for one would stall all others.
+/// The kept data is sent by flush() or any later send call; sendPending() tells how much there is.
+void Socket::Connection::setKeepSends(bool keep){
+  keepSends = keep;
+}
+
+/// Marks or unmarks this socket as corked.
+/// While corked, all sends tell the kernel more data will follow shortly, so it may hold back partially filled packets.
+/// Uncork before the last send of a response, or that last part may be delayed.
+/// Has no effect on sockets simulated using file descriptors.
+void Socket::Connection::setCork(bool cork){
+  corked = cork;
+}
+
+/// Returns the amount of bytes that were handed to the kernel, but not yet acknowledged by the peer.
+/// This grows when the peer cannot keep up with what is sent to it.
+/// Always returns zero on sockets simulated using file descriptors, or where the kernel does not report it.
+unsigned int Socket::Connection::sendQueue(){
+#ifdef TIOCOUTQ
+  if (sock < 0){return 0;}
+  int queued = 0;
+  if (ioctl(sock, TIOCOUTQ, &queued) < 0 || queued < 0){return 0;}
+  return queued;
+#else
+  return 0;
+#endif
+}
+
+/// Returns true if this socket is corked.
+bool Socket::Connection::isCorked() const{
+  return corked;
+}
+
+/// Waits until the socket is able to accept more data, or up to a second has passed.
+/// Used by the sending functions instead of switching the socket to blocking mode and back.
+void Socket::Connection::waitWritable(){
+  struct pollfd pfd;
+  pfd.fd = (sock >= 0) ? sock : pipes[0];
+  pfd.events = POLLOUT;
+  if (pfd.fd < 0){
+    Util::sleep(1);
+    return;
+  }
+  poll(&pfd, 1, 1000);
 }
 
 /// Will not buffer anything but always send right away. Blocks.
@@ -661,6 +808,43 @@ unsigned int Socket::Connection::iwrite(const void *buffer, int len){
   return r;
 }// Socket::Connection::iwrite
 
+/// Incremental gathering write call. This function tries to write the given buffers to the socket, in order,
+/// returning the amount of bytes it actually wrote.
+/// \param iov The buffers to write from.
+/// \param cnt Amount of buffers to write.
+/// \returns The amount of bytes actually written.
+unsigned int Socket::Connection::iwritev(const struct iovec *iov, int cnt){
+  if (!connected() || cnt < 1){return 0;}
+  int r;
+  if (sock >= 0){
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = cnt;
+    r = sendmsg(sock, &msg, corked ? MSG_MORE : 0);
+  }else{
+    r = writev(pipes[0], iov, cnt);
+  }
+  if (r < 0){
+    switch (errno){
+    case EWOULDBLOCK: return 0; break;
+    case EINTR: return 0; break;
+    default:
+      Error = true;
+      INSANE_MSG("Could not iwritev data! Error: %s", strerror(errno));
+      close();
+      return 0;
+      break;
+    }
+  }
+  if (r == 0 && (sock >= 0)){
+    DONTEVEN_MSG("Socket closed by remote");
+    close();
+  }
+  up += r;
+  return r;
+}// Socket::Connection::iwritev
+
 /// Incremental read call. This function tries to read len bytes to the buffer from the socket,
 /// returning the amount of bytes it actually read.
 /// \param buffer Location of the buffer to read to.
@@ -995,6 +1179,14 @@ unsigned int Socket::SSLConnection::iwrite(const void *buffer, int len){
   return r;
 }
 
+/// Incremental gathering write call. SSL records are not gathered, so this writes the first non-empty buffer only.
+unsigned int Socket::SSLConnection::iwritev(const struct iovec *iov, int cnt){
+  for (int i = 0; i < cnt; ++i){
+    if (iov[i].iov_len){return iwrite(iov[i].iov_base, iov[i].iov_len);}
+  }
+  return 0;
+}
+
 bool Socket::SSLConnection::connected() const{
   return isConnected;
 }
@@ -13,6 +13,7 @@
 #include <string>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
@@ -38,10 +39,16 @@ namespace Socket{
   bool matchIPv6Addr(const std::string &A, const std::string &B, uint8_t prefix);
   std::string getBinForms(std::string addr);
 
-  /// A buffer made out of std::string objects that can be efficiently read from and written to.
+  /// A buffer that can be efficiently read from and written to.
+  /// All data is stored in one contiguous block, of which the already read part is released now and then.
+  /// Parsers can read in place through peek() and consume(); get() hands out the data up to the next splitter as a separate chunk.
   class Buffer{
   private:
-    std::deque<std::string> data;
+    std::string data;///< Buffered data, of which the first start bytes have already been read.
+    unsigned int start;///< Offset of the first unread byte in data.
+    std::string chunk;///< The chunk currently handed out by get(). Logically comes before all of data.
+    void cutChunk();
+    void unChunk();
 
   public:
     std::string splitter;///<String to automatically split on if encountered. \n by default
@@ -57,6 +64,8 @@ namespace Socket{
     bool available(unsigned int count);
     std::string remove(unsigned int count);
     std::string copy(unsigned int count);
+    const char *peek(unsigned int count);
+    void consume(unsigned int count);
     void clear();
   };
   // Buffer
@@ -71,9 +80,14 @@ namespace Socket{
     uint64_t up;
     uint64_t down;
     long long int conntime;
+    bool corked;                                      ///< True if sends should be marked as having more data follow.
+    bool keepSends;                                   ///< True if SendNow should keep what cannot be sent instead of waiting.
     Buffer downbuffer;                                ///< Stores temporary data coming in.
+    Buffer upbuffer;                                  ///< Stores data passed to Send() that could not be sent yet.
     virtual int iread(void *buffer, int len, int flags = 0);  ///< Incremental read call.
     virtual unsigned int iwrite(const void *buffer, int len); ///< Incremental write call.
+    virtual unsigned int iwritev(const struct iovec *iov, int cnt); ///< Incremental gathering write call.
+    void waitWritable();                              ///< Waits until the socket can accept more data.
     bool iread(Buffer &buffer, int flags = 0);        ///< Incremental write call that is compatible with Socket::Buffer.
     bool iwrite(std::string &buffer);                 ///< Write call that is compatible with std::string.
   public:
@@ -106,6 +120,14 @@ namespace Socket{
     void SendNow(const std::string &data);      ///< Will not buffer anything but always send right away. Blocks.
     void SendNow(const char *data);             ///< Will not buffer anything but always send right away. Blocks.
     void SendNow(const char *data, size_t len); ///< Will not buffer anything but always send right away. Blocks.
+    void SendNow(const struct iovec *iov, int cnt); ///< Sends all given buffers right away, using as few calls as possible. Blocks.
+    bool Send(const struct iovec *iov, int cnt);    ///< Sends what the socket accepts right away and keeps the rest for later. Never blocks.
+    bool flush();                               ///< Sends as much of the kept data as possible. Never blocks.
+    unsigned int sendPending();                 ///< Returns the amount of bytes kept by Send() that were not sent yet.
+    void setKeepSends(bool keep);               ///< While set, SendNow never blocks but keeps what cannot be sent, like Send.
+    void setCork(bool cork);                    ///< While corked, sends are expected to be followed by more data soon.
+    bool isCorked() const;                      ///< Returns true if this socket is corked.
+    unsigned int sendQueue();                   ///< Returns the amount of sent bytes the peer did not receive yet.
     // stats related methods
     unsigned int connTime();             ///< Returns the time this socket has been connected.
     uint64_t dataUp();                   ///< Returns total amount of bytes sent.
@@ -136,6 +158,7 @@ namespace Socket{
       bool isConnected;
       int iread(void *buffer, int len, int flags = 0);  ///< Incremental read call.
       unsigned int iwrite(const void *buffer, int len); ///< Incremental write call.
+      unsigned int iwritev(const struct iovec *iov, int cnt); ///< Incremental gathering write call.
       mbedtls_net_context * server_fd;
       mbedtls_entropy_context * entropy;
       mbedtls_ctr_drbg_context * ctr_drbg;
@@ -9,6 +9,9 @@
 #include <iostream>
 #include <stdio.h>
 #include <sys/stat.h> // stat
+#include <sys/mman.h> // mmap, madvise
+#include <fcntl.h> // open, posix_fadvise
+#include <unistd.h> // close
 #if defined(_WIN32)
 #include <direct.h> // _mkdir
 #endif
@@ -157,6 +160,73 @@ namespace Util{
     return fseeko(stream, offset, whence);
   }
 
+  /// Asks the kernel to start reading the given range of a file in the background.
+  /// A len of zero means until the end of the file.
+  void prefetch(FILE *stream, uint64_t offset, uint64_t len){
+#if !defined(_WIN32) && !defined(__APPLE__)
+    posix_fadvise(fileno(stream), offset, len, POSIX_FADV_WILLNEED);
+#endif
+  }
+
+  MappedFile::MappedFile(){
+    ptr = 0;
+    len = 0;
+  }
+
+  MappedFile::~MappedFile(){close();}
+
+  /// Maps the given file, unmapping any previously mapped file first.
+  /// Files that cannot be opened or are empty are only logged at a high debug level: callers decide if that is an error.
+  /// Access is random by default: callers are expected to announce what they will read with willNeed.
+  bool MappedFile::open(const std::string &path){
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1){
+      HIGH_MSG("Could not open %s: %s", path.c_str(), strerror(errno));
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || !st.st_size){
+      HIGH_MSG("Could not map %s: empty or unreadable file", path.c_str());
+      ::close(fd);
+      return false;
+    }
+    void *mapped = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file referenced; the descriptor is no longer needed
+    ::close(fd);
+    if (mapped == MAP_FAILED){
+      FAIL_MSG("Could not map %s: %s", path.c_str(), strerror(errno));
+      return false;
+    }
+    ptr = (char *)mapped;
+    len = st.st_size;
+    madvise(ptr, len, MADV_RANDOM);
+    return true;
+  }
+
+  void MappedFile::close(){
+    if (ptr){munmap(ptr, len);}
+    ptr = 0;
+    len = 0;
+  }
+
+  /// Switches the kernel readahead between sequential, for reading the whole file front to back,
+  /// and random, where only the ranges passed to willNeed are read ahead.
+  void MappedFile::setSequential(bool sequential){
+    if (ptr){madvise(ptr, len, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);}
+  }
+
+  /// Asks the kernel to start reading the given range of the file in the background.
+  /// A length of zero means until the end of the file.
+  void MappedFile::willNeed(uint64_t offset, uint64_t length){
+    if (!ptr || offset >= len){return;}
+    if (!length || offset + length > len){length = len - offset;}
+    // madvise needs a page-aligned start
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - (offset % pageSize);
+    madvise(ptr + start, length + (offset - start), MADV_WILLNEED);
+  }
+
   ResizeablePointer::ResizeablePointer(){
     currSize = 0;
     ptr = 0;
@@ -1,6 +1,8 @@
+#pragma once
 #include <deque>
 #include <map>
 #include <stdint.h>
+#include <stdio.h>
 #include <string>
 
 namespace Util{
@@ -13,6 +15,28 @@ namespace Util{
 
   uint64_t ftell(FILE *stream);
   uint64_t fseek(FILE *stream, uint64_t offset, int whence);
+  void prefetch(FILE *stream, uint64_t offset, uint64_t len);
+
+  /// Read-only memory mapping of a whole file.
+  /// Lets inputs parse media straight from the page cache instead of copying it through stdio
+  /// buffers, and tell the kernel which parts they will need next.
+  class MappedFile{
+  public:
+    MappedFile();
+    ~MappedFile();
+    bool open(const std::string &path);
+    void close();
+    inline operator bool() const{return ptr;}
+    inline char *data() const{return ptr;}
+    inline uint64_t size() const{return len;}
+    void willNeed(uint64_t offset, uint64_t len);
+    void setSequential(bool sequential);
+  private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+    char *ptr;
+    uint64_t len;
+  };
 
   /// Helper class that maintains a resizeable pointer and will free it upon deletion of the class.
   class ResizeablePointer{
@@ -32,7 +32,7 @@ bool AnalyserRTMP::open(const std::string & filename){
   std::string inbuffer;
   inbuffer.reserve(3073);
   while (std::cin.good() && inbuffer.size() < 3073){inbuffer += std::cin.get();}
-  RTMPStream::rec_cnt += 3073;
+  rtmp.rec_cnt += 3073;
   inbuffer.erase(0, 3073); // strip the handshake part
   MEDIUM_MSG("Handshake skipped");
   return true;
@@ -40,7 +40,7 @@ bool AnalyserRTMP::open(const std::string & filename){
 
 bool AnalyserRTMP::parsePacket(){
   // While we can't parse a packet,
-  while (!next.Parse(strbuf)){
+  while (!next.Parse(rtmp, strbuf)){
     // fill our internal buffer "strbuf" in (up to) 1024 byte chunks
     if (std::cin.good()){
       unsigned int charCount = 0;
@@ -72,16 +72,16 @@ bool AnalyserRTMP::parsePacket(){
     return 0;
     break; // happens when connection breaks unexpectedly
   case 1:  // set chunk size
-    RTMPStream::chunk_rec_max = ntohl(*(int *)next.data.c_str());
-    DETAIL_MED("CTRL: Set chunk size: %i", RTMPStream::chunk_rec_max);
+    rtmp.chunk_rec_max = ntohl(*(int *)next.data.c_str());
+    DETAIL_MED("CTRL: Set chunk size: %i", rtmp.chunk_rec_max);
     break;
   case 2: // abort message - we ignore this one
     DETAIL_MED("CTRL: Abort message: %i", ntohl(*(int *)next.data.c_str()));
     // 4 bytes of stream id to drop
     break;
   case 3: // ack
-    RTMPStream::snd_window_at = ntohl(*(int *)next.data.c_str());
-    DETAIL_MED("CTRL: Acknowledgement: %i", RTMPStream::snd_window_at);
+    rtmp.snd_window_at = ntohl(*(int *)next.data.c_str());
+    DETAIL_MED("CTRL: Acknowledgement: %i", rtmp.snd_window_at);
     break;
   case 4:{
     short int ucmtype = ntohs(*(short int *)next.data.c_str());
@@ -125,14 +125,14 @@ bool AnalyserRTMP::parsePacket(){
     }
   }break;
   case 5: // window size of other end
-    RTMPStream::rec_window_size = ntohl(*(int *)next.data.c_str());
-    RTMPStream::rec_window_at = RTMPStream::rec_cnt;
-    DETAIL_MED("CTRL: Window size: %i", RTMPStream::rec_window_size);
+    rtmp.rec_window_size = ntohl(*(int *)next.data.c_str());
+    rtmp.rec_window_at = rtmp.rec_cnt;
+    DETAIL_MED("CTRL: Window size: %i", rtmp.rec_window_size);
     break;
   case 6:
-    RTMPStream::snd_window_size = ntohl(*(int *)next.data.c_str());
+    rtmp.snd_window_size = ntohl(*(int *)next.data.c_str());
     // 4 bytes window size, 1 byte limit type (ignored)
-    DETAIL_MED("CTRL: Set peer bandwidth: %i", RTMPStream::snd_window_size);
+    DETAIL_MED("CTRL: Set peer bandwidth: %i", rtmp.snd_window_size);
     break;
   case 8:
   case 9:
@@ -5,6 +5,7 @@
 
 class AnalyserRTMP : public Analyser{
 private:
+  RTMPStream::Session rtmp; ///< Holds the chunk stream state of the analysed connection
   RTMPStream::Chunk next; ///< Holds the most recently parsed RTMP chunk
   FLV::Tag F;///< Holds the most recently created FLV packet
   unsigned int read_in; ///< Amounts of bytes read to fill 'strbuf' so far
@@ -149,15 +149,30 @@ int Controller::handleAPIConnection(Socket::Connection & conn){
       if (H.GetVar("jsonp") != ""){
         jsonp = H.GetVar("jsonp");
       }
+      //responses can run into megabytes (e.g. the client list); stream them as chunks where the client allows it
+      bool chunked = (H.protocol == "HTTP/1.1" && H.GetHeader("Connection") != "close");
       H.Clean();
       H.SetHeader("Content-Type", "text/javascript");
       H.setCORSHeaders();
-      if (jsonp == ""){
-        H.SetBody(Response.toString() + "\n\n");
+      if (chunked){
+        H.StartResponse(H, conn);
+        {
+          HTTP::ChunkWriter w(H, conn);
+          if (jsonp != ""){
+            w.append(jsonp + "(");
+          }
+          Response.toString(w);
+          w.append(jsonp == "" ? "\n\n" : ");\n\n");
+        }
+        H.Chunkify("", 0, conn);
       }else{
-        H.SetBody(jsonp + "(" + Response.toString() + ");\n\n");
+        if (jsonp == ""){
+          H.SetBody(Response.toString() + "\n\n");
+        }else{
+          H.SetBody(jsonp + "(" + Response.toString() + ");\n\n");
+        }
+        H.SendResponse("200", "OK", conn);
       }
-      H.SendResponse("200", "OK", conn);
       H.Clean();
     }//if HTTP request received
   }//while connected
@@ -406,6 +421,9 @@ void Controller::handleAPICommands(JSON::Value & Request, JSON::Value & Response
       Controller::fillTotals(Request["totals"], Response["totals"]);
     }
   }
+  if (Request.isMember("cache")){
+    Controller::fillCache(Request["cache"], Response["cache"]);
+  }
           
   Controller::configChanged = true;
 }
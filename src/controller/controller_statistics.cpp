@@ -1,5 +1,7 @@
 #include <cstdio>
 #include <list>
+#include <algorithm>
+#include <vector>
 #include <mist/config.h>
 #include "controller_statistics.h"
 #include "controller_storage.h"
@@ -15,6 +17,7 @@
 #define STAT_CLI_BPS_DOWN 128
 #define STAT_CLI_BPS_UP 256
 #define STAT_CLI_CRC 512
+#define STAT_CLI_DROPPED 1024
 #define STAT_CLI_ALL 0xFFFF
 // These are used to store "totals" field requests in a bitfield for speedup.
 #define STAT_TOT_CLIENTS 1
@@ -29,7 +32,40 @@ std::map<Controller::sessIndex, Controller::statSession> Controller::sessions; /
 std::map<unsigned long, Controller::sessIndex> Controller::connToSession; ///< Map of socket IDs to session info.
 tthread::mutex Controller::statsMutex;
 
+class totalsData {
+  public:
+    totalsData(){
+      clients = 0;
+      downbps = 0;
+      upbps = 0;
+    }
+    void add(unsigned int down, unsigned int up){
+      clients++;
+      downbps += down;
+      upbps += up;
+    }
+    void add(const totalsData & other){
+      clients += other.clients;
+      downbps += other.downbps;
+      upbps += other.upbps;
+    }
+    void change(long long down, long long up){
+      downbps += down;
+      upbps += up;
+    }
+    long long clients;
+    long long downbps;
+    long long upbps;
+};
+
+/// Totals per stream and protocol, per second.
+/// Kept up to date by parseStatistics as sessions report in, so fillTotals does not need to go over every session for every second.
+static std::map<std::pair<std::string, std::string>, std::map<unsigned long long, totalsData> > streamTotals;
+/// Timestamp of the latest statistics received per stream, for hasViewers.
+static std::map<std::string, unsigned long long> streamLastSeen;
+
 Controller::sessIndex::sessIndex(std::string dhost, unsigned int dcrc, std::string dstreamName, std::string dconnector){
+  hash = 0;
   host = dhost;
   crc = dcrc;
   streamName = dstreamName;
@@ -37,6 +73,7 @@ Controller::sessIndex::sessIndex(std::string dhost, unsigned int dcrc, std::stri
 }
 
 Controller::sessIndex::sessIndex(){
+  hash = 0;
   crc = 0;
 }
 
@@ -49,6 +86,7 @@ std::string Controller::sessIndex::toStr(){
 /// Initializes a sessIndex from a statExchange object, converting binary format IP addresses into strings.
 /// This extracts the host, stream name, connector and crc field, ignoring everything else.
 Controller::sessIndex::sessIndex(IPC::statExchange & data){
+  hash = data.sessionHash();
   Socket::hostBytesToStr(data.host().c_str(), 16, host);
   streamName = data.streamName();
   connector = data.connector();
@@ -57,7 +95,7 @@ Controller::sessIndex::sessIndex(IPC::statExchange & data){
 
 
 bool Controller::sessIndex::operator== (const Controller::sessIndex &b) const{
-  return (host == b.host && crc == b.crc && streamName == b.streamName && connector == b.connector);
+  return (hash == b.hash && host == b.host && crc == b.crc && streamName == b.streamName && connector == b.connector);
 }
 
 bool Controller::sessIndex::operator!= (const Controller::sessIndex &b) const{
@@ -65,10 +103,12 @@ bool Controller::sessIndex::operator!= (const Controller::sessIndex &b) const{
 }
 
 bool Controller::sessIndex::operator> (const Controller::sessIndex &b) const{
+  if (hash != b.hash){return hash > b.hash;}
   return host > b.host || (host == b.host && (crc > b.crc || (crc == b.crc && (streamName > b.streamName || (streamName == b.streamName && connector > b.connector)))));
 }
 
 bool Controller::sessIndex::operator< (const Controller::sessIndex &b) const{
+  if (hash != b.hash){return hash < b.hash;}
   return host < b.host || (host == b.host && (crc < b.crc || (crc == b.crc && (streamName < b.streamName || (streamName == b.streamName && connector < b.connector)))));
 }
 
@@ -83,6 +123,49 @@ bool Controller::sessIndex::operator>= (const Controller::sessIndex &b) const{
 /// \todo Make this prettier.
 IPC::sharedServer * statPointer = 0;
 
+/// Adds the given session to the totals of its stream and protocol, for every second since it was last added up to and including t.
+/// For the second it was already added to, only the change in its speed is applied. Expects statsMutex to be locked.
+static void countTotals(const Controller::sessIndex & idx, Controller::statSession & sess, unsigned long long t){
+  if (sess.countedSec > t){return;}//late data for a second that was already counted
+  std::map<unsigned long long, totalsData> & totals = streamTotals[std::make_pair(idx.streamName, idx.connector)];
+  long long down = sess.getBpsDown(t);
+  long long up = sess.getBpsUp(t);
+  if (sess.countedSec == t){
+    totals[t].change(down - sess.countedDown, up - sess.countedUp);
+    sess.countedDown = down;
+    sess.countedUp = up;
+    return;
+  }
+  //seconds in which this session did not report still count, as in the rest of the statistics
+  if (sess.countedSec && sess.countedSec + STAT_CUTOFF > t){
+    for (unsigned long long s = sess.countedSec + 1; s < t; ++s){
+      if (sess.hasDataFor(s)){
+        totals[s].add(sess.getBpsDown(s), sess.getBpsUp(s));
+      }
+    }
+  }
+  totals[t].add(down, up);
+  sess.countedSec = t;
+  sess.countedDown = down;
+  sess.countedUp = up;
+}
+
+/// Wipes the stream totals for seconds older than STAT_CUTOFF. Expects statsMutex to be locked.
+static void wipeTotals(){
+  unsigned long long cutOffPoint = Util::epoch() - STAT_CUTOFF;
+  std::map<std::pair<std::string, std::string>, std::map<unsigned long long, totalsData> >::iterator it = streamTotals.begin();
+  while (it != streamTotals.end()){
+    while (it->second.size() && it->second.begin()->first < cutOffPoint){
+      it->second.erase(it->second.begin());
+    }
+    if (!it->second.size()){
+      streamTotals.erase(it++);
+    }else{
+      ++it;
+    }
+  }
+}
+
 
 /// This function runs as a thread and roughly once per second retrieves
 /// statistics from all connected clients, as well as wipes
@@ -94,8 +177,7 @@ void Controller::SharedMemStats(void * config){
   std::set<std::string> inactiveStreams;
   while(((Util::Config*)config)->is_active){
     {
-      tthread::lock_guard<tthread::mutex> guard(Controller::configMutex);
-      tthread::lock_guard<tthread::mutex> guard2(statsMutex);
+      tthread::lock_guard<tthread::mutex> guard(statsMutex);
       //parse current users
       statServer.parseEach(parseStatistics);
       //wipe old statistics
@@ -113,6 +195,16 @@ void Controller::SharedMemStats(void * config){
           mustWipe.pop_front();
         }
       }
+      wipeTotals();
+      //forget about streams that have not had viewers for a while
+      std::map<std::string, unsigned long long>::iterator it = streamLastSeen.begin();
+      while (it != streamLastSeen.end()){
+        if (it->second + STAT_CUTOFF < (unsigned long long)Util::epoch()){
+          streamLastSeen.erase(it++);
+        }else{
+          ++it;
+        }
+      }
     }
     Util::wait(1000);
   }
@@ -181,6 +273,9 @@ void Controller::statSession::finish(unsigned long index){
 Controller::statSession::statSession(){
   firstSec = 0xFFFFFFFFFFFFFFFFull;
   lastSec = 0;
+  countedSec = 0;
+  countedDown = 0;
+  countedUp = 0;
 }
 
 /// Moves the given connection to the given session
@@ -351,6 +446,26 @@ long long Controller::statSession::getUp(unsigned long long t){
   return retVal;
 }
 
+/// Returns the cumulative amount of frames dropped for this session at timestamp t.
+long long Controller::statSession::getDropped(unsigned long long t){
+  long long retVal = 0;
+  if (oldConns.size()){
+    for (std::deque<statStorage>::iterator it = oldConns.begin(); it != oldConns.end(); ++it){
+      if (it->hasDataFor(t)){
+        retVal += it->getDataFor(t).dropped;
+      }
+    }
+  }
+  if (curConns.size()){
+    for (std::map<unsigned long, statStorage>::iterator it = curConns.begin(); it != curConns.end(); ++it){
+      if (it->second.hasDataFor(t)){
+        retVal += it->second.getDataFor(t).dropped;
+      }
+    }
+  }
+  return retVal;
+}
+
 /// Returns the cumulative downloaded bytes per second for this session at timestamp t.
 long long Controller::statSession::getBpsDown(unsigned long long t){
   unsigned long long aTime = t - 5;
@@ -402,6 +517,7 @@ Controller::statLog & Controller::statStorage::getDataFor(unsigned long long t)
     empty.lastSecond = 0;
     empty.down = 0;
     empty.up = 0;
+    empty.dropped = 0;
     return empty;
   }
   std::map<unsigned long long, statLog>::iterator it = log.upper_bound(t);
@@ -419,6 +535,7 @@ void Controller::statStorage::update(IPC::statExchange & data) {
   tmp.lastSecond = data.lastSecond();
   tmp.down = data.down() - removeDown;
   tmp.up = data.up() - removeUp;
+  tmp.dropped = data.dropped();
   if (!log.size() && tmp.down + tmp.up > COUNTABLE_BYTES){
     //substract the start values if they are too high - this is a resumed connection of some sort
     removeDown = tmp.down;
@@ -437,43 +554,53 @@ void Controller::statStorage::update(IPC::statExchange & data) {
 void Controller::parseStatistics(char * data, size_t len, unsigned int id){
   //retrieve stats data
   IPC::statExchange tmpEx(data);
-  //calculate the current session index, store as idx.
-  sessIndex idx(tmpEx);
-  //if the connection was already indexed and it has changed, move it
-  if (connToSession.count(id) && connToSession[id] != idx){
-    sessions[connToSession[id]].switchOverTo(sessions[idx], id);
-    if (!sessions[connToSession[id]].hasData()){
-      sessions.erase(connToSession[id]);
+  std::map<unsigned long, sessIndex>::iterator conn = connToSession.find(id);
+  //only (re)build the session index if this is a new connection or the session fields changed
+  if (conn == connToSession.end() || conn->second.hash != tmpEx.sessionHash()){
+    sessIndex newIdx(tmpEx);
+    if (conn == connToSession.end()){
+      INSANE_MSG("New connection: %lu as %s", id, newIdx.toStr().c_str());
+      conn = connToSession.insert(std::make_pair((unsigned long)id, newIdx)).first;
+    }else if (conn->second != newIdx){
+      //the connection was already indexed and it has changed, move it
+      sessions[conn->second].switchOverTo(sessions[newIdx], id);
+      if (!sessions[conn->second].hasData()){
+        sessions.erase(conn->second);
+      }
+      conn->second = newIdx;
     }
   }
-  if (!connToSession.count(id)){
-    INSANE_MSG("New connection: %lu as %s", id, idx.toStr().c_str());
-  }
-  //store the index for later comparison
-  connToSession[id] = idx;
+  sessIndex & idx = conn->second;
   //update the session with the latest data
-  sessions[idx].update(id, tmpEx);
+  statSession & sess = sessions[idx];
+  sess.update(id, tmpEx);
+  countTotals(idx, sess, tmpEx.now());
+  unsigned long long & lastSeen = streamLastSeen[idx.streamName];
+  if ((unsigned long long)tmpEx.now() > lastSeen){
+    lastSeen = tmpEx.now();
+  }
   //check validity of stats data
   char counter = (*(data - 1)) & 0x7F;
   if (counter == 126 || counter == 127){
     //the data is no longer valid - connection has gone away, store for later
     INSANE_MSG("Ended connection: %lu as %s", id, idx.toStr().c_str());
     sessions[idx].finish(id);
-    connToSession.erase(id);
+    connToSession.erase(conn);
   }
 }
 
+/// Orders sessions by host, crc, stream name and protocol, ignoring the session hash the sessions map sorts on first.
+static bool sessionFieldOrder(std::map<Controller::sessIndex, Controller::statSession>::iterator a, std::map<Controller::sessIndex, Controller::statSession>::iterator b){
+  const Controller::sessIndex & A = a->first;
+  const Controller::sessIndex & B = b->first;
+  return A.host < B.host || (A.host == B.host && (A.crc < B.crc || (A.crc == B.crc && (A.streamName < B.streamName || (A.streamName == B.streamName && A.connector < B.connector)))));
+}
+
 /// Returns true if this stream has at least one connected client.
 bool Controller::hasViewers(std::string streamName){
-  if (sessions.size()){
-    long long currTime = Util::epoch();
-    for (std::map<sessIndex, statSession>::iterator it = sessions.begin(); it != sessions.end(); it++){
-      if (it->first.streamName == streamName && (it->second.hasDataFor(currTime) || it->second.hasDataFor(currTime-1))){
-        return true;
-      }
-    }
-  }
-  return false;
+  tthread::lock_guard<tthread::mutex> guard(statsMutex);
+  std::map<std::string, unsigned long long>::iterator it = streamLastSeen.find(streamName);
+  return it != streamLastSeen.end() && it->second + 1 >= (unsigned long long)Util::epoch();
 }
 
 /// This takes a "clients" request, and fills in the response data.
@@ -487,7 +614,7 @@ bool Controller::hasViewers(std::string streamName){
 ///   //array of protocols to accumulate. Empty means all.
 ///   "protocols": ["HLS", "HSS"],
 ///   //list of requested data fields. Empty means all.
-///   "fields": ["host", "stream", "protocol", "conntime", "position", "down", "up", "downbps", "upbps"],
+///   "fields": ["host", "stream", "protocol", "conntime", "position", "down", "up", "downbps", "upbps", "dropped"],
 ///   //unix timestamp of measuring moment. Negative means X seconds ago. Empty means now.
 ///   "time": 1234567
 /// }
@@ -540,6 +667,7 @@ void Controller::fillClients(JSON::Value & req, JSON::Value & rep){
       if ((*it).asStringRef() == "up"){fields |= STAT_CLI_UP;}
       if ((*it).asStringRef() == "downbps"){fields |= STAT_CLI_BPS_DOWN;}
       if ((*it).asStringRef() == "upbps"){fields |= STAT_CLI_BPS_UP;}
+      if ((*it).asStringRef() == "dropped"){fields |= STAT_CLI_DROPPED;}
     }
   }
   //select all, if none selected
@@ -570,11 +698,19 @@ void Controller::fillClients(JSON::Value & req, JSON::Value & rep){
   if (fields & STAT_CLI_BPS_DOWN){rep["fields"].append("downbps");}
   if (fields & STAT_CLI_BPS_UP){rep["fields"].append("upbps");}
   if (fields & STAT_CLI_CRC){rep["fields"].append("crc");}
+  if (fields & STAT_CLI_DROPPED){rep["fields"].append("dropped");}
   //output the data itself
   rep["data"].null();
-  //loop over all sessions
+  //loop over all sessions, in the order of their fields rather than their hash
   if (sessions.size()){
+    std::vector<std::map<sessIndex, statSession>::iterator> sorted;
+    sorted.reserve(sessions.size());
     for (std::map<sessIndex, statSession>::iterator it = sessions.begin(); it != sessions.end(); it++){
+      sorted.push_back(it);
+    }
+    std::sort(sorted.begin(), sorted.end(), sessionFieldOrder);
+    for (std::vector<std::map<sessIndex, statSession>::iterator>::iterator sIt = sorted.begin(); sIt != sorted.end(); ++sIt){
+      std::map<sessIndex, statSession>::iterator it = *sIt;
       unsigned long long time = reqTime;
       if (now && reqTime - it->second.getEnd() < 5){time = it->second.getEnd();}
       //data present and wanted? insert it!
@@ -591,6 +727,7 @@ void Controller::fillClients(JSON::Value & req, JSON::Value & rep){
           if (fields & STAT_CLI_BPS_DOWN){d.append(it->second.getBpsDown(time));}
           if (fields & STAT_CLI_BPS_UP){d.append(it->second.getBpsUp(time));}
           if (fields & STAT_CLI_CRC){d.append((long long)it->first.crc);}
+          if (fields & STAT_CLI_DROPPED){d.append(it->second.getDropped(time));}
           rep["data"].append(d);
         }
       }
@@ -599,23 +736,6 @@ void Controller::fillClients(JSON::Value & req, JSON::Value & rep){
   //all done! return is by reference, so no need to return anything here.
 }
 
-class totalsData {
-  public:
-    totalsData(){
-      clients = 0;
-      downbps = 0;
-      upbps = 0;
-    }
-    void add(unsigned int down, unsigned int up){
-      clients++;
-      downbps += down;
-      upbps += up;
-    }
-    long long clients;
-    long long downbps;
-    long long upbps;
-};
-
 /// This takes a "totals" request, and fills in the response data.
 /// 
 /// \api
@@ -712,17 +832,10 @@ void Controller::fillTotals(JSON::Value & req, JSON::Value & rep){
   if (fields & STAT_TOT_BPS_UP){rep["fields"].append("upbps");}
   //start data collection
   std::map<long long unsigned int, totalsData> totalsCount;
-  //loop over all sessions
-  /// \todo Make the interval configurable instead of 1 second
-  if (sessions.size()){
-    for (std::map<sessIndex, statSession>::iterator it = sessions.begin(); it != sessions.end(); it++){
-      //data present and wanted? insert it!
-      if ((it->second.getEnd() >= (unsigned long long)reqStart || it->second.getStart() <= (unsigned long long)reqEnd) && (!streams.size() || streams.count(it->first.streamName)) && (!protos.size() || protos.count(it->first.connector))){
-        for (unsigned long long i = reqStart; i <= reqEnd; ++i){
-          if (it->second.hasDataFor(i)){
-            totalsCount[i].add(it->second.getBpsDown(i), it->second.getBpsUp(i));
-          }
-        }
+  for (std::map<std::pair<std::string, std::string>, std::map<unsigned long long, totalsData> >::iterator it = streamTotals.begin(); it != streamTotals.end(); it++){
+    if ((!streams.size() || streams.count(it->first.first)) && (!protos.size() || protos.count(it->first.second))){
+      for (std::map<unsigned long long, totalsData>::iterator sIt = it->second.lower_bound(reqStart); sIt != it->second.end() && sIt->first <= (unsigned long long)reqEnd; ++sIt){
+        totalsCount[sIt->first].add(sIt->second);
       }
     }
   }
@@ -770,3 +883,47 @@ void Controller::fillTotals(JSON::Value & req, JSON::Value & rep){
   }
   //all done! return is by reference, so no need to return anything here.
 }
+
+/// This takes a "cache" request, and fills in the response data.
+/// The cache request is a stream name, an array of stream names, or anything else to request all configured streams.
+/// The response is an object with a member for each requested stream that has a segment/playlist cache:
+/// ~~~~~~~~~~~~~~~{.js}
+/// {
+///   "streama": {
+///     //claims that were served from the cache, and claims that had to generate their data
+///     "hits": 1234,
+///     "misses": 12,
+///     //entries removed to make room, or because they left the live buffer
+///     "evictions": 3,
+///     //amount and total size in bytes of the entries currently stored
+///     "entries": 8,
+///     "bytes": 12345678
+///   }
+/// }
+/// ~~~~~~~~~~~~~~~
+/// Must be called with the config mutex held.
+void Controller::fillCache(JSON::Value & req, JSON::Value & rep){
+  std::set<std::string> streams;
+  if (req.isString()){
+    streams.insert(req.asStringRef());
+  }else if (req.isArray() && req.size()){
+    jsonForEach(req, it){
+      streams.insert(it->asString());
+    }
+  }else{
+    jsonForEach(Storage["streams"], it){
+      streams.insert(it.key());
+    }
+  }
+  rep.null();
+  for (std::set<std::string>::iterator it = streams.begin(); it != streams.end(); ++it){
+    IPC::sharedCache cache;
+    if (!cache.init(*it, 0, false)){continue;}
+    JSON::Value & S = rep[*it];
+    S["hits"] = (long long)cache.hits();
+    S["misses"] = (long long)cache.misses();
+    S["evictions"] = (long long)cache.evictions();
+    S["entries"] = (long long)cache.entries();
+    S["bytes"] = (long long)cache.bytes();
+  }
+}
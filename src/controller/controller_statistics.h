@@ -17,6 +17,7 @@ namespace Controller {
     long lastSecond;
     long long down;
     long long up;
+    long long dropped;
   };
 
   /// This is a comparison and storage class that keeps sessions apart from each other.
@@ -26,6 +27,7 @@ namespace Controller {
       sessIndex(std::string host, unsigned int crc, std::string streamName, std::string connector);
       sessIndex(IPC::statExchange & data);
       sessIndex();
+      uint32_t hash;///< Hash of the session fields as reported by the connection, compared first. Zero if unknown.
       std::string host;
       unsigned int crc;
       std::string streamName;
@@ -75,10 +77,14 @@ namespace Controller {
       long long getLastSecond(unsigned long long time);
       long long getDown(unsigned long long time);
       long long getUp(unsigned long long time);
+      long long getDropped(unsigned long long time);
       long long getBpsDown(unsigned long long time);
       long long getBpsUp(unsigned long long time);
       long long getBpsDown(unsigned long long start, unsigned long long end);
       long long getBpsUp(unsigned long long start, unsigned long long end);
+      unsigned long long countedSec;///< Latest second this session was added to the stream totals for, zero if never
+      long long countedDown;///< Download speed this session added to the stream totals for countedSec
+      long long countedUp;///< Upload speed this session added to the stream totals for countedSec
   };
 
   
@@ -88,6 +94,7 @@ namespace Controller {
   void parseStatistics(char * data, size_t len, unsigned int id);
   void fillClients(JSON::Value & req, JSON::Value & rep);
   void fillTotals(JSON::Value & req, JSON::Value & rep);
+  void fillCache(JSON::Value & req, JSON::Value & rep);
   void SharedMemStats(void * config);
   bool hasViewers(std::string streamName);
 }
@@ -6,10 +6,13 @@
 #include <mist/defines.h>
 #include <mist/procs.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include "input.h"
 #include <sstream>
 #include <fstream>
 #include <iterator>
+#include <algorithm>
+#include <vector>
 
 namespace Mist {
   Input * Input::singleton = NULL;
@@ -19,9 +22,173 @@ namespace Mist {
       unsigned long tid = ((unsigned long)(data[i * 6]) << 24) | ((unsigned long)(data[i * 6 + 1]) << 16) | ((unsigned long)(data[i * 6 + 2]) << 8) | ((unsigned long)(data[i * 6 + 3]));
       if (tid) {
         unsigned long keyNum = ((unsigned long)(data[i * 6 + 4]) << 8) | ((unsigned long)(data[i * 6 + 5]));
+        if (!nProxy.pagesByTrack.count(tid) || keyNum + 1 > myMeta.tracks[tid].keys.size()){
+          bufferFrame(tid, keyNum + 1);
+          continue;
+        }
+        std::map<unsigned long, DTSCPageData> & pages = nProxy.pagesByTrack[tid];
+        std::map<unsigned long, DTSCPageData>::iterator page = pages.upper_bound(keyNum + 1);
+        if (page != pages.begin()){
+          unsigned long pageNum = (--page)->first;
+          if (prefetched[tid].erase(pageNum)){
+            if (nProxy.isBuffered(tid, keyNum + 1)){
+              ++prefetchHits;
+            }else{
+              ++demandStalls;
+              HIGH_MSG("Track %lu page %lu was still being buffered when a viewer reached it", tid, pageNum);
+            }
+          }else if (!nProxy.isBuffered(tid, keyNum + 1) && !bufferingInChild(tid, pageNum)){
+            ++demandStalls;
+            HIGH_MSG("Track %lu page %lu was not buffered ahead of demand", tid, pageNum);
+          }
+          ++page;
+        }
         bufferFrame(tid, keyNum + 1);//Try buffer next frame
+        //Remember the pages after this one, so they are buffered before the viewer gets there
+        for (long long depth = config->getInteger("prefetch"); depth > 0 && page != pages.end(); --depth, ++page){
+          prefetchWanted.insert(std::make_pair((unsigned int)tid, (unsigned int)page->first));
+        }
+      }
+    }
+  }
+
+  /// Buffers the pages that userCallback found viewers will reach soon in child processes, see bufferInChild,
+  /// with at most as many children at the same time as the parallel option allows.
+  /// The serve loop keeps handling on-demand requests while they are read.
+  /// Pages that are already buffered are kept from being unloaded before the viewer gets there.
+  void Input::prefetchPages(){
+    for (std::set<std::pair<unsigned int, unsigned int> >::iterator it = prefetchWanted.begin(); it != prefetchWanted.end(); ++it){
+      if (nProxy.isBuffered(it->first, it->second)){
+        bufferFrame(it->first, it->second);
+        continue;
+      }
+      if ((long long)bufferChildren.size() >= config->getInteger("parallel") || bufferingInChild(it->first, it->second) || !nProxy.pagesByTrack[it->first].count(it->second)){
+        continue;
+      }
+      std::map<unsigned int, unsigned int> pages;
+      pages[it->first] = it->second;
+      addCoveredPages(it->first, it->second, pages);
+      if (bufferInChild(pages)){
+        for (std::map<unsigned int, unsigned int>::iterator pIt = pages.begin(); pIt != pages.end(); ++pIt){
+          prefetched[pIt->first].insert(pIt->second);
+        }
+      }
+    }
+    prefetchWanted.clear();
+  }
+
+  /// Buffers the given pages, mapped from track to page number, in a child process with its own handle on the source,
+  /// see bufferPages. The child only fills the data pages: reapBufferChildren registers them on the track index pages
+  /// once it is done, so the index pages are only ever written by this process.
+  /// \return True if the child was started.
+  bool Input::bufferInChild(const std::map<unsigned int, unsigned int> & pages){
+    //Negotiate the tracks here, as the child cannot keep any negotiation state
+    if (!nProxy.metaPages.count(0)){
+      initiateMeta();
+    }
+    for (std::map<unsigned int, unsigned int>::const_iterator it = pages.begin(); it != pages.end(); ++it){
+      if (standAlone && !nProxy.trackMap.count(it->first)){
+        nProxy.trackMap[it->first] = it->first;
+      }
+      nProxy.continueNegotiate(it->first, myMeta);
+      if (nProxy.trackState[it->first] != FILL_ACC){
+        return false;
+      }
+    }
+    int result[2];
+    if (pipe(result)){
+      WARN_MSG("Could not create a pipe to buffer track %u, page %u: %s", pages.begin()->first, pages.begin()->second, strerror(errno));
+      return false;
+    }
+    pid_t pid = fork();
+    if (pid == -1){
+      WARN_MSG("Could not fork to buffer track %u, page %u: %s", pages.begin()->first, pages.begin()->second, strerror(errno));
+      close(result[0]);
+      close(result[1]);
+      return false;
+    }
+    if (pid == 0){
+      inBufferChild = true;
+      close(result[0]);
+      if (reopenSource() && bufferPages(pages)){
+        char done = 1;
+        write(result[1], &done, 1);
+      }
+      //Leave without running destructors: all shared memory still belongs to the parent
+      _exit(0);
+    }
+    close(result[1]);
+    fcntl(result[0], F_SETFL, O_NONBLOCK);
+    bufferChildren[pid].pages = pages;
+    bufferChildren[pid].result = result[0];
+    return true;
+  }
+
+  /// Registers the pages of children of bufferInChild that are done on their track index pages, so viewers can use them.
+  /// Pages of children that failed are removed; they are buffered on demand once a viewer needs them.
+  /// A child is done once its pipe holds the byte it writes on success, or is closed without it.
+  void Input::reapBufferChildren(){
+    std::map<pid_t, bufferChild>::iterator it = bufferChildren.begin();
+    while (it != bufferChildren.end()){
+      //The exit code may already have been reaped by the signal handler, so the child reports success through its pipe
+      char done = 0;
+      int r = read(it->second.result, &done, 1);
+      if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+        ++it;
+        continue;
+      }
+      bool success = (r == 1 && done);
+      close(it->second.result);
+      if (!success){
+        WARN_MSG("Buffering in child process %d failed; its pages will be buffered when a viewer needs them", it->first);
+      }
+      for (std::map<unsigned int, unsigned int>::iterator pIt = it->second.pages.begin(); pIt != it->second.pages.end(); ++pIt){
+        char pageId[NAME_BUFFER_SIZE];
+        snprintf(pageId, NAME_BUFFER_SIZE, SHM_TRACK_DATA, streamName.c_str(), nProxy.trackMap[pIt->first], (unsigned long)pIt->second);
+        uint64_t pageSize = nProxy.pagesByTrack[pIt->first][pIt->second].dataSize;
+        if (!success){
+          //Remove whatever the child left behind
+          IPC::sharedPage toErase(pageId, pageSize, false, false);
+          toErase.master = true;
+          prefetched[pIt->first].erase(pIt->second);
+          continue;
+        }
+        //Finalize the page as if it was buffered here
+        nProxy.curPage[pIt->first].init(pageId, pageSize, false);
+        nProxy.curPageNum[pIt->first] = pIt->second;
+        bufferFinalize(pIt->first);
+        pageCounter[pIt->first][pIt->second] = 15;
       }
+      bufferChildren.erase(it++);
+    }
+  }
+
+  /// Waits up to the given amount of milliseconds for a child of bufferInChild to finish, then registers the pages of those that did.
+  void Input::waitBufferChildren(int ms){
+    std::vector<struct pollfd> fds;
+    for (std::map<pid_t, bufferChild>::iterator it = bufferChildren.begin(); it != bufferChildren.end(); ++it){
+      struct pollfd pfd;
+      pfd.fd = it->second.result;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      fds.push_back(pfd);
+    }
+    if (!fds.size()){
+      Util::sleep(ms);
+      return;
     }
+    poll(&fds[0], fds.size(), ms);
+    reapBufferChildren();
+  }
+
+  /// Returns true if the given page is being buffered by a child of bufferInChild.
+  bool Input::bufferingInChild(unsigned int track, unsigned int pageNum){
+    for (std::map<pid_t, bufferChild>::iterator it = bufferChildren.begin(); it != bufferChildren.end(); ++it){
+      if (it->second.pages.count(track) && it->second.pages[track] == pageNum){
+        return true;
+      }
+    }
+    return false;
   }
   
   void Input::callbackWrapper(char * data, size_t len, unsigned int id){    
@@ -61,8 +228,37 @@ namespace Mist {
     capa["optional"]["debug"]["help"] = "The debug level at which messages need to be printed.";
     capa["optional"]["debug"]["option"] = "--debug";
     capa["optional"]["debug"]["type"] = "debug";
+
+    option.null();
+    option["arg"] = "integer";
+    option["long"] = "prefetch";
+    option["short"] = "P";
+    option["help"] = "Amount of pages to buffer ahead of each viewer of a VoD stream";
+    option["value"].append(1LL);
+    config->addOption("prefetch", option);
+    capa["optional"]["prefetch"]["name"] = "Prefetch depth";
+    capa["optional"]["prefetch"]["help"] = "For VoD streams, how many pages of media ahead of where viewers are watching to have read from the source in the background, so they do not stall when reaching the next page. Zero only reads pages on demand.";
+    capa["optional"]["prefetch"]["option"] = "--prefetch";
+    capa["optional"]["prefetch"]["type"] = "uint";
+    capa["optional"]["prefetch"]["default"] = 1LL;
+
+    option.null();
+    option["arg"] = "integer";
+    option["long"] = "parallel";
+    option["short"] = "T";
+    option["help"] = "Amount of child processes buffering pages ahead of viewers at the same time, for VoD streams";
+    option["value"].append(4LL);
+    config->addOption("parallel", option);
+    capa["optional"]["parallel"]["name"] = "Parallel buffering";
+    capa["optional"]["parallel"]["help"] = "For VoD streams, how many child processes may buffer pages ahead of where viewers are watching at the same time, each with its own handle on the source. Zero only buffers pages on demand.";
+    capa["optional"]["parallel"]["option"] = "--parallel";
+    capa["optional"]["parallel"]["type"] = "uint";
+    capa["optional"]["parallel"]["default"] = 4LL;
     
     packTime = 0;
+    prefetchHits = 0;
+    demandStalls = 0;
+    inBufferChild = false;
     lastActive = Util::epoch();
     playing = 0;
     playUntil = 0;
@@ -85,6 +281,9 @@ namespace Mist {
     }
     //the same second is not enough - add a 15 second window where we consider it too old
     if (bufHeader.st_mtime < bufStream.st_mtime + 15) {
+      if (extendHeader()){
+        return;
+      }
       INFO_MSG("Overwriting outdated DTSH header file: %s ", headerFile.c_str());
       remove(headerFile.c_str());
     }
@@ -250,9 +449,7 @@ namespace Mist {
       //close file
       file.close();
       //create header
-      file.open((filename+".dtsh").c_str());
-      file << newMeta.toJSON().toNetPacked();
-      file.close();
+      newMeta.toFile(filename + ".dtsh");
     }else{
       DEBUG_MSG(DLVL_FAIL,"No filename specified, exiting");
     }
@@ -295,6 +492,8 @@ namespace Mist {
       //load pages for connected clients on request
       //through the callbackWrapper function
       userPage.parseEach(callbackWrapper);
+      //buffer the pages viewers will reach next
+      prefetchPages();
       //unload pages that haven't been used for a while
       removeUnused();
       //If users are connected and tracks exist, reset the activity counter
@@ -306,14 +505,31 @@ namespace Mist {
       }
       INSANE_MSG("Connected: %d users, %d total", userPage.connectedUsers, userPage.amount);
       //if not shutting down, wait 1 second before looping
+      //pages buffered in the background are registered as soon as they are done in the meantime
       if (config->is_active){
-        Util::wait(1000);
+        uint64_t waitUntil = Util::bootMS() + 1000;
+        while (bufferChildren.size() && Util::bootMS() < waitUntil){
+          waitBufferChildren(waitUntil - Util::bootMS());
+        }
+        Util::wait((int64_t)waitUntil - (int64_t)Util::bootMS());
       }
     }
+    //Give pages that are being buffered in the background a moment to finish, so none are left behind
+    uint64_t waitUntil = Util::bootMS() + 5000;
+    while (bufferChildren.size() && Util::bootMS() < waitUntil){
+      waitBufferChildren(waitUntil - Util::bootMS());
+    }
+    for (std::map<pid_t, bufferChild>::iterator it = bufferChildren.begin(); it != bufferChildren.end(); ++it){
+      kill(it->first, SIGKILL);
+    }
+    while (bufferChildren.size()){
+      waitBufferChildren(100);
+    }
     if (streamStatus){streamStatus.mapped[0] = STRMSTAT_SHUTDOWN;}
     config->is_active = false;
     finish();
     DEBUG_MSG(DLVL_DEVEL, "Input for stream %s closing clean", streamName.c_str());
+    INFO_MSG("Pages reached by viewers: %llu buffered ahead of demand, %llu buffered on demand", (unsigned long long)prefetchHits, (unsigned long long)demandStalls);
     userPage.finishEach();
     //end player functionality
   }
@@ -435,6 +651,15 @@ namespace Mist {
       for (std::map<unsigned long, IPC::sharedPage>::iterator it = nProxy.metaPages.begin(); it != nProxy.metaPages.end(); it++) {
         it->second.master = true;
       }
+      //Remove segments and indexes the outputs cached for this stream
+      IPC::sharedCache cache;
+      if (cache.init(streamName, 0, false)){
+        cache.wipe();
+      }
+      IPC::sharedCache indexCache;
+      if (indexCache.init(streamName, 0, false, CACHE_MP4_INDEX)){
+        indexCache.wipe();
+      }
     }
   }
 
@@ -449,13 +674,16 @@ namespace Mist {
         for (std::map<unsigned int, unsigned int>::iterator it2 = it->second.begin(); it2 != it->second.end(); it2++){
           if (!it2->second){
             bufferRemove(it->first, it2->first);
+            prefetched[it->first].erase(it2->first);
             pageCounter[it->first].erase(it2->first);
-            for (int i = 0; i < 8192; i += 8){
+            nProxy.startIndexWrite(it->first);
+            for (int i = 0; i < SHM_TRACK_INDEX_ENTRIES * 8; i += 8){
               unsigned int thisKeyNum = ntohl(((((long long int *)(nProxy.metaPages[it->first].mapped + i))[0]) >> 32) & 0xFFFFFFFF);
               if (thisKeyNum == it2->first){
                 (((long long int *)(nProxy.metaPages[it->first].mapped + i))[0]) = 0;
               }
             }
+            nProxy.endIndexWrite(it->first);
             change = true;
             break;
           }
@@ -612,45 +840,131 @@ namespace Mist {
       return false;
     }
     //Update keynum to point to the corresponding page
-    uint64_t bufferTimer = Util::bootMS();
     MEDIUM_MSG("Loading key %u from page %lu", keyNum, (--(nProxy.pagesByTrack[track].upper_bound(keyNum)))->first);
     keyNum = (--(nProxy.pagesByTrack[track].upper_bound(keyNum)))->first;
-    if (!bufferStart(track, keyNum)){
-      WARN_MSG("bufferStart failed! Cancelling bufferFrame");
-      return false;
+    if (bufferingInChild(track, keyNum)){
+      VERYHIGH_MSG("Track %u, page %u is being buffered in the background. Cancelling bufferFrame", track, keyNum);
+      return true;
+    }
+    std::map<unsigned int, unsigned int> pages;
+    pages[track] = keyNum;
+    addCoveredPages(track, keyNum, pages);
+    return bufferPages(pages);
+  }
+
+  /// Sets fromTime and untilTime to the time range of the given page, the end being exclusive.
+  void Input::pageWindow(unsigned int track, unsigned int pageNum, uint64_t & fromTime, uint64_t & untilTime){
+    DTSC::Track & trk = myMeta.tracks[track];
+    fromTime = trk.keys[pageNum - 1].getTime();
+    untilTime = trk.lastms + 1;
+    unsigned int nextKey = pageNum - 1 + nProxy.pagesByTrack[track][pageNum].keyNum;
+    if (trk.keys.size() > nextKey){
+      untilTime = trk.keys[nextKey].getTime();
+    }
+  }
+
+  /// Adds to pages, for every other track of the stream, the unbuffered page that overlaps in time with the given page.
+  /// In interleaved files these are stored in the same byte range, so bufferPages can fill them in the same read.
+  /// Tracks already in pages are left alone.
+  void Input::addCoveredPages(unsigned int track, unsigned int pageNum, std::map<unsigned int, unsigned int> & pages){
+    uint64_t fromTime, untilTime;
+    pageWindow(track, pageNum, fromTime, untilTime);
+    for (std::map<unsigned long, std::map<unsigned long, DTSCPageData> >::iterator it = nProxy.pagesByTrack.begin(); it != nProxy.pagesByTrack.end(); ++it){
+      if (pages.count(it->first) || !it->second.size() || !myMeta.tracks.count(it->first)){
+        continue;
+      }
+      //The page that holds fromTime, or the first page if the track starts later
+      std::map<unsigned long, DTSCPageData>::iterator pageIt = it->second.begin();
+      for (std::map<unsigned long, DTSCPageData>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2){
+        if (myMeta.tracks[it->first].keys[it2->first - 1].getTime() > fromTime){break;}
+        pageIt = it2;
+      }
+      uint64_t pageFrom, pageUntil;
+      pageWindow(it->first, pageIt->first, pageFrom, pageUntil);
+      if (pageFrom >= untilTime || pageUntil <= fromTime || nProxy.isBuffered(it->first, pageIt->first) || bufferingInChild(it->first, pageIt->first)){
+        continue;
+      }
+      pages[it->first] = pageIt->first;
     }
+  }
 
+  /// Buffers the given pages, mapped from track to page number, in a single pass over the source.
+  /// The source is read from the earliest start to the latest end of the pages, and every packet is
+  /// stored on the page of its own track if it falls within that page's time range.
+  /// \return True if all pages could be started.
+  bool Input::bufferPages(const std::map<unsigned int, unsigned int> & pages){
+    uint64_t bufferTimer = Util::bootMS();
+    bool allStarted = true;
+    std::map<unsigned int, std::pair<uint64_t, uint64_t> > windows;
     std::stringstream trackSpec;
-    trackSpec << track;
-    trackSelect(trackSpec.str());
-    seek(myMeta.tracks[track].keys[keyNum - 1].getTime());
-    long long unsigned int stopTime = myMeta.tracks[track].lastms + 1;
-    if ((int)myMeta.tracks[track].keys.size() > keyNum - 1 + nProxy.pagesByTrack[track][keyNum].keyNum) {
-      stopTime = myMeta.tracks[track].keys[keyNum - 1 + nProxy.pagesByTrack[track][keyNum].keyNum].getTime();
+    uint64_t fromTime = 0xFFFFFFFFFFFFFFFFull;
+    uint64_t untilTime = 0;
+    uint64_t fromPos = 0xFFFFFFFFFFFFFFFFull;
+    uint64_t toPos = 0;
+    bool toEnd = false;
+    for (std::map<unsigned int, unsigned int>::const_iterator it = pages.begin(); it != pages.end(); ++it){
+      if (!bufferStart(it->first, it->second)){
+        WARN_MSG("bufferStart failed for track %u, page %u! Cancelling buffering of this page", it->first, it->second);
+        allStarted = false;
+        continue;
+      }
+      pageWindow(it->first, it->second, windows[it->first].first, windows[it->first].second);
+      fromTime = std::min(fromTime, windows[it->first].first);
+      untilTime = std::max(untilTime, windows[it->first].second);
+      if (trackSpec.str().size()){trackSpec << " ";}
+      trackSpec << it->first;
+      //The source may read ahead: the rest of this page, and all of the next one
+      std::deque<DTSC::Key> & keys = myMeta.tracks[it->first].keys;
+      std::map<unsigned long, DTSCPageData>::iterator nextPage = nProxy.pagesByTrack[it->first].upper_bound(it->second);
+      unsigned long endKey = keys.size() + 1;
+      if (nextPage != nProxy.pagesByTrack[it->first].end()){
+        endKey = nextPage->first + nextPage->second.keyNum;
+      }
+      fromPos = std::min(fromPos, (uint64_t)keys[it->second - 1].getBpos());
+      if (endKey <= keys.size()){
+        toPos = std::max(toPos, (uint64_t)keys[endKey - 1].getBpos());
+      }else{
+        toEnd = true;
+      }
     }
-    HIGH_MSG("Playing from %llu to %llu", myMeta.tracks[track].keys[keyNum - 1].getTime(), stopTime);
-    getNext();
-    //in case earlier seeking was inprecise, seek to the exact point
-    while (thisPacket && thisPacket.getTime() < (unsigned long long)myMeta.tracks[track].keys[keyNum - 1].getTime()){
-      getNext();
+    if (!windows.size()){
+      return false;
     }
-    uint64_t lastBuffered = 0;
-    uint64_t packCounter = 0;
-    uint64_t byteCounter = 0;
-    while (thisPacket && thisPacket.getTime() < stopTime) {
-      if (thisPacket.getTime() >= lastBuffered){
+    if (toEnd){toPos = 0;}
+
+    trackSelect(trackSpec.str());
+    seek(fromTime);
+    if (fromPos || toPos){
+      prefetch(fromPos, toPos);
+    }
+    HIGH_MSG("Playing from %llu to %llu for tracks %s", fromTime, untilTime, trackSpec.str().c_str());
+    std::map<unsigned int, uint64_t> lastBuffered;
+    std::map<unsigned int, uint64_t> packCounter;
+    std::map<unsigned int, uint64_t> byteCounter;
+    getNext();
+    while (thisPacket && thisPacket.getTime() < untilTime) {
+      unsigned int tid = thisPacket.getTrackId();
+      uint64_t packTime = thisPacket.getTime();
+      //Skip packets outside their own page, which includes any read before an inprecise seek point
+      if (windows.count(tid) && packTime >= windows[tid].first && packTime < windows[tid].second && packTime >= lastBuffered[tid]){
         bufferNext(thisPacket);
-        ++packCounter;
-        byteCounter += thisPacket.getDataLen();
-        lastBuffered = thisPacket.getTime();
+        ++packCounter[tid];
+        byteCounter[tid] += thisPacket.getDataLen();
+        lastBuffered[tid] = packTime;
       }
       getNext();
     }
-    bufferFinalize(track);
     bufferTimer = Util::bootMS() - bufferTimer;
-    DEBUG_MSG(DLVL_DEVEL, "Done buffering page %d (%llu packets, %llu bytes, %llu-%llums) for track %d (%s) in %llums", keyNum, packCounter, byteCounter, myMeta.tracks[track].keys[keyNum - 1].getTime(), stopTime, track, myMeta.tracks[track].codec.c_str(), bufferTimer);
-    pageCounter[track][keyNum] = 15;
-    return true;
+    for (std::map<unsigned int, std::pair<uint64_t, uint64_t> >::iterator it = windows.begin(); it != windows.end(); ++it){
+      unsigned int pageNum = pages.find(it->first)->second;
+      //Children of bufferInChild leave registering the page to the parent
+      if (!inBufferChild){
+        bufferFinalize(it->first);
+      }
+      DEBUG_MSG(DLVL_DEVEL, "Done buffering page %u (%llu packets, %llu bytes, %llu-%llums) for track %u (%s) in %llums", pageNum, packCounter[it->first], byteCounter[it->first], it->second.first, it->second.second, it->first, myMeta.tracks[it->first].codec.c_str(), bufferTimer);
+      pageCounter[it->first][pageNum] = 15;
+    }
+    return allStarted;
   }
   
   bool Input::atKeyFrame(){
@@ -687,15 +1001,15 @@ namespace Mist {
   }
 
   bool Input::readExistingHeader(){
-    DTSC::File tmpdtsh(config->getString("input") + ".dtsh");
-    if (!tmpdtsh){
+    if (!myMeta.fromFile(config->getString("input") + ".dtsh")){
+      myMeta = DTSC::Meta();
       return false;
     }
-    if (tmpdtsh.getMeta().version != DTSH_VERSION){
-      INFO_MSG("Updating wrong version header file from version %llu to %llu", tmpdtsh.getMeta().version, DTSH_VERSION);
+    if (myMeta.version != DTSH_VERSION){
+      INFO_MSG("Updating wrong version header file from version %llu to %llu", (unsigned long long)myMeta.version, (unsigned long long)DTSH_VERSION);
+      myMeta = DTSC::Meta();
       return false;
     }
-    myMeta = tmpdtsh.getMeta();
     return true;
   }
 
@@ -16,6 +16,12 @@ namespace Mist {
     int curPart;
   };
 
+  /// A child process buffering pages in the background, see Input::bufferInChild.
+  struct bufferChild {
+    std::map<unsigned int, unsigned int> pages;///< Track and page numbers the child fills
+    int result;///< Read end of a pipe the child writes a byte to once all of its pages are filled
+  };
+
   class Input : public InOutBase {
     public:
       Input(Util::Config * cfg);
@@ -29,12 +35,15 @@ namespace Mist {
       static void callbackWrapper(char * data, size_t len, unsigned int id);
       virtual bool checkArguments() = 0;
       virtual bool readHeader() = 0;
+      virtual bool extendHeader(){return false;}
       virtual bool needHeader(){return !readExistingHeader();}
       virtual bool preRun(){return true;}
+      virtual bool reopenSource(){return preRun();}
       virtual bool readExistingHeader();
       virtual bool atKeyFrame();
       virtual void getNext(bool smart = true) {}
       virtual void seek(int seekTime){};
+      virtual void prefetch(uint64_t fromPos, uint64_t toPos){}
       virtual void finish();
       virtual bool keepRunning();
       virtual bool openStreamSource() { return false; }
@@ -47,6 +56,7 @@ namespace Mist {
       virtual void removeUnused();
       virtual void trackSelect(std::string trackSpec){};
       virtual void userCallback(char * data, size_t len, unsigned int id);
+      void prefetchPages();
       virtual void convert();
       virtual void serve();
       virtual void stream();
@@ -55,6 +65,13 @@ namespace Mist {
 
       virtual void parseHeader();
       bool bufferFrame(unsigned int track, unsigned int keyNum);
+      bool bufferPages(const std::map<unsigned int, unsigned int> & pages);
+      void pageWindow(unsigned int track, unsigned int pageNum, uint64_t & fromTime, uint64_t & untilTime);
+      void addCoveredPages(unsigned int track, unsigned int pageNum, std::map<unsigned int, unsigned int> & pages);
+      bool bufferInChild(const std::map<unsigned int, unsigned int> & pages);
+      void reapBufferChildren();
+      void waitBufferChildren(int ms);
+      bool bufferingInChild(unsigned int track, unsigned int pageNum);
 
       unsigned int packTime;///Media-timestamp of the last packet.
       int lastActive;///Timestamp of the last time we received or sent something.
@@ -75,6 +92,13 @@ namespace Mist {
 
       std::map<unsigned int, std::map<unsigned int, unsigned int> > pageCounter;
 
+      std::set<std::pair<unsigned int, unsigned int> > prefetchWanted;///< Track and page numbers viewers will reach soon, see prefetchPages
+      std::map<unsigned int, std::set<unsigned int> > prefetched;///< Per track, pages buffered ahead of demand that no viewer has reached yet
+      uint64_t prefetchHits;///< Times a viewer reached a page that was already buffered ahead of demand
+      uint64_t demandStalls;///< Times a viewer reached a page that was not buffered yet
+      std::map<pid_t, bufferChild> bufferChildren;///< Child processes buffering pages in the background
+      bool inBufferChild;///< True in a child process of bufferInChild
+
       static Input * singleton;
   };
 
@@ -76,7 +76,7 @@ namespace Mist {
           continue;
       }
         //First detect all entries on metaPage
-        for (int i = 0; i < 8192; i += 8) {
+        for (int i = 0; i < SHM_TRACK_INDEX_ENTRIES * 8; i += 8) {
           char * tmpOffset = nProxy.metaPages[it->first].mapped + i;
           if (Bit::btohl(tmpOffset) == 0 && Bit::btohl(tmpOffset+4) == 0) {
             continue;
@@ -103,6 +103,15 @@ namespace Mist {
       delete liveMeta;
       liveMeta = 0;
     }
+    //Remove segments and indexes the outputs cached for this stream
+    IPC::sharedCache cache;
+    if (cache.init(config->getString("streamname"), 0, false)){
+      cache.wipe();
+    }
+    IPC::sharedCache indexCache;
+    if (indexCache.init(config->getString("streamname"), 0, false, CACHE_MP4_INDEX)){
+      indexCache.wipe();
+    }
   }
 
 
@@ -145,7 +154,7 @@ namespace Mist {
       indexPage.master = true;
       if (indexPage.mapped){
         char * mappedPointer = indexPage.mapped;
-        for (int j = 0; j < 8192; j += 8) {
+        for (int j = 0; j < SHM_TRACK_INDEX_ENTRIES * 8; j += 8) {
           char * tmpOffset = mappedPointer + j;
           if (Bit::btohl(tmpOffset) == 0 && Bit::btohl(tmpOffset+4) == 0){
             continue;
@@ -205,8 +214,18 @@ namespace Mist {
       nProxy.metaPages[0].init(pageName, DEFAULT_STRM_PAGE_SIZE,  true);
       nProxy.metaPages[0].master = false;
     }
+    unsigned int sendLen = myMeta.getSendLen();
+    if (nProxy.metaPages[0].len < SHM_STREAM_GENERATION + 8 || sendLen + 4 > SHM_STREAM_GENERATION){
+      WARN_MSG("Metadata for %s does not fit on its page (%u bytes), not updating", streamName.c_str(), sendLen);
+      liveMeta->post();
+      return;
+    }
+    //Outputs copy the metadata without locking, and retry whenever the generation changed while they were copying
+    IPC::generation metaGen(nProxy.metaPages[0].mapped + SHM_STREAM_GENERATION);
+    metaGen.startWrite();
     myMeta.writeTo(nProxy.metaPages[0].mapped);
-    memset(nProxy.metaPages[0].mapped + myMeta.getSendLen(), 0, (nProxy.metaPages[0].len > myMeta.getSendLen() ? std::min(nProxy.metaPages[0].len - myMeta.getSendLen(), 4ll) : 0));
+    memset(nProxy.metaPages[0].mapped + sendLen, 0, 4);
+    metaGen.endWrite();
     liveMeta->post();
   }
 
@@ -643,7 +662,7 @@ namespace Mist {
     VERYHIGH_MSG("Updating meta for track %lu, %lu pages", tNum, locations.size());
 
     //First detect all entries on metaPage
-    for (int i = 0; i < 8192; i += 8) {
+    for (int i = 0; i < SHM_TRACK_INDEX_ENTRIES * 8; i += 8) {
       char * tmpOffset = mappedPointer + i;
       if (Bit::btohl(tmpOffset) == 0 && Bit::btohl(tmpOffset+4) == 0) {
         continue;
@@ -17,6 +17,11 @@ namespace Mist {
       void getNext(bool smart = true);
       void seek(int seekTime);
       void trackSelect(std::string trackSpec);
+      void prefetch(uint64_t fromPos, uint64_t toPos){inFile.prefetch(fromPos, toPos);}
+      bool reopenSource(){
+        inFile = DTSC::File(config->getString("input"));
+        return inFile;
+      }
 
       DTSC::File inFile;
 
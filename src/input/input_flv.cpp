@@ -11,9 +11,14 @@
 #include <mist/util.h>
 #include <mist/stream.h>
 #include <mist/defines.h>
+#include <mist/bitfields.h>
+#include <mist/tinythread.h>
 
 #include "input_flv.h"
 
+/// Minimum amount of bytes per chunk when scanning an FLV file in parallel
+#define FLV_SCAN_CHUNK (32 * 1024 * 1024)
+
 namespace Mist {
   inputFLV::inputFLV(Util::Config * cfg) : Input(cfg) {
     capa["name"] = "FLV";
@@ -48,10 +53,10 @@ namespace Mist {
     
   bool inputFLV::preRun() {
     //open File
-    inFile = fopen(config->getString("input").c_str(), "r");
-    if (!inFile) {
+    if (!inFile.open(config->getString("input"))) {
       return false;
     }
+    filePos = 0;
     struct stat statData;
     lastModTime = 0;
     if (stat(config->getString("input").c_str(), &statData) != -1){
@@ -76,50 +81,215 @@ namespace Mist {
     return Input::keepRunning();
   }
 
+  /// Loads the next tag at filePos into tmpTag, straight from the file mapping.
+  /// \return True if a whole tag was loaded, false at the end of the file or on a parse error.
+  bool inputFLV::loadTag(){
+    while (filePos < inFile.size() && !FLV::Parse_Error){
+      //MemLoader works with 32-bit positions, so hand it the file from the current position on
+      unsigned int P = 0;
+      unsigned int S = (inFile.size() - filePos > 0x7FFFFFFFull) ? 0x7FFFFFFF : (inFile.size() - filePos);
+      bool loaded = tmpTag.MemLoader(inFile.data() + filePos, S, P);
+      filePos += P;
+      if (loaded){return true;}
+    }
+    return false;
+  }
+
+  /// Hints the kernel to start reading the given byte range of the file.
+  void inputFLV::prefetch(uint64_t fromPos, uint64_t toPos){
+    inFile.willNeed(fromPos, toPos > fromPos ? toPos - fromPos : 0);
+  }
+
   bool inputFLV::readHeader() {
     if (!inFile){return false;}
     //Create header file from FLV data
-    Util::fseek(inFile, 13, SEEK_SET);
-    AMF::Object amf_storage;
-    long long int lastBytePos = 13;
     uint64_t bench = Util::getMicros();
-    while (!feof(inFile) && !FLV::Parse_Error){
-      if (tmpTag.FileLoader(inFile)){
-        tmpTag.toMeta(myMeta, amf_storage);
-        if (!tmpTag.getDataLen()){continue;}
-        if (tmpTag.needsInitData() && tmpTag.isInitData()){continue;}
-        myMeta.update(tmpTag.tagTime(), tmpTag.offset(), tmpTag.getTrackID(), tmpTag.getDataLen(), lastBytePos, tmpTag.isKeyframe);
-        lastBytePos = Util::ftell(inFile);
-      }
+    myMeta.sourceSize = scanTags(13);
+    bench = Util::getMicros(bench);
+    INFO_MSG("Header generated in %llu ms: @%lld, %s, %s", bench/1000, myMeta.sourceSize, myMeta.vod?"VoD":"NOVoD", myMeta.live?"Live":"NOLive");
+    myMeta.toFile(config->getString("input") + ".dtsh");
+    return true;
+  }
+
+  /// Extends the existing header when the file only grew since it was written, such as for a recording in progress.
+  /// Only the part of the file after the last tag in the header is scanned.
+  /// \return False if there is no usable header to extend, or the file no longer matches it.
+  bool inputFLV::extendHeader() {
+    if (!inFile || !readExistingHeader()){return false;}
+    uint64_t oldSize = myMeta.sourceSize;
+    bool matches = (myMeta.vod && oldSize >= 13 && oldSize <= inFile.size());
+    //The header must still end right after a tag, and every track's last key must still start on a tag
+    if (matches && oldSize > 13){
+      uint64_t lastTag = Bit::btohl(inFile.data() + oldSize - 4);
+      matches = (lastTag + 4 <= oldSize && FLV::isTagStart(inFile.data(), oldSize, oldSize - 4 - lastTag));
+    }
+    for (std::map<unsigned int, DTSC::Track>::iterator it = myMeta.tracks.begin(); matches && it != myMeta.tracks.end(); ++it){
+      matches = (!it->second.keys.size() || FLV::isTagStart(inFile.data(), inFile.size(), it->second.keys.rbegin()->getBpos()));
+    }
+    if (!matches){
+      myMeta = DTSC::Meta();
+      return false;
     }
+    uint64_t bench = Util::getMicros();
+    myMeta.sourceSize = scanTags(oldSize);
     bench = Util::getMicros(bench);
-    INFO_MSG("Header generated in %llu ms: @%lld, %s, %s", bench/1000, lastBytePos, myMeta.vod?"VoD":"NOVoD", myMeta.live?"Live":"NOLive");
+    INFO_MSG("Header extended from %llu to %llu bytes in %llu ms", oldSize, myMeta.sourceSize, bench/1000);
+    myMeta.toFile(config->getString("input") + ".dtsh");
+    return true;
+  }
+
+  /// Scans the tags of one part of the file into an flvChunk, for scanTags.
+  /// Only reads the file mapping and the chunk itself, so chunks can be scanned in parallel.
+  void inputFLV::scanChunk(void * chunk){
+    flvChunk & C = *(flvChunk*)chunk;
+    uint64_t pos = C.from;
+    C.stopped = false;
+    if (!C.exact && !FLV::findTagStart(C.data, C.size, pos)){
+      pos = C.size;
+    }
+    C.firstPos = pos;
+    FLV::Tag tag;
+    std::set<char> seenTypes;
+    char lastAudio = 0;
+    while (pos < C.until){
+      //MemLoader writes FLV::Parse_Error, FLV::Error_Str and FLV::Header, which are shared by all threads.
+      //Those cases are handled here first, so MemLoader only ever sees a valid tag header.
+      if (C.size - pos < 11){
+        C.stopped = true;
+        break;
+      }
+      if (FLV::is_header((char*)C.data + pos)){
+        //Not stopped: scanTags continues from nextPos in its single-threaded pass
+        break;
+      }
+      if ((unsigned char)C.data[pos] > 0x12){
+        C.stopped = true;
+        C.error = "Invalid Tag received.";
+        break;
+      }
+      uint64_t tagStart = pos;
+      bool loaded = false;
+      while (!loaded && pos < C.size){
+        unsigned int P = 0;
+        unsigned int S = (C.size - pos > 0x7FFFFFFFull) ? 0x7FFFFFFF : (C.size - pos);
+        loaded = tag.MemLoader((char*)C.data + pos, S, P);
+        pos += P;
+        if (!P){break;}
+      }
+      if (!loaded){
+        C.stopped = true;
+        break;
+      }
+      flvTagInfo T;
+      T.start = tagStart;
+      T.end = pos;
+      T.time = tag.tagTime();
+      T.offset = tag.offset();
+      T.dataLen = tag.getDataLen();
+      T.trackID = tag.getTrackID();
+      T.keyframe = tag.isKeyframe;
+      bool isInit = tag.needsInitData() && tag.isInitData();
+      T.counted = T.dataLen && !isInit;
+      //toMeta only acts on metadata, init data, the first tag of a track and audio tags that change format
+      T.toMeta = isInit || tag.data[0] == 0x12 || !seenTypes.count(tag.data[0]) || (tag.data[0] == 0x08 && tag.data[11] != lastAudio);
+      seenTypes.insert(tag.data[0]);
+      if (tag.data[0] == 0x08){lastAudio = tag.data[11];}
+      C.tags.push_back(T);
+    }
+    C.nextPos = pos;
+  }
+
+  /// Adds all tags from startPos until the end of the file to myMeta.
+  /// Large files are split in chunks that are scanned in parallel threads, then merged in file order.
+  /// \return The position right after the last tag added, which is where a later extendHeader continues.
+  uint64_t inputFLV::scanTags(uint64_t startPos){
+    //The whole file is read once, front to back
+    inFile.setSequential(true);
+    filePos = startPos;
+    AMF::Object amf_storage;
+    long long int lastBytePos = startPos;
+    uint64_t chunkCount = 0;
+    if (inFile.size() > startPos){
+      chunkCount = std::min((uint64_t)tthread::thread::hardware_concurrency(), (inFile.size() - startPos) / FLV_SCAN_CHUNK);
+    }
+    if (chunkCount > 1){
+      std::deque<flvChunk> chunks(chunkCount);
+      std::deque<tthread::thread *> threads;
+      uint64_t chunkLen = (inFile.size() - startPos) / chunkCount;
+      for (unsigned int i = 0; i < chunkCount; ++i){
+        chunks[i].data = inFile.data();
+        chunks[i].size = inFile.size();
+        chunks[i].from = startPos + i * chunkLen;
+        chunks[i].until = (i == chunkCount - 1) ? inFile.size() : chunks[i].from + chunkLen;
+        chunks[i].exact = !i;
+        threads.push_back(new tthread::thread(scanChunk, &chunks[i]));
+      }
+      for (unsigned int i = 0; i < chunkCount; ++i){
+        threads[i]->join();
+        delete threads[i];
+      }
+      for (unsigned int i = 0; i < chunkCount; ++i){
+        flvChunk & C = chunks[i];
+        if (C.firstPos != filePos){
+          WARN_MSG("Header scan chunk %u starts at %llu instead of %llu; scanning the remainder in one pass", i, C.firstPos, filePos);
+          break;
+        }
+        for (std::deque<flvTagInfo>::iterator it = C.tags.begin(); it != C.tags.end(); ++it){
+          if (it->toMeta){
+            filePos = it->start;
+            loadTag();
+            tmpTag.toMeta(myMeta, amf_storage);
+          }
+          if (it->counted){
+            myMeta.update(it->time, it->offset, it->trackID, it->dataLen, lastBytePos, it->keyframe);
+            lastBytePos = it->end;
+          }
+        }
+        filePos = C.nextPos;
+        if (C.stopped){
+          if (C.error.size()){
+            ERROR_MSG("Stopping at FLV parse error @%lld: %s", lastBytePos, C.error.c_str());
+          }
+          inFile.setSequential(false);
+          return lastBytePos;
+        }
+        C.tags.clear();
+      }
+      MEDIUM_MSG("Scanned %llu bytes in %llu chunks", inFile.size() - startPos, chunkCount);
+    }
+    //Anything not covered by chunks is scanned here, tag by tag
+    while (loadTag()){
+      tmpTag.toMeta(myMeta, amf_storage);
+      if (!tmpTag.getDataLen()){continue;}
+      if (tmpTag.needsInitData() && tmpTag.isInitData()){continue;}
+      myMeta.update(tmpTag.tagTime(), tmpTag.offset(), tmpTag.getTrackID(), tmpTag.getDataLen(), lastBytePos, tmpTag.isKeyframe);
+      lastBytePos = filePos;
+    }
+    inFile.setSequential(false);
     if (FLV::Parse_Error){
       FLV::Parse_Error = false;
       ERROR_MSG("Stopping at FLV parse error @%lld: %s", lastBytePos, FLV::Error_Str.c_str());
     }
-    myMeta.toFile(config->getString("input") + ".dtsh");
-    return true;
+    return lastBytePos;
   }
   
   void inputFLV::getNext(bool smart) {
-    long long int lastBytePos = Util::ftell(inFile);
     if (selectedTracks.size() == 1){
       uint8_t targetTag = 0x08;
       if (selectedTracks.count(1)){targetTag = 0x09;}
       if (selectedTracks.count(3)){targetTag = 0x12;}
-      FLV::seekToTagType(inFile, targetTag);
+      FLV::seekToTagType(inFile.data(), inFile.size(), filePos, targetTag);
     }
-    while (!feof(inFile) && !FLV::Parse_Error){
-      if (tmpTag.FileLoader(inFile)){
-        if ( !selectedTracks.count(tmpTag.getTrackID())){
-          lastBytePos = Util::ftell(inFile);
-          continue;
-        }
-        break;
+    long long int lastBytePos = filePos;
+    bool loaded = false;
+    while ((loaded = loadTag())){
+      if ( !selectedTracks.count(tmpTag.getTrackID())){
+        lastBytePos = filePos;
+        continue;
       }
+      break;
     }
-    if (feof(inFile)){
+    if (!loaded && !FLV::Parse_Error){
       thisPacket.null();
       return;
     }
@@ -158,7 +328,7 @@ namespace Mist {
       }
       seekPos = myMeta.tracks[trackSeek].keys[i].getBpos();
     }
-    Util::fseek(inFile, seekPos, SEEK_SET);
+    filePos = seekPos;
   }
 
   void inputFLV::trackSelect(std::string trackSpec) {
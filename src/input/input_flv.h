@@ -1,8 +1,37 @@
 #include "input.h"
 #include <mist/dtsc.h>
 #include <mist/flv_tag.h>
+#include <mist/util.h>
+#include <deque>
 
 namespace Mist {
+  /// Properties of a single tag, as found while scanning an FLV file for its header.
+  struct flvTagInfo {
+    uint64_t start;///< Byte position of the tag
+    uint64_t end;///< Byte position right after the tag
+    unsigned int time;
+    int offset;
+    unsigned int dataLen;
+    unsigned int trackID;
+    bool keyframe;
+    bool counted;///< True if the tag is added to the header as a packet
+    bool toMeta;///< True if the tag may change track properties, so it must be passed through FLV::Tag::toMeta
+  };
+
+  /// The tags in one part of an FLV file, scanned by scanChunk.
+  struct flvChunk {
+    const char * data;///< The whole file
+    uint64_t size;///< Size of the whole file
+    uint64_t from;///< Position to start scanning at, searching for a tag boundary unless exact is set
+    uint64_t until;///< Position at which no more tags are started
+    bool exact;///< True if from is known to be a tag boundary
+    uint64_t firstPos;///< Position of the first tag found
+    uint64_t nextPos;///< Position after the last tag scanned
+    bool stopped;///< True if scanning ended before until, because of a parse error or a truncated tag
+    std::string error;///< The parse error, if any
+    std::deque<flvTagInfo> tags;
+  };
+
   class inputFLV : public Input {
     public:
       inputFLV(Util::Config * cfg);
@@ -11,13 +40,19 @@ namespace Mist {
       bool checkArguments();
       bool preRun();
       bool readHeader();
+      bool extendHeader();
+      uint64_t scanTags(uint64_t startPos);
+      static void scanChunk(void * chunk);
       void getNext(bool smart = true);
       void seek(int seekTime);
       void trackSelect(std::string trackSpec);
       bool keepRunning();
+      void prefetch(uint64_t fromPos, uint64_t toPos);
+      bool loadTag();
       FLV::Tag tmpTag;
       uint64_t lastModTime;
-      FILE * inFile;
+      Util::MappedFile inFile;
+      uint64_t filePos;///< Read position in inFile
   };
 }
 
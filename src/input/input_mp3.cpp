@@ -42,33 +42,38 @@ namespace Mist {
     
   bool inputMP3::preRun() {
     //open File
-    inFile = fopen(config->getString("input").c_str(), "r");
-    if (!inFile) {
+    if (!inFile.open(config->getString("input"))) {
       return false;
     }
+    filePos = 0;
     return true;
   }
 
+  /// Hints the kernel to start reading the given byte range of the file.
+  void inputMP3::prefetch(uint64_t fromPos, uint64_t toPos){
+    inFile.willNeed(fromPos, toPos > fromPos ? toPos - fromPos : 0);
+  }
+
   bool inputMP3::readHeader() {
     if (!inFile){return false;}
     myMeta = DTSC::Meta();
     myMeta.tracks[1].trackID = 1;
     myMeta.tracks[1].type = "audio";
     myMeta.tracks[1].codec = "MP3";
+    if (inFile.size() < 14){return false;}
+    //The whole file is read once, front to back
+    inFile.setSequential(true);
     //Create header file from MP3 data
-    char header[10];
-    fread(header, 10, 1, inFile);//Read a 10 byte header
+    const char * header = inFile.data();
+    filePos = 0;
     if (header[0] == 'I' || header[1] == 'D' || header[2] == '3'){
       size_t id3size = (((int)header[6] & 0x7F) << 21) | (((int)header[7] & 0x7F) << 14) | (((int)header[8] & 0x7F) << 7) | (header[9] & 0x7F) + 10 + ((header[5] & 0x10) ? 10 : 0);
       INFO_MSG("id3 size: %lu bytes", id3size);
-      fseek(inFile, id3size, SEEK_SET);
-    }else{
-      fseek(inFile, 0, SEEK_SET);
+      filePos = id3size;
     }
     //Read the first mp3 header for bitrate and such
-    size_t filePos = ftell(inFile);
-    fread(header, 4, 1, inFile);
-    fseek(inFile, filePos, SEEK_SET);
+    if (filePos + 4 > inFile.size()){return false;}
+    header = inFile.data() + filePos;
 
     //mpeg version is on the bits 0x18 of header[1], but only 0x08 is important --> 0 is version 2, 1 is version 1
     //leads to 2 - value == version, -1 to get the right index for the array
@@ -84,7 +89,8 @@ namespace Mist {
       getNext();
     }
 
-    fseek(inFile, 0, SEEK_SET);
+    inFile.setSequential(false);
+    filePos = 0;
     timestamp = 0;
     myMeta.toFile(config->getString("input") + ".dtsh");
     return true;
@@ -92,33 +98,27 @@ namespace Mist {
   
   void inputMP3::getNext(bool smart) {
     thisPacket.null();
-    static char packHeader[3000];
-    size_t filePos = ftell(inFile);
-    size_t read = fread(packHeader, 1, 3000, inFile);
-    if (!read) {
+    if (filePos + 4 > inFile.size()) {
       return;
     }
+    const unsigned char * packHeader = (const unsigned char *)inFile.data() + filePos;
     if (packHeader[0] != 0xFF || (packHeader[1] & 0xE0) != 0xE0){
-      //Find the first occurence of sync byte
-      char* i = (char*)memchr(packHeader, (char)0xFF, read);
-      if (!i) {
-        return;
+      //Find the first occurence of sync byte within the next 3000 bytes
+      size_t read = inFile.size() - filePos;
+      if (read > 3000){read = 3000;}
+      const unsigned char * i = packHeader;
+      while ((i = (const unsigned char *)memchr(i, 0xFF, read - (i - packHeader) - 1)) && (i[1] & 0xE0) != 0xE0){
+        ++i;
       }
-      size_t offset = i - packHeader;
-      while (offset && (i[1] & 0xE0) != 0xE0){
-        i = (char*)memchr(i + 1, (char)0xFF, read - (offset + 1));
-        if (!i) {
-          offset = 0;
-          break;
-        }
+      if (!i){
+        DEBUG_MSG(DLVL_FAIL, "Sync byte not found from offset %lu", (unsigned long)filePos);
+        return;
       }
-      if (!offset){
-        DEBUG_MSG(DLVL_FAIL, "Sync byte not found from offset %lu", filePos);
+      filePos += i - packHeader;
+      packHeader = i;
+      if (filePos + 4 > inFile.size()) {
         return;
       }
-      filePos += offset;
-      fseek(inFile, filePos, SEEK_SET);
-      read = fread(packHeader, 1, 3000, inFile);
     }
     //We now have a sync byte for sure
 
@@ -146,21 +146,13 @@ namespace Mist {
     }
 
 
-    if (!dataSize){
+    if (!dataSize || filePos + dataSize > inFile.size()){
       return;
     }
-    fseek(inFile, filePos + dataSize, SEEK_SET);
 
-    //Create a json value with the right data
-    static JSON::Value thisPack;
-    thisPack.null();
-    thisPack["trackid"] = 1;
-    thisPack["bpos"] = (long long)filePos;
-    thisPack["data"] = std::string(packHeader, dataSize);
-    thisPack["time"] = (long long)timestamp;
-    //Write the json value to lastpack
-    std::string tmpStr = thisPack.toNetPacked();
-    thisPacket.reInit(tmpStr.data(), tmpStr.size());
+    //Fill the packet straight from the mapped file
+    thisPacket.genericFill((long long)timestamp, 0, 1, (const char *)packHeader, dataSize, filePos, false);
+    filePos += dataSize;
 
 
     //Update the internal timestamp
@@ -178,7 +170,7 @@ namespace Mist {
       timestamp = keys[i].getTime();
     }
     timestamp = seekTime;
-    fseek(inFile, seekPos, SEEK_SET);
+    filePos = seekPos;
   }
 
   void inputMP3::trackSelect(std::string trackSpec) {
@@ -1,5 +1,6 @@
 #include "input.h"
 #include <mist/dtsc.h>
+#include <mist/util.h>
 #include <deque>
 
 namespace Mist {
@@ -22,9 +23,11 @@ namespace Mist {
       void getNext(bool smart = true);
       void seek(int seekTime);
       void trackSelect(std::string trackSpec);
+      void prefetch(uint64_t fromPos, uint64_t toPos);
       double timestamp;
 
-      FILE * inFile;
+      Util::MappedFile inFile;
+      uint64_t filePos;///< Read position in inFile
   };
 }
 
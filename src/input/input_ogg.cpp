@@ -10,6 +10,7 @@
 #include <mist/defines.h>
 #include <mist/bitstream.h>
 #include <mist/opus.h>
+#include <mist/util.h>
 #include "input_ogg.h"
 
 ///\todo Whar be Opus support?
@@ -413,6 +414,11 @@ namespace Mist {
     }  
   #endif 
 
+  /// Hints the kernel to start reading the given byte range of the file in the background.
+  void inputOGG::prefetch(uint64_t fromPos, uint64_t toPos){
+    Util::prefetch(inFile, fromPos, toPos > fromPos ? toPos - fromPos : 0);
+  }
+
   void inputOGG::seek(int seekTime){
     currentPositions.clear();
     DEBUG_MSG(DLVL_MEDIUM, "Seeking to %dms", seekTime);
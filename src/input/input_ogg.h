@@ -77,6 +77,7 @@ namespace Mist {
       void getNext(bool smart = true);
       void seek(int seekTime);
       void trackSelect(std::string trackSpec);
+      void prefetch(uint64_t fromPos, uint64_t toPos);
 
       void parseBeginOfStream(OGG::Page & bosPage);
       std::set<position> currentPositions;
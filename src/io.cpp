@@ -25,7 +25,14 @@ namespace Mist {
     nProxy.metaPages[0].master = false;
 
     //Write the metadata to the page
-    myMeta.writeTo(nProxy.metaPages[0].mapped);
+    if (myMeta.live && nProxy.metaPages[0].len >= SHM_STREAM_GENERATION + 8){
+      IPC::generation metaGen(nProxy.metaPages[0].mapped + SHM_STREAM_GENERATION);
+      metaGen.startWrite();
+      myMeta.writeTo(nProxy.metaPages[0].mapped);
+      metaGen.endWrite();
+    }else{
+      myMeta.writeTo(nProxy.metaPages[0].mapped);
+    }
 
   }
 
@@ -144,7 +151,8 @@ namespace Mist {
       //Register this page on the meta page
       //NOTE: It is important that this only happens if the stream is live....
       bool inserted = false;
-      for (int i = 0; i < 1024; i++) {
+      startIndexWrite(tid);
+      for (int i = 0; i < SHM_TRACK_INDEX_ENTRIES; i++) {
         char * tmpOffset = metaPages[tid].mapped + (i * 8);
         if ((Bit::btohl(tmpOffset) == 0 && Bit::btohl(tmpOffset+4) == 0)) {
           Bit::htobl(tmpOffset, curPageNum[tid]);
@@ -153,11 +161,13 @@ namespace Mist {
           break;
         }
       }
+      endIndexWrite(tid);
       if (!inserted){
         FAIL_MSG("Could not insert page in track index. Aborting.");
         curPage[tid].master = true;//set this page for instant-deletion when we're done with it
         return false;
       }
+      signalTrack(tid);
     }
 
     ///\return true if everything was successful
@@ -178,7 +188,8 @@ namespace Mist {
 
     DEBUG_MSG(DLVL_HIGH, "Removing page %lu on track %lu~>%lu from the corresponding metaPage", pageNumber, tid, mapTid);
     int i = 0;
-    for (; i < 1024; i++) {
+    nProxy.startIndexWrite(tid);
+    for (; i < SHM_TRACK_INDEX_ENTRIES; i++) {
       char * tmpOffset = nProxy.metaPages[tid].mapped + (i * 8);
       if (Bit::btohl(tmpOffset) == pageNumber) {
         Bit::htobl(tmpOffset, 0);
@@ -186,7 +197,8 @@ namespace Mist {
         break;
       }
     }
-    if (i == 1024){
+    nProxy.endIndexWrite(tid);
+    if (i == SHM_TRACK_INDEX_ENTRIES){
       ERROR_MSG("Could not erase page %lu for track %lu->%lu stream %s from track index!", pageNumber, tid, mapTid, streamName.c_str());
     }
 
@@ -237,8 +249,7 @@ namespace Mist {
       return 0;
     }
     //Loop over the index page
-    int len = metaPages[tid].len / 8;
-    for (int i = 0; i < len; ++i) {
+    for (int i = 0; i < SHM_TRACK_INDEX_ENTRIES; ++i) {
       char * tmpOffset = metaPages[tid].mapped + (i * 8);
       unsigned int keyAmount = Bit::btohl(tmpOffset+4);
       if (keyAmount == 0){continue;}
@@ -251,6 +262,33 @@ namespace Mist {
     return 0;
   }
 
+  ///Wakes up all processes waiting for new data or pages on the given track
+  ///\param tid The trackid whose index page holds the notifier
+  void negotiationProxy::signalTrack(unsigned long tid) {
+    if (!metaPages.count(tid) || !metaPages[tid].mapped || metaPages[tid].len < SHM_TRACK_INDEX_SIZE) {
+      return;
+    }
+    IPC::notifier(metaPages[tid].mapped + SHM_TRACK_INDEX_NOTIFY).signal();
+  }
+
+  ///Marks the start of a change to the page entries on the index page of the given track
+  ///\param tid The trackid whose index page is about to change
+  void negotiationProxy::startIndexWrite(unsigned long tid) {
+    if (!metaPages.count(tid) || !metaPages[tid].mapped || metaPages[tid].len < SHM_TRACK_INDEX_SIZE) {
+      return;
+    }
+    IPC::generation(metaPages[tid].mapped + SHM_TRACK_INDEX_GENERATION).startWrite();
+  }
+
+  ///Marks the end of a change to the page entries on the index page of the given track, so readers know to rescan it
+  ///\param tid The trackid whose index page changed
+  void negotiationProxy::endIndexWrite(unsigned long tid) {
+    if (!metaPages.count(tid) || !metaPages[tid].mapped || metaPages[tid].len < SHM_TRACK_INDEX_SIZE) {
+      return;
+    }
+    IPC::generation(metaPages[tid].mapped + SHM_TRACK_INDEX_GENERATION).endWrite();
+  }
+
   ///Buffers the next packet on the currently opened page
   ///\param pack The packet to buffer
   void InOutBase::bufferNext(const DTSC::Packet & pack) {
@@ -307,6 +345,8 @@ namespace Mist {
 
     //End of brain melt
     pageData.curOffset += size + 8;
+    //Wake up anyone waiting for this data
+    signalTrack(tid);
   }
 
   ///Wraps up the buffering of a shared memory data page
@@ -328,7 +368,8 @@ namespace Mist {
     //Keep track of registering the page on the track's index page
     bool inserted = false;
     int lowest = 0;
-    for (int i = 0; i < 1024; i++) {
+    startIndexWrite(tid);
+    for (int i = 0; i < SHM_TRACK_INDEX_ENTRIES; i++) {
       char * tmpOffset = metaPages[tid].mapped + (i * 8);
       int keyNum = Bit::btohl(tmpOffset);
       int keyAmount = Bit::btohl(tmpOffset+4);
@@ -353,6 +394,7 @@ namespace Mist {
         lowest = keyNum;
       }
     }
+    endIndexWrite(tid);
 
 #if defined(__CYGWIN__) || defined(_WIN32)
     static int wipedAlready = 0;
@@ -375,6 +417,7 @@ namespace Mist {
 #if defined(__CYGWIN__) || defined(_WIN32)
       IPC::preservePage(curPage[tid].name);
 #endif
+      signalTrack(tid);
     }
     //Close our link to the page. This will NOT destroy the shared page, as we've set master to false upon construction
     //Note: if there was a registering failure above, this WILL destroy the shared page, to prevent a memory leak
@@ -36,6 +36,9 @@ namespace Mist {
       void bufferSinglePacket(const DTSC::Packet & packet, DTSC::Meta & myMeta);
       bool isBuffered(unsigned long tid, unsigned long keyNum);
       unsigned long bufferedOnPage(unsigned long tid, unsigned long keyNum);
+      void signalTrack(unsigned long tid);
+      void startIndexWrite(unsigned long tid);
+      void endIndexWrite(unsigned long tid);
 
 
 
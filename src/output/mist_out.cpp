@@ -8,6 +8,14 @@ int spawnForked(Socket::Connection & S){
   return tmp.run();
 }
 
+Mist::Output * createOutput(Socket::Connection & S){
+  return new mistOut(S);
+}
+
+int spawnWorker(Socket::Server & S){
+  return mistOut::worker(S, createOutput);
+}
+
 int main(int argc, char * argv[]) {
   Util::Config conf(argv[0]);
   mistOut::init(&conf);
@@ -18,6 +26,9 @@ int main(int argc, char * argv[]) {
     }
     conf.activate();
     if (mistOut::listenMode()){
+      if (mistOut::workerMode() && conf.hasOption("workers") && conf.getInteger("workers") > 0){
+        return conf.serveWorkerSocket(conf.getInteger("workers"), spawnWorker);
+      }
       mistOut::listener(conf, spawnForked);
     }else{
       Socket::Connection S(fileno(stdout),fileno(stdin) );
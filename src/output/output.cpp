@@ -5,6 +5,10 @@
 #include <unistd.h>
 #include <semaphore.h>
 #include <iterator> //std::distance
+#include <algorithm> //std::upper_bound
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
 
 #include <mist/bitfields.h>
 #include <mist/stream.h>
@@ -64,8 +68,21 @@ namespace Mist{
     isBlocking = false;
     needsLookAhead = 0;
     lastStats = 0;
+    metaGeneration = 0;
+    firstData = true;
+    atLivePoint = false;
+    emptyCount = 0;
+    stepping = false;
+    nextStep = 0;
+    packetPending = false;
+    paceTries = 0;
+    lookTries = 0;
+    dataWaitUntil = 0;
+    pollEvents = 0;
+    connNum = 0;
     maxSkipAhead = 7500;
     realTime = 1000;
+    droppedFrames = 0;
     lastRecv = Util::epoch();
     if (myConn){
       setBlocking(true);
@@ -78,6 +95,134 @@ namespace Mist{
   void Output::listener(Util::Config & conf, int (*callback)(Socket::Connection & S)){
     conf.serveForkedSocket(callback);
   }
+
+  /// Serves many connections from a single worker process, as started by Util::Config::serveWorkerSocket.
+  /// New connections are accepted from the shared server socket, made nonblocking and handed to create.
+  /// Outputs are advanced one runStep() at a time, whenever their socket has a request waiting, can accept data they
+  /// could not send earlier, or their nextStep time has passed.
+  /// Sends never wait for the socket: what it does not accept is kept, and the output is paused until it is sent.
+  /// Shared memory pages are mapped once per worker, no matter how many of its outputs use them.
+  int Output::worker(Socket::Server & server_socket, Output * (*create)(Socket::Connection & S)){
+#if defined(__linux__)
+#ifdef SHM_ENABLED
+    IPC::sharedPage::shareMappings = true;
+#endif
+    int epfd = epoll_create(1024);
+    if (epfd < 0){
+      FAIL_MSG("Could not create epoll instance: %s", strerror(errno));
+      return 1;
+    }
+    server_socket.setBlocking(false);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;//the server socket is the only entry without an output
+    epoll_ctl(epfd, EPOLL_CTL_ADD, server_socket.getSocket(), &ev);
+
+    //outputs are polled by connection number rather than by pointer: when an output closes its own socket, the poll entry
+    //only goes away once no other process holds the socket either, so events may still arrive after the output is gone
+    std::map<uint64_t, Output *> outputs;
+    std::set<Output *> ready;
+    std::map<Socket::Connection *, uint64_t> draining;//connections of finished outputs still sending, and when to give up
+    struct epoll_event events[64];
+    uint64_t connCount = 0;
+    while (server_socket.connected() || outputs.size() || draining.size()){
+      if (server_socket.connected() && !config->is_active){
+        //stop accepting, but leave the socket usable for the other processes
+        epoll_ctl(epfd, EPOLL_CTL_DEL, server_socket.getSocket(), &ev);
+        server_socket.drop();
+      }
+      //wait for socket activity, at most until the first output wants to run again
+      uint64_t now = Util::getMS();
+      int timeout = 1000;
+      for (std::map<uint64_t, Output *>::iterator it = outputs.begin(); it != outputs.end() && timeout; ++it){
+        timeout = (it->second->nextStep <= now) ? 0 : std::min((uint64_t)timeout, it->second->nextStep - now);
+      }
+      if (draining.size()){timeout = std::min(timeout, 50);}
+      int num = epoll_wait(epfd, events, 64, timeout);
+      for (int i = 0; i < num; ++i){
+        if (events[i].data.u64){
+          if (!outputs.count(events[i].data.u64)){continue;}
+          Output * O = outputs[events[i].data.u64];
+          //these are reported whether we asked for them or not: the client is gone, stop sending to it
+          if (events[i].events & (EPOLLERR | EPOLLHUP)){O->myConn.close();}
+          ready.insert(O);
+          continue;
+        }
+        //accept all waiting connections
+        while (server_socket.connected()){
+          Socket::Connection S = server_socket.accept(true);
+          if (!S.connected()){break;}
+          //keep processes this one starts, such as inputs, from holding on to the connection
+          fcntl(S.getSocket(), F_SETFD, FD_CLOEXEC);
+          Socket::Connection * C = new Socket::Connection(S);
+          C->setKeepSends(true);
+          Output * O = create(*C);
+          O->setBlocking(false);
+          O->stepping = true;
+          //keep the stats of connections in this process apart
+          O->crc = getpid() + (++connCount) * 4194304;
+          O->connNum = connCount;
+          O->pollEvents = EPOLLIN;
+          ev.events = O->pollEvents;
+          ev.data.u64 = O->connNum;
+          epoll_ctl(epfd, EPOLL_CTL_ADD, C->getSocket(), &ev);
+          outputs[O->connNum] = O;
+          ready.insert(O);
+        }
+      }
+      //advance all outputs that have something to do
+      now = Util::getMS();
+      std::map<uint64_t, Output *>::iterator it = outputs.begin();
+      while (it != outputs.end()){
+        Output * O = it->second;
+        if (!ready.count(O) && O->nextStep > now){
+          ++it;
+          continue;
+        }
+        if (O->runStep()){
+          //while data is kept, only wait for the socket to accept it: runStep() does nothing else until then.
+          //otherwise only poll for requests when wanted, or unwanted ones would wake us up for as long as they are not read
+          uint32_t wantEvents = O->myConn.sendPending() ? (uint32_t)EPOLLOUT : (O->wantRequest ? (uint32_t)EPOLLIN : 0);
+          if (wantEvents != O->pollEvents && O->myConn.getSocket() >= 0){
+            O->pollEvents = wantEvents;
+            ev.events = wantEvents;
+            ev.data.u64 = O->connNum;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, O->myConn.getSocket(), &ev);
+          }
+          ++it;
+          continue;
+        }
+        Socket::Connection * C = &(O->myConn);
+        if (C->getSocket() >= 0){epoll_ctl(epfd, EPOLL_CTL_DEL, C->getSocket(), &ev);}
+        O->runEnd();
+        delete O;
+        if (C->connected()){
+          draining[C] = now + 5000;
+        }else{
+          delete C;
+        }
+        outputs.erase(it++);
+      }
+      ready.clear();
+      //give finished outputs a few seconds to get the last of their data out, then close their connections
+      std::map<Socket::Connection *, uint64_t>::iterator dIt = draining.begin();
+      while (dIt != draining.end()){
+        if (!dIt->first->flush() && dIt->first->connected() && dIt->second > now){
+          ++dIt;
+          continue;
+        }
+        dIt->first->close();
+        delete dIt->first;
+        draining.erase(dIt++);
+      }
+    }
+    close(epfd);
+    return 0;
+#else
+    FAIL_MSG("Worker mode is not supported on this platform");
+    return 1;
+#endif
+  }
   
   void Output::setBlocking(bool blocking){
     isBlocking = blocking;
@@ -94,7 +239,30 @@ namespace Mist{
       return;
     }
     //read metadata from page to myMeta variable
-    if (nProxy.metaPages[0].mapped){
+    if (nProxy.metaPages[0].mapped && !myMeta.vod && nProxy.metaPages[0].len >= SHM_STREAM_GENERATION + 8 && IPC::generation(nProxy.metaPages[0].mapped + SHM_STREAM_GENERATION).get()){
+      //Live pages carry a generation counter: copy without locking, and only apply the copy if no write happened in the meantime
+      IPC::generation metaGen(nProxy.metaPages[0].mapped + SHM_STREAM_GENERATION);
+      for (unsigned int tries = 0; tries < 50; ++tries){
+        uint32_t gen = metaGen.get();
+        if (gen == metaGeneration){
+          break;//nothing changed since the last update
+        }
+        unsigned int metaLen = Bit::btohl(nProxy.metaPages[0].mapped + 4) + 8;
+        if ((gen & 1) || metaLen > SHM_STREAM_GENERATION){
+          Util::sleep(1);
+          continue;
+        }
+        DTSC::Packet tmpMeta(nProxy.metaPages[0].mapped, metaLen);
+        if (!metaGen.unchanged(gen)){
+          continue;
+        }
+        if (tmpMeta.getVersion()){
+          myMeta.refresh(tmpMeta);
+        }
+        metaGeneration = gen;
+        break;
+      }
+    }else if (nProxy.metaPages[0].mapped){
       IPC::semaphore * liveSem = 0;
       if (!myMeta.vod){
         static char liveSemName[NAME_BUFFER_SIZE];
@@ -117,6 +285,14 @@ namespace Mist{
         liveSem = 0;
       }
     }
+    //bring the lookup indexes up to date with whatever was added or removed
+    for (std::set<unsigned long>::iterator it = selectedTracks.begin(); it != selectedTracks.end(); it++){
+      if (!myMeta.tracks.count(*it)){continue;}
+      keyIndex[*it].update(myMeta.tracks[*it]);
+      if (nProxy.metaPages.count(*it) && nProxy.metaPages[*it].mapped){
+        pageIndex[*it].update(nProxy.metaPages[*it].mapped, nProxy.metaPages[*it].len);
+      }
+    }
   }
   
   /// Called when stream initialization has failed.
@@ -218,6 +394,8 @@ namespace Mist{
     char pageId[NAME_BUFFER_SIZE];
     snprintf(pageId, NAME_BUFFER_SIZE, SHM_STREAM_INDEX, streamName.c_str());
     nProxy.metaPages.clear();
+    pageIndex.clear();
+    metaGeneration = 0;
     nProxy.metaPages[0].init(pageId, DEFAULT_STRM_PAGE_SIZE);
     if (!nProxy.metaPages[0].mapped){
       FAIL_MSG("Could not connect to data for %s", streamName.c_str());
@@ -367,23 +545,149 @@ namespace Mist{
   /// Clears the buffer, sets parseData to false, and generally makes not very much happen at all.
   void Output::stop(){
     buffer.clear();
+    packetPending = false;
     parseData = false;
   }
   
+  sortedPageBuffer::sortedPageBuffer(){
+    entries.reserve(SIMUL_TRACKS);
+  }
+
+  void sortedPageBuffer::clear(){
+    entries.clear();
+  }
+
+  unsigned int sortedPageBuffer::size() const{
+    return entries.size();
+  }
+
+  /// Returns the entry that should be played next. Only valid if size() is non-zero.
+  const sortedPageInfo & sortedPageBuffer::front() const{
+    return entries[0];
+  }
+
+  const sortedPageInfo & sortedPageBuffer::operator[](unsigned int index) const{
+    return entries[index];
+  }
+
+  /// Returns true if there is an entry for the given track.
+  bool sortedPageBuffer::count(unsigned int tid) const{
+    for (std::vector<sortedPageInfo>::const_iterator it = entries.begin(); it != entries.end(); ++it){
+      if (it->tid == tid){return true;}
+    }
+    return false;
+  }
+
+  /// Inserts an entry at its sorted position, replacing any existing entry for the same track.
+  void sortedPageBuffer::insert(const sortedPageInfo & info){
+    erase(info.tid);
+    std::vector<sortedPageInfo>::iterator it = entries.begin();
+    while (it != entries.end() && !(info < *it)){
+      ++it;
+    }
+    entries.insert(it, info);
+  }
+
+  /// Replaces the first entry and moves it back to its sorted position.
+  /// This is the common case while playing: the track that was just played moves on to its next packet.
+  void sortedPageBuffer::replaceFront(const sortedPageInfo & info){
+    if (!entries.size() || entries[0].tid != info.tid){
+      insert(info);
+      return;
+    }
+    entries[0] = info;
+    for (unsigned int i = 1; i < entries.size() && entries[i] < entries[i-1]; ++i){
+      std::swap(entries[i], entries[i-1]);
+    }
+  }
+
+  /// Removes the entry for the given track, if any. Returns true if an entry was removed.
+  bool sortedPageBuffer::erase(unsigned int tid){
+    for (std::vector<sortedPageInfo>::iterator it = entries.begin(); it != entries.end(); ++it){
+      if (it->tid == tid){
+        entries.erase(it);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  trackPageIndex::trackPageIndex(){
+    gen = 0;
+  }
+
+  /// Brings the sorted copy up to date with the given index page of len bytes.
+  /// Pages with a generation counter are only copied when it changed; others are compared to the copy.
+  /// Returns true if the page changed since the previous update, false otherwise.
+  bool trackPageIndex::update(const char * mapped, uint64_t len){
+    uint32_t pageGen = 0;
+    if (len >= SHM_TRACK_INDEX_SIZE){
+      pageGen = IPC::generation((char *)mapped + SHM_TRACK_INDEX_GENERATION).get();
+    }
+    len = std::min(len, (uint64_t)SHM_TRACK_INDEX_NOTIFY);
+    if (gen && pageGen == gen && raw.size() == len){
+      return false;
+    }
+    if (!pageGen && raw.size() == len && !memcmp(raw.data(), mapped, len)){
+      return false;
+    }
+    raw.assign(mapped, len);
+    //Only trust the generation if no write was in progress or happened during the copy
+    gen = (pageGen && IPC::generation((char *)mapped + SHM_TRACK_INDEX_GENERATION).unchanged(pageGen)) ? pageGen : 0;
+    slots.clear();
+    unsigned int entries = len / 8;
+    for (unsigned int i = 0; i < entries; i++){
+      const char * tmpOffset = raw.data() + (i * 8);
+      if (Bit::btohl(tmpOffset+4) == 0){continue;}
+      unsigned long tmpKey = Bit::btohl(tmpOffset);
+      //like a linear scan would, prefer the first entry for any given page
+      if (!slots.count(tmpKey)){
+        slots[tmpKey] = i;
+      }
+    }
+    return true;
+  }
+
+  /// Returns the number of the page holding the given key, or -1 if unknown.
+  /// Also returns -1 if the matching entry changed on the index page since the last update.
+  int trackPageIndex::pageForKey(const char * mapped, long long int keyNum) const{
+    if (!slots.size() || keyNum < 0){return -1;}
+    std::map<unsigned long, unsigned int>::const_iterator it = slots.upper_bound(keyNum);
+    if (it == slots.begin()){return -1;}
+    --it;
+    const char * tmpOffset = raw.data() + (it->second * 8);
+    //verify the entry is still the same on the real index page
+    if (memcmp(tmpOffset, mapped + (it->second * 8), 8)){return -1;}
+    long amountKey = Bit::btohl(tmpOffset+4);
+    long tmpKey = it->first;
+    if (((tmpKey?tmpKey:1) + amountKey) > keyNum){
+      return tmpKey;
+    }
+    return -1;
+  }
+
+  /// Returns the highest page number as of the last update, or -1 if there are no pages.
+  int trackPageIndex::highestPage() const{
+    if (!slots.size()){return -1;}
+    return slots.rbegin()->first;
+  }
+
   unsigned int Output::getKeyForTime(long unsigned int trackId, long long timeStamp){
     DTSC::Track & trk = myMeta.tracks[trackId];
-    if (!trk.keys.size()){
+    DTSC::TrackIndex & kIdx = keyIndex[trackId];
+    kIdx.update(trk);
+    if (!kIdx.keyCount()){
       return 0;
     }
-    unsigned int keyNo = trk.keys.begin()->getNumber();
-    unsigned int partCount = 0;
-    std::deque<DTSC::Key>::iterator it;
-    for (it = trk.keys.begin(); it != trk.keys.end() && it->getTime() <= timeStamp; it++){
-      keyNo = it->getNumber();
-      partCount += it->getParts();
+    uint64_t seekTime = timeStamp;
+    if (seekTime < kIdx.keyTime(0)){
+      return trk.keys.begin()->getNumber();
     }
+    size_t keyIdx = kIdx.keyForTime(seekTime);
+    unsigned int keyNo = trk.keys[keyIdx].getNumber();
+    uint64_t partCount = kIdx.partsBefore(keyIdx + 1);
     //if the time is before the next keyframe but after the last part, correctly seek to next keyframe
-    if (partCount && it != trk.keys.end() && timeStamp > it->getTime() - trk.parts[partCount-1].getDuration()){
+    if (partCount && keyIdx + 1 < kIdx.keyCount() && seekTime > kIdx.keyTime(keyIdx + 1) - kIdx.partDuration(partCount - 1)){
       ++keyNo;
     }
     return keyNo;
@@ -396,17 +700,59 @@ namespace Mist{
       nProxy.metaPages[trackId].init(id, SHM_TRACK_INDEX_SIZE);
     }
     if (!nProxy.metaPages[trackId].mapped){return -1;}
-    int len = nProxy.metaPages[trackId].len / 8;
-    for (int i = 0; i < len; i++){
-      char * tmpOffset = nProxy.metaPages[trackId].mapped + (i * 8);
-      long amountKey = Bit::btohl(tmpOffset+4);
-      if (amountKey == 0){continue;}
-      long tmpKey = Bit::btohl(tmpOffset);
-      if (tmpKey <= keyNum && ((tmpKey?tmpKey:1) + amountKey) > keyNum){
-        return tmpKey;
+    IPC::sharedPage & idxPage = nProxy.metaPages[trackId];
+    trackPageIndex & pIdx = pageIndex[trackId];
+    int pageNum = pIdx.pageForKey(idxPage.mapped, keyNum);
+    //only rescan the index page if the lookup failed and the page changed since
+    if (pageNum == -1 && pIdx.update(idxPage.mapped, idxPage.len)){
+      pageNum = pIdx.pageForKey(idxPage.mapped, keyNum);
+    }
+    return pageNum;
+  }
+
+  /// Returns a pointer to the data notifier on the index page of the given track, or 0 if not available.
+  char * Output::dataNotifier(long unsigned int trackId){
+    if (!nProxy.metaPages.count(trackId) || !nProxy.metaPages[trackId].mapped){
+      char id[NAME_BUFFER_SIZE];
+      snprintf(id, NAME_BUFFER_SIZE, SHM_TRACK_INDEX, streamName.c_str(), trackId);
+      nProxy.metaPages[trackId].init(id, SHM_TRACK_INDEX_SIZE, false, false);
+    }
+    if (!nProxy.metaPages[trackId].mapped || nProxy.metaPages[trackId].len < SHM_TRACK_INDEX_SIZE){return 0;}
+    return nProxy.metaPages[trackId].mapped + SHM_TRACK_INDEX_NOTIFY;
+  }
+
+  /// Returns the current value of the data notifier of the given track, to be passed to waitForData() later on.
+  uint32_t Output::dataNotifyValue(long unsigned int trackId){
+    char * notify = dataNotifier(trackId);
+    if (!notify){return 0;}
+    return IPC::notifier(notify).get();
+  }
+
+  /// Waits at most ms milliseconds for new data or pages to be signalled on the given track.
+  /// Returns immediately if anything was signalled since dataNotifyValue() returned seen.
+  /// \returns true if new data was signalled, false on timeout.
+  bool Output::waitForData(long unsigned int trackId, uint32_t seen, unsigned int ms){
+    char * notify = dataNotifier(trackId);
+    if (stepping){
+      //Never block other outputs sharing this process: check again in a few ms, and only time out after the full wait
+      if (notify && IPC::notifier(notify).get() != seen){
+        dataWaitUntil = 0;
+        return true;
+      }
+      uint64_t now = Util::getMS();
+      if (!dataWaitUntil){dataWaitUntil = now + ms;}
+      if (now < dataWaitUntil){
+        nextStep = now + 10;
+        return true;
       }
+      dataWaitUntil = 0;
+      return false;
     }
-    return -1;
+    if (!notify){
+      Util::wait(ms);
+      return false;
+    }
+    return IPC::notifier(notify).wait(seen, ms);
   }
 
   /// Gets the highest page number available for the given trackId.
@@ -417,50 +763,55 @@ namespace Mist{
       nProxy.metaPages[trackId].init(id, SHM_TRACK_INDEX_SIZE);
     }
     if (!nProxy.metaPages[trackId].mapped){return -1;}
-    int len = nProxy.metaPages[trackId].len / 8;
-    int highest = -1;
-    for (int i = 0; i < len; i++){
-      char * tmpOffset = nProxy.metaPages[trackId].mapped + (i * 8);
-      long amountKey = Bit::btohl(tmpOffset+4);
-      if (amountKey == 0){continue;}
-      long tmpKey = Bit::btohl(tmpOffset);
-      if (tmpKey > highest){highest = tmpKey;}
-    }
-    return highest;
+    pageIndex[trackId].update(nProxy.metaPages[trackId].mapped, nProxy.metaPages[trackId].len);
+    return pageIndex[trackId].highestPage();
   }
  
   /// Loads the page for the given trackId and keyNum into memory.
   /// Overwrites any existing page for the same trackId.
   /// Automatically calls thisPacket.null() if necessary.
-  void Output::loadPageForKey(long unsigned int trackId, long long int keyNum){
+  /// When stepping, never waits for the page to become available, but sets nextStep and returns false instead.
+  /// The caller should then load the same key again later; the time already spent waiting is remembered.
+  /// \returns False if the load has to be retried later, true if it finished, whether it succeeded or not.
+  bool Output::loadPageForKey(long unsigned int trackId, long long int keyNum){
     if (!myMeta.tracks.count(trackId) || !myMeta.tracks[trackId].keys.size()){
       WARN_MSG("Load for track %lu key %lld aborted - track is empty", trackId, keyNum);
-      return;
+      return true;
     }
     if (myMeta.vod && keyNum > myMeta.tracks[trackId].keys.rbegin()->getNumber()){
       INFO_MSG("Load for track %lu key %lld aborted, is > %lld", trackId, keyNum, myMeta.tracks[trackId].keys.rbegin()->getNumber());
       nProxy.curPage.erase(trackId);
       currKeyOpen.erase(trackId);
-      return;
+      return true;
     }
     VERYHIGH_MSG("Loading track %lu, containing key %lld", trackId, keyNum);
-    unsigned int timeout = 0;
+    //continue an earlier wait for this same page, if any
+    keyPageWait W;
+    W.keyNum = keyNum;
+    W.since = 0;
+    W.reconnected = false;
+    if (pageWaits.count(trackId)){
+      if (pageWaits[trackId].keyNum == keyNum){W = pageWaits[trackId];}
+      pageWaits.erase(trackId);
+    }
+    uint32_t notifySeen = dataNotifyValue(trackId);
     unsigned long pageNum = pageNumForKey(trackId, keyNum);
     while (keepGoing() && pageNum == -1){
-      if (!timeout){
+      if (!W.since){
         HIGH_MSG("Requesting page with key %lu:%lld", trackId, keyNum);
+        W.since = Util::getMS();
       }
-      ++timeout;
       //if we've been waiting for this page for 3 seconds, reconnect to the stream - something might be going wrong...
-      if (timeout == 30){
+      if (!W.reconnected && Util::getMS() - W.since >= 3000){
         DEVEL_MSG("Loading is taking longer than usual, reconnecting to stream %s...", streamName.c_str());
         reconnect();
+        W.reconnected = true;
       }
-      if (timeout > 100){
+      if (Util::getMS() - W.since > 10000){
         FAIL_MSG("Timeout while waiting for requested page %lld for track %lu. Aborting.", keyNum, trackId);
         nProxy.curPage.erase(trackId);
         currKeyOpen.erase(trackId);
-        return;
+        return true;
       }
       if (keyNum){
         nxtKeyNum[trackId] = keyNum-1;
@@ -468,12 +819,20 @@ namespace Mist{
         nxtKeyNum[trackId] = 0;
       }
       stats(true);
-      Util::wait(100);
+      if (stepping){
+        //don't hold up the other outputs of this process: look again in a little while
+        pageWaits[trackId] = W;
+        nextStep = Util::getMS() + 10;
+        return false;
+      }
+      //wake up as soon as the input signals a new page, or after 100ms
+      waitForData(trackId, notifySeen, 100);
+      notifySeen = dataNotifyValue(trackId);
       pageNum = pageNumForKey(trackId, keyNum);
     }
     
     if (!keepGoing()){
-      return;
+      return true;
     }
 
     if (keyNum){
@@ -484,7 +843,7 @@ namespace Mist{
     stats(true);
     
     if (currKeyOpen.count(trackId) && currKeyOpen[trackId] == (unsigned int)pageNum){
-      return;
+      return true;
     }
     //If we're loading the track thisPacket is on, null it to prevent accesses.
     if (thisPacket && thisPacket.getTrackId() == trackId){
@@ -496,16 +855,21 @@ namespace Mist{
     if (!(nProxy.curPage[trackId].mapped)){
       FAIL_MSG("Initializing page %s failed", nProxy.curPage[trackId].name.c_str());
       currKeyOpen.erase(trackId);
-      return;
+      return true;
     }
     currKeyOpen[trackId] = pageNum;
     VERYHIGH_MSG("Page %s loaded for %s", id, streamName.c_str());
+    return true;
   }
 
   ///Return the current time of the media buffer, or 0 if no buffer available.
+  ///Seeks that are still waiting for data count as being at the time they seek to.
   uint64_t Output::currentTime(){
-    if (!buffer.size()){return 0;}
-    return buffer.begin()->time;
+    uint64_t ret = buffer.size() ? buffer.front().time : 0xFFFFFFFFFFFFFFFFull;
+    for (std::map<unsigned long, trackSeekWait>::iterator it = seekWaits.begin(); it != seekWaits.end(); ++it){
+      if (it->second.pos < ret){ret = it->second.pos;}
+    }
+    return (ret == 0xFFFFFFFFFFFFFFFFull) ? 0 : ret;
   }
   
   ///Return the start time of the selected tracks.
@@ -556,7 +920,9 @@ namespace Mist{
       initialize();
     }
     buffer.clear();
+    seekWaits.clear();
     thisPacket.null();
+    packetPending = false;
     if (myMeta.live){
       updateMeta();
     }
@@ -567,20 +933,33 @@ namespace Mist{
         seek(*it, pos);
       }
     }
-    firstTime = Util::getMS() - buffer.begin()->time;
+    if (buffer.size()){
+      firstTime = Util::getMS() - buffer.front().time;
+    }
   }
 
+  /// Seeks a single track to the specified ms position, or to the key after it if getNextKey is set.
+  /// When stepping, a track whose data is not available yet does not block: the seek is retried by prepareNext() instead.
+  /// \returns False if the track could not be sought and was deselected.
   bool Output::seek(unsigned int tid, unsigned long long pos, bool getNextKey){
     if (myMeta.live && myMeta.tracks[tid].lastms < pos){
-      unsigned int maxTime = 0;
-      while (myMeta.tracks[tid].lastms < pos && myConn && ++maxTime <= 20 && keepGoing()){
-        Util::wait(500);
-        stats();
-        updateMeta();
+      if (stepping){
+        if (seekLater(tid, pos, getNextKey, 10000)){return true;}
+      }else{
+        unsigned long long waitUntil = Util::getMS() + 10000;
+        uint32_t notifySeen = dataNotifyValue(tid);
+        while (myMeta.tracks[tid].lastms < pos && myConn && Util::getMS() < waitUntil && keepGoing()){
+          //wake up as soon as new data arrives on this track, or after 500ms
+          waitForData(tid, notifySeen, 500);
+          notifySeen = dataNotifyValue(tid);
+          stats();
+          updateMeta();
+        }
       }
     }
     if (myMeta.tracks[tid].lastms < pos){
       WARN_MSG("Aborting seek to %llums in track %u: past end of track (= %llums).", pos, tid, myMeta.tracks[tid].lastms);
+      seekWaits.erase(tid);
       selectedTracks.erase(tid);
       return false;
     }
@@ -591,9 +970,14 @@ namespace Mist{
         pos = myMeta.tracks[tid].getKey(keyNum).getTime();
       }
     }
-    loadPageForKey(tid, keyNum + (getNextKey?1:0));
+    if (!loadPageForKey(tid, keyNum + (getNextKey?1:0))){
+      //loadPageForKey gives up by itself once it waited long enough
+      seekLater(tid, pos, getNextKey, 0xFFFFFFFFu);
+      return true;
+    }
     if (!nProxy.curPage.count(tid) || !nProxy.curPage[tid].mapped){
       WARN_MSG("Aborting seek to %llums in track %u: not available.", pos, tid);
+      seekWaits.erase(tid);
       selectedTracks.erase(tid);
       return false;
     }
@@ -611,6 +995,7 @@ namespace Mist{
     }
     if (tmpPack){
       HIGH_MSG("Sought to time %llu in %s@%u", tmp.time, streamName.c_str(), tid);
+      seekWaits.erase(tid);
       buffer.insert(tmp);
       return true;
     }else{
@@ -619,10 +1004,17 @@ namespace Mist{
         FAIL_MSG("Noes! Couldn't find packet on track %d because of some kind of corruption error or somesuch.", tid);
       }else{
         VERYHIGH_MSG("Track %d no data (key %u @ %u) - waiting...", tid, getKeyForTime(tid, pos) + (getNextKey?1:0), tmp.offset);
-        unsigned int i = 0;
-        while (!myMeta.live && nProxy.curPage[tid].mapped[tmp.offset] == 0 && ++i <= 10 && keepGoing()){
-          Util::wait(100*i);
-          stats();
+        if (stepping){
+          //wait as long as the loop below would, without blocking
+          if (!myMeta.live && seekLater(tid, pos, getNextKey, 5500)){return true;}
+        }else{
+          unsigned int i = 0;
+          uint32_t notifySeen = dataNotifyValue(tid);
+          while (!myMeta.live && nProxy.curPage[tid].mapped[tmp.offset] == 0 && ++i <= 10 && keepGoing()){
+            waitForData(tid, notifySeen, 100*i);
+            notifySeen = dataNotifyValue(tid);
+            stats();
+          }
         }
         if (nProxy.curPage[tid].mapped[tmp.offset] == 0){
           FAIL_MSG("Track %d no data (key %u@%llu) - timeout", tid, getKeyForTime(tid, pos) + (getNextKey?1:0), tmp.offset);
@@ -630,11 +1022,33 @@ namespace Mist{
           return seek(tid, pos, getNextKey);
         }
       }
+      seekWaits.erase(tid);
       selectedTracks.erase(tid);
       return false;
     }
   }
 
+  /// When stepping, lets a seek in the given track wait for its data without blocking the other outputs of this process.
+  /// The seek is retried by prepareNext() until it completes, or until it has waited ms milliseconds in total.
+  /// \returns True if the seek will be retried, false if it should give up instead.
+  bool Output::seekLater(unsigned int tid, unsigned long long pos, bool getNextKey, unsigned int ms){
+    if (!stepping || !keepGoing()){return false;}
+    uint64_t now = Util::getMS();
+    if (!seekWaits.count(tid)){
+      trackSeekWait & W = seekWaits[tid];
+      W.pos = pos;
+      W.getNextKey = getNextKey;
+      W.since = now;
+    }
+    if (now - seekWaits[tid].since >= ms){
+      seekWaits.erase(tid);
+      return false;
+    }
+    if (!nextStep || nextStep > now + 10){nextStep = now + 10;}
+    stats();
+    return true;
+  }
+
   /// This function decides where in the stream initial playback starts.
   /// The default implementation calls seek(0) for VoD.
   /// For live, it seeks to the last sync'ed keyframe of the main track, no closer than needsLookAhead+minKeepAway ms from the end.
@@ -675,7 +1089,7 @@ namespace Mist{
   }
 
   void Output::requestHandler(){
-    static bool firstData = true;//only the first time, we call onRequest if there's data buffered already.
+    //only the first time, we call onRequest if there's data buffered already.
     if ((firstData && myConn.Received().size()) || myConn.spool()){
       firstData = false;
       DONTEVEN_MSG("onRequest");
@@ -687,7 +1101,7 @@ namespace Mist{
           WARN_MSG("Disconnecting 5 minute idle connection");
           myConn.close();
         }else{
-          Util::sleep(500);
+          nextStep = Util::getMS() + 500;
         }
       }
     }
@@ -695,82 +1109,126 @@ namespace Mist{
  
   int Output::run(){
     DONTEVEN_MSG("MistOut client handler started");
-    while (keepGoing() && (wantRequest || parseData)){
-      if (wantRequest){
-        requestHandler();
+    while (runStep()){
+      uint64_t now = Util::getMS();
+      if (nextStep > now){
+        Util::sleep(nextStep - now);
       }
-      if (parseData){
-        if (!isInitialized){
-          initialize();
-        }
-        if ( !sentHeader){
-          DONTEVEN_MSG("sendHeader");
-          sendHeader();
+    }
+    runEnd();
+    return 0;
+  }
+
+  /// Does a single iteration of the output main loop: handles a request and/or sends a single packet.
+  /// Instead of waiting for real-time playback or metadata look ahead, sets nextStep and returns.
+  /// \returns False when the output is done, after which runEnd() should be called.
+  bool Output::runStep(){
+    nextStep = 0;
+    if (!keepGoing() || !(wantRequest || parseData)){
+      return false;
+    }
+    //send whatever an earlier non-blocking send had to keep, as far as the socket allows
+    if (!myConn.flush() && stepping){
+      //don't add to it before the socket accepts more: worker() runs us again once it does
+      nextStep = Util::getMS() + 1000;
+      stats();
+      return true;
+    }
+    if (wantRequest){
+      requestHandler();
+    }
+    if (parseData){
+      if (!isInitialized){
+        initialize();
+      }
+      if ( !sentHeader){
+        DONTEVEN_MSG("sendHeader");
+        sendHeader();
+      }
+      if (!sought){
+        initialSeek();
+      }
+      if (!packetPending && prepareNext()){
+        if (thisPacket){
+          packetPending = true;
+          paceTries = 5;
+          lookTries = 0;
+        }else{
+          INFO_MSG("Shutting down because of stream end");
+          if (!onFinish()){
+            return false;
+          }
         }
-        if (!sought){
-          initialSeek();
+      }
+      if (packetPending && keepGoing()){
+        //slow down processing, if real time speed is wanted
+        if (paceTries && realTime){
+          uint64_t maxTime = (((Util::getMS() - firstTime)*1000)+maxSkipAhead)/realTime;
+          if (thisPacket.getTime() > maxTime){
+            --paceTries;
+            nextStep = Util::getMS() + std::min(thisPacket.getTime() - maxTime, 1000llu);
+            stats();
+            return true;
+          }
         }
-        if (prepareNext()){
-          if (thisPacket){
-            //slow down processing, if real time speed is wanted
-            if (realTime){
-              uint8_t i = 6;
-              while (--i && thisPacket.getTime() > (((Util::getMS() - firstTime)*1000)+maxSkipAhead)/realTime && keepGoing()){
-                Util::sleep(std::min(thisPacket.getTime() - (((Util::getMS() - firstTime)*1000)+maxSkipAhead)/realTime, 1000llu));
-                stats();
-              }
-            }
+        paceTries = 0;
 
-            //delay the stream until metadata has caught up, if needed
-            if (needsLookAhead){
-              //we sleep in 250ms increments, or less if the lookahead time itself is less
-              uint32_t sleepTime = std::min((uint32_t)250, needsLookAhead);
-              //wait at most double the look ahead time, plus ten seconds
-              uint32_t timeoutTries = (needsLookAhead / sleepTime) * 2 + (10000/sleepTime);
-              uint64_t needsTime = thisPacket.getTime() + needsLookAhead; 
-              while(--timeoutTries && keepGoing()){
-                bool lookReady = true;
-                for (std::set<long unsigned int>::iterator it = selectedTracks.begin(); it != selectedTracks.end(); it++){
-                  if (myMeta.tracks[*it].lastms <= needsTime){
-                    if (timeoutTries == 1){
-                      WARN_MSG("Track %lu: %llu <= %llu", *it, myMeta.tracks[*it].lastms, needsTime);
-                    }
-                    lookReady = false;
-                    break;
-                  }
+        //delay the stream until metadata has caught up, if needed
+        if (needsLookAhead){
+          //we wait in 250ms increments, or less if the lookahead time itself is less
+          uint32_t sleepTime = std::min((uint32_t)250, needsLookAhead);
+          if (!lookTries){
+            //wait at most double the look ahead time, plus ten seconds
+            lookTries = (needsLookAhead / sleepTime) * 2 + (10000/sleepTime);
+          }else{
+            updateMeta();
+          }
+          uint64_t needsTime = thisPacket.getTime() + needsLookAhead; 
+          if (--lookTries){
+            bool lookReady = true;
+            for (std::set<long unsigned int>::iterator it = selectedTracks.begin(); it != selectedTracks.end(); it++){
+              if (myMeta.tracks[*it].lastms <= needsTime){
+                if (lookTries == 1){
+                  WARN_MSG("Track %lu: %llu <= %llu", *it, myMeta.tracks[*it].lastms, needsTime);
                 }
-                if (lookReady){break;}
-                Util::wait(sleepTime);
-                stats();
-                updateMeta();
-              }
-              if (!timeoutTries){
-                WARN_MSG("Waiting for lookahead timed out - resetting lookahead!");
-                needsLookAhead = 0;
+                lookReady = false;
+                break;
               }
             }
-
-            sendNext();
-          }else{
-            INFO_MSG("Shutting down because of stream end");
-            if (!onFinish()){
-              break;
+            if (!lookReady){
+              nextStep = Util::getMS() + sleepTime;
+              stats();
+              return true;
             }
+          }else{
+            WARN_MSG("Waiting for lookahead timed out - resetting lookahead!");
+            needsLookAhead = 0;
           }
+          lookTries = 0;
         }
+
+        packetPending = false;
+        sendNext();
       }
-      stats();
     }
+    stats();
+    return true;
+  }
+
+  /// Cleans up after the last runStep() call, closing the connection.
+  void Output::runEnd(){
     MEDIUM_MSG("MistOut client handler shutting down: %s, %s, %s", myConn.connected() ? "conn_active" : "conn_closed", wantRequest ? "want_request" : "no_want_request", parseData ? "parsing_data" : "not_parsing_data");
     onFinish();
     
     stats(true);
     nProxy.userClient.finish();
     statsPage.finish();
-    myConn.close();
-    return 0;
+    //when stepping, worker() closes the connection once it sent what is still kept for it
+    if (!stepping || !myConn.sendPending()){
+      myConn.close();
+    }
   }
-  
+
   /// Returns the ID of the main selected track, or 0 if no tracks are selected.
   /// The main track is the first video track, if any, and otherwise the first other track.
   long unsigned int Output::getMainSelectedTrack(){
@@ -793,12 +1251,7 @@ namespace Mist{
     }
     DEBUG_MSG(printLevel, "Dropping %s (%s) track %lu@k%lu (nextP=%d, lastP=%d): %s", streamName.c_str(), myMeta.tracks[trackId].codec.c_str(), (long unsigned)trackId, nxtKeyNum[trackId]+1, pageNumForKey(trackId, nxtKeyNum[trackId]+1), pageNumMax(trackId), reason.c_str());
     //now actually drop the track from the buffer
-    for (std::set<sortedPageInfo>::iterator it = buffer.begin(); it != buffer.end(); ++it){
-      if (it->tid == trackId){
-        buffer.erase(it);
-        break;
-      }
-    }
+    buffer.erase(trackId);
     selectedTracks.erase(trackId);
   }
  
@@ -808,9 +1261,24 @@ namespace Mist{
   /// \returns true if thisPacket was filled with the next packet.
   /// \returns false if we could not reliably determine the next packet yet.
   bool Output::prepareNext(){
-    static bool atLivePoint = false;
-    static int nonVideoCount = 0;
-    static unsigned int emptyCount = 0;
+    //retry seeks that were waiting for data, see seekLater(); playback starts once all of them are done
+    if (seekWaits.size()){
+      if (myMeta.live){
+        updateMeta();
+      }
+      std::map<unsigned long, trackSeekWait> waits = seekWaits;
+      for (std::map<unsigned long, trackSeekWait>::iterator it = waits.begin(); it != waits.end(); ++it){
+        if (selectedTracks.count(it->first) && myMeta.tracks.count(it->first)){
+          seek(it->first, it->second.pos, it->second.getNextKey);
+        }else{
+          seekWaits.erase(it->first);
+        }
+      }
+      if (!seekWaits.size() && buffer.size()){
+        firstTime = Util::getMS() - buffer.front().time;
+      }
+      return false;
+    }
     if (!buffer.size()){
       thisPacket.null();
       INFO_MSG("Buffer completely played out");
@@ -822,22 +1290,15 @@ namespace Mist{
       if (buffer.size() < selectedTracks.size()){
         //prepare to drop any selectedTrack without buffe entry
         for (std::set<unsigned long>::iterator it = selectedTracks.begin(); it != selectedTracks.end(); ++it){
-          bool found = false;
-          for (std::set<sortedPageInfo>::iterator bi = buffer.begin(); bi != buffer.end(); ++bi){
-            if (bi->tid == *it){
-              found = true;
-              break;
-            }
-          }
-          if (!found){
+          if (!buffer.count(*it)){
             dropTracks.insert(*it);
           }
         }
       }else{
         //prepare to drop any buffer entry without selectedTrack
-        for (std::set<sortedPageInfo>::iterator bi = buffer.begin(); bi != buffer.end(); ++bi){
-          if (!selectedTracks.count(bi->tid)){
-            dropTracks.insert(bi->tid);
+        for (unsigned int i = 0; i < buffer.size(); ++i){
+          if (!selectedTracks.count(buffer[i].tid)){
+            dropTracks.insert(buffer[i].tid);
           }
         }
       }
@@ -849,7 +1310,7 @@ namespace Mist{
       return false;
     }
 
-    sortedPageInfo nxt = *(buffer.begin());
+    sortedPageInfo nxt = buffer.front();
 
     if (!myMeta.tracks.count(nxt.tid)){
       dropTrack(nxt.tid, "disappeared from metadata", true);
@@ -868,7 +1329,10 @@ namespace Mist{
       if (thisPacket){
         nxtKeyNum[nxt.tid] = getKeyForTime(nxt.tid, thisPacket.getTime());
       }
-      loadPageForKey(nxt.tid, ++nxtKeyNum[nxt.tid]);
+      //when stepping, the page may not be available yet: we'll end up here again later on
+      if (!loadPageForKey(nxt.tid, ++nxtKeyNum[nxt.tid])){
+        return false;
+      }
       nxt.offset = 0;
       if (nProxy.curPage.count(nxt.tid) && nProxy.curPage[nxt.tid].mapped){
         if (getDTSCTime(nProxy.curPage[nxt.tid].mapped, nxt.offset) < nxt.time){
@@ -876,8 +1340,7 @@ namespace Mist{
         }else{
           nxt.time = getDTSCTime(nProxy.curPage[nxt.tid].mapped, nxt.offset);
           //swap out the next object in the buffer with a new one
-          buffer.erase(buffer.begin());
-          buffer.insert(nxt);
+          buffer.replaceFront(nxt);
         }
       }else{
         dropTrack(nxt.tid, "VoD page load failure");
@@ -892,6 +1355,11 @@ namespace Mist{
         dropTrack(nxt.tid, "timeless empty packet");
         return false;
       }
+      //store the notifier state before checking anything, so we can't miss new data arriving while we check
+      uint32_t notifySeen = dataNotifyValue(nxt.tid);
+      if (memcmp(nProxy.curPage[nxt.tid].mapped + nxt.offset, "\000\000\000\000", 4)){
+        return false;
+      }
       //if this is a live stream, we might have just reached the live point.
       //check where the next key is
       nxtKeyNum[nxt.tid] = getKeyForTime(nxt.tid, nxt.time);
@@ -899,9 +1367,11 @@ namespace Mist{
       //if the next key hasn't shown up on another page, then we're waiting.
       //VoD might be slow, so we check VoD case also, just in case
       if (currKeyOpen.count(nxt.tid) && (currKeyOpen[nxt.tid] == (unsigned int)nextPage || nextPage == -1)){
+        //we're waiting for new data to show up: block until the writer signals some, at most 250ms
+        if (waitForData(nxt.tid, notifySeen, 250)){
+          return false;
+        }
         if (++emptyCount < 100){
-          Util::wait(250);
-          //we're waiting for new data to show up
           if (emptyCount % 8 == 0){
             reconnect();//reconnect every 2 seconds
           }else{
@@ -919,7 +1389,9 @@ namespace Mist{
 
       //The next key showed up on another page!
       //We've simply reached the end of the page. Load the next key = next page.
-      loadPageForKey(nxt.tid, ++nxtKeyNum[nxt.tid]);
+      if (!loadPageForKey(nxt.tid, ++nxtKeyNum[nxt.tid])){
+        return false;
+      }
       nxt.offset = 0;
       if (nProxy.curPage.count(nxt.tid) && nProxy.curPage[nxt.tid].mapped){
         unsigned long long nextTime = getDTSCTime(nProxy.curPage[nxt.tid].mapped, nxt.offset);
@@ -930,8 +1402,7 @@ namespace Mist{
             nxt.time = nextTime;
           }
           //swap out the next object in the buffer with a new one
-          buffer.erase(buffer.begin());
-          buffer.insert(nxt);
+          buffer.replaceFront(nxt);
           MEDIUM_MSG("Next page for track %u starts at %llu.", nxt.tid, nxt.time);
         }
       }else{
@@ -949,6 +1420,7 @@ namespace Mist{
       return false;
     }
     emptyCount = 0;//valid packet - reset empty counter
+    dataWaitUntil = 0;//and stop any wait for data that was still going on
 
     //if there's a timestamp mismatch, print this.
     //except for live, where we never know the time in advance
@@ -968,8 +1440,7 @@ namespace Mist{
       }
       nxt.time = thisPacket.getTime();
       //swap out the next object in the buffer with a new one
-      buffer.erase(buffer.begin());
-      buffer.insert(nxt);
+      buffer.replaceFront(nxt);
       VERYHIGH_MSG("JIT reordering %u@%llu.", nxt.tid, nxt.time);
       return false;
     }
@@ -1016,8 +1487,7 @@ namespace Mist{
     }
 
     //exchange the current packet in the buffer for the next one
-    buffer.erase(buffer.begin());
-    buffer.insert(nxt);
+    buffer.replaceFront(nxt);
 
     return true;
   }
@@ -1055,9 +1525,11 @@ namespace Mist{
       tmpEx.crc(crc);
       tmpEx.streamName(streamName);
       tmpEx.connector(getStatsName());
+      tmpEx.updateSessionHash();
       tmpEx.up(myConn.dataUp());
       tmpEx.down(myConn.dataDown());
       tmpEx.time(now - myConn.connTime());
+      tmpEx.dropped(droppedFrames);
       if (thisPacket){
         tmpEx.lastSecond(thisPacket.getTime());
       }else{
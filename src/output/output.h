@@ -2,6 +2,7 @@
 #include <set>
 #include <cstdlib>
 #include <map>
+#include <vector>
 #include <mist/config.h>
 #include <mist/json.h>
 #include <mist/flv_tag.h>
@@ -27,6 +28,52 @@ namespace Mist {
     unsigned int offset;
   };
 
+  /// A page load that is waiting for the page holding a key to become available, see Output::loadPageForKey().
+  struct keyPageWait{
+    long long int keyNum;
+    uint64_t since;///< Time the load started waiting.
+    bool reconnected;///< True if the stream was reconnected to during this wait.
+  };
+
+  /// A seek in a single track that is waiting for its data to become available, see Output::seekLater().
+  struct trackSeekWait{
+    unsigned long long pos;
+    bool getNextKey;
+    uint64_t since;///< Time the seek started waiting.
+  };
+
+  /// Small sorted array of sortedPageInfo entries, at most one per track, earliest first.
+  /// Used instead of a std::set: there are only a few tracks (usually well below SIMUL_TRACKS),
+  /// so moving entries around in one contiguous block beats allocating a tree node for every packet.
+  class sortedPageBuffer{
+    public:
+      sortedPageBuffer();
+      void clear();
+      unsigned int size() const;
+      const sortedPageInfo & front() const;
+      const sortedPageInfo & operator[](unsigned int index) const;
+      bool count(unsigned int tid) const;
+      void insert(const sortedPageInfo & info);
+      void replaceFront(const sortedPageInfo & info);
+      bool erase(unsigned int tid);
+    private:
+      std::vector<sortedPageInfo> entries;
+  };
+
+  /// Sorted copy of a track index page (SHM_TRACK_INDEX), so the page holding a key can be found with a binary search.
+  /// The copy is only rebuilt when the generation counter of the index page changed.
+  class trackPageIndex{
+    public:
+      trackPageIndex();
+      bool update(const char * mapped, uint64_t len);
+      int pageForKey(const char * mapped, long long int keyNum) const;
+      int highestPage() const;
+    private:
+      uint32_t gen;///< Generation of the index page the copy was made at, or zero if it must be compared byte by byte.
+      std::string raw;///< Copy of the index page entries as they were during the last update.
+      std::map<unsigned long, unsigned int> slots;///< First key number of each page, mapped to its entry number on the index page.
+  };
+
   /// The output class is intended to be inherited by MistOut process classes.
   /// It contains all generic code and logic, while the child classes implement
   /// anything specific to particular protocols or containers.
@@ -37,11 +84,14 @@ namespace Mist {
     public:
       //constructor and destructor
       Output(Socket::Connection & conn);
+      virtual ~Output(){}
       //static members for initialization and capabilities
       static void init(Util::Config * cfg);
       static JSON::Value capa;
       //non-virtual generic functions
       virtual int run();
+      bool runStep();
+      void runEnd();
       virtual void stats(bool force = false);
       void seek(unsigned long long pos);
       bool seek(unsigned int tid, unsigned long long pos, bool getNextKey = false);
@@ -55,6 +105,9 @@ namespace Mist {
       void selectDefaultTracks();
       bool connectToFile(std::string file);
       static bool listenMode(){return true;}
+      /// Whether multiple instances of this output can share a process, see worker().
+      static bool workerMode(){return true;}
+      static int worker(Socket::Server & server_socket, Output * (*create)(Socket::Connection & S));
       uint32_t currTrackCount() const;
       virtual bool isReadyForPlay();
       //virtuals. The optional virtuals have default implementations that do as little as possible.
@@ -76,15 +129,36 @@ namespace Mist {
       virtual void requestHandler();
     private://these *should* not be messed with in child classes.
       std::map<unsigned long, unsigned int> currKeyOpen;
-      void loadPageForKey(long unsigned int trackId, long long int keyNum);
+      bool loadPageForKey(long unsigned int trackId, long long int keyNum);
+      bool seekLater(unsigned int tid, unsigned long long pos, bool getNextKey, unsigned int ms);
       int pageNumForKey(long unsigned int trackId, long long int keyNum);
       int pageNumMax(long unsigned int trackId);
+      char * dataNotifier(long unsigned int trackId);
+      uint32_t dataNotifyValue(long unsigned int trackId);
+      bool waitForData(long unsigned int trackId, uint32_t seen, unsigned int ms);
+      std::map<unsigned long, trackPageIndex> pageIndex;///< Sorted copies of the track index pages, per track.
+      uint32_t metaGeneration;///< Generation of the live metadata page that myMeta was last updated from.
       unsigned int lastStats;///<Time of last sending of stats.
       long long unsigned int firstTime;///< Time of first packet after last seek. Used for real-time sending.
       std::map<unsigned long, unsigned long> nxtKeyNum;///< Contains the number of the next key, for page seeking purposes.
-      std::set<sortedPageInfo> buffer;///< A sorted list of next-to-be-loaded packets.
+      sortedPageBuffer buffer;///< A sorted list of next-to-be-loaded packets, one per track.
       bool sought;///<If a seek has been done, this is set to true. Used for seeking on prepareNext().
+      bool firstData;///< True until the first request was handled; the first request may already be buffered.
+      bool atLivePoint;///< True if the last prepared packet was the last one currently available.
+      unsigned int emptyCount;///< Amount of times in a row no new data was available.
+      //step-wise running state, see runStep()
+      bool stepping;///< If true, never block while waiting for data or time to pass: set nextStep instead.
+      uint64_t nextStep;///< Time in ms before which runStep() has nothing to do. Zero if it may be called right away.
+      bool packetPending;///< True if thisPacket was prepared, but not sent yet.
+      uint8_t paceTries;///< Amount of times sending of thisPacket may still be delayed for real-time playback.
+      uint32_t lookTries;///< Amount of times sending of thisPacket may still be delayed for metadata look ahead. Zero if not waiting.
+      uint64_t dataWaitUntil;///< When stepping, time until which we wait for new data before giving up. Zero if not waiting.
+      std::map<unsigned long, keyPageWait> pageWaits;///< When stepping, page loads per track that wait for their page.
+      std::map<unsigned long, trackSeekWait> seekWaits;///< When stepping, seeks per track that wait for data, retried by prepareNext().
+      uint32_t pollEvents;///< Events worker() polls the socket of this output for.
+      uint64_t connNum;///< Number of the connection of this output within its worker() process.
     protected://these are to be messed with by child classes
+      std::map<unsigned long, DTSC::TrackIndex> keyIndex;///< Native copies of the key and part tables, per track.
       bool pushing;
       uint64_t lastRecv;
       virtual std::string getConnectedHost();
@@ -100,6 +174,7 @@ namespace Mist {
       //stream delaying variables
       unsigned int maxSkipAhead;///< Maximum ms that we will go ahead of the intended timestamps.
       unsigned int realTime;///< Playback speed in ms of data per second. eg: 0 is infinite, 1000 real-time, 5000 is 0.2X speed, 500 = 2X speed.
+      uint32_t droppedFrames;///< Amount of frames not sent because the connection could not keep up. Reported in the statistics.
       uint32_t needsLookAhead;///< Amount of millis we need to be able to look ahead in the metadata
 
       //Read/write status variables
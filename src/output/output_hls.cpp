@@ -1,6 +1,8 @@
 #include "output_hls.h"
 #include <mist/stream.h>
+#include <mist/bitfields.h>
 #include <unistd.h>
+#include <time.h>
 
 namespace Mist {
   bool OutHLS::isReadyForPlay() {
@@ -40,10 +42,10 @@ namespace Mist {
         if (audioId != -1){
           result << "_" << audioId;
         }
-        result << "/index.m3u8?sessId=" << getpid() << "\r\n";
+        result << "/index.m3u8\r\n";
       }
     }
-    if (!vidTracks && audioId){
+    if (!vidTracks && audioId != -1){
       result << "#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=" << (myMeta.tracks[audioId].bps * 8) << "\r\n";
       result << audioId << "/index.m3u8\r\n";
     }
@@ -104,14 +106,99 @@ namespace Mist {
     DEBUG_MSG(DLVL_HIGH, "Sending this index: %s", result.str().c_str());
     return result.str();
   } //liveIndex
+
+  /// Returns the playlist for the given track, or the master playlist if tid is negative, without session IDs.
+  /// Playlists only change when fragments are added or removed, so they are rendered once per fragment change
+  /// and shared with all viewers through the cache.
+  /// \param etag Set to the quoted entity tag of this version of the playlist
+  /// \param modified Set to the time this version was rendered, formatted for the Last-Modified header
+  std::string OutHLS::cachedIndex(int tid, std::string & etag, std::string & modified){
+    updateMeta();
+    DTSC::Track & Trk = (tid < 0 ? myMeta.mainTrack() : myMeta.tracks[tid]);
+    std::stringstream version;
+    if (tid < 0){
+      //The master playlist lists the codec and bandwidth of every track, hashed to keep the cache key short
+      std::stringstream trackInfo;
+      for (std::map<unsigned int,DTSC::Track>::iterator it = myMeta.tracks.begin(); it != myMeta.tracks.end(); it++){
+        trackInfo << it->first << "_" << it->second.codec << "_" << it->second.bps << ";";
+      }
+      version << "m" << myMeta.tracks.size() << "_" << std::hex << checksum::crc32(0, trackInfo.str().data(), trackInfo.str().size()) << std::dec;
+    }else{
+      version << tid;
+    }
+    version << "-" << Trk.missedFrags << "-" << Trk.fragments.size();
+    etag = "\"" + version.str() + "\"";
+
+    std::string result;
+    time_t rendered = 0;
+    std::string key = "m3u8_" + version.str();
+    IPC::sharedPage page;
+    uint64_t pageSize = 0;
+    IPC::cacheResult res = IPC::CACHE_MISS;
+    if (!cache && config->getInteger("segmentcache") > 0){
+      cache.init(streamName, config->getInteger("segmentcache") * 1024 * 1024);
+    }
+    if (cache){
+      res = cache.claim(key, page, pageSize);
+      //Rendering is quick, so wait only briefly for another viewer to finish it
+      for (unsigned int i = 0; res == IPC::CACHE_BUSY && i < 50; ++i){
+        Util::sleep(2);
+        res = cache.claim(key, page, pageSize);
+      }
+    }
+    if (res == IPC::CACHE_HIT && pageSize >= 8){
+      //The cached data is the render time, followed by the playlist
+      rendered = Bit::btohll(page.mapped);
+      result.assign(page.mapped + 8, pageSize - 8);
+    }else{
+      std::string noSess;
+      result = (tid < 0 ? liveIndex() : liveIndex(tid, noSess));
+      rendered = time(0);
+      if (res == IPC::CACHE_MISS && cache){
+        std::string data(8, '\0');
+        Bit::htobll((char*)data.data(), rendered);
+        data += result;
+        cache.store(key, Trk.firstms, data.data(), data.size());
+      }
+    }
+    char timeBuf[64];
+    struct tm tmpTime;
+    strftime(timeBuf, 64, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&rendered, &tmpTime));
+    modified = timeBuf;
+    return result;
+  }
+
+  /// Appends the session ID to every URL in a playlist that was rendered without session IDs.
+  static std::string addSessId(const std::string & playlist, const std::string & sessId){
+    std::string result;
+    result.reserve(playlist.size() + 128 * (sessId.size() + 8));
+    size_t lineStart = 0;
+    while (lineStart < playlist.size()){
+      size_t lineEnd = playlist.find("\r\n", lineStart);
+      if (lineEnd == std::string::npos){lineEnd = playlist.size();}
+      result.append(playlist, lineStart, lineEnd - lineStart);
+      if (lineEnd > lineStart && playlist[lineStart] != '#'){
+        result += "?sessId=" + sessId;
+      }
+      result.append(playlist, lineEnd, 2);
+      lineStart = lineEnd + 2;
+    }
+    return result;
+  }
   
   
   OutHLS::OutHLS(Socket::Connection & conn) : TSOutput(conn){
     realTime = 0;
     until=0xFFFFFFFFFFFFFFFFull;
+    cacheTime = 0;
   }
   
-  OutHLS::~OutHLS() {}
+  OutHLS::~OutHLS() {
+    //Let other viewers generate the segment we did not finish
+    if (cacheKey.size()){
+      cache.abandon(cacheKey);
+    }
+  }
   
   void OutHLS::init(Util::Config * cfg){
     HTTPOutput::init(cfg);
@@ -125,6 +212,13 @@ namespace Mist {
     capa["methods"][0u]["handler"] = "http";
     capa["methods"][0u]["type"] = "html5/application/vnd.apple.mpegurl";
     capa["methods"][0u]["priority"] = 9ll;
+    capa["optional"]["segmentcache"]["name"] = "Segment cache";
+    capa["optional"]["segmentcache"]["help"] = "Megabytes of generated segments and playlists to keep in shared memory per stream, so each is only generated once for all viewers. Zero disables the cache.";
+    capa["optional"]["segmentcache"]["default"] = 64ll;
+    capa["optional"]["segmentcache"]["option"] = "--segmentcache";
+    capa["optional"]["segmentcache"]["short"] = "c";
+    capa["optional"]["segmentcache"]["type"] = "uint";
+    cfg->addOption("segmentcache", JSON::fromString("{\"arg\":\"integer\",\"value\":[64],\"short\":\"c\",\"long\":\"segmentcache\",\"help\":\"Megabytes of generated segments to keep in shared memory per stream. Zero disables the cache.\"}"));
   }
 
   void OutHLS::onHTTP() {
@@ -193,6 +287,7 @@ namespace Mist {
           H.Clean(); //clean for any possible next requests
           return;
         }else{
+          audTrack = 0;
           selectedTracks.clear();
           selectedTracks.insert(vidTrack);
         }
@@ -231,7 +326,46 @@ namespace Mist {
         return;
       }
 
+      //Serve the segment from the cache if another viewer already generated it
+      if (cacheKey.size()){
+        cache.abandon(cacheKey);
+        cacheKey.clear();
+      }
+      if (!cache && config->getInteger("segmentcache") > 0){
+        cache.init(streamName, config->getInteger("segmentcache") * 1024 * 1024);
+      }
+      if (cache){
+        if (myMeta.live){
+          cache.evictBefore(Trk.firstms);
+        }
+        std::stringstream key;
+        key << vidTrack << "_" << audTrack << "_" << from << "_" << until << (appleCompat ? "a" : "");
+        IPC::sharedPage segment;
+        uint64_t segSize = 0;
+        IPC::cacheResult res = cache.claim(key.str(), segment, segSize);
+        //The viewer generating the segment renders it into the cache before sending it, so it is ready as soon as
+        //the data was read: wait about as long as that takes, then generate it ourselves
+        unsigned long long waitUntil = Util::getMS() + 5000;
+        while (res == IPC::CACHE_BUSY && Util::getMS() < waitUntil && myConn){
+          Util::sleep(10);
+          res = cache.claim(key.str(), segment, segSize);
+        }
+        if (res == IPC::CACHE_HIT){
+          H.StartResponse(H, myConn, VLCworkaround);
+          H.Chunkify(segment.mapped, segSize, myConn);
+          H.Chunkify("", 0, myConn);
+          return;
+        }
+        if (res == IPC::CACHE_MISS){
+          cacheKey = key.str();
+          cacheData.clear();
+          cacheTime = from;
+        }
+      }
+
       H.StartResponse(H, myConn, VLCworkaround);
+      //The segment is sent in many writes; let the kernel fill full packets until it is done
+      myConn.setCork(true);
       //we assume whole fragments - but timestamps may be altered at will
       uint32_t fragIndice = Trk.timeToFragnum(from);
       contPAT = Trk.missedFrags + fragIndice; //PAT continuity counter
@@ -245,6 +379,7 @@ namespace Mist {
     } else {
       initialize();
       std::string request = H.url.substr(H.url.find("/", 5) + 1);
+      std::string knownTag = H.GetHeader("If-None-Match");
       H.Clean();
       if (H.url.find(".m3u8") != std::string::npos){
         H.SetHeader("Content-Type", "audio/x-mpegurl");
@@ -264,14 +399,34 @@ namespace Mist {
         return;
       }
       std::string manifest;
+      std::string etag;
+      std::string modified;
       if (request.find("/") == std::string::npos){
-        manifest = liveIndex();
+        //The master playlist hands out a session ID of its own
+        std::stringstream newSess;
+        newSess << getpid();
+        sessId = newSess.str();
+        manifest = cachedIndex(-1, etag, modified);
       }else{
         int selectId = atoi(request.substr(0,request.find("/")).c_str());
-        manifest = liveIndex(selectId, sessId);
+        manifest = cachedIndex(selectId, etag, modified);
+      }
+      if (sessId.size()){
+        etag.insert(etag.size() - 1, "-" + sessId);
+      }
+      H.SetHeader("ETag", etag);
+      H.SetHeader("Last-Modified", modified);
+      if (knownTag == etag){
+        H.SendResponse("304", "Not Modified", myConn);
+        H.Clean();
+        return;
+      }
+      if (sessId.size()){
+        manifest = addSessId(manifest, sessId);
       }
       H.SetBody(manifest);
       H.SendResponse("200", "OK", myConn);
+      H.Clean();
     }
   }
 
@@ -293,13 +448,22 @@ namespace Mist {
           packData.addStuffing();
           while (contPkg % 16 != 0){
             packData.setContinuityCounter(++contPkg);
-            sendTS(packData.checkAndGetBuffer());
+            queueTS(packData.checkAndGetBuffer());
           }
           packData.clear();
         }
       }
+      flushTS();
+      if (cacheKey.size()){
+        cache.store(cacheKey, cacheTime, cacheData.data(), cacheData.size());
+        cacheKey.clear();
+        //The segment was only rendered into memory so far, now that it is shared it goes out to this viewer too
+        H.Chunkify(cacheData.data(), cacheData.size(), myConn);
+        cacheData.clear();
+      }
 
-      //Signal end of data
+      //Signal end of data, uncorking first so it goes out right away
+      myConn.setCork(false);
       H.Chunkify("", 0, myConn);
       return;
     }
@@ -307,7 +471,13 @@ namespace Mist {
     TSOutput::sendNext();
   }
 
+  /// Sends TS data to the viewer, or only collects it while rendering a segment for the cache.
+  /// That way other viewers waiting for the segment never wait on the connection of this viewer.
   void OutHLS::sendTS(const char * tsData, unsigned int len){    
+    if (cacheKey.size()){
+      cacheData.append(tsData, len);
+      return;
+    }
     H.Chunkify(tsData, len, myConn);
   }
 }
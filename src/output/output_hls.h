@@ -15,11 +15,16 @@ namespace Mist {
       bool hasSessionIDs(){return true;}
       std::string liveIndex();
       std::string liveIndex(int tid, std::string & sessId);
+      std::string cachedIndex(int tid, std::string & etag, std::string & modified);
       int canSeekms(unsigned int ms);
       int keysToSend;      
       unsigned int vidTrack;
       unsigned int audTrack;
       long long unsigned int until;
+      IPC::sharedCache cache;///< Segments shared by all HLS viewers of this stream
+      std::string cacheKey;///< Key of the segment being generated for the cache, empty if none
+      std::string cacheData;///< Data of the segment being generated for the cache
+      long long unsigned int cacheTime;///< Start time of the segment being generated for the cache
   };
 }
 
@@ -15,6 +15,7 @@ namespace Mist {
       virtual void onHTTP(){};
       virtual void requestHandler();
       static bool listenMode(){return false;}
+      static bool workerMode(){return false;}///< Requests may be handed off to other outputs by replacing this process.
       void reConnector(std::string & connector);
       std::string getHandler();
   protected:
@@ -6,8 +6,213 @@
 #include "output_progressive_mp4.h"
 
 #include <inttypes.h>
+#include <algorithm>
 
 namespace Mist {
+  interleaveIndex::interleaveIndex(){
+    base = 0;
+    len = 0;
+  }
+
+  /// Returns the size of an index with the given amount of tracks and parts.
+  uint64_t interleaveIndex::layoutSize(uint32_t trackCount, uint32_t partCount){
+    uint64_t res = 24 + 4 * trackCount + 4 * (trackCount + 1);
+    res += (8 - res % 8) % 8;
+    return res + 8 * (partCount + 1) + 8 * partCount + 12 * partCount;
+  }
+
+  /// Points the member arrays into the index. The index is laid out as:
+  /// - 8 byte - size of the MP4 header, 8 byte - size of the whole file
+  /// - 4 byte - track count T, 4 byte - part count P
+  /// - T * 4 byte - track IDs, in selection order
+  /// - (T + 1) * 4 byte - for each track, where its parts start in the per-track arrays, followed by P
+  /// - padding to 8 bytes
+  /// - (P + 1) * 8 byte - for each interleaved part, its offset in the mdat data, followed by the size of the mdat data
+  /// - P * 8 byte - per-track arrays: for each part of each track, its time
+  /// - P * 4 byte - for each interleaved part, the position of its track in the selection
+  /// - P * 4 byte - for each interleaved part, its index within its track
+  /// - P * 4 byte - per-track arrays: for each part of each track, its interleaved position
+  void interleaveIndex::setPointers(){
+    uint32_t trackCount = *(const uint32_t*)(base + 16);
+    uint32_t partCount = *(const uint32_t*)(base + 20);
+    uint64_t at = 24;
+    tids = (const uint32_t*)(base + at);
+    at += 4 * trackCount;
+    firstPart = (const uint32_t*)(base + at);
+    at += 4 * (trackCount + 1);
+    at += (8 - at % 8) % 8;
+    offsets = (const uint64_t*)(base + at);
+    at += 8 * (partCount + 1);
+    times = (const uint64_t*)(base + at);
+    at += 8 * partCount;
+    slots = (const uint32_t*)(base + at);
+    at += 4 * partCount;
+    parts = (const uint32_t*)(base + at);
+    at += 4 * partCount;
+    positions = (const uint32_t*)(base + at);
+  }
+
+  /// Builds the index by interleaving the parts of the given tracks the same way they are sent: ordered by time,
+  /// then by track ID.
+  void interleaveIndex::build(DTSC::Meta & M, const std::set<unsigned long> & tracks, uint64_t headerSize, uint64_t fileSize){
+    uint32_t trackCount = tracks.size();
+    uint32_t partCount = 0;
+    for (std::set<unsigned long>::const_iterator it = tracks.begin(); it != tracks.end(); it++){
+      partCount += M.tracks[*it].parts.size();
+    }
+    own.assign(layoutSize(trackCount, partCount), '\0');
+    base = own.data();
+    len = own.size();
+    char * w = (char*)own.data();
+    *(uint64_t*)w = headerSize;
+    *(uint64_t*)(w + 8) = fileSize;
+    *(uint32_t*)(w + 16) = trackCount;
+    *(uint32_t*)(w + 20) = partCount;
+    setPointers();
+    uint32_t slot = 0;
+    uint32_t first = 0;
+    for (std::set<unsigned long>::const_iterator it = tracks.begin(); it != tracks.end(); it++){
+      DTSC::Track & thisTrack = M.tracks[*it];
+      ((uint32_t*)tids)[slot] = *it;
+      ((uint32_t*)firstPart)[slot] = first;
+      uint64_t time = thisTrack.firstms;
+      for (unsigned int i = 0; i < thisTrack.parts.size(); ++i){
+        ((uint64_t*)times)[first + i] = time;
+        time += thisTrack.parts[i].getDuration();
+      }
+      first += thisTrack.parts.size();
+      ++slot;
+    }
+    ((uint32_t*)firstPart)[trackCount] = partCount;
+
+    //Tracks are inserted in selection order, so ordering by slot is the same as ordering by track ID
+    std::set<keyPart> sortSet;
+    for (slot = 0; slot < trackCount; ++slot){
+      if (firstPart[slot + 1] > firstPart[slot]){
+        keyPart temp;
+        temp.trackID = slot;
+        temp.time = times[firstPart[slot]];
+        temp.index = 0;
+        sortSet.insert(temp);
+      }
+    }
+    uint32_t pos = 0;
+    uint64_t dataSize = 0;
+    while (!sortSet.empty()){
+      keyPart temp = *sortSet.begin();
+      sortSet.erase(sortSet.begin());
+      DTSC::Track & thisTrack = M.tracks[tids[temp.trackID]];
+      ((uint64_t*)offsets)[pos] = dataSize;
+      ((uint32_t*)slots)[pos] = temp.trackID;
+      ((uint32_t*)parts)[pos] = temp.index;
+      ((uint32_t*)positions)[firstPart[temp.trackID] + temp.index] = pos;
+      dataSize += thisTrack.parts[temp.index].getSize();
+      ++pos;
+      if (temp.index + 1 < thisTrack.parts.size()){
+        temp.time += thisTrack.parts[temp.index].getDuration();
+        ++temp.index;
+        sortSet.insert(temp);
+      }
+    }
+    ((uint64_t*)offsets)[partCount] = dataSize;
+  }
+
+  /// Uses an index built by another process, without copying it. The data must stay valid while the index is used.
+  /// Returns false if the data is not an index of the given tracks.
+  bool interleaveIndex::load(const char * data, uint64_t size, const std::set<unsigned long> & tracks){
+    if (size < 24 || *(const uint32_t*)(data + 16) != tracks.size()){
+      return false;
+    }
+    if (size != layoutSize(*(const uint32_t*)(data + 16), *(const uint32_t*)(data + 20))){
+      return false;
+    }
+    own.clear();
+    base = data;
+    len = size;
+    setPointers();
+    uint32_t slot = 0;
+    for (std::set<unsigned long>::const_iterator it = tracks.begin(); it != tracks.end(); it++){
+      if (tids[slot++] != *it){
+        base = 0;
+        len = 0;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Sets the MP4 header size and file size of an index built by this process.
+  void interleaveIndex::setSizes(uint64_t headerSize, uint64_t fileSize){
+    if (own.size() < 16){return;}
+    *(uint64_t*)own.data() = headerSize;
+    *(uint64_t*)(own.data() + 8) = fileSize;
+  }
+
+  uint64_t interleaveIndex::headerSize() const{
+    return base ? *(const uint64_t*)base : 0;
+  }
+
+  uint64_t interleaveIndex::fileSize() const{
+    return base ? *(const uint64_t*)(base + 8) : 0;
+  }
+
+  uint32_t interleaveIndex::trackCount() const{
+    return base ? *(const uint32_t*)(base + 16) : 0;
+  }
+
+  uint32_t interleaveIndex::partCount() const{
+    return base ? *(const uint32_t*)(base + 20) : 0;
+  }
+
+  /// Returns the interleaved position of the part holding the given byte of the mdat data.
+  /// Empty parts are skipped. Returns partCount() if the byte lies past the end of the data.
+  uint32_t interleaveIndex::find(uint64_t dataPos) const{
+    return std::upper_bound(offsets, offsets + partCount() + 1, dataPos) - offsets - 1;
+  }
+
+  /// Fills the sortSet with the next part of every track, as it would be while sending the part at the given position.
+  void interleaveIndex::resumeAt(uint32_t pos, std::set<keyPart> & sortSet) const{
+    sortSet.clear();
+    for (uint32_t slot = 0; slot < trackCount(); ++slot){
+      const uint32_t * start = positions + firstPart[slot];
+      const uint32_t * end = positions + firstPart[slot + 1];
+      uint32_t next = std::lower_bound(start, end, pos) - start;
+      if (start + next < end){
+        keyPart temp;
+        temp.trackID = tids[slot];
+        temp.time = times[firstPart[slot] + next];
+        temp.index = next;
+        sortSet.insert(temp);
+      }
+    }
+  }
+
+  /// Returns the cache key of the index of the given tracks: their IDs, followed by a hash of the part count, time
+  /// range, key count and init data of every track and the size of the source file, if known.
+  /// This does not look at the parts themselves, so getting the key stays cheap for long files. The index cache only
+  /// lives as long as the input that loaded the metadata (see Input::finish), so within its lifetime the metadata of a
+  /// track only changes by growing, which changes its part count or time range. A grown source file that was rescanned
+  /// changes the source size.
+  std::string interleaveIndex::cacheKey(DTSC::Meta & M, const std::set<unsigned long> & tracks){
+    std::stringstream key;
+    key << "mp4i";
+    uint64_t hash = 14695981039346656037ull;
+    for (std::set<unsigned long>::const_iterator it = tracks.begin(); it != tracks.end(); it++){
+      DTSC::Track & thisTrack = M.tracks[*it];
+      uint64_t fields[5] = {thisTrack.parts.size(), (uint64_t)thisTrack.firstms, (uint64_t)thisTrack.lastms, thisTrack.keys.size(), thisTrack.init.size()};
+      for (unsigned int i = 0; i < 5; ++i){
+        hash = (hash ^ fields[i]) * 1099511628211ull;
+      }
+      for (size_t i = 0; i < thisTrack.init.size(); ++i){
+        hash = (hash ^ (uint8_t)thisTrack.init[i]) * 1099511628211ull;
+      }
+      key << "_" << *it;
+    }
+    hash = (hash ^ (uint64_t)M.sourceSize) * 1099511628211ull;
+    key << "_" << std::hex << hash;
+    return key.str();
+  }
+
   OutProgressiveMP4::OutProgressiveMP4(Socket::Connection & conn) : HTTPOutput(conn){}
   OutProgressiveMP4::~OutProgressiveMP4() {}
   
@@ -24,15 +229,53 @@ namespace Mist {
     capa["methods"][0u]["type"] = "html5/video/mp4";
     capa["methods"][0u]["priority"] = 8ll;
     capa["methods"][0u]["nolive"] = 1;
+    capa["optional"]["indexcache"]["name"] = "Index cache";
+    capa["optional"]["indexcache"]["help"] = "Megabytes of interleave indexes to keep in shared memory per stream, so range requests of all viewers share one index per track selection. Zero disables the cache.";
+    capa["optional"]["indexcache"]["default"] = 64ll;
+    capa["optional"]["indexcache"]["option"] = "--indexcache";
+    capa["optional"]["indexcache"]["short"] = "c";
+    capa["optional"]["indexcache"]["type"] = "uint";
+    cfg->addOption("indexcache", JSON::fromString("{\"arg\":\"integer\",\"value\":[64],\"short\":\"c\",\"long\":\"indexcache\",\"help\":\"Megabytes of interleave indexes to keep in shared memory per stream. Zero disables the cache.\"}"));
   }
+
+  /// Makes sure the interleave index matches the current track selection and metadata.
+  /// The index is taken from the stream's index cache when another viewer already built it, and shared through it otherwise.
+  /// That cache is separate from the segment cache of the stream, so the two never evict each other's entries.
+  /// Only building the index walks the parts of the tracks; looking it up in the cache does not.
+  void OutProgressiveMP4::loadIndex(){
+    std::string ilvKey = interleaveIndex::cacheKey(myMeta, selectedTracks);
+    if (ilv.trackCount() && ilvKey == ilvCheck){
+      return;
+    }
+    ilvCheck = ilvKey;
+    IPC::cacheResult res = IPC::CACHE_MISS;
+    uint64_t pageSize = 0;
+    if (!cache && config->getInteger("indexcache") > 0){
+      cache.init(streamName, config->getInteger("indexcache") * 1024 * 1024, true, CACHE_MP4_INDEX);
+    }
+    if (cache){
+      res = cache.claim(ilvKey, ilvPage, pageSize);
+    }
+    if (res == IPC::CACHE_HIT && ilv.load(ilvPage.mapped, pageSize, selectedTracks)){
+      HIGH_MSG("Using shared interleave index of %" PRIu32 " parts", ilv.partCount());
+      return;
+    }
+    //If another viewer is building this index right now, building our own copy takes no longer than waiting for it
+    ilv.build(myMeta, selectedTracks, 0, 0);
+    uint64_t size = 0;
+    uint64_t headerSize = mp4HeaderSize(size);
+    ilv.setSizes(headerSize, size);
+    HIGH_MSG("Built interleave index of %" PRIu32 " parts", ilv.partCount());
+    if (res == IPC::CACHE_MISS && cache){
+      cache.store(ilvKey, 0, ilv.data(), ilv.size());
+    }
+  }
+  /// Estimates the file size from the size of the mdat data in the interleave index, which loadIndex() must have loaded.
   uint64_t OutProgressiveMP4::estimateFileSize() {
-    uint64_t retVal = 0;
-    for (std::set<unsigned long>::iterator it = selectedTracks.begin(); it != selectedTracks.end(); it++) {
-      for (std::deque<unsigned long>::iterator keyIt = myMeta.tracks[*it].keySizes.begin(); keyIt != myMeta.tracks[*it].keySizes.end(); keyIt++) {
-        retVal += *keyIt;
-      }
+    if (!ilv.data()){
+      return 0;
     }
-    return retVal * 1.1;
+    return ilv.offset(ilv.partCount()) * 1.1;
   }
 
   uint64_t OutProgressiveMP4::mp4HeaderSize(uint64_t & fileSize) {
@@ -76,24 +319,37 @@ namespace Mist {
       }
       
       //Unfortunately, for our STTS and CTTS boxes, we need to loop through all parts of the track
+      //The native part columns of the track index keep this a plain scan over contiguous memory
+      DTSC::TrackIndex & tIdx = keyIndex[*it];
+      tIdx.update(thisTrack);
+      const uint32_t * durs = tIdx.durations();
+      const uint32_t * offs = tIdx.offsets();
+      const uint32_t * sizes = tIdx.sizes();
       uint64_t sttsCount = 1;
-      uint64_t prevDur = thisTrack.parts[0].getDuration();
-      uint64_t prevOffset = thisTrack.parts[0].getOffset();
+      uint64_t prevOffset = 0;
       uint64_t cttsCount = 1;
-      fileSize += thisTrack.parts[0].getSize();
-      for (unsigned int part = 1; part < partCount; ++part){
-        uint64_t partDur = thisTrack.parts[part].getDuration();
-        uint64_t partOffset = thisTrack.parts[part].getOffset();
-        uint64_t partSize = thisTrack.parts[part].getSize();
-        if (prevDur != partDur){
-          prevDur = partDur;
-          ++sttsCount;
+      if (partCount && tIdx.partCount() == partCount){
+        fileSize += sizes[0];
+        for (unsigned int part = 1; part < partCount; ++part){
+          sttsCount += (durs[part] != durs[part - 1]);
+          cttsCount += (offs[part] != offs[part - 1]);
+          fileSize += sizes[part];
         }
-        if (partOffset != prevOffset){
-          prevOffset = partOffset;
-          ++cttsCount;
+        prevOffset = offs[partCount - 1];
+      }else if (partCount){
+        //The index is out of step with the track, so fall back to the parts themselves
+        WARN_MSG("Track %lu index holds %" PRIu32 " parts instead of %" PRIu64 "; scanning parts directly", *it, tIdx.partCount(), partCount);
+        std::deque<DTSC::Part>::iterator part = thisTrack.parts.begin();
+        uint32_t prevDur = part->getDuration();
+        prevOffset = part->getOffset();
+        fileSize += part->getSize();
+        for (++part; part != thisTrack.parts.end(); ++part){
+          sttsCount += (part->getDuration() != prevDur);
+          cttsCount += (part->getOffset() != prevOffset);
+          prevDur = part->getDuration();
+          prevOffset = part->getOffset();
+          fileSize += part->getSize();
         }
-        fileSize += partSize;
       }
       if (cttsCount == 1 && ! prevOffset){
         cttsCount = 0;
@@ -330,40 +586,18 @@ namespace Mist {
     }
     //inserting right values in the STCO box header
     //total = 0;
-    //Keep track of the current size of the data within the mdat
-    uint64_t dataSize = 0;
     //Current values are actual byte offset without header-sized offset
-    std::set <keyPart> sortSet;//filling sortset for interleaving parts
-    for (std::set<long unsigned int>::iterator subIt = selectedTracks.begin(); subIt != selectedTracks.end(); subIt++) {
-      keyPart temp;
-      temp.trackID = *subIt;
-      temp.time = myMeta.tracks[*subIt].firstms;//timeplace of frame
-      temp.index = 0;
-      HIGH_MSG("Header sortSet: tid %lu time %lu", temp.trackID, temp.time);
-      sortSet.insert(temp);
-    }
-    while (!sortSet.empty()) {
-      stats();
-      keyPart temp = *sortSet.begin();
-      sortSet.erase(sortSet.begin());
-        
-      DTSC::Track & thisTrack = myMeta.tracks[temp.trackID];
-
+    loadIndex();
+    for (uint32_t pos = 0; pos < ilv.partCount(); ++pos){
       //setting the right STCO size in the STCO box
       if (useLargeBoxes){//Re-using the previously defined boolean for speedup
-        checkCO64Boxes[temp.trackID].setChunkOffset(dataOffset + dataSize, temp.index);
+        checkCO64Boxes[ilv.trackId(pos)].setChunkOffset(dataOffset + ilv.offset(pos), ilv.partIndex(pos));
       } else {
-        checkStcoBoxes[temp.trackID].setChunkOffset(dataOffset + dataSize, temp.index);
-      }
-      dataSize += thisTrack.parts[temp.index].getSize();
-      
-      //add next keyPart to sortSet
-      if (temp.index + 1< thisTrack.parts.size()) {//Only create new element, when there are new elements to be added 
-        temp.time += thisTrack.parts[temp.index].getDuration();
-        ++temp.index;
-        sortSet.insert(temp);
+        checkStcoBoxes[ilv.trackId(pos)].setChunkOffset(dataOffset + ilv.offset(pos), ilv.partIndex(pos));
       }
     }
+    //The size of the data within the mdat
+    uint64_t dataSize = ilv.offset(ilv.partCount());
 
     ///\todo Update this thing for boxes >4G?
     mdatSize = dataSize + 8;//+8 for mp4 header
@@ -388,40 +622,23 @@ namespace Mist {
     }
     //okay, we're past the header. Substract the headersize from the starting postion.
     byteStart -= headerSize;
-    //forward through the file by headers, until we reach the point where we need to be
-    while (!sortSet.empty()) {
-      //find the next part and erase it
-      keyPart temp = *sortSet.begin();
-
-      DTSC::Track & thisTrack = myMeta.tracks[temp.trackID];
-      uint64_t partSize = thisTrack.parts[temp.index].getSize();
-
-      //record where we are
-      seekPoint = temp.time;
-      //substract the size of this fragment from byteStart
-      //if that put us past the point where we wanted to be, return right now
-      if (partSize > byteStart) {
-        INFO_MSG("We're starting at time %" PRIu64 ", skipping %" PRIu64 " bytes", seekPoint, partSize - byteStart);
-        return;
-      }
-      
-
-      byteStart -= partSize; 
-
-      //otherwise, set currPos to where we are now and continue
-      currPos += partSize;
-
-      if (temp.index + 1 < myMeta.tracks[temp.trackID].parts.size()){ //only insert when there are parts left
-        temp.time += thisTrack.parts[temp.index].getDuration();
-        ++temp.index;
-        sortSet.insert(temp);
-      }
-      //Remove just-parsed element
-      sortSet.erase(sortSet.begin());
-      //wash, rinse, repeat
+    //look up the part holding the starting position, and continue the interleaving from there
+    loadIndex();
+    if (!ilv.partCount()){
+      return;
+    }
+    uint32_t pos = ilv.find(byteStart);
+    if (pos >= ilv.partCount()){
+      //We're past the last part. That's technically legal, of course.
+      seekPoint = ilv.partTime(ilv.partCount() - 1);
+      currPos += ilv.offset(ilv.partCount());
+      sortSet.clear();
+      return;
     }
-    //If we're here, we're in the last fragment.
-    //That's technically legal, of course.
+    seekPoint = ilv.partTime(pos);
+    currPos += ilv.offset(pos);
+    ilv.resumeAt(pos, sortSet);
+    INFO_MSG("We're starting at time %" PRIu64 ", skipping %" PRIu64 " bytes", seekPoint, byteStart - ilv.offset(pos));
   }
 
 /// Parses a "Range: " header, setting byteStart, byteEnd and seekPoint using data from metadata and tracks to do
@@ -511,8 +728,9 @@ namespace Mist {
     wantRequest = false;
     sentHeader = false;
 
-    fileSize = 0;
-    uint64_t headerSize = mp4HeaderSize(fileSize);
+    loadIndex();
+    fileSize = ilv.fileSize();
+    uint64_t headerSize = ilv.headerSize();
     seekPoint = 0;
     byteStart = 0;
     byteEnd = fileSize - 1;
@@ -22,6 +22,44 @@ namespace Mist {
       uint64_t index;
   };
   
+  ///\brief The order in which the parts of the selected tracks are interleaved in the mdat box, with the byte offset of
+  ///every part, so a byte position within the mdat resolves to a part with a binary search.
+  ///The index is a single flat block of memory, so it can be shared between viewers through a cache page as is.
+  class interleaveIndex {
+    public:
+      interleaveIndex();
+      void build(DTSC::Meta & M, const std::set<unsigned long> & tracks, uint64_t headerSize, uint64_t fileSize);
+      bool load(const char * data, uint64_t size, const std::set<unsigned long> & tracks);
+      void setSizes(uint64_t headerSize, uint64_t fileSize);
+      const char * data() const{return base;}
+      uint64_t size() const{return len;}
+      uint64_t headerSize() const;
+      uint64_t fileSize() const;
+      uint32_t trackCount() const;
+      uint32_t partCount() const;
+      uint32_t find(uint64_t dataPos) const;
+      uint64_t offset(uint32_t pos) const{return offsets[pos];}
+      unsigned long trackId(uint32_t pos) const{return tids[slots[pos]];}
+      uint32_t partIndex(uint32_t pos) const{return parts[pos];}
+      uint64_t partTime(uint32_t pos) const{return times[firstPart[slots[pos]] + parts[pos]];}
+      void resumeAt(uint32_t pos, std::set<keyPart> & sortSet) const;
+      static std::string cacheKey(DTSC::Meta & M, const std::set<unsigned long> & tracks);
+    private:
+      std::string own;///< Holds the index when it was built by this process
+      const char * base;
+      uint64_t len;
+      //Pointers into the index, see setPointers() for the layout
+      const uint32_t * tids;
+      const uint32_t * firstPart;
+      const uint64_t * offsets;
+      const uint64_t * times;
+      const uint32_t * slots;
+      const uint32_t * parts;
+      const uint32_t * positions;
+      static uint64_t layoutSize(uint32_t trackCount, uint32_t partCount);
+      void setPointers();
+  };
+
   class OutProgressiveMP4 : public HTTPOutput {
     public:
       OutProgressiveMP4(Socket::Connection & conn);
@@ -31,6 +69,7 @@ namespace Mist {
       uint64_t mp4HeaderSize(uint64_t & fileSize);
       std::string DTSCMeta2MP4Header(uint64_t & size);
       void findSeekPoint(uint64_t byteStart, uint64_t & seekPoint, uint64_t headerSize);
+      void loadIndex();
       void onHTTP();
       void sendNext();
       void sendHeader();
@@ -44,6 +83,10 @@ namespace Mist {
       
       //variables for standard MP4
       std::set <keyPart> sortSet;//needed for unfragmented MP4, remembers the order of keyparts
+      interleaveIndex ilv;///< Interleaving order and byte offsets of all parts of the selected tracks
+      std::string ilvCheck;///< Cache key of the current interleave index
+      IPC::sharedCache cache;///< Interleave indexes shared by all MP4 viewers of this stream
+      IPC::sharedPage ilvPage;///< Cache page the interleave index was loaded from, if any
 
       uint64_t estimateFileSize();
   };
@@ -10,35 +10,20 @@
 
 namespace Mist {
   OutRTMP::OutRTMP(Socket::Connection & conn) : Output(conn) {
+    //the handshake is done by onRequest as its data comes in
+    //block while it is going on, unless a worker process switches this connection to non-blocking again
     setBlocking(true);
-    while (!conn.Received().available(1537) && conn.connected() && config->is_active) {
-      conn.spool();
-    }
-    if (!conn || !config->is_active){
-      return;
-    }
-    RTMPStream::handshake_in.append(conn.Received().remove(1537));
-    RTMPStream::rec_cnt += 1537;
-
-    if (RTMPStream::doHandshake()) {
-      conn.SendNow(RTMPStream::handshake_out);
-      while (!conn.Received().available(1536) && conn.connected() && config->is_active) {
-        conn.spool();
-      }
-      conn.Received().remove(1536);
-      RTMPStream::rec_cnt += 1536;
-      HIGH_MSG("Handshake success");
-    } else {
-      MEDIUM_MSG("Handshake fail (this is not a problem, usually)");
-    }
-    setBlocking(false);
+    handshakeStep = 0;
     maxSkipAhead = 1500;
+    lastMeta = 0;
+    maxSendQueue = config->getInteger("maxsendqueue");
+    skipToKey = false;
   }
 
   bool OutRTMP::onFinish(){
     MEDIUM_MSG("Finishing stream %s, %s", streamName.c_str(), myConn?"while connected":"already disconnected");
     if (myConn){
-      myConn.SendNow(RTMPStream::SendUSR(1, 1)); //send UCM StreamEOF (1), stream 1
+      myConn.SendNow(rtmp.SendUSR(1, 1)); //send UCM StreamEOF (1), stream 1
       AMF::Object amfreply("container", AMF::AMF0_DDV_CONTAINER);
       amfreply.addContent(AMF::Object("", "onStatus")); //status reply
       amfreply.addContent(AMF::Object("", (double)0)); //transaction ID
@@ -146,16 +131,44 @@ namespace Mist {
     capa["methods"][0u]["type"] = "flash/10";
     capa["methods"][0u]["priority"] = 7ll;
     capa["methods"][0u]["player_url"] = "/flashplayer.swf";
+    capa["optional"]["maxsendqueue"]["name"] = "Maximum send queue";
+    capa["optional"]["maxsendqueue"]["help"] = "For live streams, the amount of sent bytes a viewer may have not received yet before video is skipped to the next keyframe. Frames that are flagged disposable are dropped from half this amount. Zero never drops frames, and waits for every send to complete instead.";
+    capa["optional"]["maxsendqueue"]["default"] = 524288ll;
+    capa["optional"]["maxsendqueue"]["option"] = "--maxsendqueue";
+    capa["optional"]["maxsendqueue"]["short"] = "q";
+    capa["optional"]["maxsendqueue"]["type"] = "uint";
     cfg->addConnectorOptions(1935, capa);
     config = cfg;
   }
   
+  /// Decides whether the current packet should be dropped because the viewer cannot keep up with a live stream.
+  /// Waiting bytes are those the kernel holds for the viewer, plus those sendNext kept because the socket was full.
+  /// Once more than maxSendQueue bytes are waiting to be received, video is skipped until a keyframe arrives
+  /// while at most half that amount is waiting. Disposable frames are already dropped from that half-way point on.
+  /// Audio is never dropped. Dropped frames are counted in droppedFrames.
+  bool OutRTMP::dropForBacklog(const DTSC::Track & track){
+    if (!myMeta.live || !maxSendQueue || track.type != "video"){return false;}
+    unsigned int queued = myConn.sendQueue() + myConn.sendPending();
+    if (!skipToKey && queued > maxSendQueue){
+      MEDIUM_MSG("Viewer fell behind (%u bytes unsent), skipping video to the next keyframe", queued);
+      skipToKey = true;
+    }
+    if (skipToKey && thisPacket.getFlag("keyframe") && queued <= maxSendQueue / 2){
+      MEDIUM_MSG("Viewer caught up, resuming video after dropping %lu frames in total", (unsigned long)droppedFrames);
+      skipToKey = false;
+    }
+    if (skipToKey || (queued > maxSendQueue / 2 && thisPacket.getFlag("disposableframe"))){
+      ++droppedFrames;
+      return true;
+    }
+    return false;
+  }
+
   void OutRTMP::sendNext(){
 
     //If there are now more selectable tracks, select the new track and do a seek to the current timestamp
     //Set sentHeader to false to force it to send init data
     if (myMeta.live && selectedTracks.size() < 2){
-      static unsigned long long lastMeta = 0;
       if (Util::epoch() > lastMeta + 5){
         lastMeta = Util::epoch();
         updateMeta();
@@ -181,11 +194,11 @@ namespace Mist {
                          0, 0, 0, 0}; //bytes 12-15 = extended timestamp
     char dataheader[] ={0, 0, 0, 0, 0};
     unsigned int dheader_len = 1;
-    static Util::ResizeablePointer swappy;
     char * tmpData = 0;//pointer to raw media data
     unsigned int data_len = 0;//length of processed media data
     thisPacket.getString("data", tmpData, data_len);
     DTSC::Track & track = myMeta.tracks[thisPacket.getTrackId()];
+    if (dropForBacklog(track)){return;}
     
     //set msg_type_id
     if (track.type == "video"){
@@ -283,8 +296,8 @@ namespace Mist {
       rtmpOffset = thisPacket.getTime();
     }
     
-    bool allow_short = RTMPStream::lastsend.count(4);
-    RTMPStream::Chunk & prev = RTMPStream::lastsend[4];
+    bool allow_short = rtmp.hasSent(4);
+    RTMPStream::Chunk & prev = rtmp.lastSent(4);
     unsigned char chtype = 0x00;
     unsigned int header_len = 12;
     bool time_is_diff = false;
@@ -346,58 +359,103 @@ namespace Mist {
       rtmpheader[3] = timestamp & 0xff;
     }
     
-    //send the header
-    myConn.setBlocking(true);
-    myConn.SendNow(rtmpheader, header_len);
-    //set the header's first byte to the "continue" type chunk, for later use
-    rtmpheader[0] = 0xC4;
-
-    //sent actual data - never send more than chunk_snd_max at a time
+    //gather the header, data header and payload, so the whole message goes out in a single write
+    //the payload is sent straight from the data page it was read from, which all viewers of the stream share
     //interleave blocks of max chunk_snd_max bytes with 0xC4 bytes to indicate continue
+    char continueChunk = 0xC4;
+    struct iovec part;
+    sendParts.clear();
+    part.iov_base = rtmpheader;
+    part.iov_len = header_len;
+    sendParts.push_back(part);
     unsigned int len_sent = 0;
     unsigned int steps = 0;
     while (len_sent < data_len){
-      unsigned int to_send = std::min(data_len - len_sent, RTMPStream::chunk_snd_max);
+      unsigned int to_send = std::min(data_len - len_sent, rtmp.chunk_snd_max);
       if (!len_sent){
-        myConn.SendNow(dataheader, dheader_len);
+        part.iov_base = dataheader;
+        part.iov_len = dheader_len;
+        sendParts.push_back(part);
         to_send -= dheader_len;
         len_sent += dheader_len;
       }
-      myConn.SendNow(tmpData+len_sent-dheader_len, to_send);
+      part.iov_base = tmpData+len_sent-dheader_len;
+      part.iov_len = to_send;
+      sendParts.push_back(part);
       len_sent += to_send;
       if (len_sent < data_len){
-        myConn.SendNow(rtmpheader, 1);
+        part.iov_base = &continueChunk;
+        part.iov_len = 1;
+        sendParts.push_back(part);
         ++steps;
       }
     }
-    myConn.setBlocking(false);
+    //live viewers are not waited for: what their socket does not accept is kept, and counts towards dropForBacklog
+    //once the kept data alone exceeds maxSendQueue, wait for it after all, so it cannot grow without bounds
+    if (myMeta.live && maxSendQueue && myConn.sendPending() < maxSendQueue){
+      myConn.Send(&sendParts[0], sendParts.size());
+    }else{
+      myConn.SendNow(&sendParts[0], sendParts.size());
+    }
     //update the sent data counter
-    RTMPStream::snd_cnt += header_len + data_len + steps;
+    rtmp.snd_cnt += header_len + data_len + steps;
   }
 
   void OutRTMP::sendHeader(){
     FLV::Tag tag;
     tag.DTSCMetaInit(myMeta, selectedTracks);
     if (tag.len){
-      myConn.SendNow(RTMPStream::SendMedia(tag));
+      myConn.SendNow(rtmp.SendMedia(tag));
     }
 
     for (std::set<long unsigned int>::iterator it = selectedTracks.begin(); it != selectedTracks.end(); it++){
       if (myMeta.tracks[*it].type == "video"){
         if (tag.DTSCVideoInit(myMeta.tracks[*it])){
-          myConn.SendNow(RTMPStream::SendMedia(tag));
+          myConn.SendNow(rtmp.SendMedia(tag));
         }
       }
       if (myMeta.tracks[*it].type == "audio"){
         if (tag.DTSCAudioInit(myMeta.tracks[*it])){
-          myConn.SendNow(RTMPStream::SendMedia(tag));
+          myConn.SendNow(rtmp.SendMedia(tag));
         }
       }
     }
     sentHeader = true;
   }
 
+  /// Advances the handshake as far as the received data allows.
+  /// Called for every bit of received data until it returns true, so it never waits for data itself.
+  /// \returns True once the handshake is done, and the received data holds chunks.
+  bool OutRTMP::handShake(){
+    Socket::Buffer & input = myConn.Received();
+    if (handshakeStep == 0){
+      if (!input.available(1537)){return false;}
+      rtmp.handshake_in.append(input.remove(1537));
+      rtmp.rec_cnt += 1537;
+      if (!rtmp.doHandshake()){
+        MEDIUM_MSG("Handshake fail (this is not a problem, usually)");
+        handshakeStep = 2;
+        setBlocking(false);
+        return true;
+      }
+      myConn.SendNow(rtmp.handshake_out);
+      handshakeStep = 1;
+    }
+    if (handshakeStep == 1){
+      if (!input.available(1536)){return false;}
+      input.consume(1536);
+      rtmp.rec_cnt += 1536;
+      HIGH_MSG("Handshake success");
+      handshakeStep = 2;
+      setBlocking(false);
+    }
+    return true;
+  }
+
   void OutRTMP::onRequest() {
+    if (handshakeStep < 2 && !handShake()){
+      return;
+    }
     parseChunk(myConn.Received());
   }
 
@@ -408,9 +466,9 @@ namespace Mist {
   void OutRTMP::sendCommand(AMF::Object & amfReply, int messageType, int streamId){
     HIGH_MSG("Sending: %s", amfReply.Print().c_str());
     if (messageType == 17){
-      myConn.SendNow(RTMPStream::SendChunk(3, messageType, streamId, (char)0 + amfReply.Pack()));
+      myConn.SendNow(rtmp.SendChunk(3, messageType, streamId, (char)0 + amfReply.Pack()));
     }else{
-      myConn.SendNow(RTMPStream::SendChunk(3, messageType, streamId, amfReply.Pack()));
+      myConn.SendNow(rtmp.SendChunk(3, messageType, streamId, amfReply.Pack()));
     }
   }//sendCommand
 
@@ -438,11 +496,11 @@ namespace Mist {
       }
       app_name = amfData.getContentP(2)->getContentP("tcUrl")->StrValue();
       app_name = app_name.substr(app_name.find('/', 7) + 1);
-      RTMPStream::chunk_snd_max = 65536; //64KiB
-      myConn.SendNow(RTMPStream::SendCTL(1, RTMPStream::chunk_snd_max)); //send chunk size max (msg 1)
-      myConn.SendNow(RTMPStream::SendCTL(5, RTMPStream::snd_window_size)); //send window acknowledgement size (msg 5)
-      myConn.SendNow(RTMPStream::SendCTL(6, RTMPStream::rec_window_size)); //send rec window acknowledgement size (msg 6)
-      myConn.SendNow(RTMPStream::SendUSR(0, 1)); //send UCM StreamBegin (0), stream 1
+      rtmp.chunk_snd_max = 65536; //64KiB
+      myConn.SendNow(rtmp.SendCTL(1, rtmp.chunk_snd_max)); //send chunk size max (msg 1)
+      myConn.SendNow(rtmp.SendCTL(5, rtmp.snd_window_size)); //send window acknowledgement size (msg 5)
+      myConn.SendNow(rtmp.SendCTL(6, rtmp.rec_window_size)); //send rec window acknowledgement size (msg 6)
+      myConn.SendNow(rtmp.SendUSR(0, 1)); //send UCM StreamBegin (0), stream 1
       //send a _result reply
       AMF::Object amfReply("container", AMF::AMF0_DDV_CONTAINER);
       amfReply.addContent(AMF::Object("", "_result")); //result success
@@ -476,7 +534,7 @@ namespace Mist {
       amfReply.addContent(AMF::Object("", (double)0, AMF::AMF0_NULL)); //null - command info
       amfReply.addContent(AMF::Object("", (double)1)); //stream ID - we use 1
       sendCommand(amfReply, messageType, streamId);
-      myConn.SendNow(RTMPStream::SendUSR(0, 1)); //send UCM StreamBegin (0), stream 1
+      myConn.SendNow(rtmp.SendUSR(0, 1)); //send UCM StreamBegin (0), stream 1
       return;
     }//createStream
     if (amfData.getContentP(0)->StrValue() == "ping"){
@@ -490,7 +548,7 @@ namespace Mist {
       return;
     }//createStream
     if (amfData.getContentP(0)->StrValue() == "closeStream"){
-      myConn.SendNow(RTMPStream::SendUSR(1, 1)); //send UCM StreamEOF (1), stream 1
+      myConn.SendNow(rtmp.SendUSR(1, 1)); //send UCM StreamEOF (1), stream 1
       AMF::Object amfreply("container", AMF::AMF0_DDV_CONTAINER);
       amfreply.addContent(AMF::Object("", "onStatus")); //status reply
       amfreply.addContent(AMF::Object("", (double)0)); //transaction ID
@@ -591,7 +649,7 @@ namespace Mist {
       amfReply.addContent(AMF::Object("", (double)0, AMF::AMF0_NULL)); //null - command info
       amfReply.addContent(AMF::Object("", 1, AMF::AMF0_BOOL)); //publish success?
       sendCommand(amfReply, messageType, streamId);
-      myConn.SendNow(RTMPStream::SendUSR(0, 1)); //send UCM StreamBegin (0), stream 1
+      myConn.SendNow(rtmp.SendUSR(0, 1)); //send UCM StreamBegin (0), stream 1
       //send a status reply
       amfReply = AMF::Object("container", AMF::AMF0_DDV_CONTAINER);
       amfReply.addContent(AMF::Object("", "onStatus")); //status reply
@@ -658,10 +716,10 @@ namespace Mist {
       sendCommand(amfreply, playMessageType, playStreamId);
       //send streamisrecorded if stream, well, is recorded.
       if (myMeta.vod){//isMember("length") && Strm.metadata["length"].asInt() > 0){
-        myConn.SendNow(RTMPStream::SendUSR(4, 1)); //send UCM StreamIsRecorded (4), stream 1
+        myConn.SendNow(rtmp.SendUSR(4, 1)); //send UCM StreamIsRecorded (4), stream 1
       }
       //send streambegin
-      myConn.SendNow(RTMPStream::SendUSR(0, 1)); //send UCM StreamBegin (0), stream 1
+      myConn.SendNow(rtmp.SendUSR(0, 1)); //send UCM StreamBegin (0), stream 1
       //and more reply
       amfreply = AMF::Object("container", AMF::AMF0_DDV_CONTAINER);
       amfreply.addContent(AMF::Object("", "onStatus")); //status reply
@@ -677,10 +735,10 @@ namespace Mist {
       rtmpOffset = currentTime();
       amfreply.getContentP(3)->addContent(AMF::Object("timecodeOffset", (double)rtmpOffset));
       sendCommand(amfreply, playMessageType, playStreamId);
-      RTMPStream::chunk_snd_max = 65536; //64KiB
-      myConn.SendNow(RTMPStream::SendCTL(1, RTMPStream::chunk_snd_max)); //send chunk size max (msg 1)
+      rtmp.chunk_snd_max = 65536; //64KiB
+      myConn.SendNow(rtmp.SendCTL(1, rtmp.chunk_snd_max)); //send chunk size max (msg 1)
       //send dunno?
-      myConn.SendNow(RTMPStream::SendUSR(32, 1)); //send UCM no clue?, stream 1
+      myConn.SendNow(rtmp.SendUSR(32, 1)); //send UCM no clue?, stream 1
 
       parseData = true;
       return;
@@ -718,10 +776,10 @@ namespace Mist {
       sendCommand(amfreply, playMessageType, playStreamId);
       //send streamisrecorded if stream, well, is recorded.
       if (myMeta.vod){//isMember("length") && Strm.metadata["length"].asInt() > 0){
-        myConn.SendNow(RTMPStream::SendUSR(4, 1)); //send UCM StreamIsRecorded (4), stream 1
+        myConn.SendNow(rtmp.SendUSR(4, 1)); //send UCM StreamIsRecorded (4), stream 1
       }
       //send streambegin
-      myConn.SendNow(RTMPStream::SendUSR(0, 1)); //send UCM StreamBegin (0), stream 1
+      myConn.SendNow(rtmp.SendUSR(0, 1)); //send UCM StreamBegin (0), stream 1
       //and more reply
       amfreply = AMF::Object("container", AMF::AMF0_DDV_CONTAINER);
       amfreply.addContent(AMF::Object("", "onStatus")); //status reply
@@ -738,10 +796,10 @@ namespace Mist {
         amfreply.getContentP(3)->addContent(AMF::Object("timecodeOffset", (double)rtmpOffset));
       }
       sendCommand(amfreply, playMessageType, playStreamId);
-      RTMPStream::chunk_snd_max = 65536; //64KiB
-      myConn.SendNow(RTMPStream::SendCTL(1, RTMPStream::chunk_snd_max)); //send chunk size max (msg 1)
+      rtmp.chunk_snd_max = 65536; //64KiB
+      myConn.SendNow(rtmp.SendCTL(1, rtmp.chunk_snd_max)); //send chunk size max (msg 1)
       //send dunno?
-      myConn.SendNow(RTMPStream::SendUSR(32, 1)); //send UCM no clue?, stream 1
+      myConn.SendNow(rtmp.SendUSR(32, 1)); //send UCM no clue?, stream 1
 
       return;
     }//seek
@@ -801,22 +859,14 @@ namespace Mist {
   ///\brief Gets and parses one RTMP chunk at a time.
   ///\param inputBuffer A buffer filled with chunk data.
   void OutRTMP::parseChunk(Socket::Buffer & inputBuffer){
-    //for DTSC conversion
-    static std::stringstream prebuffer; // Temporary buffer before sending real data
-    //for chunk parsing
-    static RTMPStream::Chunk next;
-    static FLV::Tag F;
-    static AMF::Object amfdata("empty", AMF::AMF0_DDV_CONTAINER);
-    static AMF::Object amfelem("empty", AMF::AMF0_DDV_CONTAINER);
-    static AMF::Object3 amf3data("empty", AMF::AMF3_DDV_CONTAINER);
-    static AMF::Object3 amf3elem("empty", AMF::AMF3_DDV_CONTAINER);
-
-    while (next.Parse(inputBuffer)){
+    RTMPStream::Chunk & next = nextChunk;
+    FLV::Tag & F = pushTag;
+    while (next.Parse(rtmp, inputBuffer)){
 
       //send ACK if we received a whole window
-      if ((RTMPStream::rec_cnt - RTMPStream::rec_window_at > RTMPStream::rec_window_size)){
-        RTMPStream::rec_window_at = RTMPStream::rec_cnt;
-        myConn.SendNow(RTMPStream::SendCTL(3, RTMPStream::rec_cnt)); //send ack (msg 3)
+      if ((rtmp.rec_cnt - rtmp.rec_window_at > rtmp.rec_window_size)){
+        rtmp.rec_window_at = rtmp.rec_cnt;
+        myConn.SendNow(rtmp.SendCTL(3, rtmp.rec_cnt)); //send ack (msg 3)
       }
 
       switch (next.msg_type_id){
@@ -829,8 +879,8 @@ namespace Mist {
           onFinish();
           break; //happens when connection breaks unexpectedly
         case 1: //set chunk size
-          RTMPStream::chunk_rec_max = ntohl(*(int *)next.data.c_str());
-          MEDIUM_MSG("CTRL: Set chunk size: %i", RTMPStream::chunk_rec_max);
+          rtmp.chunk_rec_max = ntohl(*(int *)next.data.c_str());
+          MEDIUM_MSG("CTRL: Set chunk size: %i", rtmp.chunk_rec_max);
           break;
         case 2: //abort message - we ignore this one
           MEDIUM_MSG("CTRL: Abort message");
@@ -838,8 +888,8 @@ namespace Mist {
           break;
         case 3: //ack
           VERYHIGH_MSG("CTRL: Acknowledgement");
-          RTMPStream::snd_window_at = ntohl(*(int *)next.data.c_str());
-          RTMPStream::snd_window_at = RTMPStream::snd_cnt;
+          rtmp.snd_window_at = ntohl(*(int *)next.data.c_str());
+          rtmp.snd_window_at = rtmp.snd_cnt;
           break;
         case 4:{
             //2 bytes event type, rest = event data
@@ -883,21 +933,19 @@ namespace Mist {
           break;
         case 5: //window size of other end
           MEDIUM_MSG("CTRL: Window size");
-          RTMPStream::rec_window_size = ntohl(*(int *)next.data.c_str());
-          RTMPStream::rec_window_at = RTMPStream::rec_cnt;
-          myConn.SendNow(RTMPStream::SendCTL(3, RTMPStream::rec_cnt)); //send ack (msg 3)
+          rtmp.rec_window_size = ntohl(*(int *)next.data.c_str());
+          rtmp.rec_window_at = rtmp.rec_cnt;
+          myConn.SendNow(rtmp.SendCTL(3, rtmp.rec_cnt)); //send ack (msg 3)
           break;
         case 6:
           MEDIUM_MSG("CTRL: Set peer bandwidth");
           //4 bytes window size, 1 byte limit type (ignored)
-          RTMPStream::snd_window_size = ntohl(*(int *)next.data.c_str());
-          myConn.SendNow(RTMPStream::SendCTL(5, RTMPStream::snd_window_size)); //send window acknowledgement size (msg 5)
+          rtmp.snd_window_size = ntohl(*(int *)next.data.c_str());
+          myConn.SendNow(rtmp.SendCTL(5, rtmp.snd_window_size)); //send window acknowledgement size (msg 5)
           break;
         case 8: //audio data
         case 9: //video data
         case 18:{//meta data
-          static std::map<unsigned int, AMF::Object> pushMeta;
-          static std::map<uint64_t, uint64_t> lastTagTime;
           if (!isInitialized){
             MEDIUM_MSG("Received useless media data");
             onFinish();
@@ -940,7 +988,7 @@ namespace Mist {
                 ptr[i+1] = tmpchar;
               }
             }
-            thisPacket.genericFill(tagTime, F.offset(), reTrack, F.getData(), F.getDataLen(), 0, F.isKeyframe);
+            thisPacket.genericFill(tagTime, F.offset(), reTrack, F.getData(), F.getDataLen(), 0, F.isKeyframe, F.isDisposable());
             ltt = tagTime;
             if (!nProxy.userClient.getData()){
               char userPageName[NAME_BUFFER_SIZE];
@@ -961,12 +1009,12 @@ namespace Mist {
             MEDIUM_MSG("Received AMF3 command message");
             if (next.data[0] != 0){
               next.data = next.data.substr(1);
-              amf3data = AMF::parse3(next.data);
+              AMF::Object3 amf3data = AMF::parse3(next.data);
               MEDIUM_MSG("AMF3: %s", amf3data.Print().c_str());
             }else{
               MEDIUM_MSG("Received AMF3-0 command message");
               next.data = next.data.substr(1);
-              amfdata = AMF::parse(next.data);
+              AMF::Object amfdata = AMF::parse(next.data);
               parseAMFCommand(amfdata, 17, next.msg_stream_id);
             }//parsing AMF0-style
           }
@@ -975,7 +1023,7 @@ namespace Mist {
           MEDIUM_MSG("Received AMF0 shared object");
           break;
         case 20:{//AMF0 command message
-            amfdata = AMF::parse(next.data);
+            AMF::Object amfdata = AMF::parse(next.data);
             parseAMFCommand(amfdata, 20, next.msg_stream_id);
           }
           break;
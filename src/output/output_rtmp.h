@@ -2,6 +2,7 @@
 #include <mist/flv_tag.h>
 #include <mist/amf.h>
 #include <mist/rtmpchunks.h>
+#include <mist/util.h>
 
 
 namespace Mist {
@@ -15,7 +16,20 @@ namespace Mist {
       void sendHeader();
       bool onFinish();
     protected:
+      RTMPStream::Session rtmp;///< Chunk stream state of this connection.
+      uint8_t handshakeStep;///< 0 while waiting for the first handshake part, 1 while waiting for the second, 2 when done.
+      bool handShake();
+      RTMPStream::Chunk nextChunk;///< The chunk that parseChunk reads into.
+      FLV::Tag pushTag;///< Pushed media messages are converted through this tag, which keeps its buffer between messages.
+      Util::ResizeablePointer swappy;///< Byte-swapped copy of 16-bit PCM audio that is being sent.
+      std::vector<struct iovec> sendParts;///< The pieces of the media message that sendNext writes in one go.
       uint64_t rtmpOffset;
+      uint64_t lastMeta;///< When the metadata was last checked for new tracks, in seconds since the epoch.
+      std::map<unsigned int, AMF::Object> pushMeta;///< Metadata pushed to us, per chunk stream.
+      std::map<uint64_t, uint64_t> lastTagTime;///< Timestamp of the last media tag pushed to us, per track.
+      uint32_t maxSendQueue;///< Unsent bytes at which live video is dropped until the next keyframe, zero to never drop.
+      bool skipToKey;///< True while dropping video frames until the next keyframe, because the viewer fell behind.
+      bool dropForBacklog(const DTSC::Track & track);
       void parseVars(std::string data);
       std::string app_name;
       void parseChunk(Socket::Buffer & inputBuffer);
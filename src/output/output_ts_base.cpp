@@ -9,6 +9,22 @@ namespace Mist {
     sendRepeatingHeaders = 0;
     appleCompat=false;
     lastHeaderTime = 0;
+    tsQueue.reserve(188 * 512);
+  }
+
+  /// Adds a TS packet to the queue. Queued packets are passed to sendTS in one call by flushTS.
+  void TSOutput::queueTS(const char * tsData, unsigned int len){
+    tsQueue.append(tsData, len);
+    //Don't let the queue grow unbounded on very large frames
+    if (tsQueue.size() >= 188 * 512){flushTS();}
+  }
+
+  /// Passes all queued TS packets to sendTS at once, and empties the queue.
+  void TSOutput::flushTS(){
+    if (tsQueue.size()){
+      sendTS(tsQueue.data(), tsQueue.size());
+      tsQueue.clear();
+    }
   }
 
   void TSOutput::fillPacket(char const * data, size_t dataLen, bool & firstPack, bool video, bool keyframe, uint32_t pkgPid, int & contPkg){
@@ -19,12 +35,12 @@ namespace Mist {
           TS::Packet tmpPack;
           tmpPack.FromPointer(TS::PAT);
           tmpPack.setContinuityCounter(++contPAT);
-          sendTS(tmpPack.checkAndGetBuffer());
-          sendTS(TS::createPMT(selectedTracks, myMeta, ++contPMT));
-          sendTS(TS::createSDT(streamName, ++contSDT));
+          queueTS(tmpPack.checkAndGetBuffer());
+          queueTS(TS::createPMT(selectedTracks, myMeta, ++contPMT));
+          queueTS(TS::createSDT(streamName, ++contSDT));
           packCounter += 3;
         }
-        sendTS(packData.checkAndGetBuffer());
+        queueTS(packData.checkAndGetBuffer());
         packCounter ++;
         packData.clear();
       }
@@ -183,5 +199,6 @@ namespace Mist {
       packData.addStuffing();
       fillPacket(0, 0, firstPack, video, keyframe, pkgPid, contPkg);
     }
+    flushTS();
   }
 }
@@ -16,6 +16,8 @@ namespace Mist {
       virtual ~TSOutput(){};
       virtual void sendNext();      
       virtual void sendTS(const char * tsData, unsigned int len=188){};
+      void queueTS(const char * tsData, unsigned int len=188);
+      void flushTS();
       void fillPacket(char const * data, size_t dataLen, bool & firstPack, bool video, bool keyframe, uint32_t pkgPid, int & contPkg);    
     protected:
       std::map<unsigned int, bool> first;
@@ -25,6 +27,7 @@ namespace Mist {
       int contSDT;
       unsigned int packCounter; ///\todo update constructors?
       TS::Packet packData;
+      std::string tsQueue; ///< TS packets waiting to be passed to sendTS together.
       bool haveAvcc;
       MP4::AVCC avccbox;
       bool appleCompat;
@@ -0,0 +1,118 @@
+/// \file dtsc_packet_bench.cpp
+/// Benchmarks the per-packet member lookups outputs do on DTSC::Packet against scanning the packed object per member.
+/// Reads packets from the DTSC file given as argument, or from a synthetic page of packets if none is given.
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <mist/dtsc.h>
+#include <mist/timing.h>
+
+/// Holds a page of packets back to back, as found in shared memory, plus the offset of each packet.
+struct packetPage{
+  std::string data;
+  std::vector<uint32_t> offsets;
+};
+
+/// Fills the page with video and audio-like packets: every video packet has an offset and every 50th is a keyframe.
+void makePage(packetPage & page, unsigned int count){
+  DTSC::Packet P;
+  for (unsigned int i = 0; i < count; ++i){
+    bool video = (i % 3 == 0);
+    std::string payload(video ? 1500 + (i * 37) % 4000 : 300, 'x');
+    P.genericFill(i * 15, video ? 80 : 0, video ? 1 : 2, payload.data(), payload.size(), page.data.size() + 1, video && !(i % 150));
+    page.offsets.push_back(page.data.size());
+    page.data.append(P.getData(), P.getDataLen());
+  }
+}
+
+/// Fills the page with the packets stored in a DTSC file, skipping its headers.
+/// \returns False if the file holds no packets.
+bool readPage(packetPage & page, const char * fileName){
+  std::ifstream file(fileName, std::ios::binary);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  std::string raw = contents.str();
+  size_t pos = 0;
+  DTSC::Packet P;
+  while (pos + 8 < raw.size()){
+    P.reInit(raw.data() + pos, 0, true);
+    if (!P){break;}
+    if (P.getVersion() == DTSC::DTSC_V2){
+      page.offsets.push_back(page.data.size());
+      page.data.append(P.getData(), P.getDataLen());
+    }
+    pos += P.getDataLen();
+  }
+  return page.offsets.size();
+}
+
+/// Reads the members TSOutput and OutRTMP read per packet by searching the packed object for each of them.
+unsigned long long readScanned(DTSC::Packet & P){
+  DTSC::Scan S = P.getScan();
+  char * dataPointer = 0;
+  unsigned int len = 0;
+  S.getMember("data").getString(dataPointer, len);
+  unsigned long long ret = len + S.getMember("offset").asInt() + (S.getMember("keyframe").asInt() ? 1 : 0);
+  if (S.hasMember("bpos")){ret += S.getMember("bpos").asInt();}
+  return ret;
+}
+
+/// Reads the same members through the DTSC::Packet getters.
+unsigned long long readIndexed(DTSC::Packet & P){
+  char * dataPointer = 0;
+  unsigned int len = 0;
+  P.getString("data", dataPointer, len);
+  unsigned long long ret = len + P.getInt("offset") + (P.getFlag("keyframe") ? 1 : 0);
+  if (P.hasMember("bpos")){ret += P.getInt("bpos");}
+  return ret;
+}
+
+int main(int argc, char ** argv){
+  packetPage page;
+  if (argc > 1){
+    if (!readPage(page, argv[1])){
+      fprintf(stderr, "No packets in %s\n", argv[1]);
+      return 1;
+    }
+  }else{
+    makePage(page, 20000);
+  }
+  const unsigned int rounds = 20;
+  DTSC::Packet P;
+  bool ok = true;
+  for (unsigned int i = 0; i < page.offsets.size(); ++i){
+    P.reInit(page.data.data() + page.offsets[i], 0, true);
+    if (readScanned(P) != readIndexed(P)){
+      fprintf(stderr, "Lookups disagree on packet %u\n", i);
+      ok = false;
+      break;
+    }
+  }
+
+  volatile unsigned long long sink = 0;
+  uint64_t start = Util::getMicros();
+  for (unsigned int r = 0; r < rounds; ++r){
+    for (unsigned int i = 0; i < page.offsets.size(); ++i){
+      P.reInit(page.data.data() + page.offsets[i], 0, true);
+      sink += readScanned(P);
+    }
+  }
+  uint64_t scanTime = Util::getMicros(start);
+  start = Util::getMicros();
+  for (unsigned int r = 0; r < rounds; ++r){
+    for (unsigned int i = 0; i < page.offsets.size(); ++i){
+      P.reInit(page.data.data() + page.offsets[i], 0, true);
+      sink += readIndexed(P);
+    }
+  }
+  uint64_t indexTime = Util::getMicros(start);
+  double packets = (double)rounds * page.offsets.size();
+  printf("%u packets: %6.1f ns/packet scanning per member, %6.1f ns/packet indexed\n", (unsigned int)page.offsets.size(),
+         scanTime * 1000.0 / packets, indexTime * 1000.0 / packets);
+  return ok ? 0 : 1;
+}
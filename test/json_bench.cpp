@@ -0,0 +1,146 @@
+/// \file json_bench.cpp
+/// Benchmarks JSON::Value parsing and serialisation over payloads shaped like the ones the controller and outputs handle:
+/// an API client list, a stream configuration and a stream's track metadata.
+/// Checks that every payload survives a round trip through both the text and the DTMI format unchanged.
+
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <mist/json.h>
+#include <mist/timing.h>
+
+/// An API client list as built by fillClients: a field list plus one array of values per session.
+JSON::Value makeClients(unsigned int count){
+  JSON::Value ret;
+  ret["fields"].append("host");
+  ret["fields"].append("stream");
+  ret["fields"].append("protocol");
+  ret["fields"].append("conntime");
+  ret["fields"].append("down");
+  ret["fields"].append("up");
+  ret["time"] = 1500000000ll;
+  for (unsigned int i = 0; i < count; ++i){
+    JSON::Value client;
+    client.append(std::string("::ffff:10.0.") + JSON::Value((long long)(i / 250)).asString() + "." + JSON::Value((long long)(i % 250)).asString());
+    client.append(std::string("stream") + JSON::Value((long long)(i % 40)).asString());
+    client.append(i % 3 ? "HTTP_Progressive_MP4" : "RTMP");
+    client.append((long long)(i * 7));
+    client.append((long long)i * 1234567);
+    client.append((long long)i * 1234);
+    ret["data"].append(client);
+  }
+  return ret;
+}
+
+/// A controller configuration holding count streams, each an object with a handful of small members.
+JSON::Value makeStreams(unsigned int count){
+  JSON::Value ret;
+  for (unsigned int i = 0; i < count; ++i){
+    std::string name = std::string("stream") + JSON::Value((long long)((i * 7919) % count)).asString();
+    JSON::Value & S = ret["streams"][name];
+    S["name"] = name;
+    S["source"] = std::string("/media/") + name + ".mp4";
+    S["DVR"] = 50000ll;
+    S["cut"] = 0ll;
+    S["segmentsize"] = 5000ll;
+    S["always_on"] = (long long)(i % 2);
+    S["online"] = 1ll;
+    S["processes"][0u]["process"] = "Livepeer";
+    S["processes"][0u]["target_profiles"][0u]["name"] = "720p";
+    S["processes"][0u]["target_profiles"][0u]["bitrate"] = 2000000ll;
+  }
+  ret["config"]["controller"]["interface"] = "0.0.0.0";
+  ret["config"]["controller"]["port"] = 4242ll;
+  return ret;
+}
+
+/// Track metadata of a stream with a video and an audio track and count keys, shaped like DTSC::Meta::toJSON.
+JSON::Value makeMeta(unsigned int count){
+  JSON::Value ret;
+  ret["vod"] = 1ll;
+  ret["version"] = 3ll;
+  for (unsigned int t = 1; t <= 2; ++t){
+    JSON::Value & T = ret["tracks"][std::string(t == 1 ? "H264_1" : "AAC_2")];
+    T["trackid"] = (long long)t;
+    T["type"] = t == 1 ? "video" : "audio";
+    T["codec"] = t == 1 ? "H264" : "AAC";
+    T["init"] = std::string(t == 1 ? 40 : 2, '\001');
+    T["bps"] = t == 1 ? 250000ll : 16000ll;
+    T["firstms"] = 0ll;
+    T["lastms"] = (long long)count * 2000;
+    T["keys"] = std::string(count * 16, '\002');
+    T["fragments"] = std::string(count / 5 * 14, '\003');
+    T["parts"] = std::string(count * 50 * 9, '\004');
+    for (unsigned int k = 0; k < count / 100; ++k){
+      T["keysizes"].append((long long)k * 9876);
+    }
+  }
+  return ret;
+}
+
+/// Times the parsers and serialisers over the given payload, repeating each operation rounds times.
+/// \returns True if the payload survives a round trip through text and DTMI.
+bool benchPayload(const char * name, const JSON::Value & payload, unsigned int rounds){
+  std::string text = payload.toString();
+  std::string packed = payload.toPacked();
+  bool ok = true;
+  if (JSON::fromString(text) != payload){
+    fprintf(stderr, "%s: text round trip changed the value\n", name);
+    ok = false;
+  }
+  if (JSON::fromDTMI(packed) != payload){
+    fprintf(stderr, "%s: DTMI round trip changed the value\n", name);
+    ok = false;
+  }
+
+  unsigned long long sink = 0;
+  uint64_t start = Util::getMicros();
+  for (unsigned int i = 0; i < rounds; ++i){sink += JSON::fromString(text).size();}
+  uint64_t parseText = Util::getMicros(start);
+  start = Util::getMicros();
+  for (unsigned int i = 0; i < rounds; ++i){sink += JSON::fromDTMI(packed).size();}
+  uint64_t parseDTMI = Util::getMicros(start);
+  start = Util::getMicros();
+  for (unsigned int i = 0; i < rounds; ++i){sink += payload.toString().size();}
+  uint64_t toString = Util::getMicros(start);
+  start = Util::getMicros();
+  for (unsigned int i = 0; i < rounds; ++i){sink += payload.toPacked().size();}
+  uint64_t toPacked = Util::getMicros(start);
+  start = Util::getMicros();
+  for (unsigned int i = 0; i < rounds; ++i){
+    JSON::Value copy = payload;
+    sink += copy.size();
+  }
+  uint64_t copy = Util::getMicros(start);
+  printf("%-8s %7u bytes: parse %8.1f us text, %8.1f us DTMI; toString %8.1f us; toPacked %8.1f us; copy %8.1f us (%llu)\n", name,
+         (unsigned int)text.size(), parseText / (double)rounds, parseDTMI / (double)rounds, toString / (double)rounds,
+         toPacked / (double)rounds, copy / (double)rounds, sink % 10);
+  return ok;
+}
+
+/// Times toNetPacked over count media packets, each a fresh object as inputs build them.
+void benchPackets(unsigned int count){
+  std::string payload(1200, 'x');
+  unsigned long long sink = 0;
+  uint64_t start = Util::getMicros();
+  for (unsigned int i = 0; i < count; ++i){
+    JSON::Value P;
+    P["trackid"] = 1ll;
+    P["time"] = (long long)i * 40;
+    P["data"] = payload;
+    P["bpos"] = (long long)i * 1300;
+    if (!(i % 50)){P["keyframe"] = 1ll;}
+    sink += P.toNetPacked().size();
+  }
+  uint64_t netPacked = Util::getMicros(start);
+  printf("packets  %7u: build and toNetPacked %6.1f ns/packet (%llu)\n", count, netPacked * 1000.0 / count, sink % 10);
+}
+
+int main(int argc, char ** argv){
+  bool ok = true;
+  ok &= benchPayload("clients", makeClients(10000), 10);
+  ok &= benchPayload("streams", makeStreams(2000), 10);
+  ok &= benchPayload("meta", makeMeta(600), 20);
+  benchPackets(200000);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+/// \file key_lookup_bench.cpp
+/// Benchmarks the time-to-key and key-to-page lookups of outputs against the linear scans they replaced.
+/// Lookup cost should stay flat as the DVR window grows.
+
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <mist/dtsc.h>
+#include <mist/bitfields.h>
+#include <mist/defines.h>
+#include <mist/shared_memory.h>
+#include <mist/timing.h>
+#include "../src/output/output.h"
+
+/// The key lookup of Output::getKeyForTime before it used DTSC::TrackIndex.
+unsigned int linearKeyForTime(DTSC::Track & trk, uint64_t timeStamp){
+  unsigned int keyNo = trk.keys.begin()->getNumber();
+  unsigned int partCount = 0;
+  std::deque<DTSC::Key>::iterator it;
+  for (it = trk.keys.begin(); it != trk.keys.end() && it->getTime() <= timeStamp; it++){
+    keyNo = it->getNumber();
+    partCount += it->getParts();
+  }
+  if (partCount && it != trk.keys.end() && timeStamp > it->getTime() - trk.parts[partCount-1].getDuration()){
+    ++keyNo;
+  }
+  return keyNo;
+}
+
+/// The key lookup of Output::getKeyForTime.
+unsigned int indexedKeyForTime(DTSC::Track & trk, DTSC::TrackIndex & kIdx, uint64_t seekTime){
+  kIdx.update(trk);
+  if (seekTime < kIdx.keyTime(0)){
+    return trk.keys.begin()->getNumber();
+  }
+  size_t keyIdx = kIdx.keyForTime(seekTime);
+  unsigned int keyNo = trk.keys[keyIdx].getNumber();
+  uint64_t partCount = kIdx.partsBefore(keyIdx + 1);
+  if (partCount && keyIdx + 1 < kIdx.keyCount() && seekTime > kIdx.keyTime(keyIdx + 1) - kIdx.partDuration(partCount - 1)){
+    ++keyNo;
+  }
+  return keyNo;
+}
+
+/// The page lookup of Output::pageNumForKey before it used Mist::trackPageIndex.
+int linearPageForKey(const char * mapped, long long keyNum){
+  for (int i = 0; i < SHM_TRACK_INDEX_ENTRIES; i++){
+    const char * tmpOffset = mapped + (i * 8);
+    long amountKey = Bit::btohl(tmpOffset+4);
+    if (amountKey == 0){continue;}
+    long tmpKey = Bit::btohl(tmpOffset);
+    if (tmpKey <= keyNum && ((tmpKey?tmpKey:1) + amountKey) > keyNum){
+      return tmpKey;
+    }
+  }
+  return -1;
+}
+
+/// Times lookups over a live track holding keyCount keys of 2 seconds, with 25 parts each.
+/// \returns True if both lookups agree on every probe.
+bool benchWindow(unsigned int keyCount){
+  DTSC::Meta M;
+  M.live = true;
+  M.tracks[1].trackID = 1;
+  M.tracks[1].type = "video";
+  M.tracks[1].codec = "H264";
+  for (uint64_t i = 0; i < keyCount * 25ull; ++i){
+    M.update(i * 80, 0, 1, 1000, 0, !(i % 25), 0);
+  }
+  DTSC::Track & trk = M.tracks[1];
+  DTSC::TrackIndex kIdx;
+  kIdx.update(trk);
+  uint64_t lastms = trk.keys.rbegin()->getTime();
+
+  //Pages of 10 keys each, entered on the index page in a scattered order, as the buffer reuses freed slots
+  std::string page(SHM_TRACK_INDEX_SIZE, '\0');
+  unsigned int pageCount = std::min(keyCount / 10, (unsigned int)SHM_TRACK_INDEX_ENTRIES);
+  for (unsigned int p = 0; p < pageCount; ++p){
+    unsigned int slot = (p * 389) % SHM_TRACK_INDEX_ENTRIES;
+    Bit::htobl((char*)page.data() + slot * 8, p * 10 + 1);
+    Bit::htobl((char*)page.data() + slot * 8 + 4, 10);
+  }
+  IPC::generation gen((char*)page.data() + SHM_TRACK_INDEX_GENERATION);
+  gen.startWrite();
+  gen.endWrite();
+  Mist::trackPageIndex pIdx;
+
+  const unsigned int probes = 2000;
+  std::vector<uint64_t> times(probes);
+  std::vector<long long> keys(probes);
+  for (unsigned int i = 0; i < probes; ++i){
+    times[i] = (lastms / probes) * i + (i * 37) % 2000;
+    keys[i] = 1 + ((uint64_t)i * 7919) % (pageCount * 10);
+  }
+
+  bool ok = true;
+  volatile unsigned long long sink = 0;
+  uint64_t start = Util::getMicros();
+  for (unsigned int i = 0; i < probes; ++i){sink += linearKeyForTime(trk, times[i]);}
+  uint64_t linearKey = Util::getMicros(start);
+  start = Util::getMicros();
+  for (unsigned int i = 0; i < probes; ++i){sink += indexedKeyForTime(trk, kIdx, times[i]);}
+  uint64_t indexedKey = Util::getMicros(start);
+  start = Util::getMicros();
+  for (unsigned int i = 0; i < probes; ++i){sink += linearPageForKey(page.data(), keys[i]);}
+  uint64_t linearPage = Util::getMicros(start);
+  start = Util::getMicros();
+  for (unsigned int i = 0; i < probes; ++i){
+    int pageNum = pIdx.pageForKey(page.data(), keys[i]);
+    if (pageNum == -1 && pIdx.update(page.data(), page.size())){
+      pageNum = pIdx.pageForKey(page.data(), keys[i]);
+    }
+    sink += pageNum;
+  }
+  uint64_t indexedPage = Util::getMicros(start);
+
+  for (unsigned int i = 0; i < probes; ++i){
+    if (linearKeyForTime(trk, times[i]) != indexedKeyForTime(trk, kIdx, times[i])){
+      fprintf(stderr, "Key mismatch for time %llu\n", (unsigned long long)times[i]);
+      ok = false;
+    }
+    if (linearPageForKey(page.data(), keys[i]) != pIdx.pageForKey(page.data(), keys[i])){
+      fprintf(stderr, "Page mismatch for key %lld\n", keys[i]);
+      ok = false;
+    }
+  }
+  printf("%6u keys, %4u pages: time->key %8.1f ns linear, %6.1f ns indexed; key->page %7.1f ns linear, %6.1f ns indexed\n", keyCount, pageCount,
+         linearKey * 1000.0 / probes, indexedKey * 1000.0 / probes, linearPage * 1000.0 / probes, indexedPage * 1000.0 / probes);
+  return ok;
+}
+
+int main(int argc, char ** argv){
+  unsigned int windows[] = {100, 1000, 5000, 10000};
+  bool ok = true;
+  for (unsigned int i = 0; i < sizeof(windows) / sizeof(windows[0]); ++i){
+    ok &= benchWindow(windows[i]);
+  }
+  return ok ? 0 : 1;
+}
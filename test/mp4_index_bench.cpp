@@ -0,0 +1,144 @@
+/// \file mp4_index_bench.cpp
+/// Benchmarks resolving progressive MP4 byte ranges through the interleave index against replaying the interleaving
+/// part by part, as findSeekPoint did before. Also times building the index, which happens once per track selection,
+/// and computing its cache key, which happens for every request.
+
+#include <cstdlib>
+#include <cstdio>
+#include <set>
+#include <mist/dtsc.h>
+#include <mist/timing.h>
+#include "../src/output/output_progressive_mp4.h"
+
+/// The part holding a byte of the mdat data: its track, its index within the track and its time.
+struct partPosition{
+  unsigned long trackId;
+  uint64_t index;
+  uint64_t time;
+};
+
+/// Finds the part holding the given byte by replaying the interleaving from the start, as findSeekPoint did.
+partPosition replayedPart(DTSC::Meta & M, const std::set<unsigned long> & tracks, uint64_t byteStart){
+  std::set<Mist::keyPart> sortSet;
+  for (std::set<unsigned long>::const_iterator it = tracks.begin(); it != tracks.end(); it++){
+    Mist::keyPart temp;
+    temp.trackID = *it;
+    temp.time = M.tracks[*it].firstms;
+    temp.index = 0;
+    sortSet.insert(temp);
+  }
+  partPosition res = {0, 0, 0};
+  while (!sortSet.empty()){
+    Mist::keyPart temp = *sortSet.begin();
+    DTSC::Track & thisTrack = M.tracks[temp.trackID];
+    uint64_t partSize = thisTrack.parts[temp.index].getSize();
+    res.trackId = temp.trackID;
+    res.index = temp.index;
+    res.time = temp.time;
+    if (partSize > byteStart){
+      return res;
+    }
+    byteStart -= partSize;
+    if (temp.index + 1 < thisTrack.parts.size()){
+      temp.time += thisTrack.parts[temp.index].getDuration();
+      ++temp.index;
+      sortSet.insert(temp);
+    }
+    sortSet.erase(sortSet.begin());
+  }
+  return res;
+}
+
+/// Fills M with a VoD asset of the given length: 25fps video with a keyframe every 2 seconds, and 44.1kHz AAC audio.
+void makeAsset(DTSC::Meta & M, unsigned int minutes){
+  M.vod = true;
+  M.tracks[1].trackID = 1;
+  M.tracks[1].type = "video";
+  M.tracks[1].codec = "H264";
+  M.tracks[1].init = std::string(40, '\001');
+  M.tracks[2].trackID = 2;
+  M.tracks[2].type = "audio";
+  M.tracks[2].codec = "AAC";
+  M.tracks[2].init = std::string(2, '\002');
+  uint64_t end = minutes * 60000ull;
+  uint64_t bpos = 1;
+  uint64_t v = 0, a = 0;
+  while (v * 40 < end || a * 1024000 / 44100 < end){
+    uint64_t vTime = v * 40;
+    uint64_t aTime = a * 1024000 / 44100;
+    if (vTime < end && vTime <= aTime){
+      uint64_t size = (v % 50) ? 2000 + (v * 7919) % 6000 : 40000;
+      M.update(vTime, 40, 1, size, bpos, !(v % 50));
+      bpos += size;
+      ++v;
+    }else{
+      M.update(aTime, 0, 2, 371, bpos, false);
+      bpos += 371;
+      ++a;
+    }
+  }
+}
+
+/// Times both lookups for probes spread over an asset of the given length.
+/// \returns True if both lookups agree on every probe.
+bool benchAsset(unsigned int minutes){
+  DTSC::Meta M;
+  makeAsset(M, minutes);
+  std::set<unsigned long> tracks;
+  tracks.insert(1);
+  tracks.insert(2);
+  uint64_t start = Util::getMicros();
+  std::string key = Mist::interleaveIndex::cacheKey(M, tracks);
+  uint64_t keyTime = Util::getMicros(start);
+  Mist::interleaveIndex ilv;
+  start = Util::getMicros();
+  ilv.build(M, tracks, 0, 0);
+  uint64_t buildTime = Util::getMicros(start);
+  uint64_t dataSize = ilv.offset(ilv.partCount());
+
+  const unsigned int probes = 10;
+  bool ok = true;
+  uint64_t replayTime = 0, indexTime = 0;
+  for (unsigned int i = 0; i < probes; ++i){
+    uint64_t bytePos = dataSize / probes * i + dataSize / (probes * 2);
+    start = Util::getMicros();
+    partPosition old = replayedPart(M, tracks, bytePos);
+    replayTime += Util::getMicros(start);
+    start = Util::getMicros();
+    uint32_t pos = 0;
+    for (unsigned int r = 0; r < 1000; ++r){pos = ilv.find(bytePos + r % 2);}
+    indexTime += Util::getMicros(start);
+    pos = ilv.find(bytePos);
+    if (old.trackId != ilv.trackId(pos) || old.index != ilv.partIndex(pos) || old.time != ilv.partTime(pos)){
+      fprintf(stderr, "Byte %llu: replay found part %llu of track %lu, index found part %lu of track %lu\n", (unsigned long long)bytePos,
+              (unsigned long long)old.index, old.trackId, (unsigned long)ilv.partIndex(pos), ilv.trackId(pos));
+      ok = false;
+    }
+  }
+  if (key != Mist::interleaveIndex::cacheKey(M, tracks)){
+    fprintf(stderr, "Cache key changed without the metadata changing\n");
+    ok = false;
+  }
+  M.sourceSize += 1000;
+  if (key == Mist::interleaveIndex::cacheKey(M, tracks)){
+    fprintf(stderr, "Cache key did not change with the source size\n");
+    ok = false;
+  }
+  M.update(M.tracks[2].lastms + 23, 0, 2, 371, M.sourceSize, false);
+  if (key == Mist::interleaveIndex::cacheKey(M, tracks)){
+    fprintf(stderr, "Cache key did not change when a track grew\n");
+    ok = false;
+  }
+  printf("%4u minutes, %7u parts: range lookup %9.1f us replayed, %6.3f us indexed; index built in %6.1f ms, cache key in %5.1f us\n",
+         minutes, ilv.partCount(), replayTime / (double)probes, indexTime / (1000.0 * probes), buildTime / 1000.0, (double)keyTime);
+  return ok;
+}
+
+int main(int argc, char ** argv){
+  unsigned int lengths[] = {10, 60, 120};
+  bool ok = true;
+  for (unsigned int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i){
+    ok &= benchAsset(lengths[i]);
+  }
+  return ok ? 0 : 1;
+}
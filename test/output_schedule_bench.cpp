@@ -0,0 +1,169 @@
+/// \file output_schedule_bench.cpp
+/// Benchmarks Output::prepareNext over synthetic multi-track VoD pages in shared memory,
+/// and the sortedPageBuffer it schedules packets with against the std::set it replaced.
+
+#include <cstdlib>
+#include <cstdio>
+#include <set>
+#include <algorithm>
+#include <string>
+#include <unistd.h>
+#include <mist/dtsc.h>
+#include <mist/bitfields.h>
+#include <mist/defines.h>
+#include <mist/shared_memory.h>
+#include <mist/timing.h>
+#include "../src/output/output.h"
+
+/// Output that plays from pages set up by the benchmark instead of from a running input.
+class benchOutput : public Mist::Output{
+  public:
+    benchOutput(Socket::Connection & conn, Util::Config & cfg, const std::string & stream, const DTSC::Meta & M) : Output(conn){
+      config = &cfg;
+      streamName = stream;
+      myMeta = M;
+      for (std::map<unsigned int, DTSC::Track>::iterator it = myMeta.tracks.begin(); it != myMeta.tracks.end(); ++it){
+        selectedTracks.insert(it->first);
+      }
+      isInitialized = true;
+    }
+    void stats(bool force = false){}
+    const DTSC::Packet & packet() const{return thisPacket;}
+};
+
+/// Period in ms between packets of the given track: one video track at 25fps, the others audio-like.
+unsigned int trackPeriod(unsigned int tid){
+  return tid == 1 ? 40 : 21 + tid;
+}
+
+/// Writes one page per track holding packetsPerTrack packets, plus its track index page, into pages.
+/// \returns False if the pages could not be created.
+bool makePages(const std::string & stream, unsigned int trackCount, unsigned int packetsPerTrack, DTSC::Meta & M, IPC::sharedPage * pages){
+  std::string payload(200, 'x');
+  M.vod = true;
+  for (unsigned int tid = 1; tid <= trackCount; ++tid){
+    char name[NAME_BUFFER_SIZE];
+    snprintf(name, NAME_BUFFER_SIZE, SHM_TRACK_DATA, stream.c_str(), (unsigned long)tid, 1ul);
+    IPC::sharedPage & data = pages[tid * 2 - 2];
+    data.init(name, DEFAULT_DATA_PAGE_SIZE, true);
+    if (!data.mapped){return false;}
+    M.tracks[tid].trackID = tid;
+    M.tracks[tid].type = (tid == 1 ? "video" : "audio");
+    M.tracks[tid].codec = (tid == 1 ? "H264" : "AAC");
+    uint64_t offset = 0;
+    unsigned int keys = 0;
+    DTSC::Packet P;
+    for (unsigned int i = 0; i < packetsPerTrack; ++i){
+      bool key = !(i % 50);
+      keys += key;
+      P.genericFill(i * trackPeriod(tid), 0, tid, payload.data(), payload.size(), offset + 1, key);
+      if (offset + P.getDataLen() + 4 > DEFAULT_DATA_PAGE_SIZE){return false;}
+      memcpy(data.mapped + offset, P.getData(), P.getDataLen());
+      offset += P.getDataLen();
+      M.update(i * trackPeriod(tid), 0, tid, payload.size(), offset, key);
+    }
+    snprintf(name, NAME_BUFFER_SIZE, SHM_TRACK_INDEX, stream.c_str(), (unsigned long)tid);
+    IPC::sharedPage & index = pages[tid * 2 - 1];
+    index.init(name, SHM_TRACK_INDEX_SIZE, true);
+    if (!index.mapped){return false;}
+    Bit::htobl(index.mapped, 1);
+    Bit::htobl(index.mapped + 4, keys);
+  }
+  M.vod = true;
+  M.live = false;
+  return true;
+}
+
+/// Times prepareNext and the scheduling containers for the given amount of tracks.
+/// \returns True if prepareNext played all packets in timestamp order.
+bool benchTracks(unsigned int trackCount){
+  const unsigned int packetsPerTrack = 4000;
+  char streamBuf[64];
+  snprintf(streamBuf, 64, "schedbench%d", (int)getpid());
+  std::string stream = streamBuf;
+  DTSC::Meta M;
+  IPC::sharedPage pages[SIMUL_TRACKS * 2];
+  if (!makePages(stream, trackCount, packetsPerTrack, M, pages)){
+    fprintf(stderr, "Could not create pages for %u tracks\n", trackCount);
+    return false;
+  }
+
+  //keepGoing() needs an active config and an open connection, or page loads give up immediately
+  Util::Config cfg("output_schedule_bench");
+  Util::Config::is_active = true;
+  int fds[2];
+  if (pipe(fds)){
+    fprintf(stderr, "Could not create pipe\n");
+    return false;
+  }
+  Socket::Connection conn(fds[1], fds[0]);
+  benchOutput out(conn, cfg, stream, M);
+  out.seek(0);
+  //Stop before any track reaches the end of its page, where prepareNext would start waiting for more data
+  uint64_t stopTime = (packetsPerTrack - 2) * trackPeriod(1);
+  for (unsigned int tid = 2; tid <= trackCount; ++tid){
+    stopTime = std::min(stopTime, (uint64_t)(packetsPerTrack - 2) * trackPeriod(tid));
+  }
+  bool ok = true;
+  uint64_t played = 0;
+  uint64_t lastTime = 0;
+  uint64_t start = Util::getMicros();
+  while (true){
+    if (!out.prepareNext()){continue;}
+    const DTSC::Packet & P = out.packet();
+    if (!P || P.getTime() >= stopTime){break;}
+    if (P.getTime() < lastTime){ok = false;}
+    lastTime = P.getTime();
+    ++played;
+  }
+  uint64_t prepTime = Util::getMicros(start);
+  if (!ok){fprintf(stderr, "Packets were played out of order\n");}
+
+  //Replay the same schedule through both containers: take the earliest entry, then put back its track's next packet
+  const unsigned int steps = 1000000;
+  std::set<Mist::sortedPageInfo> oldBuffer;
+  Mist::sortedPageBuffer newBuffer;
+  for (unsigned int tid = 1; tid <= trackCount; ++tid){
+    Mist::sortedPageInfo info;
+    info.tid = tid;
+    info.time = 0;
+    info.offset = 0;
+    oldBuffer.insert(info);
+    newBuffer.insert(info);
+  }
+  start = Util::getMicros();
+  for (unsigned int i = 0; i < steps; ++i){
+    Mist::sortedPageInfo nxt = *oldBuffer.begin();
+    oldBuffer.erase(oldBuffer.begin());
+    nxt.time += trackPeriod(nxt.tid);
+    nxt.offset += 250;
+    oldBuffer.insert(nxt);
+  }
+  uint64_t setTime = Util::getMicros(start);
+  start = Util::getMicros();
+  for (unsigned int i = 0; i < steps; ++i){
+    Mist::sortedPageInfo nxt = newBuffer.front();
+    nxt.time += trackPeriod(nxt.tid);
+    nxt.offset += 250;
+    newBuffer.replaceFront(nxt);
+  }
+  uint64_t bufTime = Util::getMicros(start);
+  if (oldBuffer.begin()->tid != newBuffer.front().tid || oldBuffer.begin()->time != newBuffer.front().time){
+    fprintf(stderr, "Schedules diverged\n");
+    ok = false;
+  }
+
+  conn.close();
+  printf("%2u tracks: prepareNext %8.0f packets/s (%llu packets); scheduling %5.1f ns std::set, %5.1f ns sortedPageBuffer\n", trackCount,
+         played * 1000000.0 / (prepTime ? prepTime : 1), (unsigned long long)played, setTime * 1000.0 / steps, bufTime * 1000.0 / steps);
+  return ok;
+}
+
+int main(int argc, char ** argv){
+  unsigned int counts[] = {2, 4, 8, SIMUL_TRACKS};
+  bool ok = true;
+  for (unsigned int i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i){
+    ok &= benchTracks(counts[i]);
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,226 @@
+/// \file rtmp_ingest_bench.cpp
+/// Benchmarks RTMP push ingest by replaying a capture of the chunk stream a publisher sends, after the handshake.
+/// Reads the capture from the file given as argument, or writes a synthetic 20Mbit/s capture to a temporary file first.
+/// Reports MB/s per core and heap allocations per frame for every stage of the ingest path, each including those before it.
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <mist/amf.h>
+#include <mist/dtsc.h>
+#include <mist/flv_tag.h>
+#include <mist/rtmpchunks.h>
+#include <mist/timing.h>
+
+/// Capture frames per second, and the size of non-key video frames and audio frames.
+/// Keyframes are four times the size of other video frames and arrive every 2 seconds.
+#define VIDEO_FPS 30
+#define AUDIO_FPS 43
+#define VIDEO_FRAME (20000000 / 8 / VIDEO_FPS)
+#define AUDIO_FRAME (128000 / 8 / AUDIO_FPS)
+
+/// Amount of heap allocations and reallocations, by anything in this process.
+static unsigned long long allocations = 0;
+
+#ifdef __GLIBC__
+extern "C"{
+  void * __libc_malloc(size_t size);
+  void * __libc_realloc(void * ptr, size_t size);
+  void * __libc_calloc(size_t count, size_t size);
+  void * malloc(size_t size){
+    ++allocations;
+    return __libc_malloc(size);
+  }
+  void * realloc(void * ptr, size_t size){
+    ++allocations;
+    return __libc_realloc(ptr, size);
+  }
+  void * calloc(size_t count, size_t size){
+    ++allocations;
+    return __libc_calloc(count, size);
+  }
+}
+#endif
+
+/// The stages of the ingest path, as done by OutRTMP::parseChunk for every media message.
+enum ingestStage{
+  STAGE_PARSE, ///< RTMPStream::Chunk::Parse reassembles the message from its chunks.
+  STAGE_TAG, ///< FLV::Tag::ChunkLoader copies it into an FLV tag, and toMeta checks the track it belongs to.
+  STAGE_PACKET, ///< DTSC::Packet::genericFill copies the payload into a DTSC packet.
+  STAGE_PAGE, ///< The packet is copied onto the data page, as bufferLivePacket does.
+  STAGE_COUNT
+};
+
+const char * stageNames[STAGE_COUNT] = {"chunk parse", "+ FLV tag", "+ DTSC packet", "+ page copy"};
+
+/// Writes a synthetic capture of the given amount of seconds to fileName: a chunk size message followed by 20Mbit/s of H264 video
+/// and 128kbit/s of AAC audio, sent in chunks of chunkSize bytes.
+bool writeCapture(const char * fileName, unsigned int seconds, unsigned int chunkSize){
+  std::ofstream file(fileName, std::ios::binary);
+  RTMPStream::Session session;
+  file << session.SendCTL(1, chunkSize);
+  session.chunk_snd_max = chunkSize;
+  std::string payload;
+  for (unsigned int s = 0; s < seconds; ++s){
+    unsigned int v = 0, a = 0;
+    while (v < VIDEO_FPS || a < AUDIO_FPS){
+      unsigned int vTime = s * 1000 + v * 1000 / VIDEO_FPS;
+      unsigned int aTime = s * 1000 + a * 1000 / AUDIO_FPS;
+      if (v < VIDEO_FPS && (a >= AUDIO_FPS || vTime <= aTime)){
+        //an FLV AVC NALU message, holding a single slice with a nal_ref_idc of 3
+        unsigned int nalSize = (v ? VIDEO_FRAME : VIDEO_FRAME * 4) - 9;
+        payload.assign(v ? VIDEO_FRAME : VIDEO_FRAME * 4, (char)(s + v));
+        payload[0] = v ? 0x27 : 0x17;
+        payload[1] = 1;
+        payload[2] = payload[3] = payload[4] = 0;
+        payload[5] = (nalSize >> 24) & 0xFF;
+        payload[6] = (nalSize >> 16) & 0xFF;
+        payload[7] = (nalSize >> 8) & 0xFF;
+        payload[8] = nalSize & 0xFF;
+        payload[9] = v ? 0x61 : 0x65;
+        file << session.SendMedia(0x09, (unsigned char *)payload.data(), payload.size(), vTime);
+        ++v;
+      }else{
+        payload.assign(AUDIO_FRAME, (char)a);
+        payload[0] = 0xAF;
+        payload[1] = 1;
+        file << session.SendMedia(0x08, (unsigned char *)payload.data(), payload.size(), aTime);
+        ++a;
+      }
+    }
+  }
+  return file.good();
+}
+
+/// Everything the ingest path of a single connection keeps between messages.
+struct ingestState{
+  RTMPStream::Session session;
+  RTMPStream::Chunk next;
+  FLV::Tag F;
+  DTSC::Meta M;
+  AMF::Object amfStorage;
+  DTSC::Packet P;
+  std::string page;
+};
+
+/// Replays the capture through the ingest path up to and including the given stage.
+/// The capture is handed over in reads of 16KiB, as they would come from the network.
+/// \returns The sum of the media payload sizes that came out, to check all stages saw the same messages.
+unsigned long long replay(const std::string & capture, ingestStage stage, ingestState & state, unsigned int & frames){
+  RTMPStream::Session & session = state.session;
+  RTMPStream::Chunk & next = state.next;
+  FLV::Tag & F = state.F;
+  DTSC::Packet & P = state.P;
+  std::string & page = state.page;
+  session.chunk_rec_max = 128;//the capture starts at the beginning of a connection
+  if (page.size() < 16 * 1024 * 1024){page.resize(16 * 1024 * 1024);}
+  size_t pageOffset = 0;
+  unsigned long long sum = 0;
+  frames = 0;
+  Socket::Buffer buffer;
+  for (size_t pos = 0; pos < capture.size(); pos += 16384){
+    buffer.append(capture.data() + pos, std::min((size_t)16384, capture.size() - pos));
+    while (next.Parse(session, buffer)){
+      if (next.msg_type_id == 1 && next.data.size() >= 4){
+        session.chunk_rec_max = ntohl(*(int *)next.data.c_str());
+        continue;
+      }
+      if (next.msg_type_id != 8 && next.msg_type_id != 9){continue;}
+      ++frames;
+      if (stage == STAGE_PARSE){
+        sum += next.data.size() - (next.msg_type_id == 9 ? 5 : 2);
+        continue;
+      }
+      F.ChunkLoader(next);
+      unsigned int reTrack = next.cs_id * 3 + (F.data[0] == 0x09 ? 1 : 2);
+      F.toMeta(state.M, state.amfStorage, reTrack);
+      if (stage == STAGE_TAG){
+        sum += F.getDataLen();
+        continue;
+      }
+      P.genericFill(next.timestamp, F.offset(), reTrack, F.getData(), F.getDataLen(), 0, F.isKeyframe, F.isDisposable());
+      char * data;
+      unsigned int len;
+      P.getString("data", data, len);
+      sum += len;
+      if (stage == STAGE_PACKET){continue;}
+      if (pageOffset + P.getDataLen() > page.size()){pageOffset = 0;}
+      memcpy((char *)page.data() + pageOffset, P.getData(), P.getDataLen());
+      pageOffset += P.getDataLen();
+    }
+  }
+  return sum;
+}
+
+/// Replays the capture through all stages: once so buffers are grown already, then three timed runs of which the fastest counts.
+/// \returns False if the stages did not all see the same media payload.
+bool benchCapture(const std::string & capture){
+  unsigned long long sums[STAGE_COUNT];
+  bool ok = true;
+  for (unsigned int s = 0; s < STAGE_COUNT; ++s){
+    ingestState state;
+    unsigned int frames = 0;
+    replay(capture, (ingestStage)s, state, frames);
+    unsigned long long startAllocs = allocations;
+    uint64_t time = 0;
+    for (unsigned int run = 0; run < 3; ++run){
+      uint64_t start = Util::getMicros();
+      sums[s] = replay(capture, (ingestStage)s, state, frames);
+      uint64_t runTime = Util::getMicros(start);
+      if (!run || runTime < time){time = runTime;}
+    }
+    printf("  %-14s %8.1f MB/s, %6.2f allocations per frame (%u frames)\n", stageNames[s], capture.size() / (time ? (double)time : 1.0),
+           (allocations - startAllocs) / (3.0 * (frames ? frames : 1)), frames);
+    if (!frames || sums[s] != sums[0]){
+      fprintf(stderr, "Stage %s saw %llu bytes of media payload instead of %llu\n", stageNames[s], sums[s], sums[0]);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+/// Reads the whole file into capture.
+bool readCapture(const char * fileName, std::string & capture){
+  std::ifstream file(fileName, std::ios::binary);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  capture = contents.str();
+  return capture.size();
+}
+
+int main(int argc, char ** argv){
+  std::string capture;
+  if (argc > 1){
+    if (!readCapture(argv[1], capture)){
+      fprintf(stderr, "Could not read capture from %s\n", argv[1]);
+      return 1;
+    }
+    printf("%s, %u bytes:\n", argv[1], (unsigned int)capture.size());
+    return benchCapture(capture) ? 0 : 1;
+  }
+  char fileName[] = "/tmp/rtmp_ingest_benchXXXXXX";
+  int fd = mkstemp(fileName);
+  if (fd < 0){
+    fprintf(stderr, "Could not create a temporary capture file\n");
+    return 1;
+  }
+  close(fd);
+  unsigned int chunkSizes[] = {128, 4096};
+  bool ok = true;
+  for (unsigned int i = 0; i < sizeof(chunkSizes) / sizeof(chunkSizes[0]); ++i){
+    if (!writeCapture(fileName, 10, chunkSizes[i]) || !readCapture(fileName, capture)){
+      fprintf(stderr, "Could not write a capture to %s\n", fileName);
+      ok = false;
+      break;
+    }
+    printf("Synthetic capture in %u byte chunks, %u bytes:\n", chunkSizes[i], (unsigned int)capture.size());
+    ok &= benchCapture(capture);
+  }
+  unlink(fileName);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,214 @@
+/// \file rtmp_send_bench.cpp
+/// Benchmarks sending media to RTMP viewers: OutRTMP::sendNext over a local socket, and the gathering write it does
+/// against the separate writes per header, slice and continuation byte it replaced.
+/// Reports the cost per frame and how many viewers of a fixed bitrate stream one core could serve.
+
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <mist/dtsc.h>
+#include <mist/timing.h>
+#include "../src/output/output_rtmp.h"
+
+/// The benchmarked stream: 2.5Mbit/s of 30fps video with a keyframe every 2 seconds, plus 128kbit/s of 44.1kHz audio.
+#define VIDEO_FPS 30
+#define AUDIO_FPS 43
+#define VIDEO_FRAME (2500000 / 8 / VIDEO_FPS)
+#define AUDIO_FRAME (128000 / 8 / AUDIO_FPS)
+
+/// RTMP output that sends packets handed to it by the benchmark, instead of packets read from a stream.
+class benchOutput : public Mist::OutRTMP{
+  public:
+    benchOutput(Socket::Connection & conn, const DTSC::Meta & M, unsigned int chunkSize) : OutRTMP(conn){
+      myMeta = M;
+      for (std::map<unsigned int, DTSC::Track>::iterator it = myMeta.tracks.begin(); it != myMeta.tracks.end(); ++it){
+        selectedTracks.insert(it->first);
+      }
+      rtmp.chunk_snd_max = chunkSize;
+    }
+    void stats(bool force = false){}
+    void send(const char * packet){
+      thisPacket.reInit(packet, 0, true);
+      sendNext();
+    }
+};
+
+/// Sends a media message the way OutRTMP did before it gathered everything into one write:
+/// separate writes for the chunk header, the FLV data header, every chunk slice and every continuation byte,
+/// with the socket switched to blocking around them.
+void sendSeparately(Socket::Connection & conn, const char * rtmpheader, unsigned int header_len, const char * dataheader,
+                    unsigned int dheader_len, const char * data, unsigned int data_len, unsigned int chunkSize){
+  conn.setBlocking(true);
+  conn.SendNow(rtmpheader, header_len);
+  unsigned int len_sent = 0;
+  data_len += dheader_len;
+  while (len_sent < data_len){
+    unsigned int to_send = std::min(data_len - len_sent, chunkSize);
+    if (!len_sent){
+      conn.SendNow(dataheader, dheader_len);
+      to_send -= dheader_len;
+      len_sent += dheader_len;
+    }
+    conn.SendNow(data + len_sent - dheader_len, to_send);
+    len_sent += to_send;
+    if (len_sent < data_len){
+      char continueChunk = 0xC4;
+      conn.SendNow(&continueChunk, 1);
+    }
+  }
+  conn.setBlocking(false);
+}
+
+/// Sends the same message in one gathering write, as OutRTMP::sendNext does now.
+void sendGathered(Socket::Connection & conn, const char * rtmpheader, unsigned int header_len, const char * dataheader,
+                  unsigned int dheader_len, const char * data, unsigned int data_len, unsigned int chunkSize,
+                  std::vector<struct iovec> & parts){
+  static char continueChunk = 0xC4;
+  struct iovec part;
+  parts.clear();
+  part.iov_base = (void *)rtmpheader;
+  part.iov_len = header_len;
+  parts.push_back(part);
+  unsigned int len_sent = 0;
+  data_len += dheader_len;
+  while (len_sent < data_len){
+    unsigned int to_send = std::min(data_len - len_sent, chunkSize);
+    if (!len_sent){
+      part.iov_base = (void *)dataheader;
+      part.iov_len = dheader_len;
+      parts.push_back(part);
+      to_send -= dheader_len;
+      len_sent += dheader_len;
+    }
+    part.iov_base = (void *)(data + len_sent - dheader_len);
+    part.iov_len = to_send;
+    parts.push_back(part);
+    len_sent += to_send;
+    if (len_sent < data_len){
+      part.iov_base = &continueChunk;
+      part.iov_len = 1;
+      parts.push_back(part);
+    }
+  }
+  conn.SendNow(&parts[0], parts.size());
+}
+
+/// Reads everything the viewer side of the socket pair has received, so sends never have to wait.
+/// \returns The amount of bytes read.
+uint64_t drain(int fd){
+  static char buf[256 * 1024];
+  uint64_t total = 0;
+  int r;
+  while ((r = read(fd, buf, sizeof(buf))) > 0){total += r;}
+  return total;
+}
+
+/// Builds one second of the benchmarked stream as a page of DTSC packets, in playback order.
+void makeSecond(DTSC::Meta & M, std::string & page, std::vector<uint32_t> & offsets){
+  M.live = true;
+  M.tracks[1].trackID = 1;
+  M.tracks[1].type = "video";
+  M.tracks[1].codec = "H264";
+  M.tracks[2].trackID = 2;
+  M.tracks[2].type = "audio";
+  M.tracks[2].codec = "AAC";
+  M.tracks[2].rate = 44100;
+  M.tracks[2].size = 16;
+  M.tracks[2].channels = 2;
+  DTSC::Packet P;
+  unsigned int v = 0, a = 0;
+  while (v < VIDEO_FPS || a < AUDIO_FPS){
+    uint64_t vTime = v * 1000 / VIDEO_FPS;
+    uint64_t aTime = a * 1000 / AUDIO_FPS;
+    if (v < VIDEO_FPS && (a >= AUDIO_FPS || vTime <= aTime)){
+      //keyframes are four times the size of other frames
+      std::string payload(v ? VIDEO_FRAME * 56 / 59 : VIDEO_FRAME * 4, 'v');
+      P.genericFill(vTime, 40, 1, payload.data(), payload.size(), 0, !v);
+      ++v;
+    }else{
+      std::string payload(AUDIO_FRAME, 'a');
+      P.genericFill(aTime, 0, 2, payload.data(), payload.size(), 0, false);
+      ++a;
+    }
+    offsets.push_back(page.size());
+    page.append(P.getData(), P.getDataLen());
+  }
+}
+
+/// Times the send paths at the given chunk size, for the given amount of seconds of the stream.
+/// \returns False if the paths did not all write the same amount of payload.
+bool benchChunkSize(const DTSC::Meta & M, const std::string & page, const std::vector<uint32_t> & offsets,
+                    unsigned int chunkSize, unsigned int seconds){
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)){
+    fprintf(stderr, "Could not create socket pair\n");
+    return false;
+  }
+  int bufSize = 4 * 1024 * 1024;
+  setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(bufSize));
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+  Socket::Connection conn(fds[0]);
+  benchOutput out(conn, M, chunkSize);
+  out.setBlocking(false);
+
+  char rtmpheader[] = {0x04, 0, 0, 0, 0, 0, 0, 0x09, 1, 0, 0, 0};
+  char dataheader[] = {0x27, 1, 0, 0, 0x28};
+  std::vector<struct iovec> parts;
+  uint64_t sendNextTime = 0, separateTime = 0, gatheredTime = 0;
+  uint64_t sendNextBytes = 0, separateBytes = 0, gatheredBytes = 0;
+  for (unsigned int s = 0; s < seconds; ++s){
+    for (unsigned int i = 0; i < offsets.size(); ++i){
+      uint64_t start = Util::getMicros();
+      out.send(page.data() + offsets[i]);
+      sendNextTime += Util::getMicros(start);
+      sendNextBytes += drain(fds[1]);
+    }
+    for (unsigned int i = 0; i < offsets.size(); ++i){
+      DTSC::Packet P(page.data() + offsets[i], 0, true);
+      char * data;
+      unsigned int len;
+      P.getString("data", data, len);
+      uint64_t start = Util::getMicros();
+      sendSeparately(conn, rtmpheader, 1, dataheader, 5, data, len, chunkSize);
+      separateTime += Util::getMicros(start);
+      separateBytes += drain(fds[1]);
+      start = Util::getMicros();
+      sendGathered(conn, rtmpheader, 1, dataheader, 5, data, len, chunkSize, parts);
+      gatheredTime += Util::getMicros(start);
+      gatheredBytes += drain(fds[1]);
+    }
+  }
+  conn.close();
+  close(fds[1]);
+
+  double frames = (double)seconds * offsets.size();
+  printf("%5u byte chunks: sendNext %6.2f us/frame, %5.0f viewers/core; separate writes %6.2f us/frame, gathered write %6.2f us/frame\n",
+         chunkSize, sendNextTime / frames, 1000000.0 / (sendNextTime / (double)seconds), separateTime / frames, gatheredTime / frames);
+  if (separateBytes != gatheredBytes || sendNextBytes < gatheredBytes){
+    fprintf(stderr, "Send paths disagree: %llu bytes from sendNext, %llu separate, %llu gathered\n", (unsigned long long)sendNextBytes,
+            (unsigned long long)separateBytes, (unsigned long long)gatheredBytes);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char ** argv){
+  Util::Config cfg("rtmp_send_bench");
+  Mist::OutRTMP::init(&cfg);
+  Util::Config::is_active = true;
+  DTSC::Meta M;
+  std::string page;
+  std::vector<uint32_t> offsets;
+  makeSecond(M, page, offsets);
+  printf("Stream of %u kbit/s in %u frames per second\n", (unsigned int)(page.size() * 8 / 1000), (unsigned int)offsets.size());
+  unsigned int chunkSizes[] = {128, 4096, 65536};
+  bool ok = true;
+  for (unsigned int i = 0; i < sizeof(chunkSizes) / sizeof(chunkSizes[0]); ++i){
+    ok &= benchChunkSize(M, page, offsets, chunkSizes[i], 20);
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,178 @@
+/// \file socket_buffer_bench.cpp
+/// Benchmarks RTMP-style chunk ingest through Socket::Buffer against the std::deque<std::string> buffer it replaced.
+/// Reports MB/s on a single core for both, reading the same synthetic chunk stream in network-sized reads.
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <mist/socket.h>
+#include <mist/timing.h>
+
+#define BUFFER_BLOCKSIZE 4096 //the block size of lib/socket.cpp
+
+/// The Socket::Buffer before it stored its data contiguously, reduced to what chunk parsing uses.
+/// Data is split on the splitter and every BUFFER_BLOCKSIZE bytes; the oldest part is at the back.
+class dequeBuffer{
+  public:
+    std::deque<std::string> data;
+    std::string splitter;
+    dequeBuffer(){splitter = "\n";}
+    void size(){
+      while (data.size() > 0 && data.back().empty()){data.pop_back();}
+    }
+    void append(const char * newdata, const unsigned int newdatasize){
+      uint32_t i = 0;
+      while (i < newdatasize){
+        uint32_t j = 0;
+        while (j + i < newdatasize && j < BUFFER_BLOCKSIZE){
+          j++;
+          if (j >= splitter.size() && !memcmp(newdata + i + j - splitter.size(), splitter.data(), splitter.size())){break;}
+        }
+        data.push_front("");
+        data.front().assign(newdata + i, (size_t)j);
+        i += j;
+      }
+    }
+    bool available(unsigned int count){
+      size();
+      unsigned int i = 0;
+      for (std::deque<std::string>::iterator it = data.begin(); it != data.end(); ++it){
+        i += (*it).size();
+        if (i >= count){return true;}
+      }
+      return false;
+    }
+    std::string remove(unsigned int count){
+      size();
+      if (!available(count)){return "";}
+      unsigned int i = 0;
+      std::string ret;
+      ret.reserve(count);
+      for (std::deque<std::string>::reverse_iterator it = data.rbegin(); it != data.rend(); ++it){
+        if (i + (*it).size() < count){
+          ret.append(*it);
+          i += (*it).size();
+          (*it).clear();
+        }else{
+          ret.append(*it, 0, count - i);
+          (*it).erase(0, count - i);
+          break;
+        }
+      }
+      return ret;
+    }
+    std::string copy(unsigned int count){
+      size();
+      if (!available(count)){return "";}
+      unsigned int i = 0;
+      std::string ret;
+      ret.reserve(count);
+      for (std::deque<std::string>::reverse_iterator it = data.rbegin(); it != data.rend(); ++it){
+        if (i + (*it).size() < count){
+          ret.append(*it);
+          i += (*it).size();
+        }else{
+          ret.append(*it, 0, count - i);
+          break;
+        }
+      }
+      return ret;
+    }
+};
+
+/// Builds a stream of chunks: a 12 byte header carrying the payload length, followed by the payload.
+/// Payloads are 128 to 4096 bytes of pseudo-random media data, so splitter bytes occur at random.
+std::string makeStream(unsigned int bytes){
+  std::string ret;
+  ret.reserve(bytes + 5000);
+  unsigned int seed = 1;
+  while (ret.size() < bytes){
+    seed = seed * 1103515245 + 12345;
+    unsigned int len = 128 + (seed >> 8) % 3969;
+    char header[12] = {0};
+    header[0] = 0x04;
+    header[4] = (len >> 16) & 0xFF;
+    header[5] = (len >> 8) & 0xFF;
+    header[6] = len & 0xFF;
+    ret.append(header, 12);
+    for (unsigned int i = 0; i < len; ++i){
+      seed = seed * 1103515245 + 12345;
+      ret += (char)(seed >> 16);
+    }
+  }
+  return ret;
+}
+
+/// Payload length from a chunk header.
+unsigned int chunkLen(const char * header){
+  return ((unsigned char)header[4] << 16) | ((unsigned char)header[5] << 8) | (unsigned char)header[6];
+}
+
+/// Reads the stream in readSize blocks, parsing chunks the way the RTMP chunk parser did before peek/consume:
+/// copy the header, then remove header and payload as strings.
+/// \returns The sum of all payload bytes, to check both parsers saw the same data.
+unsigned long long ingestOld(const std::string & stream, unsigned int readSize, unsigned int & chunks){
+  dequeBuffer B;
+  unsigned long long sum = 0;
+  for (size_t pos = 0; pos < stream.size(); pos += readSize){
+    B.append(stream.data() + pos, std::min((size_t)readSize, stream.size() - pos));
+    while (B.available(12)){
+      std::string header = B.copy(12);
+      unsigned int len = chunkLen(header.data());
+      if (!B.available(12 + len)){break;}
+      B.remove(12);
+      std::string payload = B.remove(len);
+      sum += (unsigned char)payload[0] + (unsigned char)payload[len - 1];
+      ++chunks;
+    }
+  }
+  return sum;
+}
+
+/// Reads the stream in readSize blocks, parsing chunks in place through peek and consume.
+/// \returns The sum of all payload bytes, to check both parsers saw the same data.
+unsigned long long ingestNew(const std::string & stream, unsigned int readSize, unsigned int & chunks){
+  Socket::Buffer B;
+  unsigned long long sum = 0;
+  for (size_t pos = 0; pos < stream.size(); pos += readSize){
+    B.append(stream.data() + pos, std::min((size_t)readSize, stream.size() - pos));
+    const char * header;
+    while ((header = B.peek(12))){
+      unsigned int len = chunkLen(header);
+      const char * payload = B.peek(12 + len);
+      if (!payload){break;}
+      payload += 12;
+      sum += (unsigned char)payload[0] + (unsigned char)payload[len - 1];
+      B.consume(12 + len);
+      ++chunks;
+    }
+  }
+  return sum;
+}
+
+int main(int argc, char ** argv){
+  const unsigned int streamSize = 64 * 1024 * 1024;
+  std::string stream = makeStream(streamSize);
+  unsigned int readSizes[] = {1500, 16384, 65536};
+  bool ok = true;
+  for (unsigned int i = 0; i < sizeof(readSizes) / sizeof(readSizes[0]); ++i){
+    unsigned int oldChunks = 0, newChunks = 0;
+    uint64_t start = Util::getMicros();
+    unsigned long long oldSum = ingestOld(stream, readSizes[i], oldChunks);
+    uint64_t oldTime = Util::getMicros(start);
+    start = Util::getMicros();
+    unsigned long long newSum = ingestNew(stream, readSizes[i], newChunks);
+    uint64_t newTime = Util::getMicros(start);
+    if (oldSum != newSum || oldChunks != newChunks){
+      fprintf(stderr, "Parsers disagree for %u byte reads: %u chunks (sum %llu) vs %u chunks (sum %llu)\n", readSizes[i], oldChunks, oldSum,
+              newChunks, newSum);
+      ok = false;
+    }
+    printf("%5u byte reads, %u chunks: %7.1f MB/s deque, %7.1f MB/s contiguous\n", readSizes[i], newChunks,
+           stream.size() / (oldTime ? (double)oldTime : 1.0), stream.size() / (newTime ? (double)newTime : 1.0));
+  }
+  return ok ? 0 : 1;
+}